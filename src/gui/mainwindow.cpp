@@ -102,6 +102,14 @@ MainWindow::MainWindow(QWidget *parent): QMainWindow(parent), ui(new Ui::MainWin
           this, SLOT(tunnel_state_received(quint32,TunnelId,TunnelState)), Qt::QueuedConnection);
   connect(commThread->obj, SIGNAL(tunnel_connstate_received(quint32,QByteArray)),
           this, SLOT(tunnel_connstate_received(quint32,QByteArray)), Qt::QueuedConnection);
+  connect(this, SIGNAL(gui_tunnel_latency_get(quint32,TunnelId)),
+          commThread->obj, SLOT(gui_tunnel_latency_get(quint32,TunnelId)), Qt::QueuedConnection);
+  connect(commThread->obj, SIGNAL(tunnel_latency_received(quint32,TunnelId,QByteArray)),
+          this, SLOT(tunnel_latency_received(quint32,TunnelId,QByteArray)), Qt::QueuedConnection);
+  connect(this, SIGNAL(gui_tunnel_history_get(quint32,TunnelId,quint32)),
+          commThread->obj, SLOT(gui_tunnel_history_get(quint32,TunnelId,quint32)), Qt::QueuedConnection);
+  connect(commThread->obj, SIGNAL(tunnel_history_received(quint32,TunnelId,QByteArray)),
+          this, SLOT(tunnel_history_received(quint32,TunnelId,QByteArray)), Qt::QueuedConnection);
   connect(this, SIGNAL(gui_tunnel_start(quint32,TunnelId)),
           commThread->obj, SLOT(gui_tunnel_start(quint32,TunnelId)), Qt::QueuedConnection);
   connect(this, SIGNAL(gui_tunnel_stop(quint32,TunnelId)),
@@ -105,6 +105,8 @@ private slots:
   void tunnel_config_received(quint32 conn_id, cJSON *j_config);
   void tunnel_state_received(quint32 conn_id, TunnelId tun_id, TunnelState new_state);
   void tunnel_connstate_received(quint32 conn_id, const QByteArray &data);
+  void tunnel_latency_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data);
+  void tunnel_history_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data);
 
   void on_browserTree_customContextMenuRequested(const QPoint &pos);
 
@@ -168,6 +170,8 @@ signals:
   void gui_tunnel_remove(quint32 conn_id, TunnelId tun_id);
   void gui_tunnel_state_get(quint32 conn_id, TunnelId tun_id=0);
   void gui_tunnel_connstate_get(quint32 conn_id, TunnelId tun_id, bool include_disconnected);
+  void gui_tunnel_latency_get(quint32 conn_id, TunnelId tun_id);
+  void gui_tunnel_history_get(quint32 conn_id, TunnelId tun_id, quint32 from_time);
   void gui_tunnel_start(quint32 conn_id, TunnelId tun_id);
   void gui_tunnel_stop(quint32 conn_id, TunnelId tun_id);
 
@@ -218,6 +222,7 @@ private:
 
   void page_tunnel_init();
   void page_tunnel_loadItem(QTreeWidgetItem *tunnel_item);
+  void tunnel_history_show();
   void page_tunnel_saveItem(QTreeWidgetItem *tunnel_item);
   void page_tunnel_ui_load(cJSON *json);
   void page_tunnel_ui_save(cJSON *json);
@@ -12,6 +12,10 @@
 #include <QMessageBox>
 #include "../lib/sys_util.h"
 #include "../lib/prc_log.h"
+#include "../lib/latency-histogram.h"
+#include "../lib/tunnel-history.h"
+
+#define TUNNEL_HISTORY_GUI_WINDOW     60      // seconds of 1 s throughput samples summarized on the statistics page
 
 #define UI_PAGE_TUNNEL_VERSION            1
 
@@ -32,6 +36,21 @@ QTreeWidgetItem *tsi_bytes_snd = 0;
 QTreeWidgetItem *tsi_bytes_snd_encrypted = 0;
 QTreeWidgetItem *tsi_data_bytes_rcv = 0;
 QTreeWidgetItem *tsi_data_bytes_snd = 0;
+QTreeWidgetItem *tsi_latency_chain_rtt = 0;
+QTreeWidgetItem *tsi_latency_mgrconn_in_rtt = 0;
+QTreeWidgetItem *tsi_latency_mgrconn_out_rtt = 0;
+QTreeWidgetItem *tsi_latency_connect = 0;
+QTreeWidgetItem *tsi_latency_ack_delay = 0;
+QTreeWidgetItem *tsi_history_data_rcv_rate = 0;
+QTreeWidgetItem *tsi_history_data_snd_rate = 0;
+QTreeWidgetItem *tsi_history_conn_new_count = 0;
+QTreeWidgetItem *tsi_history_conn_max_count = 0;
+QTreeWidgetItem *tsi_history_latency_max = 0;
+QTreeWidgetItem *tsi_history_buffered_max = 0;
+
+// 1 s samples of the current tunnel kept by the server (CMD_TUN_HISTORY_GET), fetched incrementally
+QVector<TunnelHistorySample> tunnel_history;
+quint32 tunnel_history_first_time=0;          // server time of tunnel_history[0]
 //QTreeWidgetItem *tsi_encryption_overhead = 0;
 //---------------------------------------------------------------------------
 void MainWindow::page_tunnel_init()
@@ -78,6 +97,32 @@ void MainWindow::page_tunnel_init()
   tsi_chain_error_count = new QTreeWidgetItem(group, QStringList() << tr("Tunnel chain errors detected"));
   tsi_chain_error_count->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
 
+  group = new QTreeWidgetItem(ui->tunnelStatsTreeWidget, QStringList() << tr("Latency (p50 / p99 / p99.9)"));
+  tsi_latency_chain_rtt = new QTreeWidgetItem(group, QStringList() << tr("Tunnel chain round-trip"));
+  tsi_latency_chain_rtt->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_latency_mgrconn_in_rtt = new QTreeWidgetItem(group, QStringList() << tr("Incoming mgrconn round-trip"));
+  tsi_latency_mgrconn_in_rtt->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_latency_mgrconn_out_rtt = new QTreeWidgetItem(group, QStringList() << tr("Outgoing mgrconn round-trip"));
+  tsi_latency_mgrconn_out_rtt->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_latency_connect = new QTreeWidgetItem(group, QStringList() << tr("Application connect time"));
+  tsi_latency_connect->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_latency_ack_delay = new QTreeWidgetItem(group, QStringList() << tr("ACK delay"));
+  tsi_latency_ack_delay->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+
+  group = new QTreeWidgetItem(ui->tunnelStatsTreeWidget, QStringList() << tr("Last minute"));
+  tsi_history_data_rcv_rate = new QTreeWidgetItem(group, QStringList() << tr("Received from clients"));
+  tsi_history_data_rcv_rate->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_history_data_snd_rate = new QTreeWidgetItem(group, QStringList() << tr("Sent to clients"));
+  tsi_history_data_snd_rate->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_history_conn_new_count = new QTreeWidgetItem(group, QStringList() << tr("New connections"));
+  tsi_history_conn_new_count->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_history_conn_max_count = new QTreeWidgetItem(group, QStringList() << tr("Peak active connections"));
+  tsi_history_conn_max_count->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_history_latency_max = new QTreeWidgetItem(group, QStringList() << tr("Peak tunnel chain latency"));
+  tsi_history_latency_max->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+  tsi_history_buffered_max = new QTreeWidgetItem(group, QStringList() << tr("Peak buffered packets"));
+  tsi_history_buffered_max->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+
   ui->tunnelStatsTreeWidget->expandAll();
 #if QT_VERSION >= 0x050000
   ui->tunnelStatsTreeWidget->header()->setSectionResizeMode(0, QHeaderView::ResizeToContents);
@@ -158,6 +203,10 @@ void MainWindow::tunnelStats_autoUpdate()
     t_last_tunnel_stats_requested.restart();
     tunnel_stats_reply_received = false;
     emit gui_tunnel_state_get(mgrconn_params->id, tun_params->id);
+    emit gui_tunnel_latency_get(mgrconn_params->id, tun_params->id);
+    // the last sample held is asked again, as it may have still been filling up
+    emit gui_tunnel_history_get(mgrconn_params->id, tun_params->id,
+                                tunnel_history.isEmpty() ? 0 : tunnel_history_first_time+tunnel_history.count()-1);
   }
 }
 
@@ -192,6 +241,9 @@ void MainWindow::page_tunnel_loadItem(QTreeWidgetItem *tunnel_item)
   ui->page_tunnel->setEnabled(true);
   t_last_tunnel_stats_requested = QTime();
   tunnel_stats_reply_received = true;
+  tunnel_history.clear();
+  tunnel_history_first_time = 0;
+  tunnel_history_show();
 
   // Connection tab
   if (!tunnel_item || tunnel_item->data(0, ItemTypeRole).toInt() != ITEM_TYPE_TUNNEL)
@@ -495,6 +547,111 @@ void MainWindow::tunnel_state_received(quint32 conn_id, TunnelId tun_id, TunnelS
   }
 }
 
+//---------------------------------------------------------------------------
+void MainWindow::tunnel_latency_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data)
+{
+  QTreeWidgetItem *tunnel_item = browserTree_getTunnelById(conn_id, tun_id);
+  if (!tunnel_item || ui->browserTree->currentItem() != tunnel_item)
+    return;
+
+  QHash<int, QTreeWidgetItem *> items;
+  items.insert(LH_CHAIN_RTT, tsi_latency_chain_rtt);
+  items.insert(LH_MGRCONN_IN_RTT, tsi_latency_mgrconn_in_rtt);
+  items.insert(LH_MGRCONN_OUT_RTT, tsi_latency_mgrconn_out_rtt);
+  items.insert(LH_CONNECT_TIME, tsi_latency_connect);
+  items.insert(LH_ACK_DELAY, tsi_latency_ack_delay);
+  QHashIterator<int, QTreeWidgetItem *> it(items);
+  while (it.hasNext())
+  {
+    if (it.next().value())
+      it.value()->setText(1, QString("N/A"));
+  }
+
+  int data_pos = 0;
+  while (data_pos < data.length())
+  {
+    quint8 kind = *((quint8 *)(data.constData()+data_pos));
+    data_pos += sizeof(kind);
+    LatencyHistogram histogram;
+    int len = histogram.parseFromBuffer(data.constData()+data_pos, data.length()-data_pos);
+    if (len < 0)
+      break;
+    data_pos += len;
+    QTreeWidgetItem *item = items.value(kind);
+    if (item)
+      item->setText(1, histogram.percentilesString());
+  }
+}
+
+//---------------------------------------------------------------------------
+void MainWindow::tunnel_history_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data)
+{
+  QTreeWidgetItem *tunnel_item = browserTree_getTunnelById(conn_id, tun_id);
+  if (!tunnel_item || ui->browserTree->currentItem() != tunnel_item)
+    return;
+
+  quint32 interval;
+  quint32 first_time;
+  QVector<TunnelHistorySample> samples;
+  if (TunnelHistory::parseFromBuffer(data.constData(), data.length(), interval, first_time, samples) < 0 ||
+      interval != TUNNEL_HISTORY_TIER0_INTERVAL)
+    return;
+  if (samples.isEmpty())
+  {
+    // nothing since the last sample held: the tunnel has been idle long enough for the server to drop its history
+    tunnel_history.clear();
+  }
+  else
+  {
+    // new samples replace held ones from first_time on (the last one held is always asked again)
+    if (tunnel_history.isEmpty() || first_time < tunnel_history_first_time ||
+        first_time > tunnel_history_first_time+tunnel_history.count())
+    {
+      tunnel_history.clear();
+      tunnel_history_first_time = first_time;
+    }
+    else
+      tunnel_history.resize(first_time-tunnel_history_first_time);
+    tunnel_history += samples;
+    if (tunnel_history.count() > TUNNEL_HISTORY_GUI_WINDOW)
+    {
+      int drop_count = tunnel_history.count()-TUNNEL_HISTORY_GUI_WINDOW;
+      tunnel_history.remove(0, drop_count);
+      tunnel_history_first_time += drop_count;
+    }
+  }
+  tunnel_history_show();
+}
+
+//---------------------------------------------------------------------------
+// throughput of the current tunnel from its server-side history, so it needs no diffing of polled counters
+void MainWindow::tunnel_history_show()
+{
+  if (!tsi_history_data_rcv_rate)
+    return;
+  if (tunnel_history.isEmpty() && tunnel_history_first_time == 0)
+  {
+    // nothing received yet (or server keeps no history)
+    tsi_history_data_rcv_rate->setText(1, QString("N/A"));
+    tsi_history_data_snd_rate->setText(1, QString("N/A"));
+    tsi_history_conn_new_count->setText(1, QString("N/A"));
+    tsi_history_conn_max_count->setText(1, QString("N/A"));
+    tsi_history_latency_max->setText(1, QString("N/A"));
+    tsi_history_buffered_max->setText(1, QString("N/A"));
+    return;
+  }
+  TunnelHistorySample total;
+  for (int i=0; i < tunnel_history.count(); i++)
+    total.merge(tunnel_history[i]);
+  int seconds = qMax(tunnel_history.count(), 1);
+  tsi_history_data_rcv_rate->setText(1, pretty_size(total.data_bytes_rcv/seconds, 1)+QString("/s"));
+  tsi_history_data_snd_rate->setText(1, pretty_size(total.data_bytes_snd/seconds, 1)+QString("/s"));
+  tsi_history_conn_new_count->setText(1, QString::number(total.conn_new_count));
+  tsi_history_conn_max_count->setText(1, QString::number(total.conn_cur_count));
+  tsi_history_latency_max->setText(1, total.latency_ms >= 0 ? QString("%1 ms").arg(total.latency_ms) : QString("N/A"));
+  tsi_history_buffered_max->setText(1, QString::number(total.buffered_packets));
+}
+
 //---------------------------------------------------------------------------
 void MainWindow::tunnel_connstate_received(quint32 conn_id, const QByteArray &data)
 {
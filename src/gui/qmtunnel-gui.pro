@@ -28,6 +28,14 @@ MOC_DIR = ./moc/
 
 unix:LIBS += -lcrypto
 
+# optional TLS session sharing between incoming mgrconns and exact resumption reporting
+# (qmake CONFIG+=ssl_session_sharing, needs Qt 5 private headers, e.g. qtbase5-private-dev)
+ssl_session_sharing:equals(QT_MAJOR_VERSION, 5) {
+QT += network-private
+DEFINES += HAVE_SSL_SESSION_SHARING
+unix:LIBS += -lssl
+}
+
 SOURCES += main.cpp\
         mainwindow.cpp \
     ../lib/cJSON.c \
@@ -37,6 +45,10 @@ SOURCES += main.cpp\
     profile.cpp \
     thread-connections.cpp \
     ../lib/mgrclient-conn.cpp \
+    ../lib/latency-histogram.cpp \
+    ../lib/tunnel-history.cpp \
+    ../lib/timer-wheel.cpp \
+    ../lib/buffer-pool.cpp \
     ../lib/mgrclient-parameters.cpp \
     ../server/widget_mgrserver.cpp \
     ../lib/mgrserver-parameters.cpp \
@@ -62,6 +74,11 @@ HEADERS  += mainwindow.h \
     ../lib/sys_util.h \
     thread-connections.h \
     ../lib/mgrclient-conn.h \
+    ../lib/latency-histogram.h \
+    ../lib/tunnel-history.h \
+    ../lib/timer-wheel.h \
+    ../lib/buffer-pool.h \
+    ../lib/stage_timer.h \
     ../lib/mgrclient-parameters.h \
     ../lib/mgr_packet.h \
     ../server/widget_mgrserver.h \
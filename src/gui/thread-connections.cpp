@@ -9,6 +9,7 @@
 #include "thread-connections.h"
 #include "../lib/prc_log.h"
 #include "../lib/tunnel-state.h"
+#include "../lib/tunnel-history.h"
 
 CommThread *commThread=NULL;
 
@@ -163,19 +164,18 @@ void CommThreadObject::gui_mgrConnDemand_disconnect(quint32 conn_id)
 void CommThreadObject::gui_mgrConnDemand_idleStart(quint32 conn_id)
 {
   MgrClientConnection *conn = connectionById(conn_id);
-  if (!conn || !conn->timer_idle)
+  if (!conn)
     return;
-  conn->timer_idle->start();
+  conn->timer_idle.start();
 }
 
 //---------------------------------------------------------------------------
 void CommThreadObject::gui_mgrConnDemand_idleStop(quint32 conn_id)
 {
   MgrClientConnection *conn = connectionById(conn_id);
-  if (!conn || !conn->timer_idle)
+  if (!conn)
     return;
-  if (conn->timer_idle->isActive())
-    conn->timer_idle->stop();
+  conn->timer_idle.stop();
 }
 
 //---------------------------------------------------------------------------
@@ -230,6 +230,31 @@ void CommThreadObject::gui_tunnel_connstate_get(quint32 conn_id, TunnelId tun_id
     conn->sendPacket(CMD_TUN_CONNSTATE_GET, QByteArray((const char *)&flags, sizeof(flags)));
 }
 
+//---------------------------------------------------------------------------
+void CommThreadObject::gui_tunnel_latency_get(quint32 conn_id, TunnelId tun_id)
+{
+  MgrClientConnection *conn = connectionById(conn_id);
+  // servers without CMD_TUN_LATENCY_GET drop connections sending unknown commands
+  if (!conn || !(conn->peer_features & MGR_FEATURE_TUN_LATENCY_GET))
+    return;
+  // send tunnel latency histograms request
+  conn->sendPacket(CMD_TUN_LATENCY_GET, QByteArray((const char *)&tun_id, sizeof(TunnelId)));
+}
+
+//---------------------------------------------------------------------------
+void CommThreadObject::gui_tunnel_history_get(quint32 conn_id, TunnelId tun_id, quint32 from_time)
+{
+  MgrClientConnection *conn = connectionById(conn_id);
+  if (!conn || !(conn->peer_features & MGR_FEATURE_TUN_HISTORY_GET))
+    return;
+  // send tunnel 1 s throughput samples request
+  MgrPacket_TunnelHistoryReq req;
+  req.tunnel_id = tun_id;
+  req.interval = TUNNEL_HISTORY_TIER0_INTERVAL;
+  req.from_time = from_time;
+  conn->sendPacket(CMD_TUN_HISTORY_GET, QByteArray((const char *)&req, sizeof(MgrPacket_TunnelHistoryReq)));
+}
+
 //---------------------------------------------------------------------------
 void CommThreadObject::gui_tunnel_start(quint32 conn_id, TunnelId tun_id)
 {
@@ -406,6 +431,35 @@ void CommThreadObject::packetReceived(MgrPacketCmd cmd, const QByteArray &data)
       emit tunnel_connstate_received(socket->params.id, data);
       break;
     }
+    case CMD_TUN_LATENCY_GET:
+    {
+      // MgrPacket_StandartReply with TunnelId as object id, histograms follow on success
+      const MgrPacket_StandartReply *packet = (const MgrPacket_StandartReply *)data.constData();
+      if (data.length() < (int)sizeof(MgrPacket_StandartReply) || packet->obj_id_len != sizeof(TunnelId) ||
+          data.length() < (int)sizeof(MgrPacket_StandartReply)+packet->obj_id_len+packet->error_len)
+      {
+        socket->log(LOG_HIGH, QString(": CMD_TUN_LATENCY_GET packet too short"));
+        socket->abort();
+        break;
+      }
+      TunnelId tun_id = *((const TunnelId *)(data.constData()+sizeof(MgrPacket_StandartReply)));
+      int data_pos = sizeof(MgrPacket_StandartReply)+packet->obj_id_len+packet->error_len;
+      if (packet->res_code != TunnelState::RES_CODE_OK)
+      {
+        socket->log(LOG_DBG1, QString(": tunnel %1 latency request failed: %2").arg(tun_id)
+                    .arg(QString::fromUtf8(data.mid(sizeof(MgrPacket_StandartReply)+packet->obj_id_len, packet->error_len))));
+        emit tunnel_latency_received(socket->params.id, tun_id, QByteArray());
+      }
+      else
+        emit tunnel_latency_received(socket->params.id, tun_id, data.mid(data_pos));
+      break;
+    }
+    case CMD_TUN_HISTORY_GET:
+    {
+      if (data.length() >= (int)sizeof(TunnelId))
+        emit tunnel_history_received(socket->params.id, *((TunnelId *)data.constData()), data.mid(sizeof(TunnelId)));
+      break;
+    }
     case CMD_TUN_CONFIG_SET:
     case CMD_TUN_REMOVE:
     case CMD_CONFIG_SET_ERROR:
@@ -490,6 +544,7 @@ void CommThreadObject::authRepPacketReceived(MgrClientConnection *socket, const
   }
 
   socket->peer_hostname = QString::fromUtf8(req_data.mid(sizeof(MgrPacket_AuthRep),rep->server_hostname_len));
+  socket->peer_features = MgrPacket_AuthRep::serverFeatures(req_data);
 
   if (rep->auth_result != MgrPacket_AuthRep::RES_CODE_OK)
   {
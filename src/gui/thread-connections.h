@@ -57,6 +57,8 @@ private slots:
   void gui_tunnel_remove(quint32 conn_id, TunnelId tun_id);
   void gui_tunnel_state_get(quint32 conn_id, TunnelId tun_id);
   void gui_tunnel_connstate_get(quint32 conn_id, TunnelId tun_id, bool include_disconnected);
+  void gui_tunnel_latency_get(quint32 conn_id, TunnelId tun_id);
+  void gui_tunnel_history_get(quint32 conn_id, TunnelId tun_id, quint32 from_time);
   void gui_tunnel_start(quint32 conn_id, TunnelId tun_id);
   void gui_tunnel_stop(quint32 conn_id, TunnelId tun_id);
 
@@ -78,6 +80,8 @@ signals:
   void mgrconn_tunnel_remove(quint32 conn_id, TunnelId tun_id, quint16 res_code, const QString &error_str);
   void tunnel_state_received(quint32 conn_id, TunnelId tun_id, TunnelState state);
   void tunnel_connstate_received(quint32 conn_id, const QByteArray &data);
+  void tunnel_latency_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data);
+  void tunnel_history_received(quint32 conn_id, TunnelId tun_id, const QByteArray &data);
 
 private:
   MgrClientConnection *connectionById(quint32 conn_id);
@@ -0,0 +1,150 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include <QThreadStorage>
+#include "buffer-pool.h"
+
+static const int buffer_pool_class_size[BUFFER_POOL_CLASSES] = { 4*1024+BUFFER_POOL_HEADROOM,
+                                                                 64*1024+BUFFER_POOL_HEADROOM,
+                                                                 512*1024+BUFFER_POOL_HEADROOM };
+
+static QMutex buffer_pools_mutex;
+static QList<BufferPool *> buffer_pools_list;           // pools of running threads
+static BufferPoolStats buffer_pools_retired;            // counters of pools of finished threads
+static QThreadStorage<BufferPool *> buffer_pools;       // declared last: pools may be deleted during static destruction
+
+//---------------------------------------------------------------------------
+void BufferPoolStats::add(const BufferPoolStats &other)
+{
+  for (int i=0; i < BUFFER_POOL_CLASSES; i++)
+  {
+    hits[i] += other.hits[i];
+    misses[i] += other.misses[i];
+    free_count[i] += other.free_count[i];
+    free_bytes[i] += other.free_bytes[i];
+  }
+  oversized += other.oversized;
+}
+
+//---------------------------------------------------------------------------
+BufferPool::BufferPool()
+{
+  QMutexLocker locker(&buffer_pools_mutex);
+  buffer_pools_list.append(this);
+}
+
+//---------------------------------------------------------------------------
+BufferPool::~BufferPool()
+{
+  QMutexLocker locker(&buffer_pools_mutex);
+  buffer_pools_list.removeOne(this);
+  BufferPoolStats retired = counters;
+  memset(retired.free_count, 0, sizeof(retired.free_count));
+  memset(retired.free_bytes, 0, sizeof(retired.free_bytes));
+  buffer_pools_retired.add(retired);
+}
+
+//---------------------------------------------------------------------------
+BufferPool *BufferPool::instance()
+{
+  if (!buffer_pools.hasLocalData())
+    buffer_pools.setLocalData(new BufferPool);
+  return buffer_pools.localData();
+}
+
+//---------------------------------------------------------------------------
+int BufferPool::classSize(int size_class)
+{
+  return buffer_pool_class_size[size_class];
+}
+
+//---------------------------------------------------------------------------
+QByteArray BufferPool::acquire(int size)
+{
+  int size_class = 0;
+  while (size_class < BUFFER_POOL_CLASSES && size > buffer_pool_class_size[size_class])
+    size_class++;
+  BufferPool *pool = instance();
+  QByteArray buffer;
+  if (size_class == BUFFER_POOL_CLASSES)
+  {
+    QMutexLocker locker(&pool->mutex);
+    pool->counters.oversized++;
+    locker.unlock();
+    buffer.reserve(size);
+    return buffer;
+  }
+
+  pool->mutex.lock();
+  if (!pool->free_list[size_class].isEmpty())
+  {
+    buffer = pool->free_list[size_class].takeLast();
+    pool->counters.hits[size_class]++;
+    pool->counters.free_count[size_class]--;
+    pool->counters.free_bytes[size_class] -= buffer_pool_class_size[size_class];
+    pool->mutex.unlock();
+    return buffer;
+  }
+  pool->counters.misses[size_class]++;
+  pool->mutex.unlock();
+  buffer.reserve(buffer_pool_class_size[size_class]);
+  return buffer;
+}
+
+//---------------------------------------------------------------------------
+void BufferPool::release(QByteArray &buffer)
+{
+#if QT_VERSION >= 0x050000
+  int size_class = 0;
+  while (size_class < BUFFER_POOL_CLASSES && buffer.capacity() != buffer_pool_class_size[size_class])
+    size_class++;
+  if (size_class == BUFFER_POOL_CLASSES || !buffer.isDetached())
+  {
+    buffer = QByteArray();
+    return;
+  }
+  buffer.resize(0);                   // keeps reserved capacity
+  BufferPool *pool = instance();
+  QMutexLocker locker(&pool->mutex);
+  if (pool->counters.free_bytes[size_class]+buffer_pool_class_size[size_class] <= BUFFER_POOL_MAX_FREE_BYTES)
+  {
+    pool->free_list[size_class].append(buffer);
+    pool->counters.free_count[size_class]++;
+    pool->counters.free_bytes[size_class] += buffer_pool_class_size[size_class];
+  }
+#endif
+  buffer = QByteArray();
+}
+
+//---------------------------------------------------------------------------
+// busy buffers are left alone: trimming them would only make the next append reallocate
+int BufferPool::trim(QByteArray &buffer, int floor)
+{
+  int capacity = buffer.capacity();
+  if (capacity <= floor || buffer.length() > floor/2)
+    return 0;
+  if (buffer.isEmpty())
+    buffer = QByteArray();
+  else
+    buffer.squeeze();
+  return qMax(capacity-buffer.capacity(), 0);
+}
+
+//---------------------------------------------------------------------------
+BufferPoolStats BufferPool::stats()
+{
+  QMutexLocker locker(&buffer_pools_mutex);
+  BufferPoolStats result = buffer_pools_retired;
+  for (int i=0; i < buffer_pools_list.count(); i++)
+  {
+    BufferPool *pool = buffer_pools_list[i];
+    QMutexLocker pool_locker(&pool->mutex);
+    result.add(pool->counters);
+  }
+  return result;
+}
@@ -0,0 +1,66 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <string.h>
+
+// size classes of packet buffers: application data chunk, typical compressed/framed packet, MGR_PACKET_MAX_LEN;
+// each one has room for packet headers on top
+#define BUFFER_POOL_CLASSES                     3
+#define BUFFER_POOL_HEADROOM                    64
+#define BUFFER_POOL_MAX_FREE_BYTES              4*1024*1024     // per size class per thread
+#define BUFFER_TRIM_FLOOR                       16*1024         // connection buffer capacity kept by trim()
+
+struct BufferPoolStats
+{
+  quint64 hits[BUFFER_POOL_CLASSES];        // acquire() served from free list
+  quint64 misses[BUFFER_POOL_CLASSES];      // acquire() had to allocate
+  quint64 oversized;                        // acquire() for more than the biggest class (not pooled)
+  quint64 free_count[BUFFER_POOL_CLASSES];  // buffers in free lists
+  quint64 free_bytes[BUFFER_POOL_CLASSES];  // their capacity
+
+  BufferPoolStats()
+  {
+    memset(this, 0, sizeof(BufferPoolStats));
+  }
+  void add(const BufferPoolStats &other);
+};
+
+// thread-local free lists of QByteArrays with reserved capacity of one of the size classes
+// (QByteArray keeps reserved capacity when resized to 0 in Qt5 only - with Qt4 every acquire() is a miss)
+class BufferPool
+{
+public:
+  static int classSize(int size_class);
+
+  // empty buffer with capacity for at least 'size' bytes
+  static QByteArray acquire(int size);
+  // returns buffer to current thread's free list if nobody else references it; buffer is null afterwards
+  static void release(QByteArray &buffer);
+  // releases capacity of a drained (empty or nearly empty) buffer above 'floor', returns released bytes
+  static int trim(QByteArray &buffer, int floor=BUFFER_TRIM_FLOOR);
+
+  static BufferPoolStats stats();           // all threads
+
+  ~BufferPool();
+
+private:
+  QList<QByteArray> free_list[BUFFER_POOL_CLASSES];
+  mutable QMutex mutex;                     // uncontended except for stats()
+  BufferPoolStats counters;
+
+  BufferPool();
+  static BufferPool *instance();            // pool of the current thread
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,146 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include "latency-histogram.h"
+#include <string.h>
+
+//---------------------------------------------------------------------------
+void LatencyHistogram::reset()
+{
+  count = 0;
+  sum_us = 0;
+  min_us = 0;
+  max_us = 0;
+  memset(buckets, 0, sizeof(buckets));
+}
+
+//---------------------------------------------------------------------------
+int LatencyHistogram::bucketIndex(quint64 value)
+{
+  if (value < 2*LATENCY_HISTOGRAM_SUB_COUNT)
+    return (int)value;
+  int msb = 0;
+  while ((value >> (msb+1)) != 0)
+    msb++;
+  int shift = msb-LATENCY_HISTOGRAM_SUB_BITS;
+  return (shift+1)*LATENCY_HISTOGRAM_SUB_COUNT+(int)((value >> shift)-LATENCY_HISTOGRAM_SUB_COUNT);
+}
+
+//---------------------------------------------------------------------------
+quint64 LatencyHistogram::bucketUpperBound(int index)
+{
+  if (index < 2*LATENCY_HISTOGRAM_SUB_COUNT)
+    return index;
+  int shift = index/LATENCY_HISTOGRAM_SUB_COUNT-1;
+  quint64 sub = index%LATENCY_HISTOGRAM_SUB_COUNT+LATENCY_HISTOGRAM_SUB_COUNT;
+  return ((sub+1) << shift)-1;
+}
+
+//---------------------------------------------------------------------------
+quint64 LatencyHistogram::percentile(double p) const
+{
+  if (count == 0)
+    return 0;
+  quint64 target = (quint64)(count*p/100.0+0.5);
+  if (target < 1)
+    target = 1;
+  quint64 seen = 0;
+  for (int i=0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if (seen >= target)
+      return qBound(min_us, bucketUpperBound(i), max_us);
+  }
+  return max_us;
+}
+
+//---------------------------------------------------------------------------
+QString LatencyHistogram::prettyTime(quint64 us)
+{
+  if (us < 1000)
+    return QString("%1 us").arg(us);
+  if (us < 1000000)
+    return QString("%1 ms").arg(us/1000.0, 0, 'f', us < 10000 ? 2 : (us < 100000 ? 1 : 0));
+  return QString("%1 s").arg(us/1000000.0, 0, 'f', 2);
+}
+
+//---------------------------------------------------------------------------
+QString LatencyHistogram::percentilesString() const
+{
+  if (count == 0)
+    return QString("N/A");
+  return QString("%1 / %2 / %3").arg(prettyTime(percentile(50)))
+                                .arg(prettyTime(percentile(99)))
+                                .arg(prettyTime(percentile(99.9)));
+}
+
+//---------------------------------------------------------------------------
+QByteArray LatencyHistogram::printToBuffer() const
+{
+  quint16 bucket_count = 0;
+  for (int i=0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    if (buckets[i] > 0)
+      bucket_count++;
+  }
+  QByteArray buffer;
+  buffer.reserve(sizeof(count)+sizeof(sum_us)+sizeof(min_us)+sizeof(max_us)+sizeof(bucket_count)+
+                 bucket_count*(sizeof(quint16)+sizeof(quint32)));
+  buffer.append((const char *)&count, sizeof(count));
+  buffer.append((const char *)&sum_us, sizeof(sum_us));
+  buffer.append((const char *)&min_us, sizeof(min_us));
+  buffer.append((const char *)&max_us, sizeof(max_us));
+  buffer.append((const char *)&bucket_count, sizeof(bucket_count));
+  for (quint16 i=0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    if (buckets[i] == 0)
+      continue;
+    buffer.append((const char *)&i, sizeof(i));
+    buffer.append((const char *)&buckets[i], sizeof(quint32));
+  }
+  return buffer;
+}
+
+//---------------------------------------------------------------------------
+// returns number of bytes parsed or -1 on error
+int LatencyHistogram::parseFromBuffer(const char *buffer, int buf_size)
+{
+  quint16 bucket_count;
+  if ((unsigned int)buf_size < sizeof(count)
+                +sizeof(sum_us)
+                +sizeof(min_us)
+                +sizeof(max_us)
+                +sizeof(bucket_count))
+    return -1;
+
+  reset();
+  int data_pos = 0;
+  count = *((quint64 *)(buffer+data_pos));
+  data_pos += sizeof(count);
+  sum_us = *((quint64 *)(buffer+data_pos));
+  data_pos += sizeof(sum_us);
+  min_us = *((quint64 *)(buffer+data_pos));
+  data_pos += sizeof(min_us);
+  max_us = *((quint64 *)(buffer+data_pos));
+  data_pos += sizeof(max_us);
+  bucket_count = *((quint16 *)(buffer+data_pos));
+  data_pos += sizeof(bucket_count);
+
+  if (data_pos+bucket_count*(int)(sizeof(quint16)+sizeof(quint32)) > buf_size)
+    return -1;
+  for (quint16 i=0; i < bucket_count; i++)
+  {
+    quint16 index = *((quint16 *)(buffer+data_pos));
+    data_pos += sizeof(quint16);
+    if (index >= LATENCY_HISTOGRAM_BUCKETS)
+      return -1;
+    buckets[index] = *((quint32 *)(buffer+data_pos));
+    data_pos += sizeof(quint32);
+  }
+  return data_pos;
+}
@@ -0,0 +1,72 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <QByteArray>
+#include <QString>
+
+// HDR-style log-linear histogram of microsecond values:
+// every power of 2 is split into LATENCY_HISTOGRAM_SUB_COUNT buckets (~6% precision)
+#define LATENCY_HISTOGRAM_SUB_BITS               4
+#define LATENCY_HISTOGRAM_SUB_COUNT             (1 << LATENCY_HISTOGRAM_SUB_BITS)
+#define LATENCY_HISTOGRAM_MAX_BITS              36      // values up to 2^36 us (~19 hours)
+#define LATENCY_HISTOGRAM_BUCKETS               ((LATENCY_HISTOGRAM_MAX_BITS-LATENCY_HISTOGRAM_SUB_BITS+1)*LATENCY_HISTOGRAM_SUB_COUNT)
+
+// histograms sent in CMD_TUN_LATENCY_GET reply
+enum LatencyHistogramKind
+{
+  LH_CHAIN_RTT=1,                     // tunnel chain heartbeat round-trip time
+  LH_MGRCONN_IN_RTT=2,                // mgrconn_in heartbeat round-trip time
+  LH_MGRCONN_OUT_RTT=3,               // mgrconn_out heartbeat round-trip time
+  LH_CONNECT_TIME=4,                  // outgoing application connection establishment time
+  LH_ACK_DELAY=5                      // time from first unacknowledged buffered packet received till CMD_TUN_BUFFER_ACK sent
+};
+
+class LatencyHistogram
+{
+public:
+  quint64 count;
+  quint64 sum_us;
+  quint64 min_us;
+  quint64 max_us;
+  quint32 buckets[LATENCY_HISTOGRAM_BUCKETS];
+
+  LatencyHistogram()
+  {
+    reset();
+  }
+
+  void reset();
+  void record(qint64 nsecs)
+  {
+    quint64 value = nsecs > 0 ? nsecs/1000 : 0;
+    if (value >= ((quint64)1 << LATENCY_HISTOGRAM_MAX_BITS))
+      value = ((quint64)1 << LATENCY_HISTOGRAM_MAX_BITS)-1;
+    buckets[bucketIndex(value)]++;
+    if (count == 0 || value < min_us)
+      min_us = value;
+    if (value > max_us)
+      max_us = value;
+    sum_us += value;
+    count++;
+  }
+
+  quint64 percentile(double p) const;           // us, p = 0..100
+  QString percentilesString() const;            // "p50 / p99 / p99.9" for GUI
+
+  int parseFromBuffer(const char *buffer, int buf_size);
+  QByteArray printToBuffer() const;             // only non-empty buckets are printed
+
+  static int bucketIndex(quint64 value);
+  static quint64 bucketUpperBound(int index);
+  static QString prettyTime(quint64 us);
+};
+
+#endif // LATENCY_HISTOGRAM_H
@@ -51,6 +51,12 @@ QString mgrPacket_cmdString(MgrPacketCmd cmd)
     case CMD_TUN_CHAIN_CHECK:          return QString("CMD_TUN_CHAIN_CHECK");
     case CMD_TUN_CHAIN_RESTORED:       return QString("CMD_TUN_CHAIN_RESTORED");
 
+    case CMD_TUN_STRIPE_ATTACH:        return QString("CMD_TUN_STRIPE_ATTACH");
+    case CMD_TUN_FLIGHTREC_GET:        return QString("CMD_TUN_FLIGHTREC_GET");
+    case CMD_TUN_LATENCY_GET:          return QString("CMD_TUN_LATENCY_GET");
+    case CMD_TUN_HISTORY_GET:          return QString("CMD_TUN_HISTORY_GET");
+    case CMD_TUN_STAGES_GET:           return QString("CMD_TUN_STAGES_GET");
+
     default: return QString::number(cmd);
   }
 }
@@ -56,6 +56,13 @@ enum
   CMD_TUN_CHAIN_HEARTBEAT_REQ=361,
   CMD_TUN_CHAIN_HEARTBEAT_REP=362,
 
+  CMD_TUN_STRIPE_ATTACH=371,
+
+  CMD_TUN_FLIGHTREC_GET=381,
+  CMD_TUN_LATENCY_GET=382,
+  CMD_TUN_HISTORY_GET=383,
+  CMD_TUN_STAGES_GET=384,
+
   CMD_MAX
 };
 
@@ -71,6 +78,12 @@ typedef quint32 MgrPacketLen;
 
 #define MGR_PACKET_VERSION                1
 
+// optional commands supported by server, sent after server hostname in CMD_AUTH_REP
+// (servers without feature negotiation send nothing there, so their features are 0)
+#define MGR_FEATURE_TUN_LATENCY_GET       0x00000001      // CMD_TUN_LATENCY_GET
+#define MGR_FEATURE_TUN_HISTORY_GET       0x00000002      // CMD_TUN_HISTORY_GET
+#define MGR_FEATURES                      (MGR_FEATURE_TUN_LATENCY_GET | MGR_FEATURE_TUN_HISTORY_GET)
+
 
 struct __attribute__ ((__packed__)) MgrPacket_StandartReply
 {
@@ -10,10 +10,22 @@
 #include "prc_log.h"
 #include "sys_util.h"
 #include "ssl_helper.h"
+#include "buffer-pool.h"
 #include <QtCore/qmath.h>
 #include <QHostAddress>
 #include <QSslCipher>
 #include <QFile>
+#include <QThreadPool>
+#include <QHash>
+#include <QCryptographicHash>
+
+QAtomicInt stage_timing_enabled(0);
+
+// TLS sessions of outgoing connections (see sslSessionKey() -> serialized session/ticket), shared by all threads
+static QHash<QString, QByteArray> ssl_session_cache;
+static QMutex ssl_session_cache_mutex;
+static quint64 ssl_session_hits = 0;
+static quint64 ssl_session_misses = 0;
 
 // $ openssl genrsa -out server.key 2048
 // $ openssl req -new -x509 -key server.key -out server.crt
@@ -58,33 +70,33 @@ void MgrClientConnection::setParameters(const MgrClientParameters *new_params)
       emit state_changed(params.enabled ? MgrClientConnection::MGR_ERROR : MgrClientConnection::MGR_NONE);
       if (this->state() != QSslSocket::UnconnectedState)
         this->abort();
-      timer_reconnect->setInterval(0);
-      timer_reconnect->start();
+      timer_reconnect.setInterval(0);
+      timer_reconnect.start();
     }
   }
   if (!need_reconnect)
   {
     if (old_params.read_buffer_size != params.read_buffer_size)
       setReadBufferSize(params.read_buffer_size);
-    if (old_params.idle_timeout != params.idle_timeout && timer_idle)
+    if (old_params.idle_timeout != params.idle_timeout)
     {
-      timer_idle->setInterval(params.idle_timeout);
-      if (timer_idle->isActive())
-        timer_idle->start();
+      timer_idle.setInterval(params.idle_timeout);
+      if (timer_idle.isActive())
+        timer_idle.start();
     }
-    if (old_params.rcv_timeout != params.rcv_timeout && timer_heartbeat_check)
+    if (old_params.rcv_timeout != params.rcv_timeout)
     {
-      timer_heartbeat_check->setInterval(params.rcv_timeout);
-      if (timer_heartbeat_check->isActive())
-        timer_heartbeat_check->start();
+      timer_heartbeat_check.setInterval(params.rcv_timeout);
+      if (timer_heartbeat_check.isActive())
+        timer_heartbeat_check.start();
     }
-    if (old_params.reconnect_interval != params.reconnect_interval && timer_reconnect)
-      timer_reconnect->setInterval(params.reconnect_interval);
-    if (old_params.reconnect_interval_max > params.reconnect_interval_max && timer_reconnect)
+    if (old_params.reconnect_interval != params.reconnect_interval)
+      timer_reconnect.setInterval(params.reconnect_interval);
+    if (old_params.reconnect_interval_max > params.reconnect_interval_max)
     {
-      timer_reconnect->setInterval(params.reconnect_interval);
-      if (timer_reconnect->isActive())
-        timer_reconnect->start();
+      timer_reconnect.setInterval(params.reconnect_interval);
+      if (timer_reconnect.isActive())
+        timer_reconnect.start();
     }
   }
 }
@@ -103,9 +115,9 @@ void MgrClientConnection::beginConnection()
   {
     if (!params.auth_username.isEmpty() && params.auth_password.isEmpty())
     {
-      log(LOG_DBG1, QString(": password is empty - waiting for input"));
-      if (timer_reconnect->isActive())
-        timer_reconnect->stop();
+      OBJ_LOG(this, LOG_DBG1, QString(": password is empty - waiting for input"));
+      if (timer_reconnect.isActive())
+        timer_reconnect.stop();
       emit password_required();
       return;
     }
@@ -127,9 +139,9 @@ void MgrClientConnection::beginConnection()
             params.private_key = QSslKey(pkey_data, QSsl::Rsa, QSsl::Pem, QSsl::PrivateKey, private_key_passphrase.toUtf8());
           if (params.private_key.isNull())
           {
-            log(LOG_DBG1, QString(": passphrase is required for private key - waiting for input"));
-            if (timer_reconnect->isActive())
-              timer_reconnect->stop();
+            OBJ_LOG(this, LOG_DBG1, QString(": passphrase is required for private key - waiting for input"));
+            if (timer_reconnect.isActive())
+              timer_reconnect.stop();
             emit passphrase_required();
             return;
           }
@@ -139,9 +151,9 @@ void MgrClientConnection::beginConnection()
   }
 
   emit state_changed(MgrClientConnection::MGR_CONNECTING);
-  log(LOG_DBG3, QString(": trying to connect..."));
-  timer_connect->setInterval(params.conn_timeout);
-  timer_connect->start();
+  OBJ_LOG(this, LOG_DBG3, QString(": trying to connect..."));
+  timer_connect.setInterval(params.conn_timeout);
+  timer_connect.start();
   this->connectToHost(params.host, params.port);
 }
 
@@ -150,7 +162,7 @@ void MgrClientConnection::socket_connect_timeout()
 {
   emit state_changed(MgrClientConnection::MGR_ERROR);
   emit connection_error(QAbstractSocket::SocketTimeoutError);
-  log(LOG_DBG2, QString(": connect timeout"));
+  OBJ_LOG(this, LOG_DBG2, QString(": connect timeout"));
   if (this->state() != QSslSocket::UnconnectedState)
     this->abort();
   if (params.conn_type == MgrClientParameters::CONN_AUTO)
@@ -161,7 +173,7 @@ void MgrClientConnection::socket_connect_timeout()
 void MgrClientConnection::socket_idle_timeout()
 {
   emit state_changed(MgrClientConnection::MGR_NONE);
-  log(LOG_DBG2, QString(": idle timeout"));
+  OBJ_LOG(this, LOG_DBG2, QString(": idle timeout"));
   if (this->state() == QSslSocket::ConnectedState)
   {
     sendPacket(CMD_CLOSE);
@@ -174,7 +186,7 @@ void MgrClientConnection::socket_phase_timeout()
 {
   emit state_changed(MgrClientConnection::MGR_ERROR);
   emit connection_error(QAbstractSocket::SocketTimeoutError);
-  log(LOG_DBG2, QString(": phase %4 timed out").arg((int)phase));
+  OBJ_LOG(this, LOG_DBG2, QString(": phase %4 timed out").arg((int)phase));
   if (this->state() == QSslSocket::ConnectedState)
     disconnectFromHost();
 }
@@ -182,9 +194,9 @@ void MgrClientConnection::socket_phase_timeout()
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_encrypted()
 {
-  timer_phase->stop();
+  timer_phase.stop();
 
-  log(LOG_DBG3, QString(": SSL handshake established"
+  OBJ_LOG(this, LOG_DBG3, QString(": SSL handshake established"
                         " (Protocol:%1, Cipher:%2, Auth:%3, Encryption:%4, KeyExchange:%5)")
       .arg(this->sessionCipher().protocolString())
       .arg(this->sessionCipher().name())
@@ -193,21 +205,46 @@ void MgrClientConnection::socket_encrypted()
       .arg(this->sessionCipher().keyExchangeMethod()));
   emit state_changed(MgrClientConnection::MGR_AUTH);
   phase = PHASE_AUTH;
-  timer_phase->setInterval(PHASE_AUTH_TIMEOUT);
-  timer_phase->start();
+  timer_phase.setInterval(PHASE_AUTH_TIMEOUT);
+  timer_phase.start();
   if (direction == OUTGOING)
   {
+#if QT_VERSION >= 0x050200
+    bool resumed = false;
+    bool known = sslSessionReused(this, resumed);
+    if (!known)
+    {
+      // offered session comes back unchanged when server accepted it - TLS 1.3 resumption issues a new one though
+#if QT_VERSION >= 0x050C00
+      known = ssl_session_offered.isEmpty() || sessionProtocol() != QSsl::TlsV1_3;
+#else
+      known = true;
+#endif
+      resumed = !ssl_session_offered.isEmpty() && sslConfiguration().sessionTicket() == ssl_session_offered;
+    }
+    if (known)
+    {
+      ssl_session_cache_mutex.lock();
+      if (resumed)
+        ssl_session_hits++;
+      else
+        ssl_session_misses++;
+      ssl_session_cache_mutex.unlock();
+      OBJ_LOG(this, LOG_DBG3, QString(resumed ? ": TLS session resumed" : ": full TLS handshake"));
+    }
+    socket_sslSessionSave();
+#endif
     if (!params.server_ssl_cert.isNull() || !params.server_ssl_cert_filename.isEmpty())
     {
       QSslCertificate cert = params.server_ssl_cert;
       if (cert.isNull())
-        cert = loadSSLCertFromFile(params.server_ssl_cert_filename);
+        cert = loadSSLCertFromFileCached(params.server_ssl_cert_filename);
       // check server SSL certificate
       if (!cert.isNull())
       {
         if (cert != peerCertificate())
         {
-          this->log(LOG_DBG1, QString(": server certificate does not match"));
+          OBJ_LOG(this, LOG_DBG1, QString(": server certificate does not match"));
           emit state_changed(MgrClientConnection::MGR_ERROR);
           emit connection_error(QAbstractSocket::ProxyConnectionClosedError);
           this->abort();
@@ -218,26 +255,83 @@ void MgrClientConnection::socket_encrypted()
   }
 }
 
+//---------------------------------------------------------------------------
+// offer TLS session of previous connection to the same server for abbreviated handshake
+void MgrClientConnection::sslSessionRestore()
+{
+  ssl_session_offered.clear();
+#if QT_VERSION >= 0x050200
+  QSslConfiguration conf = sslConfiguration();
+  conf.setSslOption(QSsl::SslOptionDisableSessionTickets, false);
+  conf.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+  ssl_session_cache_mutex.lock();
+  ssl_session_offered = ssl_session_cache.value(sslSessionKey());
+  ssl_session_cache_mutex.unlock();
+  if (!ssl_session_offered.isEmpty())
+  {
+    conf.setSessionTicket(ssl_session_offered);
+    OBJ_LOG(this, LOG_DBG4, QString(": offering cached TLS session"));
+  }
+  setSslConfiguration(conf);
+#endif
+}
+
+//---------------------------------------------------------------------------
+// session is bound to the client identity it was established with: connections to the same server
+// with another certificate or user must not resume it
+QString MgrClientConnection::sslSessionKey() const
+{
+  QSslCertificate cert = params.ssl_cert;
+  if (cert.isNull() && !params.ssl_cert_filename.isEmpty())
+    cert = loadSSLCertFromFileCached(params.ssl_cert_filename);
+  return QString("%1:%2/%3/%4").arg(params.host).arg(params.port)
+         .arg(cert.isNull() ? QString() : QString(cert.digest(QCryptographicHash::Sha1).toHex()))
+         .arg(params.auth_username);
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::sslSessionStats(quint64 &hits, quint64 &misses)
+{
+  QMutexLocker locker(&ssl_session_cache_mutex);
+  hits = ssl_session_hits;
+  misses = ssl_session_misses;
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::socket_sslSessionSave()
+{
+#if QT_VERSION >= 0x050200
+  QByteArray session = sslConfiguration().sessionTicket();
+  if (session.isEmpty())
+    return;
+  QString key = sslSessionKey();
+  QMutexLocker locker(&ssl_session_cache_mutex);
+  if (!ssl_session_cache.contains(key) && ssl_session_cache.count() >= SSL_SESSION_CACHE_MAX_SIZE)
+    ssl_session_cache.erase(ssl_session_cache.begin());
+  ssl_session_cache[key] = session;
+#endif
+}
+
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_startOperational()
 {
   if (direction == OUTGOING)
-    timer_reconnect->setInterval(0);
-  timer_phase->stop();
-  log(LOG_DBG3, QString(": authentication completed successfully"));
+    timer_reconnect.setInterval(0);
+  timer_phase.stop();
+  OBJ_LOG(this, LOG_DBG3, QString(": authentication completed successfully"));
   phase = MgrClientConnection::PHASE_OPERATIONAL;
   emit state_changed(MgrClientConnection::MGR_CONNECTED);
   if (params.flags & MgrClientParameters::FL_ENABLE_HEARTBEATS)
   {
     if (params.ping_interval > 0)
     {
-      timer_heartbeat->setInterval(params.ping_interval);
-      timer_heartbeat->start();
+      timer_heartbeat.setInterval(params.ping_interval);
+      timer_heartbeat.start();
     }
     if (params.rcv_timeout > 0)
     {
-      timer_heartbeat_check->setInterval(params.rcv_timeout);
-      timer_heartbeat_check->start();
+      timer_heartbeat_check.setInterval(params.rcv_timeout);
+      timer_heartbeat_check.start();
     }
     sendPacket(CMD_HEARTBEAT_REQ);
     t_last_heartbeat_req.restart();
@@ -246,7 +340,7 @@ void MgrClientConnection::socket_startOperational()
   {
     if (params.idle_timeout > 0)
     {
-      timer_idle->setInterval(params.idle_timeout);
+      timer_idle.setInterval(params.idle_timeout);
     }
   }
 }
@@ -275,10 +369,11 @@ void MgrClientConnection::socket_send_auth()
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_connected()
 {
-  if (direction == OUTGOING && timer_connect && timer_connect->isActive())
-    timer_connect->stop();
+  if (direction == OUTGOING && timer_connect.isActive())
+    timer_connect.stop();
   input_buffer.clear();
   output_buffer.clear();
+  clearPendingPackets();
   closing_by_cmd_close = false;
   bytes_rcv = 0;
   bytes_snd = 0;
@@ -288,30 +383,30 @@ void MgrClientConnection::socket_connected()
   t_connected.restart();
   if (direction == OUTGOING)
   {
-    log(LOG_DBG1, QString(": connected"));
+    OBJ_LOG(this, LOG_DBG1, QString(": connected"));
     setSocketOption(QSslSocket::KeepAliveOption, (params.flags & MgrClientParameters::FL_TCP_KEEP_ALIVE) ? 1 : 0);
     setSocketOption(QSslSocket::LowDelayOption, (params.flags & MgrClientParameters::FL_TCP_NO_DELAY) ? 1 : 0);
     setReadBufferSize(params.read_buffer_size);
   }
 
   phase = PHASE_INIT;
-  timer_phase->setInterval(PHASE_INIT_TIMEOUT);
-  timer_phase->start();
+  timer_phase.setInterval(PHASE_INIT_TIMEOUT);
+  timer_phase.start();
 
   if (direction == OUTGOING)
   {
     if (params.flags & MgrClientParameters::FL_DISABLE_ENCRYPTION)
     {
       // sending encryption request and waiting for the same answer
-      log(LOG_DBG4, QString(": requesting no encryption"));
+      OBJ_LOG(this, LOG_DBG4, QString(": requesting no encryption"));
       output_buffer.append(PHASE_INIT_DECRYPT_CMD);
       sendOutputBuffer();
-      timer_phase->stop();
+      timer_phase.stop();
       // starting authentication
       emit state_changed(MgrClientConnection::MGR_AUTH);
       phase = PHASE_AUTH;
-      timer_phase->setInterval(PHASE_AUTH_TIMEOUT);
-      timer_phase->start();
+      timer_phase.setInterval(PHASE_AUTH_TIMEOUT);
+      timer_phase.start();
       socket_send_auth();
     }
     else
@@ -319,15 +414,19 @@ void MgrClientConnection::socket_connected()
       // sending encryption request and waiting for the same answer
       output_buffer.append(PHASE_INIT_ENCRYPT_CMD);
       sendOutputBuffer();
-      log(LOG_DBG4, QString(": requesting encryption"));
+      OBJ_LOG(this, LOG_DBG4, QString(": requesting encryption"));
       if (!params.private_key.isNull())
         this->setPrivateKey(params.private_key);
       else if (!params.private_key_filename.isEmpty())
-        this->setPrivateKey(params.private_key_filename, QSsl::Rsa, QSsl::Pem, private_key_passphrase.toUtf8());
+        this->setPrivateKey(loadSSLKeyFromFileCached(params.private_key_filename, private_key_passphrase.toUtf8()));
       if (!params.ssl_cert.isNull())
         this->setLocalCertificate(params.ssl_cert);
       else if (!params.ssl_cert_filename.isEmpty())
-        this->setLocalCertificate(params.ssl_cert_filename);
+      {
+        QList<QSslCertificate> certs = loadSSLCertChainFromFileCached(params.ssl_cert_filename);
+        if (!certs.isEmpty())
+          this->setLocalCertificate(certs.first());
+      }
       this->setProtocol(params.ssl_protocol);
     }
   }
@@ -337,39 +436,40 @@ void MgrClientConnection::socket_connected()
 void MgrClientConnection::socket_initiate_reconnect()
 {
   closing_by_cmd_close = false;
-  if (timer_connect->isActive())
-    timer_connect->stop();
-  if (timer_reconnect->interval() == 0 && params.reconnect_interval > 0)
-    timer_reconnect->setInterval(params.reconnect_interval);
+  if (timer_connect.isActive())
+    timer_connect.stop();
+  if (timer_reconnect.interval() == 0 && params.reconnect_interval > 0)
+    timer_reconnect.setInterval(params.reconnect_interval);
   else
   {
     if (params.reconnect_interval_increment > 0)
-      timer_reconnect->setInterval(timer_reconnect->interval()+params.reconnect_interval_increment);
+      timer_reconnect.setInterval(timer_reconnect.interval()+params.reconnect_interval_increment);
     else if (params.reconnect_interval_multiplicator > 1)
-      timer_reconnect->setInterval((quint32)qCeil((double)qMax(timer_reconnect->interval(),1)*params.reconnect_interval_multiplicator));
-    if (params.reconnect_interval_max > 0 && (quint32)timer_reconnect->interval() > params.reconnect_interval_max)
-      timer_reconnect->setInterval(params.reconnect_interval_max);
+      timer_reconnect.setInterval((quint32)qCeil((double)qMax(timer_reconnect.interval(),1)*params.reconnect_interval_multiplicator));
+    if (params.reconnect_interval_max > 0 && (quint32)timer_reconnect.interval() > params.reconnect_interval_max)
+      timer_reconnect.setInterval(params.reconnect_interval_max);
   }
-  timer_reconnect->start();
+  timer_reconnect.start();
 }
 
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_disconnected()
 {
-  if (timer_connect && timer_connect->isActive())
-    timer_connect->stop();
-  if (timer_phase->isActive())
-    timer_phase->stop();
-  if (timer_idle->isActive())
-    timer_idle->stop();
-  if (timer_heartbeat->isActive())
-    timer_heartbeat->stop();
-  if (timer_heartbeat_check->isActive())
-    timer_heartbeat_check->stop();
+  if (timer_connect.isActive())
+    timer_connect.stop();
+  if (timer_phase.isActive())
+    timer_phase.stop();
+  if (timer_idle.isActive())
+    timer_idle.stop();
+  if (timer_heartbeat.isActive())
+    timer_heartbeat.stop();
+  if (timer_heartbeat_check.isActive())
+    timer_heartbeat_check.stop();
   phase = PHASE_NONE;
   input_buffer.clear();
   output_buffer.clear();
-  log(LOG_DBG1, QString(": disconnected"));
+  clearPendingPackets();
+  OBJ_LOG(this, LOG_DBG1, QString(": disconnected"));
   if (direction == OUTGOING && params.conn_type == MgrClientParameters::CONN_AUTO)
     socket_initiate_reconnect();
   else if (direction == INCOMING)
@@ -379,9 +479,9 @@ void MgrClientConnection::socket_disconnected()
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_error(QAbstractSocket::SocketError error)
 {
-  if (timer_connect && timer_connect->isActive())
-    timer_connect->stop();
-  log(LOG_DBG2, QString(" error: ")+this->errorString());
+  if (timer_connect.isActive())
+    timer_connect.stop();
+  OBJ_LOG(this, LOG_DBG2, QString(" error: ")+this->errorString());
   emit state_changed(MgrClientConnection::MGR_ERROR);
   emit connection_error(error);
   if (this->state() != QSslSocket::UnconnectedState)
@@ -401,7 +501,7 @@ void MgrClientConnection::socket_sslError(const QList<QSslError> &errors)
         errors[i].error() == QSslError::CertificateExpired ||
         errors[i].error() == QSslError::CertificateNotYetValid)
       continue;
-    log(LOG_DBG2, QString(" SSL error: ")+errors[i].errorString());
+    OBJ_LOG(this, LOG_DBG2, QString(" SSL error: ")+errors[i].errorString());
     if (this->state() != QSslSocket::UnconnectedState)
     {
       emit state_changed(MgrClientConnection::MGR_ERROR);
@@ -415,24 +515,23 @@ void MgrClientConnection::socket_sslError(const QList<QSslError> &errors)
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_bytesWritten(qint64 bytes)
 {
-  log(LOG_DBG4, QString(": %1 bytes sent").arg(bytes));
+  OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes sent").arg(bytes));
   bytes_snd += bytes;
   emit stat_bytesSent(bytes);
   int bytes_to_write = bytesToWrite();
   if (bytes_to_write > 0 && output_buffer.length() > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer, %3 in output buffer)").arg(bytes).arg(bytes_to_write).arg(output_buffer.length()));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer, %3 in output buffer)").arg(bytes).arg(bytes_to_write).arg(output_buffer.length()));
   else if (bytes_to_write > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer)").arg(bytes).arg(bytes_to_write));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer)").arg(bytes).arg(bytes_to_write));
   else if (output_buffer.length() > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%3 more in output buffer)").arg(bytes).arg(output_buffer.length()));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%3 more in output buffer)").arg(bytes).arg(output_buffer.length()));
   else
-    log(LOG_DBG4, QString(": %1 bytes written").arg(bytes));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written").arg(bytes));
   t_last_snd.restart();
-  if (timer_heartbeat->isActive())
-    timer_heartbeat->start();
+  timer_heartbeat.postpone();
   if (!output_buffer.isEmpty())
     sendOutputBuffer();
-  else if (bytes_to_write == 0 && receivers(SIGNAL(output_buffer_empty())) > 0)
+  else if (bytes_to_write == 0 && out_pending_packets.isEmpty() && receivers(SIGNAL(output_buffer_empty())) > 0)
     emit output_buffer_empty();
 }
 
@@ -442,18 +541,14 @@ void MgrClientConnection::socket_encryptedBytesWritten(qint64 bytes)
   emit stat_bytesSentEncrypted(bytes);
   bytes_snd_encrypted += bytes;
   t_last_snd.restart();
-  if (timer_heartbeat->isActive())
-    timer_heartbeat->start();
+  timer_heartbeat.postpone();
 }
 
 //-----------------------------------------------------------------------------
 void MgrClientConnection::sendOutputBuffer()
 {
-  quint64 bytes_to_write;
-  if (mode() == QSslSocket::UnencryptedMode)
-    bytes_to_write = bytesToWrite();
-  else
-    bytes_to_write = encryptedBytesToWrite();
+  StageTimer stage_timer(stage_counters, STAGE_MGRCONN_WRITE);
+  quint64 bytes_to_write = socketBytesToWrite();
   int max_new_bytes_to_write = output_buffer.length();
   if (params.write_buffer_size > 0 && bytes_to_write+max_new_bytes_to_write > params.write_buffer_size)
     max_new_bytes_to_write = params.write_buffer_size-bytes_to_write;
@@ -466,8 +561,14 @@ void MgrClientConnection::sendOutputBuffer()
     output_buffer.remove(0, send_len);
     t_last_snd.restart();
   }
-  if (timer_heartbeat->isActive())
-    timer_heartbeat->start();
+  timer_heartbeat.postpone();
+}
+
+//---------------------------------------------------------------------------
+// called periodically by the owner, returns released bytes
+quint64 MgrClientConnection::trimBuffers()
+{
+  return BufferPool::trim(input_buffer)+BufferPool::trim(output_buffer);
 }
 
 //---------------------------------------------------------------------------
@@ -478,9 +579,9 @@ QByteArray MgrClientConnection::socket_read(quint64 max_len)
   {
     qint64 bytes_avail = bytesAvailable();
     if (bytes_avail == 0)
-      log(LOG_DBG4, QString(": %1 bytes received").arg(data.length()));
+      OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes received").arg(data.length()));
     else
-      log(LOG_DBG4, QString(": %1 bytes received (%2 more available)").arg(data.length()).arg(bytes_avail));
+      OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes received (%2 more available)").arg(data.length()).arg(bytes_avail));
   }
   bytes_rcv += data.length();
   emit stat_bytesReceived(data.length());
@@ -491,15 +592,14 @@ QByteArray MgrClientConnection::socket_read(quint64 max_len)
 void MgrClientConnection::socket_readyRead()
 {
   t_last_rcv.restart();
-  if (timer_heartbeat_check->isActive())
-    timer_heartbeat_check->start();
+  timer_heartbeat_check.postpone();
   // check minimum read buffer size
   if (phase == PHASE_INIT && input_buffer.length()+bytesAvailable() < (int)strlen(PHASE_INIT_ENCRYPT_CMD))
     return;
 
-  if (params.read_buffer_size > 0 && (quint32)input_buffer.length() >= params.read_buffer_size)
+  if (params.read_buffer_size > 0 && (quint32)input_buffer.length()+in_pending_len >= params.read_buffer_size)
   {
-    // input buffer overflows, slow down and reschedule
+    // input buffer (or received packets still waiting for decompression) overflows, slow down and reschedule
     QTimer::singleShot(5, this, SLOT(socket_readyRead()));
     return;
   }
@@ -512,32 +612,39 @@ void MgrClientConnection::socket_readyRead()
     if (input_buffer == QByteArray(PHASE_INIT_ENCRYPT_CMD))
     {
       input_buffer.clear();
-      timer_phase->stop();
+      timer_phase.stop();
       phase = PHASE_SSL_HANDSHAKE;
-      log(LOG_DBG3, QString(": starting SSL handshake"));
+      OBJ_LOG(this, LOG_DBG3, QString(": starting SSL handshake"));
       if (direction == INCOMING)
       {
         // sending encryption request and waiting for the same answer
         output_buffer.append(PHASE_INIT_ENCRYPT_CMD);
         sendOutputBuffer();
       }
-      timer_phase->setInterval(PHASE_SSL_HANDSHAKE_TIMEOUT);
-      timer_phase->start();
+      timer_phase.setInterval(PHASE_SSL_HANDSHAKE_TIMEOUT);
+      timer_phase.start();
       if (direction == INCOMING)
+      {
+        sslServerContextAttach(this);
         startServerEncryption();
+        sslServerContextCapture(this);
+      }
       else
+      {
+        sslSessionRestore();
         startClientEncryption();
+      }
       return;
     }
     else if (input_buffer == QByteArray(PHASE_INIT_DECRYPT_CMD) && direction == INCOMING)
     {
       input_buffer.clear();
-      timer_phase->stop();
+      timer_phase.stop();
       emit state_changed(MgrClientConnection::MGR_AUTH);
       phase = PHASE_AUTH;
-      log(LOG_DBG3, QString(": starting authentication"));
-      timer_phase->setInterval(PHASE_AUTH_TIMEOUT);
-      timer_phase->start();
+      OBJ_LOG(this, LOG_DBG3, QString(": starting authentication"));
+      timer_phase.setInterval(PHASE_AUTH_TIMEOUT);
+      timer_phase.start();
     }
   }
   // we don't want to mess with SSL handshake, so ignore all data received in this phase
@@ -549,10 +656,13 @@ void MgrClientConnection::socket_readyRead()
     return;
   }
   int bytes_to_read = max_bytes_to_read_at_once > 0 ? max_bytes_to_read_at_once : bytesAvailable();
-  if (params.read_buffer_size > 0 && (quint32)input_buffer.length()+bytes_to_read > params.read_buffer_size)
-    bytes_to_read = params.read_buffer_size-input_buffer.length();
-  QByteArray buffer = this->socket_read(bytes_to_read);
-  input_buffer.append(buffer);
+  if (params.read_buffer_size > 0 && (quint32)input_buffer.length()+in_pending_len+bytes_to_read > params.read_buffer_size)
+    bytes_to_read = params.read_buffer_size-input_buffer.length()-in_pending_len;
+  // take over freshly read data as is if there is no incomplete packet left from previous read
+  if (input_buffer.isEmpty())
+    input_buffer = this->socket_read(bytes_to_read);
+  else
+    input_buffer.append(this->socket_read(bytes_to_read));
   parseInputBuffer();
   if (((mode() == QSslSocket::UnencryptedMode) ? bytesAvailable() : encryptedBytesAvailable()) > 0)
   {
@@ -589,7 +699,7 @@ void MgrClientConnection::parseInputBuffer()
 
     if (orig_len > MGR_PACKET_MAX_LEN)
     {
-      log(LOG_DBG3, QString(": received packet with incorrect len (%1) - dropping").arg(orig_len));
+      OBJ_LOG(this, LOG_DBG3, QString(": received packet with incorrect len (%1) - dropping").arg(orig_len));
       input_buffer.clear();
       emit state_changed(MgrClientConnection::MGR_ERROR);
       emit connection_error(QAbstractSocket::ProxyProtocolError);
@@ -599,7 +709,7 @@ void MgrClientConnection::parseInputBuffer()
     MgrPacketCmd cmd = orig_cmd & ~MGR_PACKET_FLAG_COMPRESSED;
     if (cmd >= CMD_MAX)
     {
-      log(LOG_DBG3, QString(": received packet with incorrect cmd - dropping"));
+      OBJ_LOG(this, LOG_DBG3, QString(": received packet with incorrect cmd - dropping"));
       input_buffer.clear();
       emit state_changed(MgrClientConnection::MGR_ERROR);
       emit connection_error(QAbstractSocket::ProxyProtocolError);
@@ -610,15 +720,37 @@ void MgrClientConnection::parseInputBuffer()
     if (input_buffer.length() < pos+MGR_PACKET_HEADER_LEN+(int)orig_len)
       break;
 
-    if (cmd > CMD_MAX_INTERNAL)
+    if ((cmd > CMD_MAX_INTERNAL || cmd == CMD_CLOSE) &&
+        (!in_pending_packets.isEmpty() ||
+         ((orig_cmd & MGR_PACKET_FLAG_COMPRESSED) && orig_len >= MGR_PACKET_MIN_LEN_FOR_ASYNC_COMPRESSION)))
+    {
+      // big packet is uncompressed in thread pool, packets received after it have to wait for it
+      MgrPendingPacket packet;
+      packet.seq = ++packet_job_seq;
+      packet.cmd = cmd;
+      packet.data = input_buffer.mid(pos+MGR_PACKET_HEADER_LEN,orig_len);
+      packet.ready = !(orig_cmd & MGR_PACKET_FLAG_COMPRESSED);
+      in_pending_packets.append(packet);
+      in_pending_len += packet.data.length();
+      if (!packet.ready)
+        startPacketJob(false, packet.seq, packet.data);
+    }
+    else if (cmd > CMD_MAX_INTERNAL)
     {
       QByteArray data;
       if (orig_cmd & MGR_PACKET_FLAG_COMPRESSED)
-        data = qUncompress(input_buffer.mid(pos+MGR_PACKET_HEADER_LEN,orig_len));
+      {
+        StageTimer stage_timer(stage_counters, STAGE_DECOMPRESS);
+        data = qUncompress((const uchar *)input_buffer.constData()+pos+MGR_PACKET_HEADER_LEN, orig_len);
+      }
       else
-        data = input_buffer.mid(pos+MGR_PACKET_HEADER_LEN,orig_len);
-      log(LOG_DBG4, QString(": received packet cmd=%1, len=%2").arg(mgrPacket_cmdString(cmd)).arg(orig_len));
-      emit packetReceived(cmd, data);
+      {
+        data = BufferPool::acquire(orig_len);
+        data.append(input_buffer.constData()+pos+MGR_PACKET_HEADER_LEN, orig_len);
+      }
+      OBJ_LOG(this, LOG_DBG4, QString(": received packet cmd=%1, len=%2").arg(mgrPacket_cmdString(cmd)).arg(orig_len));
+      dispatchPacket(cmd, data);
+      BufferPool::release(data);
       if (this->state() != QAbstractSocket::ConnectedState)
       {
         input_buffer.clear();
@@ -629,9 +761,11 @@ void MgrClientConnection::parseInputBuffer()
       sendPacket(CMD_HEARTBEAT_REP);
     else if (cmd == CMD_HEARTBEAT_REP)
     {
-      if (latency != (unsigned int)qAbs(t_last_heartbeat_req.elapsed()))
+      qint64 rtt_nsecs = t_last_heartbeat_req.nsecsElapsed();
+      latency_histogram.record(rtt_nsecs);
+      if (latency != (quint32)(rtt_nsecs/1000000))
       {
-        latency = qAbs(t_last_heartbeat_req.elapsed());
+        latency = rtt_nsecs/1000000;
         emit latency_changed(latency);
       }
     }
@@ -652,10 +786,140 @@ void MgrClientConnection::parseInputBuffer()
 //---------------------------------------------------------------------------
 void MgrClientConnection::log(LogPriority prio, const QString &text)
 {
-  if (!params.name.isEmpty())
-    prc_log(prio, log_prefix+QString("Connection with %1 (%2:%3)").arg(params.name).arg(params.host).arg(params.port)+text);
+  if (!prc_log_enabled(prio))
+    return;
+  if (log_prefix_full.isEmpty() ||
+      log_prefix_full_prefix != log_prefix || log_prefix_full_name != params.name ||
+      log_prefix_full_host != params.host || log_prefix_full_port != params.port)
+  {
+    log_prefix_full_prefix = log_prefix;
+    log_prefix_full_name = params.name;
+    log_prefix_full_host = params.host;
+    log_prefix_full_port = params.port;
+    if (!params.name.isEmpty())
+      log_prefix_full = log_prefix+QString("Connection with %1 (%2:%3)").arg(params.name).arg(params.host).arg(params.port);
+    else
+      log_prefix_full = log_prefix+QString("Connection with %1:%2").arg(params.host).arg(params.port);
+  }
+  prc_log(prio, log_prefix_full+text);
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::parsePendingPackets()
+{
+  QTime t_processing;
+  t_processing.start();
+  while (!in_pending_packets.isEmpty() && in_pending_packets.first().ready)
+  {
+    if ((unsigned int)qAbs(t_processing.elapsed()) > max_processing_time_ms)
+    {
+      // parsing is taking too long? Give other connections a chance!
+      QTimer::singleShot(0, this, SLOT(parsePendingPackets()));
+      break;
+    }
+    MgrPendingPacket packet = in_pending_packets.takeFirst();
+    in_pending_len -= packet.data.length();
+    if (packet.cmd == CMD_CLOSE)
+    {
+      closing_by_cmd_close = true;
+      this->abort();
+      return;
+    }
+    OBJ_LOG(this, LOG_DBG4, QString(": received packet cmd=%1, len=%2").arg(mgrPacket_cmdString(packet.cmd)).arg(packet.data.length()));
+    dispatchPacket(packet.cmd, packet.data);
+    if (this->state() != QAbstractSocket::ConnectedState)
+    {
+      in_pending_packets.clear();
+      in_pending_len = 0;
+      return;
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+void MgrPacketJob::run()
+{
+  QByteArray result = compress ? qCompress(data) : qUncompress(data);
+  data.clear();
+  QMutexLocker locker(&conn_ref->mutex);
+  if (conn_ref->conn)
+    QMetaObject::invokeMethod(conn_ref->conn, "packetJobFinished", Qt::QueuedConnection,
+                              Q_ARG(quint32, seq), Q_ARG(bool, compress), Q_ARG(QByteArray, result));
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::startPacketJob(bool compress, quint32 seq, const QByteArray &data)
+{
+  MgrPacketJob *job = new MgrPacketJob;
+  job->compress = compress;
+  job->seq = seq;
+  job->data = data;
+  job->conn_ref = conn_ref;
+  QThreadPool::globalInstance()->start(job);
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::packetJobFinished(quint32 seq, bool compress, const QByteArray &data)
+{
+  QList<MgrPendingPacket> &packets = compress ? out_pending_packets : in_pending_packets;
+  // packet may be gone already if connection was reset while job was running
+  for (int i=0; i < packets.count(); i++)
+  {
+    if (packets[i].seq != seq)
+      continue;
+    if (compress)
+    {
+      bytes_snd_compressible += packets[i].data.length();
+      bytes_snd_compressed += qMin(data.length(), packets[i].data.length());
+    }
+    if (!compress)
+    {
+      in_pending_len -= packets[i].data.length();
+      in_pending_len += data.length();
+      packets[i].data = data;
+    }
+    else if (data.length() < packets[i].data.length())
+    {
+      out_pending_len -= packets[i].data.length()-data.length();
+      packets[i].cmd = (MgrPacketCmd)(packets[i].cmd | MGR_PACKET_FLAG_COMPRESSED);
+      packets[i].data = data;
+    }
+    packets[i].ready = true;
+    break;
+  }
+  if (compress)
+    sendPendingPackets();
   else
-    prc_log(prio, log_prefix+QString("Connection with %1:%2").arg(params.host).arg(params.port)+text);
+    parsePendingPackets();
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::sendPendingPackets()
+{
+  while (!out_pending_packets.isEmpty() && out_pending_packets.first().ready)
+  {
+    MgrPendingPacket packet = out_pending_packets.takeFirst();
+    out_pending_len -= packet.data.length();
+    if (packet.data.length() > MGR_PACKET_MAX_LEN)
+    {
+      // sendPacket() has already returned true for it, so the peer would silently miss a packet
+      OBJ_LOG(this, LOG_DBG1, QString(": packet cmd=%1 is too big (%2 bytes) even compressed - closing connection").arg(mgrPacket_cmdString(packet.cmd & ~MGR_PACKET_FLAG_COMPRESSED)).arg(packet.data.length()));
+      emit state_changed(MgrClientConnection::MGR_ERROR);
+      emit connection_error(QAbstractSocket::ProxyProtocolError);
+      this->abort();
+      return;
+    }
+    sendFrame(packet.cmd, packet.data);
+  }
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::clearPendingPackets()
+{
+  out_pending_packets.clear();
+  in_pending_packets.clear();
+  out_pending_len = 0;
+  in_pending_len = 0;
 }
 
 //---------------------------------------------------------------------------
@@ -665,47 +929,136 @@ bool MgrClientConnection::sendPacket(MgrPacketCmd _cmd, const QByteArray &_data)
     return false;
 
   MgrPacketLen len = _data.length();
-  if (params.max_io_buffer_size > 0 && output_buffer.length()+len > params.max_io_buffer_size)
+  if (params.max_io_buffer_size > 0 && output_buffer.length()+out_pending_len+len > params.max_io_buffer_size)
   {
-    log(LOG_DBG1, QString("output buffer overflow - dropping"));
+    OBJ_LOG(this, LOG_DBG1, QString("output buffer overflow - dropping"));
     output_buffer.clear();
     emit state_changed(MgrClientConnection::MGR_ERROR);
     emit connection_error(QAbstractSocket::ProxyProtocolError);
     this->abort();
     return false;
   }
-  bool compressed = false;
-  if ((params.flags & MgrClientParameters::FL_USE_COMPRESSION) && len >= MGR_PACKET_MIN_LEN_FOR_COMPRESSION)
+  bool compress = (params.flags & MgrClientParameters::FL_USE_COMPRESSION) && len >= MGR_PACKET_MIN_LEN_FOR_COMPRESSION;
+  if (len > MGR_PACKET_MAX_LEN && !compress)
   {
-    QByteArray data = qCompress(_data);
-    if (data.length() < _data.length())
-    {
-      MgrPacketLen cmd = _cmd | MGR_PACKET_FLAG_COMPRESSED;
-      len = data.length();
-      if (len > MGR_PACKET_MAX_LEN)
-        return false;
-      output_buffer.reserve(output_buffer.length()+sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+data.length());
-      output_buffer.append(QByteArray((const char *)&cmd, sizeof(MgrPacketCmd)));
-      output_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
-      output_buffer.append(data);
-      compressed = true;
-    }
+    OBJ_LOG(this, LOG_DBG1, QString(": packet cmd=%1 is too big (%2 bytes) - not sending").arg(mgrPacket_cmdString(_cmd)).arg(len));
+    return false;
   }
-  if (!compressed)
+  if ((compress && len >= MGR_PACKET_MIN_LEN_FOR_ASYNC_COMPRESSION && len <= MGR_PACKET_MAX_LEN) ||
+      !out_pending_packets.isEmpty())
   {
-    if (len > MGR_PACKET_MAX_LEN)
-      return false;
-    output_buffer.reserve(output_buffer.length()+sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+_data.length());
-    output_buffer.append(QByteArray((const char *)&_cmd, sizeof(MgrPacketCmd)));
-    output_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
-    output_buffer.append(_data);
+    // big packet is compressed in thread pool, packets sent after it have to wait for it
+    MgrPendingPacket packet;
+    packet.seq = ++packet_job_seq;
+    packet.cmd = _cmd;
+    packet.data = _data;
+    packet.ready = !compress;
+    out_pending_packets.append(packet);
+    out_pending_len += len;
+    if (compress)
+      startPacketJob(true, packet.seq, _data);
+    return true;
+  }
+  if (compress)
+  {
+    QByteArray compressed_data = qCompress(_data);
+    bytes_snd_compressible += _data.length();
+    bytes_snd_compressed += qMin(compressed_data.length(), _data.length());
+    if (compressed_data.length() < _data.length())
+      return sendFrame((MgrPacketCmd)(_cmd | MGR_PACKET_FLAG_COMPRESSED), compressed_data);
+  }
+  return sendFrame(_cmd, _data);
+}
+
+//---------------------------------------------------------------------------
+bool MgrClientConnection::sendFrame(MgrPacketCmd cmd, const QByteArray &data)
+{
+  MgrPacketLen len = data.length();
+  if (len > MGR_PACKET_MAX_LEN)
+  {
+    OBJ_LOG(this, LOG_DBG1, QString(": packet cmd=%1 is too big (%2 bytes) - not sending").arg(mgrPacket_cmdString(cmd & ~MGR_PACKET_FLAG_COMPRESSED)).arg(len));
+    return false;
   }
+
+  MgrPacketCmd _cmd = cmd & ~MGR_PACKET_FLAG_COMPRESSED;
+  char header[MGR_PACKET_HEADER_LEN];
+  memcpy(header, &cmd, sizeof(MgrPacketCmd));
+  memcpy(header+sizeof(MgrPacketCmd), &len, sizeof(MgrPacketLen));
   if ((_cmd != CMD_HEARTBEAT_REQ && _cmd != CMD_HEARTBEAT_REP) || prc_log_level >= LOG_DBG4)
-    log(LOG_DBG4, QString(": sending packet cmd=%1, len=%2").arg(mgrPacket_cmdString(_cmd)).arg(len));
+    OBJ_LOG(this, LOG_DBG4, QString(": sending packet cmd=%1, len=%2").arg(mgrPacket_cmdString(_cmd)).arg(len));
+
+  // nothing is waiting in output buffer and socket has room for the packet:
+  // pass it to the socket right away instead of copying it to output buffer first
+  if (output_buffer.isEmpty() &&
+      (params.write_buffer_size == 0 || socketBytesToWrite()+MGR_PACKET_HEADER_LEN+len <= params.write_buffer_size))
+  {
+    StageTimer stage_timer(stage_counters, STAGE_MGRCONN_WRITE);
+    if (this->write(header, MGR_PACKET_HEADER_LEN) != MGR_PACKET_HEADER_LEN ||
+        (len > 0 && this->write(data) != (qint64)len))
+      return false;
+    t_last_snd.restart();
+    timer_heartbeat.postpone();
+    return true;
+  }
+
+  output_buffer.reserve(output_buffer.length()+MGR_PACKET_HEADER_LEN+len);
+  output_buffer.append(header, MGR_PACKET_HEADER_LEN);
+  output_buffer.append(data);
   sendOutputBuffer();
   return true;
 }
 
+//---------------------------------------------------------------------------
+void MgrClientConnection::timerWheelExpired(TimerWheelTimer *timer)
+{
+  if (timer == &timer_heartbeat)
+  {
+    timer_heartbeat.start();
+    socket_heartbeat();
+  }
+  else if (timer == &timer_heartbeat_check)
+  {
+    timer_heartbeat_check.start();
+    socket_heartbeat_check();
+  }
+  else if (timer == &timer_phase)
+    socket_phase_timeout();
+  else if (timer == &timer_idle)
+    socket_idle_timeout();
+  else if (timer == &timer_connect)
+    socket_connect_timeout();
+  else if (timer == &timer_reconnect)
+    beginConnection();
+}
+
+//---------------------------------------------------------------------------
+// timer wheel is per thread: carry active timers over to the wheel of the new thread
+bool MgrClientConnection::event(QEvent *e)
+{
+  if (e->type() == QEvent::ThreadChange)
+  {
+    timer_connect.suspend();
+    timer_heartbeat.suspend();
+    timer_heartbeat_check.suspend();
+    timer_reconnect.suspend();
+    timer_phase.suspend();
+    timer_idle.suspend();
+    QMetaObject::invokeMethod(this, "timers_resume", Qt::QueuedConnection);
+  }
+  return QSslSocket::event(e);
+}
+
+//---------------------------------------------------------------------------
+void MgrClientConnection::timers_resume()
+{
+  timer_connect.resume();
+  timer_heartbeat.resume();
+  timer_heartbeat_check.resume();
+  timer_reconnect.resume();
+  timer_phase.resume();
+  timer_idle.resume();
+}
+
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_heartbeat()
 {
@@ -717,7 +1070,7 @@ void MgrClientConnection::socket_heartbeat()
 //---------------------------------------------------------------------------
 void MgrClientConnection::socket_heartbeat_check()
 {
-  log(LOG_DBG3, QString(": no heartbeat received in %1 s").arg((double)params.rcv_timeout/1000, 0, 'f', 1));
+  OBJ_LOG(this, LOG_DBG3, QString(": no heartbeat received in %1 s").arg((double)params.rcv_timeout/1000, 0, 'f', 1));
   emit state_changed(MgrClientConnection::MGR_ERROR);
   emit connection_error(QAbstractSocket::SocketTimeoutError);
   this->abort();
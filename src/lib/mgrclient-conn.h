@@ -12,9 +12,17 @@
 #include <QSslSocket>
 #include <QTimer>
 #include <QTime>
+#include <QElapsedTimer>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QMutex>
+#include <string.h>
 #include "mgrclient-parameters.h"
 #include "mgr_packet.h"
 #include "prc_log.h"
+#include "latency-histogram.h"
+#include "stage_timer.h"
+#include "timer-wheel.h"
 
 #define PHASE_INIT_TIMEOUT                          3000
 #define PHASE_INIT_ENCRYPT_CMD             "ENCRYPT\r\n"
@@ -24,7 +32,59 @@
 
 #define PHASE_AUTH_TIMEOUT                          3000
 
-class MgrClientConnection: public QSslSocket
+// max number of peers (host:port) to keep TLS sessions for
+#define SSL_SESSION_CACHE_MAX_SIZE                  1024
+
+// packets of this size or bigger are (un)compressed in thread pool instead of connection's thread
+#define MGR_PACKET_MIN_LEN_FOR_ASYNC_COMPRESSION   32*1024
+
+class MgrClientConnection;
+
+// receiver of connection's packets, bound once the connection's role is known (see MgrClientConnection::setPacketHandler()):
+// packets reach it with a direct call instead of packetReceived() signal
+class MgrPacketHandler
+{
+public:
+  virtual ~MgrPacketHandler() {}
+  virtual void mgrPacketReceived(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data) = 0;
+};
+
+// lets packet jobs running in thread pool reach connection only while it exists
+struct MgrClientConnectionRef
+{
+  QMutex mutex;
+  MgrClientConnection *conn;
+
+  MgrClientConnectionRef(MgrClientConnection *_conn)
+  {
+    conn = _conn;
+  }
+};
+
+// packet data compression/decompression running in QThreadPool::globalInstance()
+class MgrPacketJob: public QRunnable
+{
+public:
+  bool compress;
+  quint32 seq;
+  QByteArray data;
+  QSharedPointer<MgrClientConnectionRef> conn_ref;
+
+  void run();
+};
+
+// packet waiting for its own or previous packet's (de)compression to finish
+struct MgrPendingPacket
+{
+  quint32 seq;
+  MgrPacketCmd cmd;                  // outgoing packets: with MGR_PACKET_FLAG_COMPRESSED if data is compressed
+  QByteArray data;
+  bool ready;
+};
+
+// TLS records are always processed in userspace by QSslSocket: it drives OpenSSL through memory BIOs, so kernel TLS
+// (OpenSSL's SSL_OP_ENABLE_KTLS or TCP_ULP "tls" with our own keys) can't take over the socket after the handshake
+class MgrClientConnection: public QSslSocket, public TimerWheelClient
 {
   Q_OBJECT
 public:
@@ -47,60 +107,47 @@ public:
     connect(this, SIGNAL(bytesWritten(qint64)), this, SLOT(socket_bytesWritten(qint64)));
     connect(this, SIGNAL(encryptedBytesWritten(qint64)), this, SLOT(socket_encryptedBytesWritten(qint64)));
     connect(this, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
+#if QT_VERSION >= 0x050F00
+    connect(this, SIGNAL(newSessionTicketReceived()), this, SLOT(socket_sslSessionSave()));
+#endif
 
     this->setPeerVerifyMode(QSslSocket::QueryPeer);
 
-    // timer for heartbeat send
-    timer_heartbeat = new QTimer(this);
-    timer_heartbeat->setSingleShot(false);
-    connect(timer_heartbeat, SIGNAL(timeout()), this, SLOT(socket_heartbeat()));
-
-    // timer for heartbeat check
-    timer_heartbeat_check = new QTimer(this);
-    timer_heartbeat_check->setSingleShot(false);
-    connect(timer_heartbeat_check, SIGNAL(timeout()), this, SLOT(socket_heartbeat_check()));
-
-    // timer for phase timeout
-    timer_phase = new QTimer(this);
-    timer_phase->setSingleShot(true);
-    connect(timer_phase, SIGNAL(timeout()), this, SLOT(socket_phase_timeout()));
-
-    // timer for idle timeout (this one should start/restart in application!)
-    timer_idle = new QTimer(this);
-    timer_idle->setSingleShot(true);
-    connect(timer_idle, SIGNAL(timeout()), this, SLOT(socket_idle_timeout()));
-
-    if (dir == OUTGOING)
-    {
-      // timer for connect timeout
-      timer_connect = new QTimer(this);
-      timer_connect->setSingleShot(true);
-      connect(timer_connect, SIGNAL(timeout()), this, SLOT(socket_connect_timeout()));
-
-      // timer for reconnect
-      timer_reconnect = new QTimer(this);
-      timer_reconnect->setSingleShot(true);
-      connect(timer_reconnect, SIGNAL(timeout()), this, SLOT(beginConnection()));
-    }
-    else
-    {
-      timer_connect = NULL;
-      timer_reconnect = NULL;
-    }
+    // timers are scheduled into the thread's timer wheel, see timerWheelExpired()
+    // (timer_idle should be started/restarted in application!)
+    timer_connect.client = this;
+    timer_heartbeat.client = this;
+    timer_heartbeat_check.client = this;
+    timer_reconnect.client = this;
+    timer_phase.client = this;
+    timer_idle.client = this;
 
     bytes_rcv = 0;
     bytes_snd = 0;
     bytes_rcv_encrypted = 0;
     bytes_snd_encrypted = 0;
+    bytes_snd_compressible = 0;
+    bytes_snd_compressed = 0;
     latency = 0;
     phase = PHASE_NONE;
     protocol_version = MGR_PACKET_VERSION;
+    peer_features = 0;
     max_bytes_to_read_at_once = (MGR_PACKET_MAX_LEN+sizeof(MgrPacketCmd)+sizeof(MgrPacketLen))*2;
     max_processing_time_ms = 50;
     closing_by_cmd_close = false;
+    out_pending_len = 0;
+    in_pending_len = 0;
+    packet_job_seq = 0;
+    log_prefix_full_port = 0;
+    packet_handler = NULL;
+    packet_handler_role = 0;
+    conn_ref = QSharedPointer<MgrClientConnectionRef>(new MgrClientConnectionRef(this));
   }
   ~MgrClientConnection()
   {
+    conn_ref->mutex.lock();
+    conn_ref->conn = NULL;
+    conn_ref->mutex.unlock();
     this->log(LOG_DBG4, QString(": destroyed"));
     if (this->state() != QSslSocket::UnconnectedState)
       this->abort();
@@ -113,29 +160,52 @@ public:
   QTime t_last_rcv;
   QTime t_last_snd;
   QTime t_last_check;
-  QTime t_last_heartbeat_req;
+  QElapsedTimer t_last_heartbeat_req;
 
   quint64 bytes_rcv;
   quint64 bytes_snd;
   quint64 bytes_rcv_encrypted;
   quint64 bytes_snd_encrypted;
+  quint64 bytes_snd_compressible;         // packet data bytes which compression was tried for (not reset on reconnect)
+  quint64 bytes_snd_compressed;           // the same data as actually sent (compressed or not)
   quint32 latency;
-
-  QTimer *timer_connect;
-  QTimer *timer_heartbeat;
-  QTimer *timer_heartbeat_check;
-  QTimer *timer_reconnect;
-  QTimer *timer_phase;
-  QTimer *timer_idle;
+  LatencyHistogram latency_histogram;     // heartbeat round-trip times
+  StageCounters stage_counters;           // STAGE_MGRCONN_WRITE and STAGE_DECOMPRESS
+
+  TimerWheelTimer timer_connect;          // outgoing connections only
+  TimerWheelTimer timer_heartbeat;        // periodic, postponed by every write
+  TimerWheelTimer timer_heartbeat_check;  // periodic, postponed by every read
+  TimerWheelTimer timer_reconnect;        // outgoing connections only, interval is the current reconnect backoff
+  TimerWheelTimer timer_phase;
+  TimerWheelTimer timer_idle;
   bool closing_by_cmd_close;
 
   quint32 max_bytes_to_read_at_once;      // limit amount of data to read from socket at once in readyRead() (0 = no limit)
   quint32 max_processing_time_ms;         // limit time used for processing of received packets in readyRead() (0 = no limit)
 
+  // TLS session resumption statistics of all outgoing connections: abbreviated and full handshakes
+  static void sslSessionStats(quint64 &hits, quint64 &misses);
+
   quint8 protocol_version;                // version of MgrPacket/MgrClientConnection protocol
+  quint32 peer_features;                  // MGR_FEATURE_* supported by server (outgoing connections)
   QString peer_hostname;                  // peer (server or client) hostname reported by itself
 
-  QString log_prefix;
+  QString log_prefix;                     // prepended to every log message of this connection
+  QString log_prefix_full;                // cached log_prefix+"Connection with ..."
+  QString log_prefix_full_prefix;         // log_prefix, name, host and port log_prefix_full was built for
+  QString log_prefix_full_name;
+  QString log_prefix_full_host;
+  quint16 log_prefix_full_port;
+
+  MgrPacketHandler *packet_handler;       // NULL = packets are emitted with packetReceived()
+  int packet_handler_role;                // handler-defined role of the connection
+
+  // must be called in connection's thread
+  void setPacketHandler(MgrPacketHandler *handler, int role=0)
+  {
+    packet_handler = handler;
+    packet_handler_role = role;
+  }
 
   enum ConnPhase { PHASE_NONE=0,             // Connection is not established yet
                    PHASE_INIT=1,             // Connection established, sending HTTP request and processing HTTP replies
@@ -156,8 +226,33 @@ public:
   void setParameters(const MgrClientParameters *new_params);
   bool sendPacket(MgrPacketCmd _cmd, const QByteArray &_data=QByteArray());
   void sendOutputBuffer();
+  // bytes already passed to the socket and not yet written to the network
+  qint64 socketBytesToWrite() const
+  {
+    return (mode() == QSslSocket::UnencryptedMode) ? bytesToWrite() : encryptedBytesToWrite();
+  }
+  // bytes of sent packets not yet written to the network (including packets waiting for compression)
+  qint64 outputBytesPending() const
+  {
+    return output_buffer.length()+out_pending_len+bytesToWrite();
+  }
+  // received bytes not yet parsed into packets
+  qint64 inputBytesPending() const
+  {
+    return input_buffer.length()+bytesAvailable()+encryptedBytesAvailable();
+  }
+  // memory held by input/output buffers (sendFrame() reserves output_buffer, so it keeps its size after a burst)
+  quint64 bufferCapacity() const
+  {
+    return input_buffer.capacity()+output_buffer.capacity();
+  }
+  quint64 trimBuffers();
 
   void log(LogPriority prio, const QString &text);
+  virtual void timerWheelExpired(TimerWheelTimer *timer);
+
+protected:
+  virtual bool event(QEvent *e);
 
 signals:
   void state_changed(quint16 mgr_conn_state);
@@ -180,6 +275,28 @@ private:
 
   void socket_send_auth();
 
+  bool sendFrame(MgrPacketCmd cmd, const QByteArray &data);
+  void sendPendingPackets();
+  void startPacketJob(bool compress, quint32 seq, const QByteArray &data);
+  void clearPendingPackets();
+  void sslSessionRestore();
+  QString sslSessionKey() const;
+  void dispatchPacket(MgrPacketCmd cmd, const QByteArray &data)
+  {
+    if (packet_handler)
+      packet_handler->mgrPacketReceived(this, cmd, data);
+    else
+      emit packetReceived(cmd, data);
+  }
+
+  QList<MgrPendingPacket> out_pending_packets;     // packets to send, in order
+  QList<MgrPendingPacket> in_pending_packets;      // received packets to emit, in order
+  quint32 out_pending_len;
+  quint32 in_pending_len;                          // data held by in_pending_packets, counted against read_buffer_size
+  quint32 packet_job_seq;
+  QSharedPointer<MgrClientConnectionRef> conn_ref;
+  QByteArray ssl_session_offered;                  // cached TLS session used for current handshake
+
 private slots:
   void socket_encrypted();
   void socket_disconnected();
@@ -194,8 +311,12 @@ private slots:
   void socket_heartbeat();
   void socket_heartbeat_check();
   void socket_idle_timeout();
+  void socket_sslSessionSave();
+  void timers_resume();
 
   void parseInputBuffer();
+  void parsePendingPackets();
+  void packetJobFinished(quint32 seq, bool compress, const QByteArray &data);
 
 public slots:
   void beginConnection();
@@ -253,6 +374,17 @@ struct __attribute__ ((__packed__)) MgrPacket_AuthRep
     access_flags = 0;
   }
 
+  // MGR_FEATURE_* following server hostname
+  static quint32 serverFeatures(const QByteArray &rep_data)
+  {
+    const MgrPacket_AuthRep *rep = (const MgrPacket_AuthRep *)rep_data.constData();
+    int offset = sizeof(MgrPacket_AuthRep)+rep->server_hostname_len;
+    if (rep_data.length() < offset+(int)sizeof(quint32))
+      return 0;
+    quint32 features;
+    memcpy(&features, rep_data.constData()+offset, sizeof(quint32));
+    return features;
+  }
 };
 
 
@@ -158,6 +158,14 @@ void MgrServerParameters::parseJSON(cJSON *json, quint32 /*j_flags*/)
   if (j && j->type == cJSON_Number)
     max_incoming_mgrconn = j->valueint;
 
+  j = cJSON_GetObjectItem(json, "worker_threads");
+  if (j && j->type == cJSON_Number)
+    worker_threads = j->valueint;
+
+  j = cJSON_GetObjectItem(json, "max_buffer_memory");
+  if (j && j->type == cJSON_Number)
+    max_buffer_memory = (quint64)j->valuedouble;
+
   j = cJSON_GetObjectItem(json, "flags");
   if (j && j->type == cJSON_String)
     flags = QByteArray(j->valuestring).toUInt(0, 16);
@@ -201,6 +209,10 @@ void MgrServerParameters::printJSON(cJSON *json, quint32 j_flags) const
   if (!private_key_filename.isEmpty())
     cJSON_AddStringToObject(json, "private_key_filename", private_key_filename.toUtf8());
   cJSON_AddNumberToObject(json, "max_incoming_mgrconn", max_incoming_mgrconn);
+  if (worker_threads > 0)
+    cJSON_AddNumberToObject(json, "worker_threads", worker_threads);
+  if (max_buffer_memory > 0)
+    cJSON_AddNumberToObject(json, "max_buffer_memory", max_buffer_memory);
   if (flags != 0)
     cJSON_AddStringToObject(json, "flags", QByteArray::number(flags, 16));
   cJSON_AddNumberToObject(json, "unique_conn_id", unique_conn_id);
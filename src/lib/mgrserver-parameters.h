@@ -140,10 +140,14 @@ public:
   QString private_key_filename;       // OpenSSL private key filename
 
   quint32 max_incoming_mgrconn;       // maximum number of incoming management connections (GUI + tunservers)
+  quint32 worker_threads;             // number of worker threads tunnels are distributed over (0 - run tunnels in MgrServer thread), applied on MgrServer start
+  quint64 max_buffer_memory;          // server-wide budget for tunnel buffers in bytes (0 - unlimited), tunnels over their fair share are throttled/restarted
   quint32 flags;                      // Additional flags, such as:
   enum
   {
     FL_ENABLE_HTTP                            = 0x00000001   // enable HTTP protocol for management connections
+   ,FL_STAGE_TIMING                           = 0x00000002   // measure time spent in tunnel data path stages (applied at runtime)
+   ,FL_IO_URING                               = 0x00000004   // TCP application connections through io_uring on Linux (applied to new connections)
   };
 
   quint32 unique_conn_id;
@@ -172,6 +176,8 @@ public:
     listen_interface = QHostAddress::Any;
     listen_port = DEFAULT_MGR_PORT;
     max_incoming_mgrconn = 100;
+    worker_threads = 0;
+    max_buffer_memory = 0;
     flags = 0;
     unique_conn_id = 1;
     unique_user_group_id = 1;
@@ -187,6 +193,8 @@ public:
     ssl_cert_filename = src.ssl_cert_filename;
     private_key_filename = src.private_key_filename;
     max_incoming_mgrconn = src.max_incoming_mgrconn;
+    worker_threads = src.worker_threads;
+    max_buffer_memory = src.max_buffer_memory;
     flags = src.flags;
     unique_conn_id = src.unique_conn_id;
     unique_user_group_id = src.unique_user_group_id;
@@ -217,6 +225,8 @@ private:
         ssl_cert_filename == src.ssl_cert_filename &&
         private_key_filename == src.private_key_filename &&
         max_incoming_mgrconn == src.max_incoming_mgrconn &&
+        worker_threads == src.worker_threads &&
+        max_buffer_memory == src.max_buffer_memory &&
         flags == src.flags &&
         user_groups == src.user_groups &&
         users == src.users &&
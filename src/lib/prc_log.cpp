@@ -13,6 +13,7 @@
 #include <QFileInfo>
 #include <QDateTime>
 #include <QThread>
+#include <QAtomicInt>
 
 LogPriority prc_log_level = LOG_NORMAL;
 qint64 prc_log_max_size = 1024*1024;
@@ -26,6 +27,40 @@ const char *log_first_letters = "FCHNL12345";
 int PRC_LOG_DUPLICATES_TIMEOUT = 30;
 bool prc_log_reopen_flag = false;
 
+// log records are passed to writer thread through bounded multi-producer ring (no locks on caller's side)
+#define PRC_LOG_RING_SIZE              8192          // must be power of 2
+#define PRC_LOG_FLUSH_INTERVAL          100          // ms between writer thread passes (and file flushes)
+
+struct PrcLogRecord
+{
+  QAtomicInt seq;                       // ring position this slot is ready for (writing or reading), as quint32
+  LogPriority prio;
+  qint64 ts;                            // ms since epoch
+  QString text;
+};
+
+class PrcLogWriter: public QThread
+{
+public:
+  QAtomicInt stop_flag;
+
+  PrcLogWriter(): QThread(), stop_flag(0)
+  {
+  }
+
+  void writePending();
+
+protected:
+  void run();
+};
+
+static PrcLogRecord prc_log_ring[PRC_LOG_RING_SIZE];
+// positions grow forever and wrap around: they are compared and advanced as quint32 only
+static QAtomicInt prc_log_ring_head(0);       // next position to write (producers)
+static quint32 prc_log_ring_tail = 0;         // next position to read (writer thread only)
+static PrcLogWriter *prc_log_writer = NULL;
+QAtomicInt prc_log_dropped(0);               // records dropped because ring was full
+
 //---------------------------------------------------------------------------
 bool prc_log_try_open()
 {
@@ -46,6 +81,13 @@ void prc_log_init()
   mkpath(QFileInfo(prc_log_filename).path());
   f_log.setFileName(prc_log_filename);
   prc_log_try_open();
+
+  for (quint32 i=0; i < PRC_LOG_RING_SIZE; i++)
+    prc_log_ring[i].seq.fetchAndStoreOrdered((int)i);
+  prc_log_ring_head.fetchAndStoreOrdered(0);
+  prc_log_ring_tail = 0;
+  prc_log_writer = new PrcLogWriter;
+  prc_log_writer->start(QThread::LowPriority);
 }
 
 //---------------------------------------------------------------------------
@@ -75,20 +117,27 @@ bool prc_log_truncate()
 //---------------------------------------------------------------------------
 void prc_log_finish()
 {
+  if (prc_log_writer)
+  {
+    // writer thread writes out everything left in the ring before it stops
+    prc_log_writer->stop_flag.fetchAndStoreOrdered(1);
+    prc_log_writer->wait();
+    delete prc_log_writer;
+    prc_log_writer = NULL;
+  }
   if (f_log.isOpen())
     f_log.close();
 }
 
 //---------------------------------------------------------------------------
-void prc_log(const LogPriority prio, const QString &log_text)
+// write log record to the file (mutex_prc_log must be locked)
+static void prc_log_write(const LogPriority prio, const QDateTime &now, const QString &log_text, bool flush)
 {
   static QString prev_log_text;
   static LogPriority prev_log_prio;
   static int prev_log_text_count=0;
   static QDateTime prev_log_ts;
 
-  if (prio > prc_log_level || prc_log_level == LOG_NONE)
-    return;
   if (prc_log_reopen_flag)
   {
     prc_log_reopen_flag = false;
@@ -104,9 +153,7 @@ void prc_log(const LogPriority prio, const QString &log_text)
   if (f_log.size() > prc_log_max_size && !prc_log_truncate())
     return;
 
-  QDateTime now = QDateTime::currentDateTime();
   QString new_log_text = log_text;
-  QMutexLocker mutex_locker(&mutex_prc_log);
   QString thread_str;
   /*
   // this block was to log thread number
@@ -145,7 +192,7 @@ void prc_log(const LogPriority prio, const QString &log_text)
   }
   if (prc_log_level < LOG_NORMAL)
     fprintf(stderr, "%s: %s\r\n", (const char *)SysUtil::process_name.toUtf8(), (const char *)new_log_text.toUtf8());
-  if (!f_log.flush())
+  if (flush && !f_log.flush())
   {
     f_log.close();
     if (!prc_log_try_open())
@@ -156,3 +203,83 @@ void prc_log(const LogPriority prio, const QString &log_text)
   prev_log_prio = prio;
   prev_log_ts = now;
 }
+
+//---------------------------------------------------------------------------
+// put record to the ring, returns false if ring is full
+static bool prc_log_enqueue(const LogPriority prio, const QString &log_text)
+{
+  quint32 pos = (quint32)prc_log_ring_head.fetchAndAddOrdered(0);
+  PrcLogRecord *rec;
+  for (;;)
+  {
+    rec = &prc_log_ring[pos & (PRC_LOG_RING_SIZE-1)];
+    quint32 dif = (quint32)rec->seq.fetchAndAddOrdered(0)-pos;
+    if (dif == 0)
+    {
+      // slot is free - try to claim it
+      if (prc_log_ring_head.testAndSetOrdered((int)pos, (int)(pos+1)))
+        break;
+      pos = (quint32)prc_log_ring_head.fetchAndAddOrdered(0);
+    }
+    else if (dif >= 0x80000000u)          // slot is still a whole ring behind (not read yet)
+      return false;
+    else
+      pos = (quint32)prc_log_ring_head.fetchAndAddOrdered(0);
+  }
+  rec->prio = prio;
+  rec->ts = QDateTime::currentMSecsSinceEpoch();
+  rec->text = log_text;
+  rec->seq.fetchAndStoreOrdered((int)(pos+1));
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void PrcLogWriter::writePending()
+{
+  QMutexLocker mutex_locker(&mutex_prc_log);
+  int dropped = prc_log_dropped.fetchAndStoreOrdered(0);
+  if (dropped > 0)
+    prc_log_write(LOG_HIGH, QDateTime::currentDateTime(), QString("log writer can't keep up, %1 log records dropped").arg(dropped), false);
+  bool written = dropped > 0;
+  for (;;)
+  {
+    PrcLogRecord &rec = prc_log_ring[prc_log_ring_tail & (PRC_LOG_RING_SIZE-1)];
+    if ((quint32)rec.seq.fetchAndAddOrdered(0) != prc_log_ring_tail+1)
+      break;
+    prc_log_write(rec.prio, QDateTime::fromMSecsSinceEpoch(rec.ts), rec.text, false);
+    rec.text.clear();
+    rec.seq.fetchAndStoreOrdered((int)(prc_log_ring_tail+PRC_LOG_RING_SIZE));
+    prc_log_ring_tail++;
+    written = true;
+  }
+  if (written && f_log.isOpen())
+    f_log.flush();
+}
+
+//---------------------------------------------------------------------------
+void PrcLogWriter::run()
+{
+  while (!stop_flag.fetchAndAddOrdered(0))
+  {
+    writePending();
+    msleep(PRC_LOG_FLUSH_INTERVAL);
+  }
+  writePending();
+}
+
+//---------------------------------------------------------------------------
+void prc_log(const LogPriority prio, const QString &log_text)
+{
+  if (!prc_log_enabled(prio))
+    return;
+  if (prc_log_writer)
+  {
+    // never block caller on disk I/O: count records which don't fit into the ring
+    if (!prc_log_enqueue(prio, log_text))
+      prc_log_dropped.fetchAndAddOrdered(1);
+    return;
+  }
+  // no writer thread (not initialized yet or already finished)
+  QMutexLocker mutex_locker(&mutex_prc_log);
+  prc_log_write(prio, QDateTime::currentDateTime(), log_text, true);
+}
@@ -30,6 +30,13 @@ extern int prc_log_keep_files;
 extern bool prc_log_reopen_flag;
 extern QString prc_log_filename;
 
+// true if message of this priority is going to be written - check it before formatting message text
+#define prc_log_enabled(prio)         ((prio) <= prc_log_level && prc_log_level != LOG_NONE)
+
+// message text (and object's log prefix) is only formatted if message is going to be written
+#define PRC_LOG(prio, text)           do { if (prc_log_enabled(prio)) prc_log(prio, text); } while (0)
+#define OBJ_LOG(obj, prio, text)      do { if (prc_log_enabled(prio)) (obj)->log(prio, text); } while (0)
+
 void prc_log(const LogPriority prio, const QString &log_text);
 void prc_log_init();
 void prc_log_finish();
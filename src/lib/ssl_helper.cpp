@@ -7,6 +7,41 @@
 */
 
 #include "ssl_helper.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#ifdef HAVE_SSL_SESSION_SHARING
+#include <QtCore/private/qobject_p.h>
+#include <QtNetwork/private/qsslsocket_p.h>
+#include <QtNetwork/private/qsslsocket_openssl_p.h>
+#include <QtNetwork/private/qsslcontext_openssl_p.h>
+#include <openssl/ssl.h>
+#include <string.h>
+
+#define SSL_SESSION_ID_CONTEXT            "qmtunnel"
+
+// SSL context shared by incoming sockets: one session cache and one set of ticket keys for all of them
+static QSharedPointer<QSslContext> ssl_server_context;
+static QByteArray ssl_server_context_cert;            // digest of local certificate the context was created with
+static QMutex ssl_server_context_mutex;
+#endif
+
+struct SSLFileCacheEntry
+{
+  QDateTime last_modified;
+  qint64 size;
+  QByteArray passphrase;
+  QList<QSslCertificate> certs;
+  QSslKey key;
+};
+
+static QHash<QString, SSLFileCacheEntry> ssl_file_cache;
+static QMutex ssl_file_cache_mutex;
 
 //---------------------------------------------------------------------------
 bool isCorrectKeyCertificatePair(const QSslKey &key, const QSslCertificate &cert)
@@ -38,6 +73,63 @@ QSslCertificate loadSSLCertFromFile(const QString &filename)
   return crt;
 }
 
+//---------------------------------------------------------------------------
+// returns cache entry for the file (parsing it if file is new or was modified) - ssl_file_cache_mutex must be locked
+static SSLFileCacheEntry &sslFileCacheEntry(const QString &filename, const QByteArray &passphrase, bool is_key)
+{
+  QFileInfo fi(filename);
+  QString cache_key = (is_key ? QString("key:") : QString("crt:"))+filename;
+  QHash<QString, SSLFileCacheEntry>::iterator it = ssl_file_cache.find(cache_key);
+  if (it != ssl_file_cache.end() &&
+      it.value().last_modified == fi.lastModified() &&
+      it.value().size == fi.size() &&
+      it.value().passphrase == passphrase)
+    return it.value();
+
+  SSLFileCacheEntry entry;
+  entry.last_modified = fi.lastModified();
+  entry.size = fi.size();
+  entry.passphrase = passphrase;
+  if (is_key)
+  {
+    QFile f(filename);
+    if (f.open(QIODevice::ReadOnly))
+      entry.key = QSslKey(&f, QSsl::Rsa, QSsl::Pem, QSsl::PrivateKey, passphrase);
+  }
+  else
+  {
+    QList<QSslCertificate> certificateList = QSslCertificate::fromPath(filename, QSsl::Pem);
+    for (int i=0; i < certificateList.count(); i++)
+    {
+      if (!certificateList.at(i).isNull())
+        entry.certs.append(certificateList.at(i));
+    }
+  }
+  return ssl_file_cache.insert(cache_key, entry).value();
+}
+
+//---------------------------------------------------------------------------
+QList<QSslCertificate> loadSSLCertChainFromFileCached(const QString &filename)
+{
+  QMutexLocker locker(&ssl_file_cache_mutex);
+  return sslFileCacheEntry(filename, QByteArray(), false).certs;
+}
+
+//---------------------------------------------------------------------------
+QSslCertificate loadSSLCertFromFileCached(const QString &filename)
+{
+  // same certificate as loadSSLCertFromFile() returns
+  QList<QSslCertificate> certs = loadSSLCertChainFromFileCached(filename);
+  return certs.isEmpty() ? QSslCertificate() : certs.last();
+}
+
+//---------------------------------------------------------------------------
+QSslKey loadSSLKeyFromFileCached(const QString &filename, const QByteArray &passphrase)
+{
+  QMutexLocker locker(&ssl_file_cache_mutex);
+  return sslFileCacheEntry(filename, passphrase, true).key;
+}
+
 //---------------------------------------------------------------------------
 QByteArray QByteArray_from_X509(X509 *x509)
 {
@@ -68,3 +160,101 @@ QByteArray QByteArray_from_X509(X509 *x509)
 
   return "-----BEGIN CERTIFICATE-----\n" + tmp + "-----END CERTIFICATE-----\n";
 }
+
+//---------------------------------------------------------------------------
+static QByteArray pbkdf2_sha256(const QByteArray &password, const QByteArray &salt, int iterations)
+{
+  QByteArray hash(32, 0);
+  if (PKCS5_PBKDF2_HMAC(password.constData(), password.length(),
+                        (const unsigned char *)salt.constData(), salt.length(), iterations, EVP_sha256(),
+                        hash.length(), (unsigned char *)hash.data()) != 1)
+    return QByteArray();
+  return hash;
+}
+
+//---------------------------------------------------------------------------
+bool isPasswordHash(const QString &str)
+{
+  return str.startsWith(PASSWORD_HASH_PREFIX) && str.count('$') == 4;
+}
+
+//---------------------------------------------------------------------------
+QString passwordHash(const QString &password)
+{
+  QByteArray salt(PASSWORD_HASH_SALT_LEN, 0);
+  if (RAND_bytes((unsigned char *)salt.data(), salt.length()) != 1)
+    return QString();
+  QByteArray hash = pbkdf2_sha256(password.toUtf8(), salt, PASSWORD_HASH_ITERATIONS);
+  if (hash.isEmpty())
+    return QString();
+  return QString(PASSWORD_HASH_PREFIX)+QString("%1$").arg(PASSWORD_HASH_ITERATIONS)+
+      QString::fromLatin1(salt.toBase64())+QString("$")+QString::fromLatin1(hash.toBase64());
+}
+
+//---------------------------------------------------------------------------
+// stored_password may also be plain-text password from config of older version
+bool passwordVerify(const QString &password, const QString &stored_password)
+{
+  if (!isPasswordHash(stored_password))
+    return password == stored_password;
+
+  QStringList parts = stored_password.mid(strlen(PASSWORD_HASH_PREFIX)).split('$');
+  int iterations = parts[0].toInt();
+  QByteArray salt = QByteArray::fromBase64(parts[1].toLatin1());
+  QByteArray stored_hash = QByteArray::fromBase64(parts[2].toLatin1());
+  if (iterations <= 0 || stored_hash.isEmpty())
+    return false;
+  QByteArray hash = pbkdf2_sha256(password.toUtf8(), salt, iterations);
+  return hash.length() == stored_hash.length() &&
+      CRYPTO_memcmp(hash.constData(), stored_hash.constData(), hash.length()) == 0;
+}
+
+//---------------------------------------------------------------------------
+bool sslSessionReused(QSslSocket *socket, bool &reused)
+{
+#ifdef HAVE_SSL_SESSION_SHARING
+  QSslSocketBackendPrivate *d = static_cast<QSslSocketBackendPrivate *>(QObjectPrivate::get(socket));
+  if (!d->ssl)
+    return false;
+  reused = (SSL_session_reused(d->ssl) == 1);
+  return true;
+#else
+  Q_UNUSED(socket);
+  Q_UNUSED(reused);
+  return false;
+#endif
+}
+
+//---------------------------------------------------------------------------
+void sslServerContextAttach(QSslSocket *socket)
+{
+#ifdef HAVE_SSL_SESSION_SHARING
+  QMutexLocker locker(&ssl_server_context_mutex);
+  if (!ssl_server_context.isNull() && ssl_server_context_cert == socket->localCertificate().digest())
+    QSslSocketPrivate::checkSettingSslContext(socket, ssl_server_context);
+#else
+  Q_UNUSED(socket);
+#endif
+}
+
+//---------------------------------------------------------------------------
+void sslServerContextCapture(QSslSocket *socket)
+{
+#ifdef HAVE_SSL_SESSION_SHARING
+  QSslSocketBackendPrivate *d = static_cast<QSslSocketBackendPrivate *>(QObjectPrivate::get(socket));
+  if (!d->ssl)
+    return;
+  // OpenSSL refuses to resume sessions when peer certificate is requested and there is no session id context
+  SSL_set_session_id_context(d->ssl, (const unsigned char *)SSL_SESSION_ID_CONTEXT, strlen(SSL_SESSION_ID_CONTEXT));
+  QByteArray cert = socket->localCertificate().digest();
+  QMutexLocker locker(&ssl_server_context_mutex);
+  if (!ssl_server_context.isNull() && ssl_server_context_cert == cert)
+    return;
+  // first incoming socket or certificate changed: later sockets share this socket's context
+  ssl_server_context = QSslSocketPrivate::sslContext(socket);
+  ssl_server_context_cert = cert;
+  SSL_CTX_set_session_id_context(SSL_get_SSL_CTX(d->ssl), (const unsigned char *)SSL_SESSION_ID_CONTEXT, strlen(SSL_SESSION_ID_CONTEXT));
+#else
+  Q_UNUSED(socket);
+#endif
+}
@@ -11,11 +11,31 @@
 
 #include <QSslCertificate>
 #include <QSslKey>
+#include <QSslSocket>
 #include <openssl/evp.h>
 #include <openssl/x509.h>
 
+#define PASSWORD_HASH_PREFIX              "$pbkdf2-sha256$"
+#define PASSWORD_HASH_ITERATIONS                    10000
+#define PASSWORD_HASH_SALT_LEN                         16
+
 bool isCorrectKeyCertificatePair(const QSslKey &key, const QSslCertificate &cert);
 QSslCertificate loadSSLCertFromFile(const QString &filename);
+// parsed certificates/keys are reused until file is modified
+QList<QSslCertificate> loadSSLCertChainFromFileCached(const QString &filename);
+QSslCertificate loadSSLCertFromFileCached(const QString &filename);
+QSslKey loadSSLKeyFromFileCached(const QString &filename, const QByteArray &passphrase=QByteArray());
 QByteArray QByteArray_from_X509(X509 *x509);
 
+// salted PBKDF2 password hashes: $pbkdf2-sha256$<iterations>$<base64 salt>$<base64 hash>
+bool isPasswordHash(const QString &str);
+QString passwordHash(const QString &password);
+bool passwordVerify(const QString &password, const QString &stored_password);
+
+// TLS session details not exposed by QSslSocket, available when built with qmake CONFIG+=ssl_session_sharing
+// (Qt 5 private headers); without it sslSessionReused() returns false and server sockets keep their own SSL contexts
+bool sslSessionReused(QSslSocket *socket, bool &reused);      // false if it can't be told
+void sslServerContextAttach(QSslSocket *socket);              // before startServerEncryption(): use shared SSL context
+void sslServerContextCapture(QSslSocket *socket);             // after startServerEncryption(): share socket's SSL context
+
 #endif // SSL_HELPER_H
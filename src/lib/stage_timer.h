@@ -0,0 +1,91 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <string.h>
+
+// data path stages timed while stageTimingEnabled() (MgrServerParameters::FL_STAGE_TIMING);
+// stages may nest: app_read includes compression and mgrconn writes done while queueing the packet
+enum DataPathStage
+{
+  STAGE_APP_READ=0,                   // Tunnel::connDataReceived - reading application data and framing it
+  STAGE_COMPRESS,                     // Tunnel::queueOutPacket/queueInPacket - compression of buffered data packets
+  STAGE_MGRCONN_WRITE,                // MgrClientConnection::sendOutputBuffer/sendFrame - TLS and socket writes
+  STAGE_DECOMPRESS,                   // MgrClientConnection::parseInputBuffer - decompression of received packets
+  STAGE_APP_DELIVERY,                 // Tunnel::cmd_conn_data - delivery of data to application connection
+  STAGE_COUNT
+};
+
+extern QAtomicInt stage_timing_enabled;      // set from MgrServer thread, read on data path of every thread
+
+inline bool stageTimingEnabled()
+{
+#if QT_VERSION >= 0x050000
+  return stage_timing_enabled.load() != 0;
+#else
+  return stage_timing_enabled != 0;
+#endif
+}
+
+struct StageCounters
+{
+  quint64 nsecs[STAGE_COUNT];         // cumulative time
+  quint64 calls[STAGE_COUNT];
+
+  StageCounters()
+  {
+    memset(nsecs, 0, sizeof(nsecs));
+    memset(calls, 0, sizeof(calls));
+  }
+
+  void add(const StageCounters &src)
+  {
+    for (int i=0; i < STAGE_COUNT; i++)
+    {
+      nsecs[i] += src.nsecs[i];
+      calls[i] += src.calls[i];
+    }
+  }
+
+  static const char *stageName(int stage)
+  {
+    static const char *names[STAGE_COUNT] = { "app_read", "compress", "mgrconn_write", "decompress", "app_delivery" };
+    return (stage >= 0 && stage < STAGE_COUNT) ? names[stage] : "unknown";
+  }
+};
+
+// adds time spent in the enclosing scope to StageCounters (does nothing unless stageTimingEnabled())
+class StageTimer
+{
+public:
+  StageTimer(StageCounters &_counters, DataPathStage _stage): counters(_counters), stage(_stage)
+  {
+    started = stageTimingEnabled();
+    if (started)
+      timer.start();
+  }
+  ~StageTimer()
+  {
+    if (!started)
+      return;
+    counters.nsecs[stage] += timer.nsecsElapsed();
+    counters.calls[stage]++;
+  }
+
+private:
+  StageCounters &counters;
+  DataPathStage stage;
+  bool started;
+  QElapsedTimer timer;
+};
+
+#endif // STAGE_TIMER_H
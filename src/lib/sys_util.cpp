@@ -32,6 +32,7 @@ int last_signum=0;
 }
 
 bool flag_kill = false;
+bool flag_dump_flightrec = false;
 
 using namespace SysUtil;
 
@@ -47,6 +48,8 @@ void linux_signal_handler(int signum)
   }
   else if (signum == SIGHUP)
     prc_log_reopen_flag = true;
+  else if (signum == SIGUSR1)
+    flag_dump_flightrec = true;
 }
 
 //-----------------------------------------------------------------------------
@@ -82,6 +85,9 @@ void log_last_signum()
     case SIGPIPE:
       prc_log(LOG_HIGH, QString("Got signal SIGPIPE"));
       break;
+    case SIGUSR1:
+      prc_log(LOG_HIGH, QString("Got signal SIGUSR1"));
+      break;
     default:
       prc_log(LOG_HIGH, QString("Got signal %1").arg(signum));
       break;
@@ -102,6 +108,7 @@ void sysutil_init(int , char *[])
   signal(SIGHUP,  linux_signal_handler);
   signal(SIGINT,  linux_signal_handler);
   signal(SIGQUIT, linux_signal_handler);
+  signal(SIGUSR1, linux_signal_handler);
 #endif
 
   SysUtil::process_name = QFileInfo(QCoreApplication::applicationFilePath()).fileName();
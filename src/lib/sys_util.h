@@ -24,6 +24,7 @@ extern QString user_name;
 }
 
 extern bool flag_kill;
+extern bool flag_dump_flightrec;      // SIGUSR1 - dump tunnel flight recorders to files
 
 void sysutil_init(int argc, char *argv[]);
 QString pretty_size(quint64 val, int max_precision=0);
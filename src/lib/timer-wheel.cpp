@@ -0,0 +1,242 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include <QThreadStorage>
+#include <string.h>
+#include "timer-wheel.h"
+
+static QThreadStorage<TimerWheel *> timer_wheels;
+
+//---------------------------------------------------------------------------
+void TimerWheelTimer::start(int msecs)
+{
+  interval_msecs = msecs;
+  suspended_msecs = -1;
+  TimerWheel::instance()->schedule(this, qMax(msecs, 0));
+}
+
+//---------------------------------------------------------------------------
+void TimerWheelTimer::stop()
+{
+  suspended_msecs = -1;
+  if (wheel)
+    wheel->cancel(this);
+}
+
+//---------------------------------------------------------------------------
+void TimerWheelTimer::postpone()
+{
+  if (wheel)
+    wheel->postpone(this);
+}
+
+//---------------------------------------------------------------------------
+int TimerWheelTimer::remainingTime() const
+{
+  return wheel ? wheel->remainingTime(this) : -1;
+}
+
+//---------------------------------------------------------------------------
+void TimerWheelTimer::suspend()
+{
+  if (!wheel)
+    return;
+  int msecs = wheel->remainingTime(this);
+  wheel->cancel(this);
+  suspended_msecs = msecs;
+}
+
+//---------------------------------------------------------------------------
+void TimerWheelTimer::resume()
+{
+  if (suspended_msecs < 0)
+    return;
+  TimerWheel::instance()->schedule(this, suspended_msecs);
+  suspended_msecs = -1;
+}
+
+//---------------------------------------------------------------------------
+TimerWheel *TimerWheel::instance()
+{
+  if (!timer_wheels.hasLocalData())
+    timer_wheels.setLocalData(new TimerWheel);
+  return timer_wheels.localData();
+}
+
+//---------------------------------------------------------------------------
+TimerWheel::TimerWheel(QObject *parent): QObject(parent)
+{
+  memset(wheel_slots, 0, sizeof(wheel_slots));
+  cur_tick = 0;
+  timer_count = 0;
+  clock.start();
+  timer_tick = new QTimer(this);
+  timer_tick->setInterval(TIMER_WHEEL_TICK);
+  connect(timer_tick, SIGNAL(timeout()), this, SLOT(tick_timeout()));
+}
+
+//---------------------------------------------------------------------------
+TimerWheel::~TimerWheel()
+{
+  // owners may outlive the wheel (thread exit) - leave their timers inactive
+  for (int level=0; level < TIMER_WHEEL_LEVELS; level++)
+  {
+    for (int index=0; index < TIMER_WHEEL_SLOTS; index++)
+    {
+      TimerWheelTimer *timer = wheel_slots[level][index];
+      while (timer)
+      {
+        TimerWheelTimer *next = timer->next;
+        timer->wheel = NULL;
+        timer->slot_head = NULL;
+        timer->prev = timer->next = NULL;
+        timer = next;
+      }
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+void TimerWheel::schedule(TimerWheelTimer *timer, quint32 msecs)
+{
+  if (timer->wheel)
+    timer->wheel->cancel(timer);
+  quint64 now_tick = now();
+  if (timer_count == 0)
+  {
+    cur_tick = now_tick;
+    if (!timer_tick->isActive())
+      timer_tick->start();
+  }
+  timer->expires = qMax(now_tick+1, (quint64)(clock.elapsed()+msecs+TIMER_WHEEL_TICK-1)/TIMER_WHEEL_TICK);   // never fires early
+  timer->wheel = this;
+  link(timer);
+  timer_count++;
+}
+
+//---------------------------------------------------------------------------
+void TimerWheel::cancel(TimerWheelTimer *timer)
+{
+  if (timer->wheel != this)
+    return;
+  unlink(timer);
+  timer->wheel = NULL;
+  timer_count--;
+}
+
+//---------------------------------------------------------------------------
+// lazy restart: only the deadline is moved forward (no relinking) -
+// the timer is relinked when its old slot is reached
+void TimerWheel::postpone(TimerWheelTimer *timer)
+{
+  if (timer->wheel != this)
+    return;
+  // deadline is taken from the clock: cur_tick falls behind while the thread is busy
+  quint64 expires = (quint64)(clock.elapsed()+qMax(timer->interval_msecs, 0)+TIMER_WHEEL_TICK-1)/TIMER_WHEEL_TICK;
+  if (expires >= timer->expires)
+    timer->expires = expires;
+  else
+    schedule(timer, qMax(timer->interval_msecs, 0));
+}
+
+//---------------------------------------------------------------------------
+int TimerWheel::remainingTime(const TimerWheelTimer *timer) const
+{
+  qint64 msecs = (qint64)timer->expires*TIMER_WHEEL_TICK-clock.elapsed();
+  return (int)qMax(msecs, (qint64)0);
+}
+
+//---------------------------------------------------------------------------
+// put timer into the slot of the lowest level which covers its expiration tick
+void TimerWheel::link(TimerWheelTimer *timer)
+{
+  quint64 expires = qMax(timer->expires, cur_tick);
+  quint64 delta = expires-cur_tick;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS-1 && delta >= ((quint64)1 << (TIMER_WHEEL_SLOT_BITS*(level+1))))
+    level++;
+  if (delta >= ((quint64)1 << (TIMER_WHEEL_SLOT_BITS*TIMER_WHEEL_LEVELS)))
+    expires = cur_tick+((quint64)1 << (TIMER_WHEEL_SLOT_BITS*TIMER_WHEEL_LEVELS))-1;   // re-linked when cascaded
+  int index = (expires >> (TIMER_WHEEL_SLOT_BITS*level)) & (TIMER_WHEEL_SLOTS-1);
+
+  timer->slot_head = &wheel_slots[level][index];
+  timer->prev = NULL;
+  timer->next = *timer->slot_head;
+  if (timer->next)
+    timer->next->prev = timer;
+  *timer->slot_head = timer;
+}
+
+//---------------------------------------------------------------------------
+void TimerWheel::unlink(TimerWheelTimer *timer)
+{
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else if (timer->slot_head)
+    *timer->slot_head = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  timer->slot_head = NULL;
+  timer->prev = timer->next = NULL;
+}
+
+//---------------------------------------------------------------------------
+// move timers of higher level slot down to lower levels
+void TimerWheel::cascade(int level, int index)
+{
+  TimerWheelTimer *timer = wheel_slots[level][index];
+  wheel_slots[level][index] = NULL;
+  while (timer)
+  {
+    TimerWheelTimer *next = timer->next;
+    link(timer);
+    timer = next;
+  }
+}
+
+//---------------------------------------------------------------------------
+void TimerWheel::tick_timeout()
+{
+  quint64 now_tick = now();
+  while (cur_tick < now_tick && timer_count > 0)
+  {
+    cur_tick++;
+    int index = cur_tick & (TIMER_WHEEL_SLOTS-1);
+    if (index == 0)
+    {
+      for (int level=1; level < TIMER_WHEEL_LEVELS; level++)
+      {
+        int level_index = (cur_tick >> (TIMER_WHEEL_SLOT_BITS*level)) & (TIMER_WHEEL_SLOTS-1);
+        cascade(level, level_index);
+        if (level_index != 0)
+          break;
+      }
+    }
+
+    // expired timer's owner may start/stop any timers (including this one) or delete itself
+    while (wheel_slots[0][index])
+    {
+      TimerWheelTimer *timer = wheel_slots[0][index];
+      unlink(timer);
+      if (timer->expires > cur_tick)
+      {
+        link(timer);
+        continue;
+      }
+      timer->wheel = NULL;
+      timer_count--;
+      if (timer->client)
+        timer->client->timerWheelExpired(timer);
+    }
+  }
+  if (timer_count == 0)
+  {
+    cur_tick = now_tick;
+    timer_tick->stop();
+  }
+}
@@ -0,0 +1,113 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+// hierarchical timer wheel: TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots,
+// level N slot covers TIMER_WHEEL_SLOTS^N ticks (100ms * 64^4 = ~19 days at the last level)
+#define TIMER_WHEEL_TICK                        100     // ms
+#define TIMER_WHEEL_SLOT_BITS                   6
+#define TIMER_WHEEL_SLOTS                       (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS                      4
+
+class TimerWheel;
+class TimerWheelTimer;
+
+class TimerWheelClient
+{
+public:
+  virtual ~TimerWheelClient() {}
+  virtual void timerWheelExpired(TimerWheelTimer *timer) = 0;
+};
+
+// one-shot timer embedded into its owner (QTimer-like interface); unlinked from the wheel before timerWheelExpired() is called
+class TimerWheelTimer
+{
+public:
+  TimerWheelClient *client;
+  void *data;                         // owner-defined
+  quint64 expires;                    // wheel tick
+
+  void start(int msecs);              // (re)schedule in the current thread's wheel
+  void start() { start(interval_msecs); }
+  void stop();
+  bool isActive() const { return wheel != NULL; }
+  void setInterval(int msecs) { interval_msecs = msecs; }
+  int interval() const { return interval_msecs; }
+  void postpone();                    // restart if active, cheap enough to be called on every read/write
+  int remainingTime() const;
+
+  // owner's moveToThread(): suspend() on QEvent::ThreadChange, resume() from a queued call in the new thread
+  void suspend();
+  void resume();
+
+  TimerWheelTimer(TimerWheelClient *_client=NULL, void *_data=NULL)
+  {
+    client = _client;
+    data = _data;
+    expires = 0;
+    interval_msecs = 0;
+    suspended_msecs = -1;
+    wheel = NULL;
+    slot_head = NULL;
+    prev = next = NULL;
+  }
+  ~TimerWheelTimer()
+  {
+    stop();
+  }
+
+private:
+  friend class TimerWheel;
+  int interval_msecs;
+  int suspended_msecs;                // remaining time of suspended timer (-1 = not suspended)
+  TimerWheel *wheel;
+  TimerWheelTimer **slot_head;
+  TimerWheelTimer *prev;
+  TimerWheelTimer *next;
+  Q_DISABLE_COPY(TimerWheelTimer)
+};
+
+// one wheel per thread, driven by a single QTimer which only runs while there are active timers
+class TimerWheel: public QObject
+{
+  Q_OBJECT
+public:
+  static TimerWheel *instance();      // wheel of the current thread
+
+  void schedule(TimerWheelTimer *timer, quint32 msecs);
+  void cancel(TimerWheelTimer *timer);
+  void postpone(TimerWheelTimer *timer);
+  int remainingTime(const TimerWheelTimer *timer) const;
+  int count() const { return timer_count; }
+
+  TimerWheel(QObject *parent=NULL);
+  ~TimerWheel();
+
+private slots:
+  void tick_timeout();
+
+private:
+  TimerWheelTimer *wheel_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  quint64 cur_tick;                   // last processed tick
+  int timer_count;
+  QElapsedTimer clock;
+  QTimer *timer_tick;
+
+  quint64 now() const { return clock.elapsed()/TIMER_WHEEL_TICK; }
+  void link(TimerWheelTimer *timer);
+  void unlink(TimerWheelTimer *timer);
+  void cascade(int level, int index);
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,173 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include "tunnel-history.h"
+
+//---------------------------------------------------------------------------
+static void varint_append(QByteArray &buffer, qint64 value)
+{
+  quint64 zz = ((quint64)value << 1) ^ (quint64)(value >> 63);
+  while (zz >= 0x80)
+  {
+    buffer.append((char)((zz & 0x7f) | 0x80));
+    zz >>= 7;
+  }
+  buffer.append((char)zz);
+}
+
+//---------------------------------------------------------------------------
+static bool varint_read(const char *buffer, int buf_size, int &data_pos, qint64 &value)
+{
+  quint64 zz = 0;
+  for (int shift=0; shift < 64; shift += 7)
+  {
+    if (data_pos >= buf_size)
+      return false;
+    quint8 b = buffer[data_pos++];
+    zz |= (quint64)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+    {
+      value = (qint64)(zz >> 1) ^ -(qint64)(zz & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------
+void TunnelHistoryTier::add(quint32 time, const TunnelHistorySample &sample)
+{
+  quint32 slot = time/interval;
+  if (!samples.isEmpty())
+  {
+    if (slot < last_slot)             // clock went back - count it in the current sample
+      slot = last_slot;
+    if (slot == last_slot)
+    {
+      samples[last_pos].merge(sample);
+      if (!sample.isEmpty())
+        last_busy_slot = slot;
+      return;
+    }
+    if (slot-last_busy_slot < (quint32)size)
+    {
+      // skipped intervals have no samples
+      for (quint32 i=last_slot; i < slot; i++)
+      {
+        if (samples.count() < size)
+          samples.append(TunnelHistorySample());
+        last_pos = (last_pos+1) % samples.count();
+        samples[last_pos] = TunnelHistorySample();
+      }
+      last_slot = slot;
+      samples[last_pos] = sample;
+      if (!sample.isEmpty())
+        last_busy_slot = slot;
+      return;
+    }
+    // nothing but empty samples would be left in the ring
+    samples.clear();
+    samples.squeeze();
+  }
+  if (sample.isEmpty())
+    return;
+  samples.append(sample);
+  first_slot = slot;
+  last_slot = slot;
+  last_busy_slot = slot;
+  last_pos = 0;
+}
+
+//---------------------------------------------------------------------------
+QByteArray TunnelHistoryTier::printToBuffer(quint32 from_time, quint32 to_time) const
+{
+  MgrPacket_TunnelHistoryRep header;
+  header.interval = interval;
+  int count = samples.count();
+  quint32 begin_slot = 0;
+  quint32 end_slot = 0;               // last slot+1
+  if (count > 0)
+  {
+    begin_slot = qMax(first_slot, last_slot+1 >= (quint32)count ? last_slot+1-count : 0);
+    end_slot = last_slot+1;
+    if (from_time > 0 && from_time/interval > begin_slot)
+      begin_slot = from_time/interval;
+    if (to_time > 0 && to_time/interval+1 < end_slot)
+      end_slot = to_time/interval+1;
+    if (end_slot < begin_slot)
+      end_slot = begin_slot;
+  }
+  header.first_time = begin_slot*interval;
+  header.sample_count = end_slot-begin_slot;
+
+  QByteArray buffer;
+  buffer.reserve(sizeof(MgrPacket_TunnelHistoryRep)+header.sample_count*8);
+  buffer.append((const char *)&header, sizeof(MgrPacket_TunnelHistoryRep));
+  TunnelHistorySample prev;
+  for (quint32 slot=begin_slot; slot < end_slot; slot++)
+  {
+    int pos = (last_pos-(int)(last_slot-slot)+count) % count;
+    const TunnelHistorySample &s = samples[pos];
+    varint_append(buffer, (qint64)(s.data_bytes_rcv-prev.data_bytes_rcv));
+    varint_append(buffer, (qint64)(s.data_bytes_snd-prev.data_bytes_snd));
+    varint_append(buffer, (qint64)s.conn_new_count-(qint64)prev.conn_new_count);
+    varint_append(buffer, (qint64)s.conn_cur_count-(qint64)prev.conn_cur_count);
+    varint_append(buffer, (qint64)s.latency_ms-(qint64)prev.latency_ms);
+    varint_append(buffer, (qint64)s.buffered_packets-(qint64)prev.buffered_packets);
+    prev = s;
+  }
+  return buffer;
+}
+
+//---------------------------------------------------------------------------
+const TunnelHistoryTier &TunnelHistory::tier(quint32 interval) const
+{
+  for (int i=0; i < TUNNEL_HISTORY_TIERS; i++)
+  {
+    if (tiers[i].interval == interval)
+      return tiers[i];
+  }
+  return tiers[0];
+}
+
+//---------------------------------------------------------------------------
+// parses MgrPacket_TunnelHistoryRep with its samples, returns number of bytes parsed or -1 on error
+int TunnelHistory::parseFromBuffer(const char *buffer, int buf_size, quint32 &interval, quint32 &first_time, QVector<TunnelHistorySample> &samples)
+{
+  if (buf_size < (int)sizeof(MgrPacket_TunnelHistoryRep))
+    return -1;
+  const MgrPacket_TunnelHistoryRep *header = (const MgrPacket_TunnelHistoryRep *)buffer;
+  interval = header->interval;
+  first_time = header->first_time;
+  samples.clear();
+  if ((quint64)header->sample_count*6 > (quint64)buf_size)     // every sample takes at least 6 bytes
+    return -1;
+  samples.reserve(header->sample_count);
+
+  int data_pos = sizeof(MgrPacket_TunnelHistoryRep);
+  TunnelHistorySample prev;
+  for (quint32 i=0; i < header->sample_count; i++)
+  {
+    qint64 d[6];
+    for (int j=0; j < 6; j++)
+    {
+      if (!varint_read(buffer, buf_size, data_pos, d[j]))
+        return -1;
+    }
+    TunnelHistorySample s;
+    s.data_bytes_rcv = prev.data_bytes_rcv+d[0];
+    s.data_bytes_snd = prev.data_bytes_snd+d[1];
+    s.conn_new_count = prev.conn_new_count+d[2];
+    s.conn_cur_count = prev.conn_cur_count+d[3];
+    s.latency_ms = prev.latency_ms+d[4];
+    s.buffered_packets = prev.buffered_packets+d[5];
+    samples.append(s);
+    prev = s;
+  }
+  return data_pos;
+}
@@ -0,0 +1,144 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef TUNNEL_HISTORY_H
+#define TUNNEL_HISTORY_H
+
+#include <QVector>
+#include <QByteArray>
+#include "tunnel-parameters.h"
+
+// tunnel throughput time series kept by tunserver: every tier is a ring of samples aggregated over its interval;
+// rings grow with the history actually recorded, so stopped and idle tunnels keep no samples at all
+#define TUNNEL_HISTORY_TIERS                         3
+#define TUNNEL_HISTORY_TIER0_INTERVAL                1      // seconds
+#define TUNNEL_HISTORY_TIER0_SIZE                 3600      // 1 hour
+#define TUNNEL_HISTORY_TIER1_INTERVAL               60
+#define TUNNEL_HISTORY_TIER1_SIZE                 1440      // 1 day
+#define TUNNEL_HISTORY_TIER2_INTERVAL             3600
+#define TUNNEL_HISTORY_TIER2_SIZE                  168      // 1 week
+
+struct TunnelHistorySample
+{
+  quint64 data_bytes_rcv;             // sum over interval
+  quint64 data_bytes_snd;             // sum over interval
+  quint32 conn_new_count;             // sum over interval
+  quint32 conn_cur_count;             // max over interval
+  qint32 latency_ms;                  // max over interval (-1 - unknown)
+  quint32 buffered_packets;           // max over interval
+
+  TunnelHistorySample()
+  {
+    data_bytes_rcv = 0;
+    data_bytes_snd = 0;
+    conn_new_count = 0;
+    conn_cur_count = 0;
+    latency_ms = -1;
+    buffered_packets = 0;
+  }
+
+  // nothing happened over interval (stopped or idle tunnel)
+  bool isEmpty() const
+  {
+    return data_bytes_rcv == 0 && data_bytes_snd == 0 && conn_new_count == 0 && conn_cur_count == 0 &&
+           latency_ms < 0 && buffered_packets == 0;
+  }
+
+  void merge(const TunnelHistorySample &src)
+  {
+    data_bytes_rcv += src.data_bytes_rcv;
+    data_bytes_snd += src.data_bytes_snd;
+    conn_new_count += src.conn_new_count;
+    conn_cur_count = qMax(conn_cur_count, src.conn_cur_count);
+    latency_ms = qMax(latency_ms, src.latency_ms);
+    buffered_packets = qMax(buffered_packets, src.buffered_packets);
+  }
+};
+
+class TunnelHistoryTier
+{
+public:
+  quint32 interval;                   // seconds per sample
+  int size;                           // maximum number of samples
+  QVector<TunnelHistorySample> samples;   // grows up to size with the first non-empty sample, released when
+                                          // there were only empty samples for size intervals
+  quint32 first_slot;                 // time/interval of the very first sample
+  quint32 last_slot;                  // time/interval of the most recent sample
+  quint32 last_busy_slot;             // time/interval of the most recent non-empty sample
+  int last_pos;                       // its index in samples
+
+  TunnelHistoryTier(quint32 _interval=1, int _size=0)
+  {
+    interval = _interval;
+    size = _size;
+    first_slot = 0;
+    last_slot = 0;
+    last_busy_slot = 0;
+    last_pos = 0;
+  }
+
+  void add(quint32 time, const TunnelHistorySample &sample);
+  QByteArray printToBuffer(quint32 from_time, quint32 to_time) const;
+};
+
+class TunnelHistory
+{
+public:
+  TunnelHistoryTier tiers[TUNNEL_HISTORY_TIERS];
+
+  TunnelHistory()
+  {
+    tiers[0] = TunnelHistoryTier(TUNNEL_HISTORY_TIER0_INTERVAL, TUNNEL_HISTORY_TIER0_SIZE);
+    tiers[1] = TunnelHistoryTier(TUNNEL_HISTORY_TIER1_INTERVAL, TUNNEL_HISTORY_TIER1_SIZE);
+    tiers[2] = TunnelHistoryTier(TUNNEL_HISTORY_TIER2_INTERVAL, TUNNEL_HISTORY_TIER2_SIZE);
+  }
+
+  void add(quint32 time, const TunnelHistorySample &sample)
+  {
+    for (int i=0; i < TUNNEL_HISTORY_TIERS; i++)
+      tiers[i].add(time, sample);
+  }
+  // tier with the given interval (or the finest one for unknown interval)
+  const TunnelHistoryTier &tier(quint32 interval) const;
+
+  static int parseFromBuffer(const char *buffer, int buf_size, quint32 &interval, quint32 &first_time, QVector<TunnelHistorySample> &samples);
+};
+
+struct __attribute__ ((__packed__)) MgrPacket_TunnelHistoryReq
+{
+  TunnelId tunnel_id;
+  quint32 interval;                   // TUNNEL_HISTORY_TIER..._INTERVAL
+  quint32 from_time;                  // seconds since epoch (0 - oldest sample)
+  quint32 to_time;                    // seconds since epoch (0 - up to now)
+
+  MgrPacket_TunnelHistoryReq()
+  {
+    tunnel_id = 0;
+    interval = TUNNEL_HISTORY_TIER0_INTERVAL;
+    from_time = 0;
+    to_time = 0;
+  }
+};
+
+// reply: TunnelId, then MgrPacket_TunnelHistoryRep and sample_count samples;
+// every sample field is encoded as zigzag varint of its difference from the same field of the previous sample
+struct __attribute__ ((__packed__)) MgrPacket_TunnelHistoryRep
+{
+  quint32 interval;
+  quint32 first_time;                 // seconds since epoch of the first sample
+  quint32 sample_count;
+
+  MgrPacket_TunnelHistoryRep()
+  {
+    interval = 0;
+    first_time = 0;
+    sample_count = 0;
+  }
+};
+
+#endif // TUNNEL_HISTORY_H
@@ -92,6 +92,14 @@ void TunnelParameters::parseJSON(cJSON *json)
   if (j && j->type == cJSON_Number)
     max_incoming_connections = j->valueint;
 
+  j = cJSON_GetObjectItem(json, "bind_listeners");
+  if (j && j->type == cJSON_Number && j->valueint > 0)
+    bind_listeners = j->valueint;
+
+  j = cJSON_GetObjectItem(json, "bind_backlog");
+  if (j && j->type == cJSON_Number)
+    bind_backlog = j->valueint;
+
   j = cJSON_GetObjectItem(json, "max_bytes_to_read_at_once");
   if (j && j->type == cJSON_Number)
     max_bytes_to_read_at_once = j->valueint;
@@ -116,10 +124,18 @@ void TunnelParameters::parseJSON(cJSON *json)
   if (j && j->type == cJSON_Number)
     connect_timeout = j->valueint;
 
+  j = cJSON_GetObjectItem(json, "conn_idle_timeout");
+  if (j && j->type == cJSON_Number)
+    conn_idle_timeout = j->valueint;
+
   j = cJSON_GetObjectItem(json, "failure_tolerance_timeout");
   if (j && j->type == cJSON_Number)
     failure_tolerance_timeout = j->valueint;
 
+  j = cJSON_GetObjectItem(json, "mgrconn_stripes");
+  if (j && j->type == cJSON_Number && j->valueint > 0)
+    mgrconn_stripes = j->valueint;
+
   j = cJSON_GetObjectItem(json, "max_state_dispatch_frequency");
   if (j && j->type == cJSON_Number)
     max_state_dispatch_frequency = j->valueint;
@@ -177,6 +193,10 @@ void TunnelParameters::printJSON(cJSON *json) const
     cJSON_AddNumberToObject(json, "idle_timeout", idle_timeout);
   if (max_incoming_connections > 0)
     cJSON_AddNumberToObject(json, "max_incoming_connections", max_incoming_connections);
+  if (bind_listeners > 1 && app_protocol == TCP)
+    cJSON_AddNumberToObject(json, "bind_listeners", bind_listeners);
+  if (bind_backlog > 0 && app_protocol == TCP)
+    cJSON_AddNumberToObject(json, "bind_backlog", bind_backlog);
   if (max_bytes_to_read_at_once > 0)
     cJSON_AddNumberToObject(json, "max_bytes_to_read_at_once", max_bytes_to_read_at_once);
   if (max_io_buffer_size > 0)
@@ -189,11 +209,195 @@ void TunnelParameters::printJSON(cJSON *json) const
     cJSON_AddNumberToObject(json, "max_data_packet_size", max_data_packet_size);
   if (connect_timeout > 0)
     cJSON_AddNumberToObject(json, "connect_timeout", connect_timeout);
+  if (conn_idle_timeout > 0)
+    cJSON_AddNumberToObject(json, "conn_idle_timeout", conn_idle_timeout);
   if (failure_tolerance_timeout > 0)
     cJSON_AddNumberToObject(json, "failure_tolerance_timeout", failure_tolerance_timeout);
+  if (mgrconn_stripes > 1)
+    cJSON_AddNumberToObject(json, "mgrconn_stripes", mgrconn_stripes);
   if (max_state_dispatch_frequency > 0)
     cJSON_AddNumberToObject(json, "max_state_dispatch_frequency", max_state_dispatch_frequency);
   cJSON_AddNumberToObject(json, "max_incoming_connections_info", max_incoming_connections_info);
   cJSON_AddNumberToObject(json, "incoming_connections_info_timeout", incoming_connections_info_timeout);
   cJSON_AddStringToObject(json, "flags", QByteArray::number(flags, 16));
 }
+
+//---------------------------------------------------------------------------
+bool TunnelParameters::matchesRule(const QString &rule) const
+{
+  return TunnelRule(rule).matches(*this);
+}
+
+//---------------------------------------------------------------------------
+// simple wildcards are matched as plain strings, only complex ones need regexp
+TunnelRulePattern::TunnelRulePattern(const QString &pattern)
+{
+  int stars = pattern.count('*');
+  bool special = pattern.contains('?') || pattern.contains('[');
+  if (pattern.isEmpty() || pattern == QString("*"))
+    type = ANY;
+  else if (stars == 0 && !special)
+  {
+    type = EXACT;
+    text = pattern.toLower();
+  }
+  else if (stars == 1 && !special && pattern.endsWith('*'))
+  {
+    type = PREFIX;
+    text = pattern.left(pattern.length()-1).toLower();
+  }
+  else if (stars == 1 && !special && pattern.startsWith('*'))
+  {
+    type = SUFFIX;
+    text = pattern.mid(1).toLower();
+  }
+  else
+  {
+    type = WILDCARD;
+    rx = QRegExp(pattern, Qt::CaseInsensitive, QRegExp::Wildcard);
+  }
+}
+
+//---------------------------------------------------------------------------
+bool TunnelRulePattern::matches(const QString &value) const
+{
+  switch (type)
+  {
+    case ANY:
+      return true;
+    case EXACT:
+      return value.compare(text, Qt::CaseInsensitive) == 0;
+    case PREFIX:
+      return value.startsWith(text, Qt::CaseInsensitive);
+    case SUFFIX:
+      return value.endsWith(text, Qt::CaseInsensitive);
+    case WILDCARD:
+      return rx.exactMatch(value);
+  }
+  return false;
+}
+
+//---------------------------------------------------------------------------
+TunnelRuleEndpoint::TunnelRuleEndpoint(const QString &subrule)
+{
+  is_set = !subrule.isEmpty();
+  hostport_valid = true;
+  if (!is_set)
+    return;
+  pipe = TunnelRulePattern(subrule);
+  if (subrule.contains(":"))
+  {
+    QRegExp rx("(|\\*|.+):([0-9\\*]*)");
+    if (!rx.exactMatch(subrule))
+    {
+      hostport_valid = false;
+      return;
+    }
+    host = TunnelRulePattern(rx.cap(1));
+    port = TunnelRulePattern(rx.cap(2));
+  }
+  else
+    host = TunnelRulePattern(subrule);
+}
+
+//---------------------------------------------------------------------------
+bool TunnelRuleEndpoint::matches(TunnelParameters::AppProtocol app_protocol, const QString &value_host, quint16 value_port) const
+{
+  if (!is_set)
+    return true;
+  if (app_protocol == TunnelParameters::PIPE)
+    return pipe.matches(value_host);
+  return hostport_valid &&
+      host.matches(value_host) &&
+      (port.type == TunnelRulePattern::ANY || port.matches(QString::number(value_port)));
+}
+
+//---------------------------------------------------------------------------
+// rule format: direction#first-endpoint#tunserver#...#tunserver#last-endpoint
+TunnelRule::TunnelRule(const QString &rule)
+{
+  QStringList subrules = rule.split("#");
+  parts = subrules.count();
+  fwd_direction = 0;
+  QString subrule = subrules.first().trimmed();
+  if (subrule == QString("L"))
+    fwd_direction = TunnelParameters::LOCAL_TO_REMOTE;
+  else if (subrule == QString("R"))
+    fwd_direction = TunnelParameters::REMOTE_TO_LOCAL;
+  if (parts > 1)
+    first = TunnelRuleEndpoint(subrules[1].trimmed());
+  for (int i=2; i < parts-1; i++)
+  {
+    subrule = subrules[i].trimmed();
+    chain.append(TunnelRuleEndpoint(subrule));
+    chain_optional.append(subrule.isEmpty() || subrule == QString("*"));
+  }
+  if (parts > 2)
+    last = TunnelRuleEndpoint(subrules.last().trimmed());
+}
+
+//---------------------------------------------------------------------------
+bool TunnelRule::matches(const TunnelParameters &tun_params) const
+{
+  if (fwd_direction != 0 && fwd_direction != tun_params.fwd_direction)
+    return false;
+  bool l2r = tun_params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE;
+  if (parts > 1 &&
+      !first.matches(tun_params.app_protocol,
+                     l2r ? tun_params.bind_address : tun_params.remote_host,
+                     l2r ? tun_params.bind_port : tun_params.remote_port))
+    return false;
+  for (int i=0; i < chain.count(); i++)
+  {
+    if (i >= tun_params.tunservers.count())
+    {
+      if (!chain_optional[i])
+        return false;
+      continue;
+    }
+    // tunservers are always host:port
+    if (!chain[i].matches(TunnelParameters::TCP, tun_params.tunservers.at(i).host, tun_params.tunservers.at(i).port))
+      return false;
+  }
+  if (parts > 2 &&
+      !last.matches(tun_params.app_protocol,
+                    l2r ? tun_params.remote_host : tun_params.bind_address,
+                    l2r ? tun_params.remote_port : tun_params.bind_port))
+    return false;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void TunnelRuleMatcher::compile(const QStringList &rules)
+{
+  rules_any.clear();
+  rules_l.clear();
+  rules_r.clear();
+  for (int i=0; i < rules.count(); i++)
+  {
+    TunnelRule rule(rules[i]);
+    if (rule.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE)
+      rules_l.append(rule);
+    else if (rule.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL)
+      rules_r.append(rule);
+    else
+      rules_any.append(rule);
+  }
+}
+
+//---------------------------------------------------------------------------
+bool TunnelRuleMatcher::matches(const TunnelParameters &tun_params) const
+{
+  const QList<TunnelRule> &rules = (tun_params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE) ? rules_l : rules_r;
+  for (int i=0; i < rules.count(); i++)
+  {
+    if (rules[i].matches(tun_params))
+      return true;
+  }
+  for (int i=0; i < rules_any.count(); i++)
+  {
+    if (rules_any[i].matches(tun_params))
+      return true;
+  }
+  return false;
+}
@@ -11,6 +11,7 @@
 
 #include <QString>
 #include <QStringList>
+#include <QRegExp>
 #include "../lib/cJSON.h"
 #include "../lib/mgrclient-parameters.h"
 #include "../lib/mgr_packet.h"
@@ -43,6 +44,8 @@ public:
   quint32 owner_group_id;              // owner group id
 
   quint32 max_incoming_connections;    // maximum number of incoming TCP or PIPE connections
+  quint32 bind_listeners;              // number of SO_REUSEPORT TCP listening sockets, each accepting in its own thread (1 = single listener)
+  quint32 bind_backlog;                // TCP listen() backlog (0 = default)
   quint32 max_bytes_to_read_at_once;   // limit amount of data to read from socket at once in readyRead() (0 = no limit)
   quint32 max_io_buffer_size;          // Maximum read/write buffer size in bytes (0=unlimited)
   quint32 read_buffer_size;            // Maximum read buffer size in bytes (0=unlimited)
@@ -50,7 +53,9 @@ public:
   quint32 max_data_packet_size;        // Maximum size of packet with data (0=maximum packet size)
   quint32 failure_tolerance_timeout;   // Keep data buffered in case of short-time failure of tunserver-tunserver mgrconn (ms)
   quint32 connect_timeout;             // Connect timeout for outgoing application connections (ms)
+  quint32 conn_idle_timeout;           // Close application connections (expire UDP ones) idle for this long (ms) (0 - never)
   quint32 heartbeat_interval;          // Tunnel heartbeat (latency check) interval (ms) (0 - no heartbeat and latency check)
+  quint32 mgrconn_stripes;             // Number of parallel tunserver-tunserver mgrconns to stripe data packets across (1 = no striping)
 
   quint32 max_state_dispatch_frequency;// Maximum frequency (ms) of sending out tunnel state updates to subscribers
   quint32 max_incoming_connections_info;// Maximum number of items in incoming connections info list
@@ -73,8 +78,11 @@ public:
     orig_id = 0;
     next_id = 0;
     max_incoming_connections = 100;
+    bind_listeners = 1;
+    bind_backlog = 0;
     max_bytes_to_read_at_once = (MGR_PACKET_MAX_LEN-sizeof(quint16))*2;
     connect_timeout = 10*1000;
+    conn_idle_timeout = 0;
     failure_tolerance_timeout = 1000;
     max_io_buffer_size = 1024*1024*32;
     read_buffer_size = 1024*1024*8;
@@ -87,6 +95,7 @@ public:
     bind_port = 8080;
     remote_port = 80;
     heartbeat_interval = 60*1000;
+    mgrconn_stripes = 1;
     udp_port_range_from = 33001;
     udp_port_range_till = 63000;
     idle_timeout = 300000;
@@ -103,13 +112,18 @@ public:
     orig_id = src.orig_id;
     next_id = src.next_id;
     max_incoming_connections = src.max_incoming_connections;
+    bind_listeners = src.bind_listeners;
+    bind_backlog = src.bind_backlog;
     max_bytes_to_read_at_once = src.max_bytes_to_read_at_once;
     connect_timeout = src.connect_timeout;
+    conn_idle_timeout = src.conn_idle_timeout;
     max_io_buffer_size = src.max_io_buffer_size;
     read_buffer_size = src.read_buffer_size;
     write_buffer_size = src.write_buffer_size;
     max_data_packet_size = src.max_data_packet_size;
     failure_tolerance_timeout = src.failure_tolerance_timeout;
+    heartbeat_interval = src.heartbeat_interval;
+    mgrconn_stripes = src.mgrconn_stripes;
     name = src.name;
     owner_user_id = src.owner_user_id;
     owner_group_id = src.owner_group_id;
@@ -181,121 +195,7 @@ public:
     return tunnel_rule;
   }
 
-  bool matchesRule(const QString &rule) const
-  {
-    QStringList subrules = rule.split("#");
-    if (subrules.isEmpty())
-      return true;
-
-    // forward direction
-    QString subrule = subrules.first().trimmed();
-    if (!subrule.isEmpty())
-    {
-      if ((subrule == QString("L") && fwd_direction != LOCAL_TO_REMOTE) ||
-          (subrule == QString("R") && fwd_direction != REMOTE_TO_LOCAL))
-        return false;
-    }
-    subrules.removeFirst();
-    if (subrules.isEmpty())
-      return true;
-
-    // L+bind/R+remote
-    subrule = subrules.first().trimmed();
-    if (!subrule.isEmpty())
-    {
-      if (app_protocol == PIPE)
-      {
-        if (!QRegExp(subrule, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(fwd_direction == LOCAL_TO_REMOTE ? bind_address : remote_host))
-          return false;
-      }
-      else
-      {
-        QString sub_host = subrule;
-        QString sub_port;
-        if (subrule.contains(":"))
-        {
-          QRegExp rx("(|\\*|.+):([0-9\\*]*)");
-          if (!rx.exactMatch(subrule))
-            return false;
-          sub_host = rx.cap(1);
-          sub_port = rx.cap(2);
-        }
-        if (!sub_host.isEmpty() && !QRegExp(sub_host, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(fwd_direction == LOCAL_TO_REMOTE ? bind_address : remote_host))
-          return false;
-        if (!sub_port.isEmpty() && !QRegExp(sub_port, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(QString::number(fwd_direction == LOCAL_TO_REMOTE ? bind_port : remote_port)))
-          return false;
-      }
-    }
-    subrules.removeFirst();
-    if (subrules.isEmpty())
-      return true;
-
-    // tunservers chain
-    int chain_index = 0;
-    while (subrules.count() > 1)
-    {
-      subrule = subrules.first().trimmed();
-      if (chain_index >= tunservers.count())
-      {
-        if (subrule == QString("*") || subrule.isEmpty())
-        {
-          chain_index++;
-          subrules.removeFirst();
-          continue;
-        }
-        else
-          return false;
-      }
-
-      QString sub_host = subrule;
-      QString sub_port;
-      if (subrule.contains(":"))
-      {
-        QRegExp rx("(|\\*|.+):([0-9\\*]*)");
-        if (!rx.exactMatch(subrule))
-          return false;
-        sub_host = rx.cap(1);
-        sub_port = rx.cap(2);
-      }
-      if (!sub_host.isEmpty() && !QRegExp(sub_host, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(tunservers.at(chain_index).host))
-        return false;
-      if (!sub_port.isEmpty() && !QRegExp(sub_port, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(QString::number(tunservers.at(chain_index).port)))
-        return false;
-
-      chain_index++;
-      subrules.removeFirst();
-    }
-
-    // L+remote/R+bind
-    subrule = subrules.first().trimmed();
-    if (!subrule.isEmpty())
-    {
-      if (app_protocol == PIPE)
-      {
-        if (!QRegExp(subrule, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(fwd_direction == LOCAL_TO_REMOTE ? remote_host : bind_address))
-          return false;
-      }
-      else
-      {
-        QString sub_host = subrule;
-        QString sub_port;
-        if (subrule.contains(":"))
-        {
-          QRegExp rx("(|\\*|.+):([0-9\\*]*)");
-          if (!rx.exactMatch(subrule))
-            return false;
-          sub_host = rx.cap(1);
-          sub_port = rx.cap(2);
-        }
-        if (!sub_host.isEmpty() && !QRegExp(sub_host, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(fwd_direction == LOCAL_TO_REMOTE ? remote_host : bind_address))
-          return false;
-        if (!sub_port.isEmpty() && !QRegExp(sub_port, Qt::CaseInsensitive, QRegExp::Wildcard).exactMatch(QString::number(fwd_direction == LOCAL_TO_REMOTE ? remote_port : bind_port)))
-          return false;
-      }
-    }
-
-    return true;
-  }
+  bool matchesRule(const QString &rule) const;
 
 private:
 
@@ -306,13 +206,17 @@ private:
         orig_id == src.orig_id &&
         next_id == src.next_id &&
         max_incoming_connections == src.max_incoming_connections &&
+        bind_listeners == src.bind_listeners &&
+        bind_backlog == src.bind_backlog &&
         max_bytes_to_read_at_once == src.max_bytes_to_read_at_once &&
         connect_timeout == src.connect_timeout &&
+        conn_idle_timeout == src.conn_idle_timeout &&
         max_io_buffer_size == src.max_io_buffer_size &&
         read_buffer_size == src.read_buffer_size &&
         write_buffer_size == src.write_buffer_size &&
         max_data_packet_size == src.max_data_packet_size &&
         failure_tolerance_timeout == src.failure_tolerance_timeout &&
+        mgrconn_stripes == src.mgrconn_stripes &&
         name == src.name &&
         owner_user_id == src.owner_user_id &&
         owner_group_id == src.owner_group_id &&
@@ -330,4 +234,60 @@ private:
 
 Q_DECLARE_METATYPE(TunnelParameters*);
 
+// host or port wildcard of tunnel allow rule, compiled once
+class TunnelRulePattern
+{
+public:
+  enum PatternType { ANY, EXACT, PREFIX, SUFFIX, WILDCARD } type;
+  QString text;                       // lowercase: whole value (EXACT), value without '*' (PREFIX/SUFFIX)
+  QRegExp rx;                         // WILDCARD only
+
+  TunnelRulePattern(const QString &pattern=QString());
+  bool matches(const QString &value) const;
+};
+
+// endpoint (host[:port]) of tunnel allow rule
+class TunnelRuleEndpoint
+{
+public:
+  bool is_set;                        // false - any endpoint
+  bool hostport_valid;                // false - rule never matches TCP/UDP tunnels
+  TunnelRulePattern pipe;             // whole subrule for PIPE tunnels
+  TunnelRulePattern host;
+  TunnelRulePattern port;
+
+  TunnelRuleEndpoint(const QString &subrule=QString());
+  bool matches(TunnelParameters::AppProtocol app_protocol, const QString &value_host, quint16 value_port) const;
+};
+
+// tunnel allow rule (see UserGroup::tunnel_allow_list) split and compiled once
+class TunnelRule
+{
+public:
+  int fwd_direction;                  // TunnelParameters::FwdDirection or 0 - any direction
+  int parts;                          // number of '#'-separated parts in rule
+  TunnelRuleEndpoint first;           // L: bind address, R: remote host
+  QList<TunnelRuleEndpoint> chain;    // tunservers
+  QList<bool> chain_optional;         // '*' or empty tunserver - may be missing in tunnel
+  TunnelRuleEndpoint last;            // L: remote host, R: bind address
+
+  TunnelRule(const QString &rule=QString());
+  bool matches(const TunnelParameters &tun_params) const;
+};
+
+// list of tunnel allow rules, matches if any of rules matches
+class TunnelRuleMatcher
+{
+public:
+  QList<TunnelRule> rules_any;
+  QList<TunnelRule> rules_l;          // LOCAL_TO_REMOTE rules
+  QList<TunnelRule> rules_r;          // REMOTE_TO_LOCAL rules
+
+  TunnelRuleMatcher() {}
+  TunnelRuleMatcher(const QStringList &rules) { compile(rules); }
+
+  void compile(const QStringList &rules);
+  bool matches(const TunnelParameters &tun_params) const;
+};
+
 #endif // TUNNELPARAMETERS_H
@@ -0,0 +1,605 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include <QThreadStorage>
+#include "io_uring_backend.h"
+#include "../lib/prc_log.h"
+#ifdef HAVE_IO_URING
+#include <QSocketNotifier>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#endif
+
+#define IO_URING_BUF_GROUP                      0
+
+bool io_uring_enabled = false;
+
+static QMutex io_uring_backends_mutex;
+static QList<IoUringBackend *> io_uring_backends_list;      // rings of running threads
+static IoUringStats io_uring_backends_retired;              // counters of rings of finished threads
+static QThreadStorage<IoUringBackend *> io_uring_backends;  // declared last: rings may be deleted during static destruction
+
+//---------------------------------------------------------------------------
+void IoUringStats::add(const IoUringStats &other)
+{
+  submit_calls += other.submit_calls;
+  sqe_count += other.sqe_count;
+  cqe_count += other.cqe_count;
+  buffers_exhausted += other.buffers_exhausted;
+}
+
+//---------------------------------------------------------------------------
+IoUringBackend::IoUringBackend()
+{
+  ring = NULL;
+  buf_ring = NULL;
+  buf_memory = NULL;
+  event_fd = -1;
+  event_notifier = NULL;
+  submit_scheduled = false;
+  QMutexLocker locker(&io_uring_backends_mutex);
+  io_uring_backends_list.append(this);
+}
+
+//---------------------------------------------------------------------------
+IoUringBackend::~IoUringBackend()
+{
+  ring_close();
+  qDeleteAll(ops);
+  QMutexLocker locker(&io_uring_backends_mutex);
+  io_uring_backends_list.removeOne(this);
+  io_uring_backends_retired.add(counters);
+}
+
+//---------------------------------------------------------------------------
+// created on first use: the ring stays unset if it could not be set up, so that is not retried for every connection
+IoUringBackend *IoUringBackend::instance()
+{
+  if (!io_uring_backends.hasLocalData())
+  {
+    IoUringBackend *backend = new IoUringBackend;
+    io_uring_backends.setLocalData(backend);
+    if (!backend->init())
+      prc_log(LOG_HIGH, QString("io_uring could not be set up, application connections of this thread use Qt sockets"));
+  }
+  IoUringBackend *backend = io_uring_backends.localData();
+  return (backend && backend->ring) ? backend : NULL;
+}
+
+//---------------------------------------------------------------------------
+IoUringStats IoUringBackend::stats()
+{
+  QMutexLocker locker(&io_uring_backends_mutex);
+  IoUringStats result = io_uring_backends_retired;
+  for (int i=0; i < io_uring_backends_list.count(); i++)
+  {
+    IoUringBackend *backend = io_uring_backends_list[i];
+    QMutexLocker backend_locker(&backend->mutex);
+    result.add(backend->counters);
+  }
+  return result;
+}
+
+#ifdef HAVE_IO_URING
+
+//---------------------------------------------------------------------------
+// multishot recv into a provided buffer ring is tried on a socket pair in a scratch ring: kernel version says nothing
+// about backports or io_uring being restricted (kernel.io_uring_disabled, seccomp)
+static bool io_uring_probe()
+{
+  struct io_uring ring;
+  if (io_uring_queue_init(4, &ring, 0) < 0)
+    return false;
+  bool result = false;
+  struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+  if (probe && io_uring_opcode_supported(probe, IORING_OP_ACCEPT) && io_uring_opcode_supported(probe, IORING_OP_CONNECT) &&
+      io_uring_opcode_supported(probe, IORING_OP_RECV) && io_uring_opcode_supported(probe, IORING_OP_SEND) &&
+      io_uring_opcode_supported(probe, IORING_OP_ASYNC_CANCEL))
+  {
+    static char probe_buffers[2][64];
+    int res = 0;
+    int fds[2];
+    struct io_uring_buf_ring *buf_ring = io_uring_setup_buf_ring(&ring, 2, IO_URING_BUF_GROUP, 0, &res);
+    if (buf_ring && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0)
+    {
+      for (int bid=0; bid < 2; bid++)
+        io_uring_buf_ring_add(buf_ring, probe_buffers[bid], sizeof(probe_buffers[bid]), bid, io_uring_buf_ring_mask(2), bid);
+      io_uring_buf_ring_advance(buf_ring, 2);
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      io_uring_prep_recv_multishot(sqe, fds[0], NULL, 0, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = IO_URING_BUF_GROUP;
+      struct io_uring_cqe *cqe;
+      if (::write(fds[1], "x", 1) == 1 && io_uring_submit_and_wait(&ring, 1) >= 0 && io_uring_peek_cqe(&ring, &cqe) == 0)
+      {
+        // kernels without multishot recv fail it with -EINVAL, with it the request stays armed
+        result = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+        io_uring_cqe_seen(&ring, cqe);
+      }
+      ::close(fds[1]);                // ends the armed recv
+      ::close(fds[0]);
+    }
+    if (buf_ring)
+      io_uring_free_buf_ring(&ring, buf_ring, 2, IO_URING_BUF_GROUP);
+    else
+      prc_log(LOG_DBG1, QString("io_uring probe: provided buffer rings are not supported: %1").arg(strerror(-res)));
+  }
+  if (probe)
+    io_uring_free_probe(probe);
+  io_uring_queue_exit(&ring);
+  return result;
+}
+
+//---------------------------------------------------------------------------
+bool IoUringBackend::available()
+{
+  static int result = -1;
+  if (result < 0)
+    result = io_uring_probe() ? 1 : 0;
+  return result == 1;
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::configure(bool enable)
+{
+  bool enabled = enable && available();
+  if (enable && !enabled)
+    prc_log(LOG_HIGH, QString("io_uring is not available (needs qmake CONFIG+=io_uring and kernel support for multishot recv with provided buffer rings, Linux 6.0+), application connections use Qt sockets"));
+  else if (enabled != io_uring_enabled)
+    prc_log(LOG_LOW, QString("io_uring for application connections %1").arg(enabled ? "enabled" : "disabled"));
+  io_uring_enabled = enabled;
+}
+
+//---------------------------------------------------------------------------
+bool IoUringBackend::init()
+{
+  ring = new struct io_uring;
+  int res = io_uring_queue_init(IO_URING_ENTRIES, ring, 0);
+  if (res < 0)
+  {
+    prc_log(LOG_HIGH, QString("io_uring_queue_init() failed: %1").arg(strerror(-res)));
+    delete ring;
+    ring = NULL;
+    return false;
+  }
+  if (posix_memalign((void **)&buf_memory, 4096, (size_t)IO_URING_BUF_COUNT*IO_URING_BUF_SIZE) != 0)
+  {
+    buf_memory = NULL;
+    ring_close();
+    return false;
+  }
+  buf_ring = io_uring_setup_buf_ring(ring, IO_URING_BUF_COUNT, IO_URING_BUF_GROUP, 0, &res);
+  if (!buf_ring)
+  {
+    prc_log(LOG_HIGH, QString("io_uring_setup_buf_ring() failed: %1").arg(strerror(-res)));
+    ring_close();
+    return false;
+  }
+  for (int bid=0; bid < IO_URING_BUF_COUNT; bid++)
+    io_uring_buf_ring_add(buf_ring, buf_memory+(size_t)bid*IO_URING_BUF_SIZE, IO_URING_BUF_SIZE, bid, io_uring_buf_ring_mask(IO_URING_BUF_COUNT), bid);
+  io_uring_buf_ring_advance(buf_ring, IO_URING_BUF_COUNT);
+
+  // completions are signalled through eventfd, so they are processed by the thread's Qt event loop
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0 || io_uring_register_eventfd(ring, event_fd) < 0)
+  {
+    prc_log(LOG_HIGH, QString("io_uring eventfd registration failed"));
+    ring_close();
+    return false;
+  }
+  event_notifier = new QSocketNotifier(event_fd, QSocketNotifier::Read, this);
+  QObject::connect(event_notifier, SIGNAL(activated(int)), this, SLOT(completions()));
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// operations still in flight are cancelled by the kernel
+void IoUringBackend::ring_close()
+{
+  delete event_notifier;
+  event_notifier = NULL;
+  if (ring)
+  {
+    if (buf_ring)
+      io_uring_free_buf_ring(ring, buf_ring, IO_URING_BUF_COUNT, IO_URING_BUF_GROUP);
+    io_uring_queue_exit(ring);
+    delete ring;
+  }
+  ring = NULL;
+  buf_ring = NULL;
+  stop_pending.clear();
+  free(buf_memory);
+  buf_memory = NULL;
+  if (event_fd >= 0)
+    ::close(event_fd);
+  event_fd = -1;
+}
+
+//---------------------------------------------------------------------------
+// operations prepared during one event loop iteration are submitted together
+struct io_uring_sqe *IoUringBackend::sqe_get()
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  if (!sqe)
+  {
+    // submission queue is full
+    submit();
+    sqe = io_uring_get_sqe(ring);
+    if (!sqe)
+      return NULL;
+  }
+  submit_schedule();
+  return sqe;
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::submit_schedule()
+{
+  if (!submit_scheduled)
+  {
+    submit_scheduled = true;
+    QMetaObject::invokeMethod(this, "submit", Qt::QueuedConnection);
+  }
+}
+
+//---------------------------------------------------------------------------
+static void stop_prep(struct io_uring_sqe *sqe, IoUringOp *op)
+{
+  io_uring_prep_cancel64(sqe, (quint64)(quintptr)op, 0);
+  io_uring_sqe_set_data64(sqe, (quint64)(quintptr)op | 1);
+}
+
+//---------------------------------------------------------------------------
+// also called after every batch of completions, which is what frees a full submission queue
+void IoUringBackend::submit()
+{
+  submit_scheduled = false;
+  if (!ring)
+    return;
+  for (;;)
+  {
+    // stop requests which found the submission queue full go out first
+    while (!stop_pending.isEmpty())
+    {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+      if (!sqe)
+        break;
+      stop_prep(sqe, stop_pending.takeFirst());
+    }
+    if (io_uring_sq_ready(ring) == 0)
+      return;
+    int res = io_uring_submit(ring);
+    if (res < 0)
+      prc_log(LOG_HIGH, QString("io_uring_submit() failed: %1").arg(strerror(-res)));
+    {
+      QMutexLocker locker(&mutex);
+      counters.submit_calls++;
+      if (res > 0)
+        counters.sqe_count += res;
+    }
+    if (res <= 0 || stop_pending.isEmpty())
+      return;
+  }
+}
+
+//---------------------------------------------------------------------------
+IoUringOp *IoUringBackend::op_new(IoUringOp::Type type, IoUringClient *client, int fd, struct io_uring_sqe *sqe)
+{
+  IoUringOp *op = new IoUringOp(this, type, client, fd);
+  io_uring_sqe_set_data(sqe, op);
+  ops.insert(op);
+  return op;
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::op_release(IoUringOp *op)
+{
+  if (--op->refs > 0)
+    return;
+  ops.remove(op);
+  delete op;
+}
+
+//---------------------------------------------------------------------------
+IoUringOp *IoUringBackend::accept(IoUringClient *client, int listen_fd)
+{
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return NULL;
+  io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  return op_new(IoUringOp::OP_ACCEPT, client, listen_fd, sqe);
+}
+
+//---------------------------------------------------------------------------
+IoUringOp *IoUringBackend::connect(IoUringClient *client, int fd, const QHostAddress &address, quint16 port)
+{
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return NULL;
+  QByteArray sockaddr_data;
+  if (address.protocol() == QAbstractSocket::IPv6Protocol)
+  {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    Q_IPV6ADDR ip6 = address.toIPv6Address();
+    memcpy(&addr.sin6_addr, &ip6, sizeof(addr.sin6_addr));
+    sockaddr_data = QByteArray((const char *)&addr, sizeof(addr));
+  }
+  else
+  {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(address.toIPv4Address());
+    sockaddr_data = QByteArray((const char *)&addr, sizeof(addr));
+  }
+  IoUringOp *op = op_new(IoUringOp::OP_CONNECT, client, fd, sqe);
+  op->buffer = sockaddr_data;         // has to stay valid until the operation is done
+  io_uring_prep_connect(sqe, fd, (const struct sockaddr *)op->buffer.constData(), op->buffer.length());
+  io_uring_sqe_set_data(sqe, op);
+  return op;
+}
+
+//---------------------------------------------------------------------------
+bool IoUringBackend::recv_arm(IoUringOp *op)
+{
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return false;
+  io_uring_prep_recv_multishot(sqe, op->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = IO_URING_BUF_GROUP;
+  io_uring_sqe_set_data(sqe, op);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+IoUringOp *IoUringBackend::recv(IoUringClient *client, int fd)
+{
+  IoUringOp *op = new IoUringOp(this, IoUringOp::OP_RECV, client, fd);
+  if (!recv_arm(op))
+  {
+    delete op;
+    return NULL;
+  }
+  ops.insert(op);
+  return op;
+}
+
+//---------------------------------------------------------------------------
+IoUringOp *IoUringBackend::send(IoUringClient *client, int fd, const QByteArray &data)
+{
+  struct io_uring_sqe *sqe = sqe_get();
+  if (!sqe)
+    return NULL;
+  IoUringOp *op = op_new(IoUringOp::OP_SEND, client, fd, sqe);
+  op->buffer = data;                  // shared reference keeps data valid until the operation is done
+  io_uring_prep_send(sqe, fd, op->buffer.constData(), op->buffer.length(), MSG_NOSIGNAL | MSG_WAITALL);
+  io_uring_sqe_set_data(sqe, op);
+  return op;
+}
+
+//---------------------------------------------------------------------------
+// op is freed when both its own and the cancel request's completions are in
+// (user_data of the latter has the lowest bit set), so its address is not reused by a newer op meanwhile;
+// a multishot op is not stopped by closing its socket, so a cancel that does not fit is queued, never dropped
+void IoUringBackend::stop(IoUringOp *op)
+{
+  if (!op || op->stopping)
+    return;
+  IoUringBackend *backend = op->backend;
+  op->stopping = true;
+  op->refs++;
+  struct io_uring_sqe *sqe = backend->sqe_get();
+  if (sqe)
+    stop_prep(sqe, op);
+  else
+  {
+    backend->stop_pending.append(op);
+    backend->submit_schedule();
+  }
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::cancel(IoUringOp *op)
+{
+  if (!op)
+    return;
+  op->client = NULL;
+  stop(op);
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::buffer_recycle(int bid)
+{
+  io_uring_buf_ring_add(buf_ring, buf_memory+(size_t)bid*IO_URING_BUF_SIZE, IO_URING_BUF_SIZE, bid, io_uring_buf_ring_mask(IO_URING_BUF_COUNT), 0);
+  io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::completions()
+{
+  quint64 value;
+  if (::read(event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    prc_log(LOG_HIGH, QString("io_uring eventfd read failed: %1").arg(strerror(errno)));
+
+  quint64 count = 0;
+  struct io_uring_cqe *cqe;
+  while (ring && io_uring_peek_cqe(ring, &cqe) == 0)
+  {
+    quint64 user_data = cqe->user_data;
+    int result = cqe->res;
+    quint32 flags = cqe->flags;
+    io_uring_cqe_seen(ring, cqe);
+    count++;
+    IoUringOp *op = (IoUringOp *)(quintptr)(user_data & ~(quint64)1);
+    if (!op)
+      continue;
+    if (user_data & 1)
+      op_release(op);
+    else
+      complete(op, result, flags);
+  }
+  {
+    QMutexLocker locker(&mutex);
+    counters.cqe_count += count;
+  }
+  // operations started by completion handlers go out with a single syscall
+  submit();
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::complete(IoUringOp *op, int result, quint32 flags)
+{
+  bool final = !(flags & IORING_CQE_F_MORE);
+  const char *data = NULL;
+  int bid = -1;
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    data = buf_memory+(size_t)bid*IO_URING_BUF_SIZE;
+  }
+  if (result == -ENOBUFS)
+  {
+    QMutexLocker locker(&mutex);
+    counters.buffers_exhausted++;
+  }
+
+  // multishot recv also stops when provided buffers run out - it is restarted without bothering the client
+  bool restart = final && op->type == IoUringOp::OP_RECV && !op->stopping && (result > 0 || result == -ENOBUFS);
+  if (op->client && !(restart && result == -ENOBUFS))
+    op->client->ioUringCompleted(op, result, data, final && !restart);
+  else if (op->type == IoUringOp::OP_ACCEPT && result >= 0)
+    ::close(result);                  // accepted after listening was cancelled
+  if (bid >= 0)
+    buffer_recycle(bid);
+  if (!final)
+    return;
+  if (restart && op->client)
+  {
+    if (recv_arm(op))
+      return;
+    op->client->ioUringCompleted(op, -EAGAIN, NULL, true);
+  }
+  op_release(op);
+}
+
+//---------------------------------------------------------------------------
+int IoUringBackend::socketFor(const QHostAddress &address)
+{
+  int fd = ::socket(address.protocol() == QAbstractSocket::IPv6Protocol ? AF_INET6 : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  return (fd < 0) ? -errno : fd;
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::closeSocket(int fd)
+{
+  ::close(fd);
+}
+
+//---------------------------------------------------------------------------
+void IoUringBackend::setSocketOptions(int fd, bool keep_alive, bool no_delay)
+{
+  int value = keep_alive ? 1 : 0;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value));
+  value = no_delay ? 1 : 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+//---------------------------------------------------------------------------
+// -errno to the nearest QAbstractSocket error, so connection errors are reported the same way as with Qt sockets
+void IoUringBackend::socketError(int result, QAbstractSocket::SocketError &error, QString &error_str)
+{
+  switch (-result)
+  {
+    case ECONNREFUSED: error = QAbstractSocket::ConnectionRefusedError; break;
+    case ECONNRESET:
+    case EPIPE: error = QAbstractSocket::RemoteHostClosedError; break;
+    case ETIMEDOUT: error = QAbstractSocket::SocketTimeoutError; break;
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case ENETDOWN: error = QAbstractSocket::NetworkError; break;
+    case EACCES:
+    case EPERM: error = QAbstractSocket::SocketAccessError; break;
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+    case EAGAIN: error = QAbstractSocket::SocketResourceError; break;
+    default: error = QAbstractSocket::UnknownSocketError;
+  }
+  error_str = QString::fromLocal8Bit(strerror(-result));
+}
+
+//---------------------------------------------------------------------------
+bool IoUringBackend::peerAddress(int fd, QHostAddress &address, quint16 &port)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) != 0)
+    return false;
+  address.setAddress((const struct sockaddr *)&addr);
+  if (addr.ss_family == AF_INET6)
+    port = ntohs(((const struct sockaddr_in6 *)&addr)->sin6_port);
+  else
+    port = ntohs(((const struct sockaddr_in *)&addr)->sin_port);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+quint16 IoUringBackend::localPort(int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0)
+    return 0;
+  if (addr.ss_family == AF_INET6)
+    return ntohs(((const struct sockaddr_in6 *)&addr)->sin6_port);
+  return ntohs(((const struct sockaddr_in *)&addr)->sin_port);
+}
+
+#else // HAVE_IO_URING
+
+//---------------------------------------------------------------------------
+bool IoUringBackend::available() { return false; }
+void IoUringBackend::configure(bool enable)
+{
+  if (enable)
+    prc_log(LOG_HIGH, QString("io_uring support is not compiled in (qmake CONFIG+=io_uring), application connections use Qt sockets"));
+}
+bool IoUringBackend::init() { return false; }
+void IoUringBackend::ring_close() {}
+void IoUringBackend::submit() {}
+void IoUringBackend::completions() {}
+IoUringOp *IoUringBackend::accept(IoUringClient *, int) { return NULL; }
+IoUringOp *IoUringBackend::connect(IoUringClient *, int, const QHostAddress &, quint16) { return NULL; }
+IoUringOp *IoUringBackend::recv(IoUringClient *, int) { return NULL; }
+IoUringOp *IoUringBackend::send(IoUringClient *, int, const QByteArray &) { return NULL; }
+void IoUringBackend::stop(IoUringOp *) {}
+void IoUringBackend::cancel(IoUringOp *) {}
+int IoUringBackend::socketFor(const QHostAddress &) { return -1; }
+void IoUringBackend::closeSocket(int) {}
+void IoUringBackend::setSocketOptions(int, bool, bool) {}
+void IoUringBackend::socketError(int, QAbstractSocket::SocketError &error, QString &error_str)
+{
+  error = QAbstractSocket::UnsupportedSocketOperationError;
+  error_str = QString("io_uring is not available");
+}
+bool IoUringBackend::peerAddress(int, QHostAddress &, quint16 &) { return false; }
+quint16 IoUringBackend::localPort(int) { return 0; }
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,141 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef IO_URING_BACKEND_H
+#define IO_URING_BACKEND_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QAbstractSocket>
+#include <QSet>
+#include <QMutex>
+#include <string.h>
+
+// optional Linux data plane for TCP application connections (MgrServerParameters::FL_IO_URING):
+// multishot accept/recv with a registered ring of provided receive buffers, one submission per event loop iteration.
+// Needs liburing >= 2.4 at build time (qmake CONFIG+=io_uring) and a kernel supporting both (Linux 6.0+, probed at run time),
+// otherwise IoUringBackend::instance() is NULL and connections use QTcpSocket
+#define IO_URING_ENTRIES                        1024
+#define IO_URING_BUF_COUNT                      512         // provided receive buffers per thread (power of 2)
+#define IO_URING_BUF_SIZE                       16*1024
+
+extern bool io_uring_enabled;                 // set by MgrServer when FL_IO_URING is on and the backend is available
+
+class IoUringBackend;
+class IoUringOp;
+
+class IoUringClient
+{
+public:
+  virtual ~IoUringClient() {}
+  // result: accepted fd (OP_ACCEPT), bytes (OP_RECV, OP_SEND; 0 = connection closed by peer), 0 (OP_CONNECT) or -errno;
+  // data: received bytes, valid during the call only; op is deleted after its final completion
+  virtual void ioUringCompleted(IoUringOp *op, int result, const char *data, bool final) = 0;
+};
+
+class IoUringOp
+{
+public:
+  enum Type { OP_ACCEPT=1, OP_CONNECT, OP_RECV, OP_SEND };
+  Type type;
+  IoUringBackend *backend;
+  IoUringClient *client;              // NULL once cancelled (op is freed by its last completion)
+  int fd;
+  QByteArray buffer;                  // OP_SEND: data in flight, OP_CONNECT: sockaddr
+  bool stopping;                      // stop() requested: completions already in flight are still delivered
+
+private:
+  friend class IoUringBackend;
+  int refs;                           // own final completion + completion of cancel request
+  IoUringOp(IoUringBackend *_backend, Type _type, IoUringClient *_client, int _fd)
+  {
+    backend = _backend;
+    type = _type;
+    client = _client;
+    fd = _fd;
+    stopping = false;
+    refs = 1;
+  }
+  Q_DISABLE_COPY(IoUringOp)
+};
+
+struct IoUringStats
+{
+  quint64 submit_calls;               // io_uring_enter() syscalls
+  quint64 sqe_count;                  // operations submitted
+  quint64 cqe_count;                  // completions processed
+  quint64 buffers_exhausted;          // multishot recv stopped because all provided buffers were in use
+
+  IoUringStats()
+  {
+    memset(this, 0, sizeof(IoUringStats));
+  }
+  void add(const IoUringStats &other);
+};
+
+struct io_uring;
+struct io_uring_buf_ring;
+struct io_uring_sqe;
+class QSocketNotifier;
+
+// one ring per thread; all operations of a connection have to be started from its thread
+class IoUringBackend: public QObject
+{
+  Q_OBJECT
+public:
+  static bool available();                    // built with liburing and kernel passes the feature probe
+  static void configure(bool enable);         // sets io_uring_enabled (MgrServerParameters::FL_IO_URING)
+  static IoUringBackend *instance();          // ring of the current thread, NULL if it could not be set up
+  static IoUringStats stats();                // all threads
+
+  IoUringOp *accept(IoUringClient *client, int listen_fd);       // multishot
+  IoUringOp *connect(IoUringClient *client, int fd, const QHostAddress &address, quint16 port);
+  IoUringOp *recv(IoUringClient *client, int fd);                // multishot, provided buffers
+  IoUringOp *send(IoUringClient *client, int fd, const QByteArray &data);
+  static void stop(IoUringOp *op);                               // ends multishot op, client gets its final completion
+  static void cancel(IoUringOp *op);                             // client is not called anymore
+
+  static int socketFor(const QHostAddress &address);             // -errno on error
+  static void closeSocket(int fd);
+  static void setSocketOptions(int fd, bool keep_alive, bool no_delay);
+  static bool peerAddress(int fd, QHostAddress &address, quint16 &port);
+  static quint16 localPort(int fd);
+  static void socketError(int result, QAbstractSocket::SocketError &error, QString &error_str);
+
+  ~IoUringBackend();
+
+private slots:
+  void submit();
+  void completions();
+
+private:
+  struct io_uring *ring;
+  struct io_uring_buf_ring *buf_ring;
+  char *buf_memory;
+  int event_fd;
+  QSocketNotifier *event_notifier;
+  bool submit_scheduled;
+  QSet<IoUringOp *> ops;
+  QList<IoUringOp *> stop_pending;    // stop() found the submission queue full, cancel goes out with next submit()
+  mutable QMutex mutex;               // uncontended except for stats()
+  IoUringStats counters;
+
+  IoUringBackend();
+  bool init();
+  void ring_close();
+  struct io_uring_sqe *sqe_get();
+  void submit_schedule();
+  IoUringOp *op_new(IoUringOp::Type type, IoUringClient *client, int fd, struct io_uring_sqe *sqe);
+  void op_release(IoUringOp *op);
+  bool recv_arm(IoUringOp *op);
+  void buffer_recycle(int bid);
+  void complete(IoUringOp *op, int result, quint32 flags);
+};
+
+#endif // IO_URING_BACKEND_H
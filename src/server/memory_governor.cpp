@@ -0,0 +1,190 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include "memory_governor.h"
+#include "../lib/prc_log.h"
+
+MemoryGovernor memory_governor;
+
+//---------------------------------------------------------------------------
+MemoryAccount::MemoryAccount(): account_state(ST_OK)
+{
+  tunnel_id = 0;
+  user_id = 0;
+  reported = 0;
+  resume_receiver = NULL;
+  QMutexLocker locker(&memory_governor.mutex);
+  memory_governor.accounts.append(this);
+}
+
+//---------------------------------------------------------------------------
+MemoryAccount::~MemoryAccount()
+{
+  update(0);
+  QMutexLocker locker(&memory_governor.mutex);
+  memory_governor.accounts.removeOne(this);
+}
+
+//---------------------------------------------------------------------------
+void MemoryAccount::setOwner(TunnelId _tunnel_id, quint32 _user_id)
+{
+  QMutexLocker locker(&memory_governor.mutex);
+  tunnel_id = _tunnel_id;
+  if (user_id == _user_id)
+    return;
+  if (reported > 0)
+  {
+    memory_governor.user_bytes[user_id] -= reported;
+    if (memory_governor.user_bytes[user_id] == 0)
+      memory_governor.user_bytes.remove(user_id);
+    memory_governor.user_bytes[_user_id] += reported;
+  }
+  user_id = _user_id;
+}
+
+//---------------------------------------------------------------------------
+void MemoryAccount::setResumeReceiver(QObject *receiver)
+{
+  QMutexLocker locker(&memory_governor.mutex);
+  resume_receiver = receiver;
+}
+
+//---------------------------------------------------------------------------
+// called on every buffer change, so it should stay cheap
+void MemoryAccount::update(quint64 bytes)
+{
+  qint64 delta = (qint64)bytes-(qint64)reported;     // reported is only modified by the owner's thread
+  if (delta == 0 || (bytes > 0 && qAbs(delta) < MEMORY_GOVERNOR_GRANULARITY))
+    return;
+  memory_governor.charge(this, delta);
+}
+
+//---------------------------------------------------------------------------
+quint64 MemoryAccount::bytes() const
+{
+  QMutexLocker locker(&memory_governor.mutex);
+  return reported;
+}
+
+//---------------------------------------------------------------------------
+MemoryGovernor::MemoryGovernor()
+{
+  max_bytes = 0;
+  total_bytes = 0;
+  level = LEVEL_OK;
+  active_accounts = 0;
+}
+
+//---------------------------------------------------------------------------
+void MemoryGovernor::setMaxBytes(quint64 bytes)
+{
+  QMutexLocker locker(&mutex);
+  max_bytes = bytes;
+  level = levelFor(total_bytes);
+  rebalance_locked();
+}
+
+//---------------------------------------------------------------------------
+int MemoryGovernor::levelFor(quint64 bytes) const
+{
+  if (max_bytes == 0)
+    return LEVEL_OK;
+  if (bytes >= max_bytes)
+    return LEVEL_EXHAUSTED;
+  if (bytes >= max_bytes/100*MEMORY_GOVERNOR_TIGHT_PERCENT)
+    return LEVEL_TIGHT;
+  return LEVEL_OK;
+}
+
+//---------------------------------------------------------------------------
+void MemoryGovernor::charge(MemoryAccount *account, qint64 delta)
+{
+  QMutexLocker locker(&mutex);
+  if (account->reported == 0)
+    active_accounts++;
+  account->reported += delta;
+  if (account->reported == 0)
+    active_accounts--;
+  total_bytes += delta;
+  quint64 &user_total = user_bytes[account->user_id];
+  user_total += delta;
+  if (user_total == 0)
+    user_bytes.remove(account->user_id);
+
+  // accounts are re-evaluated right away when pressure level changes, periodically otherwise
+  int new_level = levelFor(total_bytes);
+  if (new_level != level)
+  {
+    if (new_level > level)
+      prc_log(LOG_DBG1, QString("Memory governor: %1 of %2 bytes used by tunnel buffers, %3")
+              .arg(total_bytes).arg(max_bytes).arg(new_level == LEVEL_EXHAUSTED ? "budget exhausted" : "throttling"));
+    level = new_level;
+    rebalance_locked();
+  }
+  else
+    setState(account, stateFor(account));
+}
+
+//---------------------------------------------------------------------------
+// throttled connections stop reading until their account is allowed to read again, so its owner is told then
+void MemoryGovernor::setState(MemoryAccount *account, int state)
+{
+  int prev_state = account->account_state.fetchAndStoreOrdered(state);
+  if (prev_state != MemoryAccount::ST_OK && state == MemoryAccount::ST_OK && account->resume_receiver)
+    QMetaObject::invokeMethod(account->resume_receiver, "memory_resume", Qt::QueuedConnection);
+}
+
+//---------------------------------------------------------------------------
+void MemoryGovernor::rebalance()
+{
+  QMutexLocker locker(&mutex);
+  rebalance_locked();
+}
+
+//---------------------------------------------------------------------------
+// fair share: budget divided equally among tunnels and among owner users with buffered data;
+// only accounts over either share are throttled (and evicted once the budget is exhausted)
+int MemoryGovernor::stateFor(const MemoryAccount *account) const
+{
+  if (level == LEVEL_OK || account->reported == 0)
+    return MemoryAccount::ST_OK;
+  bool over_share = account->reported >= max_bytes/qMax(active_accounts, 1) ||
+                    user_bytes.value(account->user_id) >= max_bytes/qMax(user_bytes.count(), 1);
+  if (over_share)
+    return (level == LEVEL_EXHAUSTED) ? MemoryAccount::ST_EVICT : MemoryAccount::ST_THROTTLED;
+  return (level == LEVEL_EXHAUSTED) ? MemoryAccount::ST_THROTTLED : MemoryAccount::ST_OK;
+}
+
+//---------------------------------------------------------------------------
+void MemoryGovernor::rebalance_locked()
+{
+  for (int i=0; i < accounts.count(); i++)
+    setState(accounts[i], stateFor(accounts[i]));
+}
+
+//---------------------------------------------------------------------------
+MemoryGovernorUsage MemoryGovernor::usage() const
+{
+  QMutexLocker locker(&mutex);
+  MemoryGovernorUsage result;
+  result.max_bytes = max_bytes;
+  result.total_bytes = total_bytes;
+  result.level = level;
+  result.user_bytes = user_bytes;
+  result.throttled_count = 0;
+  result.evict_count = 0;
+  for (int i=0; i < accounts.count(); i++)
+  {
+    int state = accounts[i]->state();
+    if (state == MemoryAccount::ST_THROTTLED)
+      result.throttled_count++;
+    else if (state == MemoryAccount::ST_EVICT)
+      result.evict_count++;
+  }
+  return result;
+}
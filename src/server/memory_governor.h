@@ -0,0 +1,94 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef MEMORY_GOVERNOR_H
+#define MEMORY_GOVERNOR_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QMutex>
+#include <QList>
+#include <QHash>
+#include "../lib/tunnel-parameters.h"
+
+#define MEMORY_GOVERNOR_GRANULARITY             64*1024     // account changes smaller than this are not reported
+#define MEMORY_GOVERNOR_TIGHT_PERCENT           80          // above this accounts over their fair share are throttled
+
+class MemoryGovernor;
+
+// buffer bytes of one tunnel, reported to memory_governor
+class MemoryAccount
+{
+public:
+  enum State { ST_OK=0,
+               ST_THROTTLED=1,                // budget is tight and account is over its fair share: pause reading
+               ST_EVICT=2                     // budget is exhausted and account is over its fair share: drop buffers
+             };
+
+  void setOwner(TunnelId _tunnel_id, quint32 _user_id);
+  void setResumeReceiver(QObject *receiver);  // its memory_resume() slot is queued when reading is allowed again
+  void update(quint64 bytes);                 // current usage, only changes by MEMORY_GOVERNOR_GRANULARITY are reported
+  int state() const { return account_state.fetchAndAddOrdered(0); }
+  bool readAllowed() const { return state() == ST_OK; }
+  quint64 bytes() const;
+
+  MemoryAccount();
+  ~MemoryAccount();
+
+private:
+  friend class MemoryGovernor;
+  TunnelId tunnel_id;
+  quint32 user_id;
+  quint64 reported;                           // under MemoryGovernor::mutex
+  mutable QAtomicInt account_state;
+  QObject *resume_receiver;                   // object owning the account (Tunnel), reading is resumed by it
+  Q_DISABLE_COPY(MemoryAccount)
+};
+
+struct MemoryGovernorUsage
+{
+  quint64 max_bytes;
+  quint64 total_bytes;
+  int level;                                  // MemoryGovernor::Level
+  QHash<quint32, quint64> user_bytes;         // by owner user id
+  quint32 throttled_count;
+  quint32 evict_count;
+};
+
+// server-wide budget for tunnel buffers (MgrServerParameters::max_buffer_memory)
+class MemoryGovernor
+{
+public:
+  enum Level { LEVEL_OK=0, LEVEL_TIGHT, LEVEL_EXHAUSTED };
+
+  void setMaxBytes(quint64 bytes);
+  void rebalance();                           // periodically (MgrServer metrics timer)
+  MemoryGovernorUsage usage() const;
+
+  MemoryGovernor();
+
+private:
+  friend class MemoryAccount;
+  mutable QMutex mutex;
+  quint64 max_bytes;                          // 0 = unlimited
+  quint64 total_bytes;
+  int level;
+  QList<MemoryAccount *> accounts;
+  int active_accounts;                        // accounts with reported bytes
+  QHash<quint32, quint64> user_bytes;
+
+  int levelFor(quint64 bytes) const;
+  int stateFor(const MemoryAccount *account) const;
+  void charge(MemoryAccount *account, qint64 delta);
+  void setState(MemoryAccount *account, int state);
+  void rebalance_locked();
+};
+
+extern MemoryGovernor memory_governor;
+
+#endif // MEMORY_GOVERNOR_H
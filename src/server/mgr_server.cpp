@@ -8,7 +8,13 @@
 
 #include "mgr_server.h"
 #include "../lib/prc_log.h"
+#include "../lib/ssl_helper.h"
+#include "../lib/sys_util.h"
 #include "mainwindow.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
 
 MgrServerThread *mgrServerThread = NULL;
 extern bool daemon_mode;
@@ -20,6 +26,11 @@ void mgrServerThread_init()
   qRegisterMetaType<QAbstractSocket::SocketError>("QAbstractSocket::SocketError");
   qRegisterMetaType<QLocalSocket::LocalSocketError>("QLocalSocket::LocalSocketError");
   qRegisterMetaType<MgrPacketCmd>("MgrPacketCmd");
+  qRegisterMetaType<TunnelId>("TunnelId");
+  // passed to tunnels running in worker threads with blocking queued calls
+  qRegisterMetaType<TunnelParameters*>("TunnelParameters*");
+  qRegisterMetaType<cJSON*>("cJSON*");
+  flightrec_clock_init();
 
   mgrServer = new MgrServer;
   mgrServer->config_load();
@@ -65,6 +76,7 @@ void MgrServer::resetConnections()
       mgrconn_list_in[i]->abort();
     }
   }
+  auth_pending.clear();
   while (!mgrconn_list_in.isEmpty())
   {
     MgrClientConnection *socket = mgrconn_list_in.takeFirst();
@@ -74,12 +86,9 @@ void MgrServer::resetConnections()
 }
 
 //---------------------------------------------------------------------------
-void MgrServer::packetReceived(MgrPacketCmd cmd, const QByteArray &data)
+// incoming mgrconns not handed over to tunnels
+void MgrServer::mgrPacketReceived(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &data)
 {
-  MgrClientConnection *socket = qobject_cast<MgrClientConnection *>(sender());
-  if (!socket)
-    return;
-
   switch (cmd)
   {
     case CMD_AUTH_REQ:
@@ -111,6 +120,11 @@ void MgrServer::packetReceived(MgrPacketCmd cmd, const QByteArray &data)
     case CMD_TUN_CONN_IN_DROP:
     case CMD_TUN_CONN_IN_DATA:
     case CMD_TUN_CONN_OUT_DATA:
+    case CMD_TUN_STRIPE_ATTACH:
+    case CMD_TUN_FLIGHTREC_GET:
+    case CMD_TUN_LATENCY_GET:
+    case CMD_TUN_HISTORY_GET:
+    case CMD_TUN_STAGES_GET:
       cmd_tun(socket, cmd, data);
       break;
     default:
@@ -121,7 +135,8 @@ void MgrServer::packetReceived(MgrPacketCmd cmd, const QByteArray &data)
 }
 
 //---------------------------------------------------------------------------
-void send_standart_reply(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &obj_id, quint16 res_code, const QString &error_str)
+void send_standart_reply(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &obj_id, quint16 res_code, const QString &error_str,
+                         const QByteArray &reply_data)
 {
   QByteArray error_buf = error_str.toUtf8();
   MgrPacket_StandartReply error_packet;
@@ -129,12 +144,14 @@ void send_standart_reply(MgrClientConnection *socket, MgrPacketCmd cmd, const QB
   error_packet.obj_id_len = obj_id.length();
   error_packet.error_len = error_buf.length();
   QByteArray buffer;
-  buffer.reserve(sizeof(MgrPacket_StandartReply)+obj_id.length()+error_buf.length());
+  buffer.reserve(sizeof(MgrPacket_StandartReply)+obj_id.length()+error_buf.length()+reply_data.length());
   buffer = QByteArray((const char *)&error_packet, sizeof(MgrPacket_StandartReply));
   if (!obj_id.isEmpty())
     buffer.append(obj_id);
   if (!error_str.isEmpty())
     buffer.append(error_buf);
+  if (!reply_data.isEmpty())
+    buffer.append(reply_data);
   socket->sendPacket(cmd, buffer);
 }
 
@@ -150,8 +167,28 @@ void MgrServer::start()
     return;
   }
   initUserGroups();
+  stage_timing_enabled.fetchAndStoreOrdered((params.flags & MgrServerParameters::FL_STAGE_TIMING) ? 1 : 0);
+  memory_governor.setMaxBytes(params.max_buffer_memory);
+  IoUringBackend::configure(params.flags & MgrServerParameters::FL_IO_URING);
+  ssl_config_load();
   prc_log(LOG_LOW, QString("MgrServer on %1:%2 started").arg(params.listen_interface.toString()).arg(params.listen_port));
+  workers_start();
   tunnels_start();
+  if (!timer_flightrec)
+  {
+    timer_flightrec = new QTimer(this);
+    timer_flightrec->setInterval(1000);
+    connect(timer_flightrec, SIGNAL(timeout()), this, SLOT(flightrec_check()));
+  }
+  timer_flightrec->start();
+  if (!timer_metrics)
+  {
+    timer_metrics = new QTimer(this);
+    timer_metrics->setInterval(METRICS_UPDATE_INTERVAL);
+    connect(timer_metrics, SIGNAL(timeout()), this, SLOT(metrics_timeout()));
+  }
+  t_metrics_tick.invalidate();
+  timer_metrics->start();
   emit server_started();
 }
 
@@ -164,10 +201,112 @@ void MgrServer::stop()
     prc_log(LOG_LOW, QString("MgrServer on %1:%2 stopped").arg(params.listen_interface.toString()).arg(params.listen_port));
   }
   tunnels_clear();
+  tunnels_pending_dispatch.clear();
+  mgrconn_pending_handover.clear();
   resetConnections();
+  workers_stop();
+  if (timer_flightrec)
+    timer_flightrec->stop();
+  if (timer_metrics)
+    timer_metrics->stop();
   emit server_stopped();
 }
 
+//---------------------------------------------------------------------------
+// parse private key and certificate chain once instead of reading files for every incoming mgrconn
+void MgrServer::ssl_config_load()
+{
+  QSslConfiguration conf = QSslConfiguration::defaultConfiguration();
+  conf.setPeerVerifyMode(QSslSocket::QueryPeer);
+  conf.setPrivateKey(loadSSLKeyFromFileCached(params.private_key_filename));
+  QList<QSslCertificate> certs = loadSSLCertChainFromFileCached(params.ssl_cert_filename);
+  if (!certs.isEmpty())
+  {
+#if QT_VERSION >= 0x050100
+    conf.setLocalCertificateChain(certs);
+#else
+    conf.setLocalCertificate(certs.first());
+#endif
+  }
+  ssl_config = conf;
+
+  if (!ssl_files_watcher)
+  {
+    ssl_files_watcher = new QFileSystemWatcher(this);
+    connect(ssl_files_watcher, SIGNAL(fileChanged(QString)), this, SLOT(ssl_files_changed()));
+  }
+  if (!ssl_files_watcher->files().isEmpty())
+    ssl_files_watcher->removePaths(ssl_files_watcher->files());
+  // files replaced by rename are no longer watched, so paths are re-added on every reload
+  if (!params.private_key_filename.isEmpty() && QFile::exists(params.private_key_filename))
+    ssl_files_watcher->addPath(params.private_key_filename);
+  if (!params.ssl_cert_filename.isEmpty() && QFile::exists(params.ssl_cert_filename))
+    ssl_files_watcher->addPath(params.ssl_cert_filename);
+}
+
+//---------------------------------------------------------------------------
+void MgrServer::ssl_files_changed()
+{
+  prc_log(LOG_DBG1, QString("MgrServer private key/certificate file changed - reloading"));
+  ssl_config_load();
+}
+
+//---------------------------------------------------------------------------
+// write flight recorders of all tunnels to flightrec-<tunnel_id>-<time>.bin files next to the log file
+void MgrServer::flightrec_check()
+{
+  if (!flag_dump_flightrec)
+    return;
+  flag_dump_flightrec = false;
+
+  QString dir = prc_log_filename.isEmpty() ? QDir::currentPath() : QFileInfo(prc_log_filename).path();
+  QString time_str = QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss");
+  for (int i=0; i < tunnels.count(); i++)
+  {
+    Tunnel *tunnel = tunnels[i];
+    QByteArray dump;
+    QMetaObject::invokeMethod(tunnel, "flightrecDump", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, dump));
+    QString filename = QString("%1/flightrec-%2-%3.bin").arg(dir).arg(tunnel->paramsCopy().id).arg(time_str);
+    QFile file(filename);
+    if (!file.open(QIODevice::WriteOnly) || file.write(dump) != dump.length())
+    {
+      prc_log(LOG_HIGH, QString("Failed to write flight recorder dump %1: %2").arg(filename).arg(file.errorString()));
+      continue;
+    }
+    prc_log(LOG_LOW, QString("Tunnel '%1': flight recorder dumped to %2").arg(tunnel->paramsCopy().name).arg(filename));
+  }
+}
+
+//---------------------------------------------------------------------------
+void MgrServer::workers_start()
+{
+  for (quint32 i=workers.count(); i < params.worker_threads; i++)
+  {
+    QThread *worker = new QThread;
+    worker->setObjectName(QString("TunnelWorker%1").arg(i+1));
+    worker->start();
+    workers.append(worker);
+  }
+  if (!workers.isEmpty())
+    prc_log(LOG_DBG2, QString("%1 tunnel worker threads started").arg(workers.count()));
+}
+
+//---------------------------------------------------------------------------
+void MgrServer::workers_stop()
+{
+  if (workers.isEmpty())
+    return;
+  // objects scheduled for deletion in worker threads are deleted when their event loops quit
+  while (!workers.isEmpty())
+  {
+    QThread *worker = workers.takeLast();
+    worker->quit();
+    worker->wait();
+    delete worker;
+  }
+  prc_log(LOG_DBG2, QString("tunnel worker threads stopped"));
+}
+
 //---------------------------------------------------------------------------
 void MgrServer::quit()
 {
@@ -183,6 +322,12 @@ void MgrServer::socket_finished()
   if (!socket)
     return;
   tunnel_owner_mgrconn_removed(socket);
+  QMutableHashIterator<quint32, MgrClientConnection *> it_auth(auth_pending);
+  while (it_auth.hasNext())
+  {
+    if (it_auth.next().value() == socket)
+      it_auth.remove();
+  }
   mgrconn_list_in.removeOne(socket);
   delete mgrconn_state_list_in.take(socket);
   socket->deleteLater();
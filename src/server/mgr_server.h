@@ -11,6 +11,14 @@
 
 #include <QThread>
 #include <QTcpServer>
+#include <QMutex>
+#include <QSslConfiguration>
+#include <QFileSystemWatcher>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMultiHash>
+#include <QTimer>
+#include <QElapsedTimer>
 #include "../lib/mgrclient-conn.h"
 #include "../lib/mgrserver-parameters.h"
 #include <QtGlobal>
@@ -20,9 +28,56 @@
 #define SERVER_MAJOR_VERSION     0
 #define SERVER_MINOR_VERSION     1
 
+#define METRICS_UPDATE_INTERVAL           1000      // tunnels publish their counters for /metrics and history this often
+#define METRICS_CACHE_TIME                1000      // /metrics reply is reused for this long
+
+// incoming mgrconn waiting to be handed over to the worker thread of its tunnel
+struct MgrConnHandover
+{
+  MgrClientConnection *socket;
+  Tunnel *tunnel;
+  quint8 stripe_index;                // 0 - main mgrconn_in of the restored tunnel
+  TunnelParameters tun_params;        // new parameters of the restored tunnel
+
+  MgrConnHandover()
+  {
+    socket = NULL;
+    tunnel = NULL;
+    stripe_index = 0;
+  }
+};
+
+// throttling of tunnel state notifications (TunnelParameters::max_state_dispatch_frequency),
+// kept by MgrServer since the tunnel itself may run in a worker thread
+struct MgrTunnelStateDispatch
+{
+  QTime t_last_sent;
+  bool queued;                        // notification is postponed till tunnels_state_dispatch_queued()
+
+  MgrTunnelStateDispatch()
+  {
+    queued = false;
+  }
+};
+
+class MgrServer;
+
+// verifies passwords of users matching auth request in MgrServer::auth_pool thread
+class MgrAuthJob: public QRunnable
+{
+public:
+  MgrServer *server;
+  quint32 auth_id;
+  QString password;                   // password received from client
+  QList<quint32> user_ids;            // candidate users in params.users order
+  QStringList user_passwords;         // their stored passwords (empty - no password required)
+
+  void run();
+};
+
 // we need to create some QObject-derived class in order to exchange signals/slots between main and server threads
 // this way MgrServer's slots will be executed in MgrServerThread thread
-class MgrServer: public QTcpServer
+class MgrServer: public QTcpServer, public MgrPacketHandler
 {
   Q_OBJECT
 public:
@@ -30,21 +85,53 @@ public:
   QHash<MgrClientConnection *, MgrClientState *> mgrconn_state_list_in;
   QHash<quint32, User *> hash_users;
   QHash<quint32, UserGroup *> hash_user_groups;
+  QMultiHash<QString, int> hash_users_by_name;        // params.users indexes of users with password
+  QMultiHash<QByteArray, int> hash_users_by_cert;     // params.users indexes of users with certificate (by SHA-1 digest)
+  QHash<quint32, TunnelRuleMatcher> hash_tunnel_rule_matchers;   // compiled tunnel_allow_list by user group id
 
   TunnelId unique_tunnel_id;
 
   QList<Tunnel *> tunnels;
   QHash<quint32, Tunnel *> hash_tunnels;
   QHash<MgrClientConnection *, Tunnel *> hash_tunnel_mgconn_in;
+  QHash<TunnelId, MgrTunnelStateDispatch> hash_tunnel_state_dispatch;
+
+  QList<QThread *> workers;                       // worker threads running tunnels (params.worker_threads)
+  QList<Tunnel *> tunnels_pending_dispatch;       // new tunnels waiting to be moved to worker threads
+  QList<MgrConnHandover> mgrconn_pending_handover;
 
   MgrServerParameters params;
 
+  QSslConfiguration ssl_config;                   // applied to every incoming mgrconn
+  QFileSystemWatcher *ssl_files_watcher;          // reloads ssl_config when key/certificate files change
+
+  QThreadPool auth_pool;                          // password verification (MgrAuthJob)
+  QHash<quint32, MgrClientConnection *> auth_pending;
+  quint32 auth_seq;
+
+  QTimer *timer_flightrec;                        // checks flag_dump_flightrec (set by SIGUSR1)
+
+  QTimer *timer_metrics;                          // Tunnel::metrics_update() and event loop lag
+  QElapsedTimer t_metrics_tick;
+  qint64 event_loop_lag_ms;
+  qint64 event_loop_lag_max_ms;
+  QByteArray metrics_cache;                       // last /metrics reply
+  QElapsedTimer t_metrics_cache;
+  QByteArray metrics_print();
+
   MgrServer(QObject *parent=NULL): QTcpServer(parent)
   {
     unique_tunnel_id = 1;
+    ssl_files_watcher = NULL;
+    auth_seq = 0;
+    timer_flightrec = NULL;
+    timer_metrics = NULL;
+    event_loop_lag_ms = 0;
+    event_loop_lag_max_ms = 0;
   }
   ~MgrServer()
   {
+    auth_pool.waitForDone();
     resetConnections();
   }
 
@@ -65,9 +152,10 @@ public:
     if (!userGroup)
       return false;
 
-    return tunnel->params.owner_user_id == user->id ||
+    TunnelParameters tun_params = tunnel->paramsCopy();
+    return tun_params.owner_user_id == user->id ||
            (userGroup->access_flags & UserGroup::AF_TUNNEL_SUPER_ADMIN) ||
-          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tunnel->params.owner_group_id == userGroup->id);
+          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tun_params.owner_group_id == userGroup->id);
   }
 
   bool isTunnelConfigChangeAllowed(Tunnel *tunnel, MgrClientConnection *mgrconn)
@@ -83,9 +171,10 @@ public:
     if (!userGroup)
       return false;
 
-    return tunnel->params.owner_user_id == user->id ||
+    TunnelParameters tun_params = tunnel->paramsCopy();
+    return tun_params.owner_user_id == user->id ||
            (userGroup->access_flags & UserGroup::AF_TUNNEL_SUPER_ADMIN) ||
-          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tunnel->params.owner_group_id == userGroup->id);
+          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tun_params.owner_group_id == userGroup->id);
   }
 
   bool isTunnelControlAllowed(Tunnel *tunnel, MgrClientConnection *mgrconn)
@@ -101,9 +190,10 @@ public:
     if (!userGroup)
       return false;
 
-    return tunnel->params.owner_user_id == user->id ||
+    TunnelParameters tun_params = tunnel->paramsCopy();
+    return tun_params.owner_user_id == user->id ||
            (userGroup->access_flags & UserGroup::AF_TUNNEL_SUPER_ADMIN) ||
-          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tunnel->params.owner_group_id == userGroup->id);
+          ((userGroup->access_flags & UserGroup::AF_TUNNEL_GROUP_ADMIN) && tun_params.owner_group_id == userGroup->id);
   }
 
   bool isTunnelViewAllowed(Tunnel *tunnel, MgrClientConnection *mgrconn)
@@ -111,6 +201,17 @@ public:
     return isTunnelViewAllowed(tunnel, userById(mgrconn_state_list_in[mgrconn]->user_id));
   }
 
+  // used by tunnels running in worker threads
+  QString privateKeyFilename() const
+  {
+    QMutexLocker locker(&params_mutex);
+    return params.private_key_filename;
+  }
+  QString sslCertFilename() const
+  {
+    QMutexLocker locker(&params_mutex);
+    return params.ssl_cert_filename;
+  }
 
 public slots:
   void start();
@@ -121,10 +222,16 @@ private slots:
   void gui_config_set(cJSON *json);
   void socket_finished();
   void socket_parseInitBuffer();
-  void packetReceived(MgrPacketCmd cmd, const QByteArray &data);
 
-  void tunnel_stopped();
-  void tunnel_state_changed();
+  void tunnel_remove_requested(TunnelId tunnel_id);
+  void tunnel_state_changed(TunnelId tunnel_id);
+  void tunnels_state_dispatch_queued();
+  void tunnels_config_save();
+  void tunnels_dispatch();
+  void ssl_files_changed();
+  void authJobFinished(quint32 auth_id, quint32 user_id);
+  void flightrec_check();
+  void metrics_timeout();
 
 signals:
   void listenError(QAbstractSocket::SocketError error, const QString &errorString);
@@ -133,12 +240,17 @@ signals:
   void server_stopped();
 
 private:
+  void mgrPacketReceived(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &data);
   void authReqPacketReceived(MgrClientConnection *socket, const QByteArray &data);
+  void authReply(MgrClientConnection *socket, quint8 auth_result, quint32 user_id=0);
+  bool usersPasswordsHash(MgrServerParameters *server_params);
+  void ssl_config_load();
   void config_get(MgrClientConnection *socket);
   void config_set(MgrClientConnection *socket, const QByteArray &data);
 
   void send_tunnel_config(MgrClientConnection *socket, Tunnel *tunnel);
   void send_tunnel_state(MgrClientConnection *socket, Tunnel *tunnel, bool include_stat=true);
+  void tunnel_state_dispatch(Tunnel *tunnel, TunnelId tunnel_id);
   void send_tunnel_connstate(MgrClientConnection *socket, Tunnel *tunnel, bool include_disconnected=false);
   void cmd_tunnel_create(MgrClientConnection *socket, const QByteArray &data);
   void cmd_tunnel_config_get(MgrClientConnection *socket);
@@ -148,6 +260,11 @@ private:
   void cmd_tun_remove(MgrClientConnection *socket, const QByteArray &data);
   void cmd_tun_state_get(MgrClientConnection *socket, const QByteArray &data);
   void cmd_tun_connstate_get(MgrClientConnection *socket, const QByteArray &data);
+  void cmd_tun_stripe_attach(MgrClientConnection *socket, const QByteArray &data);
+  void cmd_tun_flightrec_get(MgrClientConnection *socket, const QByteArray &data);
+  void cmd_tun_latency_get(MgrClientConnection *socket, const QByteArray &data);
+  void cmd_tun_history_get(MgrClientConnection *socket, const QByteArray &data);
+  void cmd_tun_stages_get(MgrClientConnection *socket, const QByteArray &data);
   void tunnel_owner_mgrconn_removed(MgrClientConnection *socket);
   void tunnel_add(Tunnel *tunnel);
   void tunnel_remove(Tunnel *tunnel);
@@ -155,11 +272,23 @@ private:
   void tunnels_start();
   void tunnels_stop();
   void tunnels_clear();
+  void tunnel_adopt_mgrconn(Tunnel *tunnel, MgrClientConnection *socket);
+  QThread *tunnel_worker() const;
+  void workers_start();
+  void workers_stop();
   void cmd_tun(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &req_data);
 
+  // tunnels running in worker threads are called with blocking queued connection
+  Qt::ConnectionType tunnelCallType(Tunnel *tunnel) const
+  {
+    return tunnel->thread() == QThread::currentThread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+  }
+
   UserGroup *userGroupById(quint32 group_id) const;
   User *userById(quint32 user_id) const;
 
+  mutable QMutex params_mutex;                    // protects params read by worker threads
+
 protected:
 #if QT_VERSION >= 0x050000
   void incomingConnection(qintptr socketDescriptor);
@@ -201,6 +330,8 @@ extern bool mgr_server_params_modified_on_server_while_editing;
 
 bool config_check(MgrServerParameters *old_params, MgrServerParameters *new_params, quint16 &res_code, QString &config_error);
 
-void send_standart_reply(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &obj_id, quint16 res_code, const QString &error_str);
+// reply_data (if any) follows error string
+void send_standart_reply(MgrClientConnection *socket, MgrPacketCmd cmd, const QByteArray &obj_id, quint16 res_code, const QString &error_str,
+                         const QByteArray &reply_data=QByteArray());
 
 #endif // MGR_SERVER_H
@@ -9,6 +9,9 @@
 #include "mgr_server.h"
 #include "../lib/prc_log.h"
 #include "../lib/sys_util.h"
+#include "../lib/ssl_helper.h"
+#include <QCryptographicHash>
+#include <QtAlgorithms>
 
 //---------------------------------------------------------------------------
 void MgrServer::authReqPacketReceived(MgrClientConnection *socket, const QByteArray &req_data)
@@ -34,35 +37,107 @@ void MgrServer::authReqPacketReceived(MgrClientConnection *socket, const QByteAr
   socket->params.auth_username = QString::fromUtf8(req_data.mid(sizeof(MgrPacket_AuthReq)+req->hostname_len,req->username_len));
   socket->params.auth_password = QString::fromUtf8(req_data.mid(sizeof(MgrPacket_AuthReq)+req->hostname_len+req->username_len,req->password_len));
 
-  MgrPacket_AuthRep rep;
-  rep.server_hostname_len = SysUtil::machine_name.toUtf8().length();
   if (req->protocol_version > MGR_PACKET_VERSION)
-    rep.auth_result = MgrPacket_AuthRep::RES_CODE_UNSUPPORTED_PROTOCOL_VERSION;
-  else
   {
-    rep.auth_result = MgrPacket_AuthRep::RES_CODE_AUTH_FAILED;
+    authReply(socket, MgrPacket_AuthRep::RES_CODE_UNSUPPORTED_PROTOCOL_VERSION);
+    return;
+  }
+
+  // users which may match: by name (password users) and by peer certificate (certificate users)
+  QList<int> user_indexes = hash_users_by_name.values(socket->params.auth_username);
+  QSslCertificate peer_cert = socket->peerCertificate();
+  if (!peer_cert.isNull())
+    user_indexes += hash_users_by_cert.values(peer_cert.digest(QCryptographicHash::Sha1));
+  qSort(user_indexes);
+
+  MgrAuthJob *job = new MgrAuthJob;
+  job->server = this;
+  job->password = socket->params.auth_password;
+  for (int k=0; k < user_indexes.count(); k++)
+  {
+    if (k > 0 && user_indexes[k] == user_indexes[k-1])
+      continue;
+    const User &user = params.users[user_indexes[k]];
+    if (!user.enabled || (user.cert.isNull() && user.password.isEmpty()) ||
+        (!user.cert.isNull() && user.cert != peer_cert) ||
+        (!user.password.isEmpty() && user.name != socket->params.auth_username) ||
+        !userGroupById(user.group_id))
+      continue;
+    // certificate-only user ahead of all password users - no need to verify passwords
+    if (user.password.isEmpty() && job->user_ids.isEmpty())
+    {
+      delete job;
+      authReply(socket, MgrPacket_AuthRep::RES_CODE_OK, user.id);
+      return;
+    }
+    job->user_ids.append(user.id);
+    job->user_passwords.append(user.password);
+  }
+  if (job->user_ids.isEmpty())
+  {
+    delete job;
+    authReply(socket, MgrPacket_AuthRep::RES_CODE_AUTH_FAILED);
+    return;
+  }
+
+  // password hashing is slow by design, so keep it away from mgrconn/tunnel processing
+  job->auth_id = ++auth_seq;
+  auth_pending.insert(job->auth_id, socket);
+  auth_pool.start(job);
+}
+
+//---------------------------------------------------------------------------
+void MgrAuthJob::run()
+{
+  quint32 user_id = 0;
+  for (int i=0; i < user_ids.count(); i++)
+  {
+    if (user_passwords[i].isEmpty() || passwordVerify(password, user_passwords[i]))
+    {
+      user_id = user_ids[i];
+      break;
+    }
+  }
+  QMetaObject::invokeMethod(server, "authJobFinished", Qt::QueuedConnection,
+                            Q_ARG(quint32, auth_id), Q_ARG(quint32, user_id));
+}
+
+//---------------------------------------------------------------------------
+void MgrServer::authJobFinished(quint32 auth_id, quint32 user_id)
+{
+  // connection may be already closed
+  MgrClientConnection *socket = auth_pending.take(auth_id);
+  if (!socket)
+    return;
+  authReply(socket, user_id ? MgrPacket_AuthRep::RES_CODE_OK : MgrPacket_AuthRep::RES_CODE_AUTH_FAILED, user_id);
+}
 
-    for (int i=0; i < params.users.count(); i++)
+//---------------------------------------------------------------------------
+void MgrServer::authReply(MgrClientConnection *socket, quint8 auth_result, quint32 user_id)
+{
+  MgrPacket_AuthRep rep;
+  rep.server_hostname_len = SysUtil::machine_name.toUtf8().length();
+  rep.auth_result = auth_result;
+  if (auth_result == MgrPacket_AuthRep::RES_CODE_OK)
+  {
+    // user could be removed from config while its password was checked
+    User *user = userById(user_id);
+    UserGroup *user_group = user ? userGroupById(user->group_id) : NULL;
+    if (!user_group)
+      rep.auth_result = MgrPacket_AuthRep::RES_CODE_AUTH_FAILED;
+    else
     {
-      if (params.users[i].enabled && (!params.users[i].cert.isNull() || !params.users[i].password.isEmpty()) &&
-          ((params.users[i].cert.isNull() || params.users[i].cert == socket->peerCertificate()) &&
-           (params.users[i].password.isEmpty() || (params.users[i].password == socket->params.auth_password && params.users[i].name == socket->params.auth_username))))
-      {
-        UserGroup *user_group = userGroupById(params.users[i].group_id);
-        if (!user_group)
-          continue;
-        rep.auth_result = MgrPacket_AuthRep::RES_CODE_OK;
-        rep.access_flags = user_group->access_flags;
-        socket->params.auth_username = params.users[i].name;
-        mgrconn_state_list_in[socket]->user_id = params.users[i].id;
-        break;
-      }
+      rep.access_flags = user_group->access_flags;
+      socket->params.auth_username = user->name;
+      mgrconn_state_list_in[socket]->user_id = user->id;
     }
   }
 
   QByteArray rep_data((const char *)&rep, sizeof(MgrPacket_AuthRep));
   if (SysUtil::machine_name.length() > 0)
     rep_data.append(SysUtil::machine_name.toUtf8());
+  quint32 features = MGR_FEATURES;
+  rep_data.append((const char *)&features, sizeof(quint32));
 
   socket->sendPacket(CMD_AUTH_REP, rep_data);
   if (rep.auth_result != MgrPacket_AuthRep::RES_CODE_OK)
@@ -77,16 +152,50 @@ void MgrServer::authReqPacketReceived(MgrClientConnection *socket, const QByteAr
   }
 }
 
+//---------------------------------------------------------------------------
+// replace plain-text passwords with salted hashes, returns true if any password was replaced
+bool MgrServer::usersPasswordsHash(MgrServerParameters *server_params)
+{
+  bool replaced = false;
+  for (int i=0; i < server_params->users.count(); i++)
+  {
+    QString &password = server_params->users[i].password;
+    if (password.isEmpty() || isPasswordHash(password) ||
+        password == QString(USER_PASSWORD_SPECIAL_CLEAR) || password == QString(USER_PASSWORD_SPECIAL_SECRET))
+      continue;
+    QString hash = passwordHash(password);
+    if (hash.isEmpty())
+      continue;
+    password = hash;
+    replaced = true;
+  }
+  return replaced;
+}
+
 //---------------------------------------------------------------------------
 void MgrServer::initUserGroups()
 {
   hash_user_groups.clear();
+  hash_tunnel_rule_matchers.clear();
   for (int i=0; i < params.user_groups.count(); i++)
+  {
     hash_user_groups.insert(params.user_groups[i].id, &params.user_groups[i]);
+    hash_tunnel_rule_matchers.insert(params.user_groups[i].id, TunnelRuleMatcher(params.user_groups[i].tunnel_allow_list));
+  }
 
   hash_users.clear();
   for (int i=0; i < params.users.count(); i++)
     hash_users.insert(params.users[i].id, &params.users[i]);
+
+  hash_users_by_name.clear();
+  hash_users_by_cert.clear();
+  for (int i=0; i < params.users.count(); i++)
+  {
+    if (!params.users[i].password.isEmpty())
+      hash_users_by_name.insert(params.users[i].name, i);
+    else if (!params.users[i].cert.isNull())
+      hash_users_by_cert.insert(params.users[i].cert.digest(QCryptographicHash::Sha1), i);
+  }
 }
 
 //---------------------------------------------------------------------------
@@ -80,6 +80,13 @@ bool MgrServer::config_load()
   config_load_tunnels(j_config);
 
   cJSON_Delete(j_config);
+
+  // config of older version may have plain-text passwords
+  if (usersPasswordsHash(&params))
+  {
+    prc_log(LOG_DBG1, QString("Replacing plain-text user passwords with hashes in config file %1").arg(qmtunnel_config_filepath));
+    config_save(&params);
+  }
   return true;
 }
 
@@ -176,6 +183,7 @@ void MgrServer::gui_config_set(cJSON *json)
     }
   }
   cJSON_Delete(json);
+  usersPasswordsHash(&new_params);
   if (new_params.listen_interface != params.listen_interface ||
       new_params.listen_port != params.listen_port ||
       new_params.ssl_cert_filename != params.ssl_cert_filename ||
@@ -186,7 +194,9 @@ void MgrServer::gui_config_set(cJSON *json)
     if (!config_save(&new_params))
       return;
     stop();
+    params_mutex.lock();
     params = new_params;
+    params_mutex.unlock();
     start();
   }
   else
@@ -194,8 +204,13 @@ void MgrServer::gui_config_set(cJSON *json)
     new_params.config_version = ++params.config_version;
     if (!config_save(&new_params))
       return;
+    params_mutex.lock();
     params = new_params;
+    params_mutex.unlock();
     initUserGroups();
+    stage_timing_enabled.fetchAndStoreOrdered((params.flags & MgrServerParameters::FL_STAGE_TIMING) ? 1 : 0);
+    memory_governor.setMaxBytes(params.max_buffer_memory);
+    IoUringBackend::configure(params.flags & MgrServerParameters::FL_IO_URING);
     // send configuration to subscribed clients
     QHashIterator<MgrClientConnection *, MgrClientState *> iterator(mgrconn_state_list_in);
     while (iterator.hasNext())
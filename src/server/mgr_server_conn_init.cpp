@@ -52,6 +52,26 @@ void http_error(MgrClientConnection *conn, int http_code, const char *http_error
   conn->disconnectFromHost();
 }
 
+//---------------------------------------------------------------------------
+void http_reply(MgrClientConnection *conn, const char *content_type, const QByteArray &body)
+{
+  char current_time[50];
+  time_t t = time(NULL);
+  strftime(current_time, sizeof(current_time), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+
+  conn->log(LOG_DBG2, QString(": HTTP 200 OK (%1 bytes)").arg(body.length()));
+  conn->write(QString("HTTP/1.1 200 OK\r\n"
+                      "Server: %1\r\n"
+                      "Date: %2\r\n"
+                      "Content-Type: %3\r\n"
+                      "Content-Length: %4\r\n"
+                      "Connection: close\r\n"
+                      "\r\n").arg(QString::fromUtf8(http_server_name))
+                             .arg(QString::fromUtf8(current_time))
+                             .arg(QString::fromUtf8(content_type))
+                             .arg(body.length()).toUtf8()+body);
+  conn->disconnectFromHost();
+}
 
 //---------------------------------------------------------------------------
 #if QT_VERSION >= 0x050000
@@ -65,12 +85,11 @@ void MgrServer::incomingConnection(int socketDescriptor)
   connect(socket, SIGNAL(socket_finished()), this, SLOT(socket_finished()));
   if (params.flags & MgrServerParameters::FL_ENABLE_HTTP)
     connect(socket, SIGNAL(init_inputParsing()), this, SLOT(socket_parseInitBuffer()));
-  connect(socket, SIGNAL(packetReceived(MgrPacketCmd,QByteArray)), this, SLOT(packetReceived(MgrPacketCmd,QByteArray)));
+  socket->setPacketHandler(this);
   mgrconn_list_in.append(socket);
   MgrClientState *socket_state = new MgrClientState;
   mgrconn_state_list_in.insert(socket, socket_state);
-  socket->setPrivateKey(params.private_key_filename);
-  socket->setLocalCertificate(params.ssl_cert_filename);
+  socket->setSslConfiguration(ssl_config);
   socket->params.name.clear();
   socket->params.host = socket->peerAddress().toString();
   socket->params.port = socket->peerPort();
@@ -151,17 +170,17 @@ void MgrServer::socket_parseInitBuffer()
       http_error(socket, 505, "HTTP Version Not Supported");
       return;
     }
-/*
     QUrl http_uri = http_req_line_rx.cap(2);
-    if (http_method == QString("GET") && http_uri == QUrl("/test"))
+    if (http_method == QString("GET") && http_uri.path() == QString("/metrics"))
     {
+      http_reply(socket, "text/plain; version=0.0.4", metrics_print());
+      return;
     }
     else
     {
-    */
       http_error(socket, 404, "Not Found");
       return;
-//    }
+    }
 
     pos_header_end = socket->input_buffer.indexOf("\r\n\r\n");
   }
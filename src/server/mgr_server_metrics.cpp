@@ -0,0 +1,261 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include "mgr_server.h"
+#include "../lib/prc_log.h"
+#include "../lib/buffer-pool.h"
+
+enum
+{
+  MT_UP=0
+ ,MT_CHAIN_OK
+ ,MT_LATENCY
+ ,MT_BYTES_RCV
+ ,MT_BYTES_SND
+ ,MT_BYTES_SND_ENCRYPTED
+ ,MT_DATA_BYTES_RCV
+ ,MT_DATA_BYTES_SND
+ ,MT_CONN_TOTAL
+ ,MT_CONN_CUR
+ ,MT_CONN_FAILED
+ ,MT_CHAIN_ERRORS
+ ,MT_BUFFERED_PACKETS
+ ,MT_BUFFERED_BYTES
+ ,MT_REORDER_PACKETS
+ ,MT_MGRCONN_IN_PENDING
+ ,MT_MGRCONN_OUT_PENDING
+ ,MT_IN_CONNS
+ ,MT_OUT_CONNS
+ ,MT_UDP_CONNS
+ ,MT_COMPRESS_IN
+ ,MT_COMPRESS_OUT
+ ,MT_COMPRESS_RATIO
+ ,MT_STAGE_SECONDS
+ ,MT_STAGE_CALLS
+ ,MT_MEMORY_BYTES
+ ,MT_MEMORY_THROTTLED
+ ,MT_BUFFER_RETAINED
+ ,MT_BUFFER_TRIMMED
+ ,MT_COUNT
+};
+
+struct MetricFamily
+{
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+static const MetricFamily tunnel_metric_families[MT_COUNT] =
+{
+  {"qmtunnel_tunnel_up", "gauge", "Tunnel is started"}
+ ,{"qmtunnel_tunnel_chain_ok", "gauge", "Tunnel chain is established"}
+ ,{"qmtunnel_tunnel_chain_latency_seconds", "gauge", "Tunnel chain latency"}
+ ,{"qmtunnel_tunnel_bytes_received_total", "counter", "Total bytes received by tunnel mgrconns"}
+ ,{"qmtunnel_tunnel_bytes_sent_total", "counter", "Total bytes sent by tunnel mgrconns"}
+ ,{"qmtunnel_tunnel_encrypted_bytes_sent_total", "counter", "Total encrypted bytes sent by tunnel mgrconns"}
+ ,{"qmtunnel_tunnel_data_bytes_received_total", "counter", "Total application data bytes received"}
+ ,{"qmtunnel_tunnel_data_bytes_sent_total", "counter", "Total application data bytes sent"}
+ ,{"qmtunnel_tunnel_connections_total", "counter", "Total incoming tunnel connections"}
+ ,{"qmtunnel_tunnel_connections", "gauge", "Current incoming tunnel connections"}
+ ,{"qmtunnel_tunnel_connections_failed_total", "counter", "Failed outgoing tunnel connections"}
+ ,{"qmtunnel_tunnel_chain_errors_total", "counter", "Tunnel chain disconnections/errors"}
+ ,{"qmtunnel_tunnel_retransmit_buffer_packets", "gauge", "Sent data packets waiting for acknowledgement"}
+ ,{"qmtunnel_tunnel_retransmit_buffer_bytes", "gauge", "Bytes of sent data packets waiting for acknowledgement"}
+ ,{"qmtunnel_tunnel_reorder_buffer_packets", "gauge", "Data packets received ahead of time through stripes"}
+ ,{"qmtunnel_tunnel_mgrconn_in_queue_bytes", "gauge", "Bytes queued for sending to previous tunserver in chain"}
+ ,{"qmtunnel_tunnel_mgrconn_out_queue_bytes", "gauge", "Bytes queued for sending to next tunserver in chain"}
+ ,{"qmtunnel_tunnel_in_connections", "gauge", "Open incoming application connections"}
+ ,{"qmtunnel_tunnel_out_connections", "gauge", "Open outgoing application connections"}
+ ,{"qmtunnel_tunnel_udp_connections", "gauge", "Open UDP pseudo-connections"}
+ ,{"qmtunnel_tunnel_compression_input_bytes_total", "counter", "Bytes compression was tried for"}
+ ,{"qmtunnel_tunnel_compression_output_bytes_total", "counter", "Bytes sent for the same data after compression"}
+ ,{"qmtunnel_tunnel_compression_ratio", "gauge", "Compression output/input bytes ratio"}
+ ,{"qmtunnel_tunnel_stage_seconds_total", "counter", "Time spent in data path stage (stages may nest)"}
+ ,{"qmtunnel_tunnel_stage_calls_total", "counter", "Data path stage calls"}
+ ,{"qmtunnel_tunnel_memory_bytes", "gauge", "Tunnel buffer bytes charged to server memory budget"}
+ ,{"qmtunnel_tunnel_memory_throttled", "gauge", "Tunnel is throttled (1) or being evicted (2) by memory governor"}
+ ,{"qmtunnel_tunnel_buffer_retained_bytes", "gauge", "Capacity of tunnel connection buffers after last idle trim pass"}
+ ,{"qmtunnel_tunnel_buffer_trimmed_bytes_total", "counter", "Connection buffer capacity released by idle trim passes"}
+};
+
+//---------------------------------------------------------------------------
+static QByteArray metrics_label_value(const QString &value)
+{
+  QByteArray result = value.toUtf8();
+  result.replace('\\', "\\\\");
+  result.replace('"', "\\\"");
+  result.replace('\n', "\\n");
+  return result;
+}
+
+//---------------------------------------------------------------------------
+static void metrics_family(QByteArray &buffer, const char *name, const char *type, const char *help)
+{
+  buffer.append("# HELP ").append(name).append(' ').append(help).append('\n');
+  buffer.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+//---------------------------------------------------------------------------
+static void metrics_sample(QByteArray &buffer, const char *name, const QByteArray &labels, const QByteArray &value)
+{
+  buffer.append(name).append(labels).append(' ').append(value).append('\n');
+}
+
+//---------------------------------------------------------------------------
+// measures MgrServer event loop lag and asks tunnels to publish fresh counters
+void MgrServer::metrics_timeout()
+{
+  if (t_metrics_tick.isValid())
+  {
+    event_loop_lag_ms = qMax((qint64)0, t_metrics_tick.restart()-METRICS_UPDATE_INTERVAL);
+    if (event_loop_lag_ms > event_loop_lag_max_ms)
+      event_loop_lag_max_ms = event_loop_lag_ms;
+  }
+  else
+    t_metrics_tick.start();
+
+  for (int i=0; i < tunnels.count(); i++)
+    QMetaObject::invokeMethod(tunnels[i], "metrics_update", Qt::QueuedConnection);
+  memory_governor.rebalance();
+}
+
+//---------------------------------------------------------------------------
+// Prometheus text exposition format, built from tunnels' cached TunnelMetrics only
+QByteArray MgrServer::metrics_print()
+{
+  if (!metrics_cache.isEmpty() && t_metrics_cache.isValid() && t_metrics_cache.elapsed() < METRICS_CACHE_TIME)
+    return metrics_cache;
+
+  QByteArray families[MT_COUNT];
+  for (int i=0; i < tunnels.count(); i++)
+  {
+    TunnelMetrics m = tunnels[i]->metricsCopy();
+    if (m.id == 0)
+      continue;                       // not published yet
+    QByteArray labels = "{tunnel_id=\"" + QByteArray::number(m.id) + "\",tunnel=\"" + metrics_label_value(m.name) + "\"}";
+    metrics_sample(families[MT_UP], tunnel_metric_families[MT_UP].name, labels, (m.flags & TunnelState::TF_STARTED) ? "1" : "0");
+    metrics_sample(families[MT_CHAIN_OK], tunnel_metric_families[MT_CHAIN_OK].name, labels, (m.flags & TunnelState::TF_CHAIN_OK) ? "1" : "0");
+    if (m.latency_ms >= 0)
+      metrics_sample(families[MT_LATENCY], tunnel_metric_families[MT_LATENCY].name, labels, QByteArray::number(m.latency_ms/1000.0, 'g', 6));
+    metrics_sample(families[MT_BYTES_RCV], tunnel_metric_families[MT_BYTES_RCV].name, labels, QByteArray::number(m.stats.bytes_rcv));
+    metrics_sample(families[MT_BYTES_SND], tunnel_metric_families[MT_BYTES_SND].name, labels, QByteArray::number(m.stats.bytes_snd));
+    metrics_sample(families[MT_BYTES_SND_ENCRYPTED], tunnel_metric_families[MT_BYTES_SND_ENCRYPTED].name, labels, QByteArray::number(m.stats.bytes_snd_encrypted));
+    metrics_sample(families[MT_DATA_BYTES_RCV], tunnel_metric_families[MT_DATA_BYTES_RCV].name, labels, QByteArray::number(m.stats.data_bytes_rcv));
+    metrics_sample(families[MT_DATA_BYTES_SND], tunnel_metric_families[MT_DATA_BYTES_SND].name, labels, QByteArray::number(m.stats.data_bytes_snd));
+    metrics_sample(families[MT_CONN_TOTAL], tunnel_metric_families[MT_CONN_TOTAL].name, labels, QByteArray::number(m.stats.conn_total_count));
+    metrics_sample(families[MT_CONN_CUR], tunnel_metric_families[MT_CONN_CUR].name, labels, QByteArray::number(m.stats.conn_cur_count));
+    metrics_sample(families[MT_CONN_FAILED], tunnel_metric_families[MT_CONN_FAILED].name, labels, QByteArray::number(m.stats.conn_failed_count));
+    metrics_sample(families[MT_CHAIN_ERRORS], tunnel_metric_families[MT_CHAIN_ERRORS].name, labels, QByteArray::number(m.stats.chain_error_count));
+    metrics_sample(families[MT_BUFFERED_PACKETS], tunnel_metric_families[MT_BUFFERED_PACKETS].name, labels, QByteArray::number(m.buffered_packets_count));
+    metrics_sample(families[MT_BUFFERED_BYTES], tunnel_metric_families[MT_BUFFERED_BYTES].name, labels, QByteArray::number(m.buffered_packets_len));
+    metrics_sample(families[MT_REORDER_PACKETS], tunnel_metric_families[MT_REORDER_PACKETS].name, labels, QByteArray::number(m.reorder_packets_count));
+    metrics_sample(families[MT_MGRCONN_IN_PENDING], tunnel_metric_families[MT_MGRCONN_IN_PENDING].name, labels, QByteArray::number(m.mgrconn_in_pending));
+    metrics_sample(families[MT_MGRCONN_OUT_PENDING], tunnel_metric_families[MT_MGRCONN_OUT_PENDING].name, labels, QByteArray::number(m.mgrconn_out_pending));
+    metrics_sample(families[MT_IN_CONNS], tunnel_metric_families[MT_IN_CONNS].name, labels, QByteArray::number(m.in_conn_count));
+    metrics_sample(families[MT_OUT_CONNS], tunnel_metric_families[MT_OUT_CONNS].name, labels, QByteArray::number(m.out_conn_count));
+    metrics_sample(families[MT_UDP_CONNS], tunnel_metric_families[MT_UDP_CONNS].name, labels, QByteArray::number(m.udp_conn_count));
+    metrics_sample(families[MT_COMPRESS_IN], tunnel_metric_families[MT_COMPRESS_IN].name, labels, QByteArray::number(m.compress_bytes_in));
+    metrics_sample(families[MT_COMPRESS_OUT], tunnel_metric_families[MT_COMPRESS_OUT].name, labels, QByteArray::number(m.compress_bytes_out));
+    if (m.compress_bytes_in > 0)
+      metrics_sample(families[MT_COMPRESS_RATIO], tunnel_metric_families[MT_COMPRESS_RATIO].name, labels, QByteArray::number((double)m.compress_bytes_out/m.compress_bytes_in, 'g', 6));
+    for (int stage=0; stage < STAGE_COUNT; stage++)
+    {
+      if (m.stages.calls[stage] == 0)
+        continue;
+      QByteArray stage_labels = labels;
+      stage_labels.insert(stage_labels.length()-1, QByteArray(",stage=\"")+StageCounters::stageName(stage)+"\"");
+      metrics_sample(families[MT_STAGE_SECONDS], tunnel_metric_families[MT_STAGE_SECONDS].name, stage_labels, QByteArray::number(m.stages.nsecs[stage]/1e9, 'g', 9));
+      metrics_sample(families[MT_STAGE_CALLS], tunnel_metric_families[MT_STAGE_CALLS].name, stage_labels, QByteArray::number(m.stages.calls[stage]));
+    }
+    metrics_sample(families[MT_MEMORY_BYTES], tunnel_metric_families[MT_MEMORY_BYTES].name, labels, QByteArray::number(m.memory_bytes));
+    metrics_sample(families[MT_MEMORY_THROTTLED], tunnel_metric_families[MT_MEMORY_THROTTLED].name, labels, QByteArray::number(m.memory_state));
+    metrics_sample(families[MT_BUFFER_RETAINED], tunnel_metric_families[MT_BUFFER_RETAINED].name, labels, QByteArray::number(m.buffer_retained_bytes));
+    metrics_sample(families[MT_BUFFER_TRIMMED], tunnel_metric_families[MT_BUFFER_TRIMMED].name, labels, QByteArray::number(m.buffer_trimmed_bytes));
+  }
+
+  QByteArray buffer;
+  metrics_family(buffer, "qmtunnel_tunnels", "gauge", "Configured tunnels");
+  metrics_sample(buffer, "qmtunnel_tunnels", QByteArray(), QByteArray::number(tunnels.count()));
+  metrics_family(buffer, "qmtunnel_mgrconn_incoming", "gauge", "Incoming management connections");
+  metrics_sample(buffer, "qmtunnel_mgrconn_incoming", QByteArray(), QByteArray::number(mgrconn_list_in.count()));
+  metrics_family(buffer, "qmtunnel_event_loop_lag_seconds", "gauge", "MgrServer event loop lag measured by 1s timer");
+  metrics_sample(buffer, "qmtunnel_event_loop_lag_seconds", QByteArray(), QByteArray::number(event_loop_lag_ms/1000.0, 'g', 6));
+  metrics_family(buffer, "qmtunnel_event_loop_lag_max_seconds", "gauge", "Maximum MgrServer event loop lag since start");
+  metrics_sample(buffer, "qmtunnel_event_loop_lag_max_seconds", QByteArray(), QByteArray::number(event_loop_lag_max_ms/1000.0, 'g', 6));
+
+  MemoryGovernorUsage memory_usage = memory_governor.usage();
+  if (memory_usage.max_bytes > 0)
+  {
+    metrics_family(buffer, "qmtunnel_memory_budget_bytes", "gauge", "Server-wide budget for tunnel buffers");
+    metrics_sample(buffer, "qmtunnel_memory_budget_bytes", QByteArray(), QByteArray::number(memory_usage.max_bytes));
+  }
+  metrics_family(buffer, "qmtunnel_memory_used_bytes", "gauge", "Tunnel buffer bytes charged to server memory budget");
+  metrics_sample(buffer, "qmtunnel_memory_used_bytes", QByteArray(), QByteArray::number(memory_usage.total_bytes));
+  metrics_family(buffer, "qmtunnel_memory_pressure", "gauge", "Memory governor level: 0 - ok, 1 - throttling, 2 - budget exhausted");
+  metrics_sample(buffer, "qmtunnel_memory_pressure", QByteArray(), QByteArray::number(memory_usage.level));
+  metrics_family(buffer, "qmtunnel_memory_user_bytes", "gauge", "Tunnel buffer bytes by tunnel owner");
+  QHashIterator<quint32, quint64> i_user(memory_usage.user_bytes);
+  while (i_user.hasNext())
+  {
+    i_user.next();
+    metrics_sample(buffer, "qmtunnel_memory_user_bytes", "{user_id=\"" + QByteArray::number(i_user.key()) + "\"}", QByteArray::number(i_user.value()));
+  }
+
+  BufferPoolStats pool_stats = BufferPool::stats();
+  QByteArray pool_families[4];
+  for (int i=0; i < BUFFER_POOL_CLASSES; i++)
+  {
+    QByteArray labels = "{size=\"" + QByteArray::number(BufferPool::classSize(i)) + "\"}";
+    metrics_sample(pool_families[0], "qmtunnel_buffer_pool_hits_total", labels, QByteArray::number(pool_stats.hits[i]));
+    metrics_sample(pool_families[1], "qmtunnel_buffer_pool_misses_total", labels, QByteArray::number(pool_stats.misses[i]));
+    metrics_sample(pool_families[2], "qmtunnel_buffer_pool_free_buffers", labels, QByteArray::number(pool_stats.free_count[i]));
+    metrics_sample(pool_families[3], "qmtunnel_buffer_pool_free_bytes", labels, QByteArray::number(pool_stats.free_bytes[i]));
+  }
+  metrics_family(buffer, "qmtunnel_buffer_pool_hits_total", "counter", "Packet buffers reused from thread-local pools");
+  buffer.append(pool_families[0]);
+  metrics_family(buffer, "qmtunnel_buffer_pool_misses_total", "counter", "Packet buffers allocated because pool was empty");
+  buffer.append(pool_families[1]);
+  metrics_family(buffer, "qmtunnel_buffer_pool_free_buffers", "gauge", "Packet buffers kept in pools");
+  buffer.append(pool_families[2]);
+  metrics_family(buffer, "qmtunnel_buffer_pool_free_bytes", "gauge", "Capacity of packet buffers kept in pools");
+  buffer.append(pool_families[3]);
+  metrics_family(buffer, "qmtunnel_buffer_pool_oversized_total", "counter", "Packet buffers bigger than the biggest pool size class");
+  metrics_sample(buffer, "qmtunnel_buffer_pool_oversized_total", QByteArray(), QByteArray::number(pool_stats.oversized));
+
+  quint64 ssl_session_hits, ssl_session_misses;
+  MgrClientConnection::sslSessionStats(ssl_session_hits, ssl_session_misses);
+  metrics_family(buffer, "qmtunnel_tls_sessions_resumed_total", "counter", "Outgoing mgrconn TLS handshakes that resumed a cached session");
+  metrics_sample(buffer, "qmtunnel_tls_sessions_resumed_total", QByteArray(), QByteArray::number(ssl_session_hits));
+  metrics_family(buffer, "qmtunnel_tls_full_handshakes_total", "counter", "Outgoing mgrconn TLS handshakes without session resumption");
+  metrics_sample(buffer, "qmtunnel_tls_full_handshakes_total", QByteArray(), QByteArray::number(ssl_session_misses));
+
+  if (io_uring_enabled)
+  {
+    IoUringStats uring_stats = IoUringBackend::stats();
+    metrics_family(buffer, "qmtunnel_io_uring_submit_calls_total", "counter", "io_uring submission syscalls");
+    metrics_sample(buffer, "qmtunnel_io_uring_submit_calls_total", QByteArray(), QByteArray::number(uring_stats.submit_calls));
+    metrics_family(buffer, "qmtunnel_io_uring_sqes_total", "counter", "Operations submitted to io_uring");
+    metrics_sample(buffer, "qmtunnel_io_uring_sqes_total", QByteArray(), QByteArray::number(uring_stats.sqe_count));
+    metrics_family(buffer, "qmtunnel_io_uring_cqes_total", "counter", "io_uring completions processed");
+    metrics_sample(buffer, "qmtunnel_io_uring_cqes_total", QByteArray(), QByteArray::number(uring_stats.cqe_count));
+    metrics_family(buffer, "qmtunnel_io_uring_buffers_exhausted_total", "counter", "Multishot receives restarted because all provided buffers were in use");
+    metrics_sample(buffer, "qmtunnel_io_uring_buffers_exhausted_total", QByteArray(), QByteArray::number(uring_stats.buffers_exhausted));
+  }
+  for (int i=0; i < MT_COUNT; i++)
+  {
+    if (families[i].isEmpty())
+      continue;
+    metrics_family(buffer, tunnel_metric_families[i].name, tunnel_metric_families[i].type, tunnel_metric_families[i].help);
+    buffer.append(families[i]);
+  }
+
+  metrics_cache = buffer;
+  t_metrics_cache.start();
+  return buffer;
+}
@@ -13,12 +13,13 @@
 //---------------------------------------------------------------------------
 void MgrServer::send_tunnel_config(MgrClientConnection *socket, Tunnel *tunnel)
 {
+  TunnelParameters tun_params = tunnel->paramsCopy();
   bool can_modify = isTunnelConfigChangeAllowed(tunnel, socket);
-  if (!(tunnel->params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
+  if (!(tun_params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
     can_modify = false;
 
   cJSON *json = cJSON_CreateObject();
-  tunnel->params.printJSON(json);
+  tun_params.printJSON(json);
   if (can_modify)
     cJSON_AddTrueToObject(json, "can_modify");
   else
@@ -32,18 +33,24 @@ void MgrServer::send_tunnel_config(MgrClientConnection *socket, Tunnel *tunnel)
 //---------------------------------------------------------------------------
 void MgrServer::send_tunnel_state(MgrClientConnection *socket, Tunnel *tunnel, bool include_stat)
 {
+  TunnelId tunnel_id = tunnel->paramsCopy().id;
+  QByteArray state_buffer;
+  QMetaObject::invokeMethod(tunnel, "statePrintToBuffer", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, state_buffer), Q_ARG(bool, include_stat));
   QByteArray packet_data;
-  packet_data.append((const char *)&tunnel->params.id, sizeof(TunnelId));
-  packet_data.append(tunnel->state.printToBuffer(include_stat));
+  packet_data.append((const char *)&tunnel_id, sizeof(TunnelId));
+  packet_data.append(state_buffer);
   socket->sendPacket(CMD_TUN_STATE_GET, packet_data);
 }
 
 //---------------------------------------------------------------------------
 void MgrServer::send_tunnel_connstate(MgrClientConnection *socket, Tunnel *tunnel, bool include_disconnected)
 {
+  TunnelId tunnel_id = tunnel->paramsCopy().id;
+  QByteArray conn_buffer;
+  QMetaObject::invokeMethod(tunnel, "in_connPrintToBuffer", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, conn_buffer), Q_ARG(bool, include_disconnected));
   QByteArray packet_data;
-  packet_data.append((const char *)&tunnel->params.id, sizeof(TunnelId));
-  packet_data.append(tunnel->in_connPrintToBuffer(include_disconnected));
+  packet_data.append((const char *)&tunnel_id, sizeof(TunnelId));
+  packet_data.append(conn_buffer);
   socket->sendPacket(CMD_TUN_CONNSTATE_GET, packet_data);
 }
 
@@ -91,16 +98,9 @@ void MgrServer::cmd_tunnel_create(MgrClientConnection *socket, const QByteArray
     return;
   }
 
-  bool tun_allowed = userGroup->tunnel_allow_list.isEmpty();
+  bool tun_allowed = userGroup->tunnel_allow_list.isEmpty() ||
+                     hash_tunnel_rule_matchers.value(userGroup->id).matches(tun_params);
   QString tunnel_rule = tun_params.tunnelRule();
-  for (int rule_index=0; rule_index < userGroup->tunnel_allow_list.count(); rule_index++)
-  {
-    if (tun_params.matchesRule(userGroup->tunnel_allow_list[rule_index]))
-    {
-      tun_allowed = true;
-      break;
-    }
-  }
   if (!tun_allowed)
   {
     res_code = TunnelState::RES_CODE_PERMISSION_DENIED;
@@ -133,25 +133,44 @@ void MgrServer::cmd_tunnel_create(MgrClientConnection *socket, const QByteArray
   }
 
   Tunnel *tunnel = hash_tunnels.value(tun_params.next_id);
+  if (tunnel)
+  {
+    TunnelParameters cur_params = tunnel->paramsCopy();
+    quint64 state_flags = 0;
+    QMetaObject::invokeMethod(tunnel, "stateFlags", tunnelCallType(tunnel), Q_RETURN_ARG(quint64, state_flags));
+    // master tunnel running in worker thread can't take GUI mgrconn which is shared with other tunnels
+    if (cur_params.orig_id != tun_params.id ||
+        cur_params.owner_user_id != user->id ||
+        cur_params.owner_group_id != userGroup->id ||
+        !(state_flags & TunnelState::TF_STARTED) ||
+        ((cur_params.flags & TunnelParameters::FL_MASTER_TUNSERVER) && tunnel->thread() != thread()))
+      tunnel = NULL;
+  }
   // if such tunnel already exists
-  if (tunnel && tunnel->params.orig_id == tun_params.id &&
-      tunnel->params.owner_user_id == user->id &&
-      tunnel->params.owner_group_id == userGroup->id &&
-      (tunnel->state.flags & TunnelState::TF_STARTED))
+  if (tunnel)
   {
+    if (tunnel->thread() != thread())
+    {
+      hash_tunnel_mgconn_in.insert(socket, tunnel);
+      MgrConnHandover handover;
+      handover.socket = socket;
+      handover.tunnel = tunnel;
+      handover.tun_params = tun_params;
+      mgrconn_pending_handover.append(handover);
+      QTimer::singleShot(0, this, SLOT(tunnels_dispatch()));
+      return;
+    }
     if (tunnel->mgrconn_in)
       hash_tunnel_mgconn_in.remove(tunnel->mgrconn_in);
-    tunnel->mgrconn_in = socket;
-    tunnel->setNewParams(&tun_params);
     hash_tunnel_mgconn_in.insert(socket, tunnel);
-    tunnel->mgrconn_in_restored();
+    tunnel->mgrconn_in_reattached(socket, &tun_params);
     return;
   }
 
   tunnel = new Tunnel;
   tunnel->moveToThread(QThread::currentThread());
-  connect(tunnel, SIGNAL(stopped()), this, SLOT(tunnel_stopped()));
-  connect(tunnel, SIGNAL(state_changed()), this, SLOT(tunnel_state_changed()));
+  connect(tunnel, SIGNAL(remove_requested(TunnelId)), this, SLOT(tunnel_remove_requested(TunnelId)));
+  connect(tunnel, SIGNAL(state_changed(TunnelId)), this, SLOT(tunnel_state_changed(TunnelId)));
   tunnel->state.flags &= ~TunnelState::TF_CHECK_PASSED;
   tunnel->state.flags |= TunnelState::TF_MGRCONN_IN_CLEAR_TO_SEND;
   tunnel->state.flags |= TunnelState::TF_MGRCONN_IN_CONNECTED;
@@ -182,6 +201,13 @@ void MgrServer::cmd_tunnel_create(MgrClientConnection *socket, const QByteArray
     }
   }
 
+  // tunnel and its mgrconn_in are moved to a worker thread once this packet has been processed
+  if (!workers.isEmpty() && !(tunnel->params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
+  {
+    tunnels_pending_dispatch.append(tunnel);
+    QTimer::singleShot(0, this, SLOT(tunnels_dispatch()));
+    return;
+  }
   tunnel->start();
 }
 
@@ -197,8 +223,8 @@ void MgrServer::cmd_tun_start(MgrClientConnection *socket, const QByteArray &dat
     return;
   if (!isTunnelControlAllowed(tunnel, socket))
     return;
-  tunnel->log(LOG_DBG1, QString(": starting tunnel due to CMD_TUN_START command from %1 (%2:%3)").arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
-  tunnel->start();
+  prc_log(LOG_DBG1, QString("Tunnel '%1': starting tunnel due to CMD_TUN_START command from %2 (%3:%4)").arg(tunnel->paramsCopy().name).arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
+  QMetaObject::invokeMethod(tunnel, "start", tunnelCallType(tunnel));
 }
 
 //---------------------------------------------------------------------------
@@ -214,15 +240,8 @@ void MgrServer::cmd_tun_stop(MgrClientConnection *socket, const QByteArray &data
   if (!isTunnelControlAllowed(tunnel, socket))
     return;
 
-  tunnel->log(LOG_DBG1, QString(": stopping tunnel due to CMD_TUN_STOP command from %1 (%2:%3)").arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
-  tunnel->state.flags |= TunnelState::TF_STOPPING;
-  if (tunnel->mgrconn_out && (tunnel->state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) && tunnel->mgrconn_out->output_buffer.length()+tunnel->mgrconn_out->bytesToWrite() < 64*1024)
-  {
-    tunnel->mgrconn_out->sendPacket(CMD_TUN_STOP);
-    tunnel->mgrconn_out->sendPacket(CMD_CLOSE);
-  }
-  else
-    tunnel->stop();
+  prc_log(LOG_DBG1, QString("Tunnel '%1': stopping tunnel due to CMD_TUN_STOP command from %2 (%3:%4)").arg(tunnel->paramsCopy().name).arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
+  QMetaObject::invokeMethod(tunnel, "stop_chain", tunnelCallType(tunnel));
 }
 
 //---------------------------------------------------------------------------
@@ -237,22 +256,13 @@ void MgrServer::cmd_tun_remove(MgrClientConnection *socket, const QByteArray &da
     return;
   if (!isTunnelConfigChangeAllowed(tunnel, socket))
     return;
-  tunnel->log(LOG_DBG1, QString(": stopping and removing tunnel due to CMD_TUN_REMOVE command from %1 (%2:%3)").arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
-  tunnel->state.flags |= TunnelState::TF_STOPPING;
-  tunnel->to_be_deleted = true;
-  tunnel->params.flags &= ~TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY;
+  prc_log(LOG_DBG1, QString("Tunnel '%1': stopping and removing tunnel due to CMD_TUN_REMOVE command from %2 (%3:%4)").arg(tunnel->paramsCopy().name).arg(socket->peer_hostname).arg(socket->peerAddress().toString()).arg(socket->peerPort()));
+  QMetaObject::invokeMethod(tunnel, "remove_chain", tunnelCallType(tunnel));
   if (!flag_kill && this->isListening())
   {
     prc_log(LOG_DBG2, QString("saving tunnels in configuration file"));
     config_save(&params);
   }
-  if (tunnel->mgrconn_out && (tunnel->state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) && tunnel->mgrconn_out->output_buffer.length()+tunnel->mgrconn_out->bytesToWrite() < 64*1024)
-  {
-    tunnel->mgrconn_out->sendPacket(CMD_TUN_STOP);
-    tunnel->mgrconn_out->sendPacket(CMD_CLOSE);
-  }
-  else
-    tunnel->stop();
 }
 
 //---------------------------------------------------------------------------
@@ -279,7 +289,7 @@ void MgrServer::cmd_tun_state_get(MgrClientConnection *socket, const QByteArray
   if (data.length() >= (int)sizeof(TunnelId))
   {
     Tunnel *tunnel = hash_tunnels.value(*((TunnelId *)data.data()));
-    if (isTunnelViewAllowed(tunnel, user))
+    if (tunnel && isTunnelViewAllowed(tunnel, user))
       send_tunnel_state(socket, tunnel, true);
     return;
   }
@@ -305,7 +315,7 @@ void MgrServer::cmd_tun_connstate_get(MgrClientConnection *socket, const QByteAr
   if (data.length() >= (int)(sizeof(quint8)+sizeof(TunnelId)))
   {
     Tunnel *tunnel = hash_tunnels.value(*((TunnelId *)(data.data()+sizeof(quint8))));
-    if (isTunnelViewAllowed(tunnel, user))
+    if (tunnel && isTunnelViewAllowed(tunnel, user))
       send_tunnel_connstate(socket, tunnel, flags & 0x01);
     return;
   }
@@ -317,6 +327,169 @@ void MgrServer::cmd_tun_connstate_get(MgrClientConnection *socket, const QByteAr
   }
 }
 
+//---------------------------------------------------------------------------
+// reply: TunnelId + flight recorder dump (see tunnel_flightrec.h)
+void MgrServer::cmd_tun_flightrec_get(MgrClientConnection *socket, const QByteArray &data)
+{
+  User *user = userById(mgrconn_state_list_in[socket]->user_id);
+  if (!user)
+    return;
+  if (data.length() < (int)sizeof(TunnelId))
+    return;
+  TunnelId tunnel_id = *((TunnelId *)data.data());
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel || !isTunnelViewAllowed(tunnel, user))
+    return;
+
+  QByteArray dump;
+  QMetaObject::invokeMethod(tunnel, "flightrecDump", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, dump));
+  QByteArray buffer;
+  buffer.reserve(sizeof(TunnelId)+dump.length());
+  buffer.append((const char *)&tunnel_id, sizeof(TunnelId));
+  buffer.append(dump);
+  socket->sendPacket(CMD_TUN_FLIGHTREC_GET, buffer);
+}
+
+//---------------------------------------------------------------------------
+// reply: TunnelId + latency histograms (see Tunnel::latencyPrintToBuffer)
+// reply: MgrPacket_StandartReply with TunnelId as object id, followed by histograms if res_code is RES_CODE_OK
+void MgrServer::cmd_tun_latency_get(MgrClientConnection *socket, const QByteArray &data)
+{
+  User *user = userById(mgrconn_state_list_in[socket]->user_id);
+  if (!user)
+    return;
+  if (data.length() < (int)sizeof(TunnelId))
+  {
+    socket->log(LOG_DBG1, QString(": CMD_TUN_LATENCY_GET packet too short"));
+    socket->abort();
+    return;
+  }
+  TunnelId tunnel_id = *((TunnelId *)data.data());
+  QByteArray obj_id((const char *)&tunnel_id, sizeof(TunnelId));
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel)
+  {
+    send_standart_reply(socket, CMD_TUN_LATENCY_GET, obj_id, TunnelState::RES_CODE_TUNNEL_NOT_FOUND, QString("Tunnel not found"));
+    return;
+  }
+  if (!isTunnelViewAllowed(tunnel, user))
+  {
+    send_standart_reply(socket, CMD_TUN_LATENCY_GET, obj_id, TunnelState::RES_CODE_PERMISSION_DENIED, QString("Permission denied"));
+    return;
+  }
+
+  QByteArray histograms;
+  QMetaObject::invokeMethod(tunnel, "latencyPrintToBuffer", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, histograms));
+  send_standart_reply(socket, CMD_TUN_LATENCY_GET, obj_id, TunnelState::RES_CODE_OK, QString(), histograms);
+}
+
+//---------------------------------------------------------------------------
+// request: MgrPacket_TunnelHistoryReq, reply: TunnelId + MgrPacket_TunnelHistoryRep + delta-encoded samples
+void MgrServer::cmd_tun_history_get(MgrClientConnection *socket, const QByteArray &data)
+{
+  User *user = userById(mgrconn_state_list_in[socket]->user_id);
+  if (!user)
+    return;
+  if (data.length() < (int)sizeof(MgrPacket_TunnelHistoryReq))
+    return;
+  MgrPacket_TunnelHistoryReq req = *((MgrPacket_TunnelHistoryReq *)data.data());
+  TunnelId tunnel_id = req.tunnel_id;
+  quint32 interval = req.interval;
+  quint32 from_time = req.from_time;
+  quint32 to_time = req.to_time;
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel || !isTunnelViewAllowed(tunnel, user))
+    return;
+
+  QByteArray history;
+  QMetaObject::invokeMethod(tunnel, "historyPrintToBuffer", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, history),
+                            Q_ARG(quint32, interval), Q_ARG(quint32, from_time), Q_ARG(quint32, to_time));
+  QByteArray buffer;
+  buffer.reserve(sizeof(TunnelId)+history.length());
+  buffer.append((const char *)&tunnel_id, sizeof(TunnelId));
+  buffer.append(history);
+  socket->sendPacket(CMD_TUN_HISTORY_GET, buffer);
+}
+
+//---------------------------------------------------------------------------
+// reply: TunnelId + data path stage counters (see Tunnel::stagesPrintToBuffer)
+void MgrServer::cmd_tun_stages_get(MgrClientConnection *socket, const QByteArray &data)
+{
+  User *user = userById(mgrconn_state_list_in[socket]->user_id);
+  if (!user)
+    return;
+  if (data.length() < (int)sizeof(TunnelId))
+    return;
+  TunnelId tunnel_id = *((TunnelId *)data.data());
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel || !isTunnelViewAllowed(tunnel, user))
+    return;
+
+  QByteArray stages;
+  QMetaObject::invokeMethod(tunnel, "stagesPrintToBuffer", tunnelCallType(tunnel), Q_RETURN_ARG(QByteArray, stages));
+  QByteArray buffer;
+  buffer.reserve(sizeof(TunnelId)+stages.length());
+  buffer.append((const char *)&tunnel_id, sizeof(TunnelId));
+  buffer.append(stages);
+  socket->sendPacket(CMD_TUN_STAGES_GET, buffer);
+}
+
+//---------------------------------------------------------------------------
+// previous tunserver in chain wants to use this connection as additional mgrconn_in for the tunnel
+void MgrServer::cmd_tun_stripe_attach(MgrClientConnection *socket, const QByteArray &data)
+{
+  if (data.length() < (int)sizeof(MgrPacket_TunnelStripeAttach))
+  {
+    socket->log(LOG_DBG1, QString(": CMD_TUN_STRIPE_ATTACH packet too short"));
+    socket->abort();
+    return;
+  }
+  User *user = userById(mgrconn_state_list_in[socket]->user_id);
+  if (!user)
+    return;
+  MgrPacket_TunnelStripeAttach *packet = (MgrPacket_TunnelStripeAttach *)data.data();
+  QByteArray obj_id((const char *)&packet->orig_tunnel_id, sizeof(TunnelId));
+
+  Tunnel *tunnel = hash_tunnels.value(packet->tunnel_id);
+  TunnelParameters tun_params;
+  quint64 state_flags = 0;
+  if (tunnel)
+  {
+    tun_params = tunnel->paramsCopy();
+    QMetaObject::invokeMethod(tunnel, "stateFlags", tunnelCallType(tunnel), Q_RETURN_ARG(quint64, state_flags));
+  }
+  if (!tunnel || tun_params.orig_id != packet->orig_tunnel_id ||
+      (tun_params.flags & TunnelParameters::FL_MASTER_TUNSERVER) ||
+      !(state_flags & TunnelState::TF_STARTED))
+  {
+    send_standart_reply(socket, CMD_TUN_STRIPE_ATTACH, obj_id, TunnelState::RES_CODE_TUNNEL_NOT_FOUND, QString("Tunnel not found"));
+    return;
+  }
+  if (tun_params.owner_user_id != user->id ||
+      packet->stripe_index == 0 ||
+      packet->stripe_index >= qMin(tun_params.mgrconn_stripes, (quint32)TUNNEL_MAX_MGRCONN_STRIPES) ||
+      hash_tunnel_mgconn_in.contains(socket))
+  {
+    send_standart_reply(socket, CMD_TUN_STRIPE_ATTACH, obj_id, TunnelState::RES_CODE_PERMISSION_DENIED, QString("Permission denied on '%1'").arg(SysUtil::machine_name));
+    return;
+  }
+
+  socket->log(LOG_DBG1, QString(": attaching stripe %1 to tunnel '%2' id=%3").arg(packet->stripe_index).arg(tun_params.name).arg(tun_params.id));
+  hash_tunnel_mgconn_in.insert(socket, tunnel);
+  if (tunnel->thread() != thread())
+  {
+    // tunnel replies once the stripe is handed over to its worker thread
+    MgrConnHandover handover;
+    handover.socket = socket;
+    handover.tunnel = tunnel;
+    handover.stripe_index = packet->stripe_index;
+    mgrconn_pending_handover.append(handover);
+    QTimer::singleShot(0, this, SLOT(tunnels_dispatch()));
+    return;
+  }
+  tunnel->mgrconn_in_stripe_attached(socket, packet->stripe_index);
+}
+
 //---------------------------------------------------------------------------
 void MgrServer::cmd_tunnel_config_set(MgrClientConnection *socket, const QByteArray &req_data)
 {
@@ -353,7 +526,7 @@ void MgrServer::cmd_tunnel_config_set(MgrClientConnection *socket, const QByteAr
     return;
   }
 
-  if (!(tunnel->params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
+  if (!(tunnel->paramsCopy().flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
     send_standart_reply(socket, CMD_TUN_CONFIG_SET, QByteArray((const char *)&tun_params.id, sizeof(TunnelId)),
                         TunnelState::RES_CODE_PERMISSION_DENIED, QString("Tunnel configuration can only be modified on the first (master) tunserver"));
@@ -368,7 +541,7 @@ void MgrServer::cmd_tunnel_config_set(MgrClientConnection *socket, const QByteAr
     return;
   }
 
-  tunnel->setNewParams(&tun_params);
+  QMetaObject::invokeMethod(tunnel, "setNewParams", tunnelCallType(tunnel), Q_ARG(TunnelParameters*, &tun_params));
 
   send_standart_reply(socket, CMD_TUN_CONFIG_SET, QByteArray((const char *)&tun_params.id, sizeof(TunnelId)), res_code, error_str);
 
@@ -413,6 +586,14 @@ bool MgrServer::tunnel_checkParams(TunnelParameters *tun_params, quint16 &res_co
     }
   }
 
+  // SO_REUSEPORT listeners have to share one port (tunservers which do not bind get neither of them)
+  if (tun_params->app_protocol == TunnelParameters::TCP && tun_params->bind_listeners > 1 && tun_params->bind_port == 0)
+  {
+    res_code = TunnelState::RES_CODE_BIND_ERROR;
+    error_str = Tunnel::tr("Several bind listeners need a fixed bind port");
+    return false;
+  }
+
   return true;
 }
 
@@ -420,8 +601,9 @@ bool MgrServer::tunnel_checkParams(TunnelParameters *tun_params, quint16 &res_co
 void MgrServer::tunnel_owner_mgrconn_removed(MgrClientConnection *socket)
 {
   Tunnel *tunnel = hash_tunnel_mgconn_in.take(socket);
-  if (tunnel)
-    tunnel->mgrconn_in_disconnected();
+  // mgrconn waiting to be handed over to worker thread is simply forgotten
+  if (tunnel && tunnel->thread() == thread())
+    tunnel->mgrconn_in_disconnected(socket);
 }
 
 //---------------------------------------------------------------------------
@@ -462,40 +644,10 @@ void MgrServer::cmd_tun(MgrClientConnection *socket, MgrPacketCmd cmd, const QBy
       break;
     case CMD_TUN_CHAIN_HEARTBEAT_REQ:
     case CMD_TUN_CHAIN_HEARTBEAT_REP:
-    {
-      Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (tunnel)
-        tunnel->cmd_tun_heartbeat(cmd, socket);
-      break;
-    }
     case CMD_TUN_BUFFER_ACK:
-    {
-      Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (tunnel)
-        tunnel->cmd_tun_buffer_ack_received(socket, data);
-      break;
-    }
     case CMD_TUN_BUFFER_RESEND_FROM:
-    {
-      Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (tunnel)
-        tunnel->cmd_tun_buffer_resend_from(socket, data);
-      break;
-    }
     case CMD_TUN_CHAIN_BROKEN:
-    {
-      Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (tunnel)
-        tunnel->cmd_tun_chain_broken(socket);
-      break;
-    }
     case CMD_TUN_CHAIN_CHECK:
-    {
-      Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (tunnel)
-        tunnel->cmd_tun_chain_check(socket);
-      break;
-    }
     case CMD_TUN_CONN_OUT_NEW:
     case CMD_TUN_CONN_OUT_DROP:
     case CMD_TUN_CONN_OUT_CONNECTED:
@@ -503,56 +655,28 @@ void MgrServer::cmd_tun(MgrClientConnection *socket, MgrPacketCmd cmd, const QBy
     case CMD_TUN_CONN_IN_DATA:
     case CMD_TUN_CONN_OUT_DATA:
     {
+      // packets of mgrconn waiting to be handed over to worker thread are dropped:
+      // previous tunserver doesn't send them until it gets a reply from the tunnel
       Tunnel *tunnel = hash_tunnel_mgconn_in.value(socket);
-      if (!tunnel)
-        return;
-      if (!tunnel->t_last_buffered_packet_ack_rcv.isValid())
-        tunnel->t_last_buffered_packet_ack_rcv.start();
-      if (tunnel->forward_packet(socket, cmd, data))
-        break;
-      if (data.length() < (int)(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)))
-      {
-        socket->log(LOG_DBG1, QString(": CMD_TUN_CONN_... packet too short"));
-        socket->abort();
-        return;
-      }
-      TunnelConnPacketId packet_id = *((TunnelConnPacketId *)data.data());
-      TunnelConnId conn_id = *((TunnelConnId *)(data.data()+sizeof(TunnelConnPacketId)));
-      if (!tunnel->buffered_packet_received(packet_id, data.length()))
-        return;
-      switch (cmd)
-      {
-        case CMD_TUN_CONN_OUT_NEW:
-        {
-          tunnel->cmd_conn_out_new(conn_id);
-          break;
-        }
-        case CMD_TUN_CONN_OUT_DROP:
-        {
-          tunnel->cmd_conn_out_drop(conn_id, data.mid(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)));
-          break;
-        }
-        case CMD_TUN_CONN_OUT_CONNECTED:
-        {
-          tunnel->cmd_conn_out_connected(conn_id, data.mid(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)));
-          break;
-        }
-        case CMD_TUN_CONN_IN_DROP:
-        {
-          tunnel->cmd_conn_in_drop(conn_id, data.mid(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)));
-          break;
-        }
-        case CMD_TUN_CONN_IN_DATA:
-        case CMD_TUN_CONN_OUT_DATA:
-        {
-          tunnel->cmd_conn_data(cmd == CMD_TUN_CONN_IN_DATA ? TunnelConn::INCOMING : TunnelConn::OUTGOING,
-                      conn_id, data.mid(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)));
-        }
-        default:
-          break;
-      }
+      if (tunnel && tunnel->thread() == thread())
+        tunnel->mgrconn_in_packet(socket, cmd, data);
       break;
     }
+    case CMD_TUN_STRIPE_ATTACH:
+      cmd_tun_stripe_attach(socket, data);
+      break;
+    case CMD_TUN_FLIGHTREC_GET:
+      cmd_tun_flightrec_get(socket, data);
+      break;
+    case CMD_TUN_LATENCY_GET:
+      cmd_tun_latency_get(socket, data);
+      break;
+    case CMD_TUN_HISTORY_GET:
+      cmd_tun_history_get(socket, data);
+      break;
+    case CMD_TUN_STAGES_GET:
+      cmd_tun_stages_get(socket, data);
+      break;
     default:
     {
       socket->log(LOG_DBG1, QString(": Unknown packet cmd %1 - dropping connection").arg(cmd));
@@ -568,12 +692,20 @@ void MgrServer::tunnel_remove(Tunnel *tunnel)
 {
   if (!tunnels.contains(tunnel))
     return;
-  tunnel->to_be_deleted = true;
-  tunnel->stop();
+  TunnelId tunnel_id = tunnel->paramsCopy().id;
+  QMetaObject::invokeMethod(tunnel, "stop_and_remove", tunnelCallType(tunnel));
   tunnels.removeOne(tunnel);
-  hash_tunnels.remove(tunnel->params.id);
-  if (tunnel->mgrconn_in)
-    hash_tunnel_mgconn_in.remove(tunnel->mgrconn_in);
+  hash_tunnels.remove(tunnel_id);
+  hash_tunnel_state_dispatch.remove(tunnel_id);
+  tunnels_pending_dispatch.removeAll(tunnel);
+  // remove both main incoming mgrconn and its stripes
+  QMutableHashIterator<MgrClientConnection *, Tunnel *> i_mgrconn_in(hash_tunnel_mgconn_in);
+  while (i_mgrconn_in.hasNext())
+  {
+    i_mgrconn_in.next();
+    if (i_mgrconn_in.value() == tunnel)
+      i_mgrconn_in.remove();
+  }
 
   // send notification to subscribed clients
   QHashIterator<MgrClientConnection *, MgrClientState *> iterator(mgrconn_state_list_in);
@@ -583,7 +715,7 @@ void MgrServer::tunnel_remove(Tunnel *tunnel)
     if (iterator.value()->flags & MgrClientState::FL_TUNNELS_CONFIG)
     {
       if (isTunnelViewAllowed(tunnel, userById(iterator.value()->user_id)))
-        send_standart_reply(iterator.key(), CMD_TUN_REMOVE, QByteArray((const char *)&tunnel->params.id, sizeof(TunnelId)), TunnelState::RES_CODE_OK, QString());
+        send_standart_reply(iterator.key(), CMD_TUN_REMOVE, QByteArray((const char *)&tunnel_id, sizeof(TunnelId)), TunnelState::RES_CODE_OK, QString());
     }
   }
 
@@ -591,39 +723,44 @@ void MgrServer::tunnel_remove(Tunnel *tunnel)
 }
 
 //---------------------------------------------------------------------------
-void MgrServer::tunnel_stopped()
+// signals from worker threads may come when the tunnel is already removed (and its id possibly reused),
+// so the tunnel is looked up by id and has to be the sender itself
+void MgrServer::tunnel_remove_requested(TunnelId tunnel_id)
 {
-  Tunnel *tunnel = qobject_cast<Tunnel *>(sender());
-  if (!tunnel)
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel || tunnel != sender())
     return;
-  if (!tunnel->restart_after_stop &&
-      (!(tunnel->state.flags & TunnelState::TF_CHECK_PASSED) ||
-       !(tunnel->params.flags & TunnelParameters::FL_MASTER_TUNSERVER) ||
-         tunnel->to_be_deleted))
-    tunnel_remove(tunnel);
+  tunnel_remove(tunnel);
 }
 
 
 //---------------------------------------------------------------------------
-void MgrServer::tunnel_state_changed()
+void MgrServer::tunnel_state_changed(TunnelId tunnel_id)
 {
-  Tunnel *tunnel = qobject_cast<Tunnel *>(sender());
-  if (!tunnel)
+  Tunnel *tunnel = hash_tunnels.value(tunnel_id);
+  if (!tunnel || tunnel != sender())
     return;
+  tunnel_state_dispatch(tunnel, tunnel_id);
+}
 
+//---------------------------------------------------------------------------
+void MgrServer::tunnel_state_dispatch(Tunnel *tunnel, TunnelId tunnel_id)
+{
 //  tunnel->log(LOG_DBG1, QString("flags = 0x%1").arg(tunnel->state.flags, 0, 16));
 //  tunnel->log(LOG_DBG1, QString("last_error_code = %1").arg(tunnel->state.last_error_code));
 
   // limit notifications frequency
-  if (tunnel->params.max_state_dispatch_frequency > 0)
+  MgrTunnelStateDispatch &dispatch = hash_tunnel_state_dispatch[tunnel_id];
+  quint32 max_state_dispatch_frequency = tunnel->paramsCopy().max_state_dispatch_frequency;
+  if (max_state_dispatch_frequency > 0)
   {
-    unsigned int ms_since_last_state_dispatch = qAbs(tunnel->t_last_state_sent.elapsed());
-    if (tunnel->t_last_state_sent.isValid() && ms_since_last_state_dispatch < tunnel->params.max_state_dispatch_frequency)
+    unsigned int ms_since_last_state_dispatch = qAbs(dispatch.t_last_sent.elapsed());
+    if (dispatch.t_last_sent.isValid() && ms_since_last_state_dispatch < max_state_dispatch_frequency)
     {
-      if (!tunnel->state_dispatch_queued)
+      if (!dispatch.queued)
       {
-        tunnel->state_dispatch_queued = true;
-        QTimer::singleShot(tunnel->params.max_state_dispatch_frequency-ms_since_last_state_dispatch, tunnel, SIGNAL(state_changed()));
+        dispatch.queued = true;
+        QTimer::singleShot(max_state_dispatch_frequency-ms_since_last_state_dispatch, this, SLOT(tunnels_state_dispatch_queued()));
       }
       return;
     }
@@ -640,22 +777,128 @@ void MgrServer::tunnel_state_changed()
         send_tunnel_state(iterator.key(), tunnel, false);
     }
   }
-  tunnel->t_last_state_sent.restart();
-  tunnel->state_dispatch_queued = false;
+  dispatch.t_last_sent.restart();
+  dispatch.queued = false;
+}
+
+//---------------------------------------------------------------------------
+// every postponed notification is checked again: those not due yet are postponed once more
+void MgrServer::tunnels_state_dispatch_queued()
+{
+  QList<TunnelId> tunnel_ids;
+  QMutableHashIterator<TunnelId, MgrTunnelStateDispatch> iterator(hash_tunnel_state_dispatch);
+  while (iterator.hasNext())
+  {
+    iterator.next();
+    if (iterator.value().queued)
+    {
+      iterator.value().queued = false;
+      tunnel_ids.append(iterator.key());
+    }
+  }
+  for (int i=0; i < tunnel_ids.count(); i++)
+  {
+    Tunnel *tunnel = hash_tunnels.value(tunnel_ids[i]);
+    if (tunnel)
+      tunnel_state_dispatch(tunnel, tunnel_ids[i]);
+  }
 }
 
 //---------------------------------------------------------------------------
 void MgrServer::tunnels_stop()
 {
   for (int i=0; i < tunnels.count(); i++)
-    tunnels[i]->stop();
+    QMetaObject::invokeMethod(tunnels[i], "stop", tunnelCallType(tunnels[i]));
 }
 
 //---------------------------------------------------------------------------
 void MgrServer::tunnels_start()
 {
   for (int i=0; i < tunnels.count(); i++)
-    tunnels[i]->start();
+  {
+    // tunnels loaded from config have no mgrconn_in and can be moved to worker threads right away
+    if (!workers.isEmpty() && tunnels[i]->thread() == thread() && !tunnels[i]->mgrconn_in)
+      tunnels[i]->moveToThread(tunnel_worker());
+    QMetaObject::invokeMethod(tunnels[i], "start", tunnelCallType(tunnels[i]));
+  }
+}
+
+//---------------------------------------------------------------------------
+// least loaded worker thread
+QThread *MgrServer::tunnel_worker() const
+{
+  QThread *worker = NULL;
+  int min_tunnel_count = 0;
+  for (int i=0; i < workers.count(); i++)
+  {
+    int tunnel_count = 0;
+    for (int j=0; j < tunnels.count(); j++)
+    {
+      if (tunnels[j]->thread() == workers[i])
+        tunnel_count++;
+    }
+    if (!worker || tunnel_count < min_tunnel_count)
+    {
+      worker = workers[i];
+      min_tunnel_count = tunnel_count;
+    }
+  }
+  return worker;
+}
+
+//---------------------------------------------------------------------------
+// incoming mgrconn stops being MgrServer's connection and is served by the tunnel in its thread
+void MgrServer::tunnel_adopt_mgrconn(Tunnel *tunnel, MgrClientConnection *socket)
+{
+  hash_tunnel_mgconn_in.remove(socket);
+  mgrconn_list_in.removeOne(socket);
+  delete mgrconn_state_list_in.take(socket);
+  disconnect(socket, 0, this, 0);
+  socket->setPacketHandler(tunnel, Tunnel::MGRCONN_ROLE_IN);
+  connect(socket, SIGNAL(socket_finished()), tunnel, SLOT(mgrconn_in_finished()));
+  connect(socket, SIGNAL(socket_finished()), socket, SLOT(deleteLater()));
+  socket->moveToThread(tunnel->thread());
+}
+
+//---------------------------------------------------------------------------
+// tunnels and mgrconns are handed over to worker threads outside of mgrconn packet processing
+void MgrServer::tunnels_dispatch()
+{
+  while (!tunnels_pending_dispatch.isEmpty())
+  {
+    Tunnel *tunnel = tunnels_pending_dispatch.takeFirst();
+    if (!tunnels.contains(tunnel))
+      continue;
+    if (!tunnel->mgrconn_in)
+    {
+      // previous tunserver has gone before the tunnel is started
+      tunnel_remove(tunnel);
+      continue;
+    }
+    tunnel->moveToThread(tunnel_worker());
+    tunnel_adopt_mgrconn(tunnel, tunnel->mgrconn_in);
+    QMetaObject::invokeMethod(tunnel, "start", Qt::QueuedConnection);
+  }
+
+  while (!mgrconn_pending_handover.isEmpty())
+  {
+    MgrConnHandover handover = mgrconn_pending_handover.takeFirst();
+    if (!tunnels.contains(handover.tunnel) || hash_tunnel_mgconn_in.value(handover.socket) != handover.tunnel)
+      continue;
+    tunnel_adopt_mgrconn(handover.tunnel, handover.socket);
+    if (handover.stripe_index > 0)
+      QMetaObject::invokeMethod(handover.tunnel, "mgrconn_in_stripe_attached", Qt::BlockingQueuedConnection,
+                                Q_ARG(MgrClientConnection*, handover.socket), Q_ARG(quint8, handover.stripe_index));
+    else
+      QMetaObject::invokeMethod(handover.tunnel, "mgrconn_in_reattached", Qt::BlockingQueuedConnection,
+                                Q_ARG(MgrClientConnection*, handover.socket), Q_ARG(TunnelParameters*, &handover.tun_params));
+  }
+}
+
+//---------------------------------------------------------------------------
+void MgrServer::tunnels_config_save()
+{
+  config_save(&params);
 }
 
 //---------------------------------------------------------------------------
@@ -671,7 +914,7 @@ void MgrServer::config_load_tunnels(cJSON *j_config)
 {
   for (int i=tunnels.count()-1; i >= 0; i--)
   {
-    if (tunnels[i]->params.flags & TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY)
+    if (tunnels[i]->paramsCopy().flags & TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY)
       tunnel_remove(tunnels[i]);
   }
 
@@ -684,8 +927,8 @@ void MgrServer::config_load_tunnels(cJSON *j_config)
     cJSON *j_item = cJSON_GetArrayItem(j_tunnels, i);
     Tunnel *tunnel = new Tunnel;
     tunnel->moveToThread(QThread::currentThread());
-    connect(tunnel, SIGNAL(stopped()), this, SLOT(tunnel_stopped()));
-    connect(tunnel, SIGNAL(state_changed()), this, SLOT(tunnel_state_changed()));
+    connect(tunnel, SIGNAL(remove_requested(TunnelId)), this, SLOT(tunnel_remove_requested(TunnelId)));
+    connect(tunnel, SIGNAL(state_changed(TunnelId)), this, SLOT(tunnel_state_changed(TunnelId)));
     tunnel->params.parseJSON(j_item);
     tunnel->state.flags |= TunnelState::TF_CHECK_PASSED
                         |  TunnelState::TF_SAVED_IN_CONFIG;
@@ -705,14 +948,13 @@ void MgrServer::config_save_tunnels(cJSON *j_config)
 
   for (int i=0; i < tunnels.count(); i++)
   {
-    if ((tunnels[i]->params.flags & TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY) &&
-        (tunnels[i]->state.flags & TunnelState::TF_CHECK_PASSED))
-    {
-      cJSON *j_item = cJSON_CreateObject();
-      tunnels[i]->params.printJSON(j_item);
-      tunnels[i]->state.flags |= TunnelState::TF_SAVED_IN_CONFIG;
+    cJSON *j_item = cJSON_CreateObject();
+    bool saved = false;
+    QMetaObject::invokeMethod(tunnels[i], "config_print", tunnelCallType(tunnels[i]), Q_RETURN_ARG(bool, saved), Q_ARG(cJSON*, j_item));
+    if (saved)
       cJSON_AddItemToArray(j_tunnels, j_item);
-    }
+    else
+      cJSON_Delete(j_item);
   }
 }
 
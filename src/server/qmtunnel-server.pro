@@ -28,16 +28,32 @@ MOC_DIR = ./moc/
 
 unix:LIBS += -lcrypto
 
+# optional TLS session sharing between incoming mgrconns and exact resumption reporting
+# (qmake CONFIG+=ssl_session_sharing, needs Qt 5 private headers, e.g. qtbase5-private-dev)
+ssl_session_sharing:equals(QT_MAJOR_VERSION, 5) {
+QT += network-private
+DEFINES += HAVE_SSL_SESSION_SHARING
+unix:LIBS += -lssl
+}
+
+# optional io_uring data plane for application connections (qmake CONFIG+=io_uring, needs liburing >= 2.4)
+linux:io_uring {
+DEFINES += HAVE_IO_URING
+LIBS += -luring
+}
+
 SOURCES += main.cpp\
         mainwindow.cpp \
     ../lib/cJSON.c \
     ../lib/prc_log.cpp \
     ../lib/sys_util.cpp \
     ../lib/mgrclient-conn.cpp \
+    ../lib/latency-histogram.cpp \
     ../lib/mgrclient-parameters.cpp \
     ../lib/mgrserver-parameters.cpp \
     mgr_server.cpp \
     mgr_server_conn_init.cpp \
+    mgr_server_metrics.cpp \
     ../lib/client-conn-parameters.cpp \
     mgr_server_config.cpp \
     ../lib/ssl_helper.cpp \
@@ -48,6 +64,12 @@ SOURCES += main.cpp\
     widget_usergroups.cpp \
     mgr_server_tun.cpp \
     ../lib/tunnel-state.cpp \
+    ../lib/tunnel-history.cpp \
+    ../lib/timer-wheel.cpp \
+    ../lib/buffer-pool.cpp \
+    memory_governor.cpp \
+    io_uring_backend.cpp \
+    tunnel_listener.cpp \
     tunnel.cpp \
     tunnel_conn.cpp \
     ../lib/mgr_packet.cpp \
@@ -63,6 +85,8 @@ HEADERS  += mainwindow.h \
     ../lib/prc_log.h \
     ../lib/sys_util.h \
     ../lib/mgrclient-conn.h \
+    ../lib/latency-histogram.h \
+    ../lib/stage_timer.h \
     ../lib/mgrclient-parameters.h \
     ../lib/mgrserver-parameters.h \
     mgr_server.h \
@@ -75,8 +99,15 @@ HEADERS  += mainwindow.h \
     widget_mgrserver.h \
     widget_usergroups.h \
     ../lib/tunnel-state.h \
+    ../lib/tunnel-history.h \
+    ../lib/timer-wheel.h \
+    ../lib/buffer-pool.h \
+    memory_governor.h \
+    io_uring_backend.h \
+    tunnel_listener.h \
     tunnel.h \
     tunnel_conn.h \
+    tunnel_flightrec.h \
     aboutdialog.h \
     gui_settings.h \
     gui_settings_dialog.h
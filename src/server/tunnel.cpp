@@ -9,6 +9,17 @@
 #include "tunnel.h"
 #include "../lib/sys_util.h"
 #include "mgr_server.h"
+#include <QDateTime>
+
+QElapsedTimer flightrec_clock;
+qint64 flightrec_clock_start_ms = 0;
+
+//---------------------------------------------------------------------------
+void flightrec_clock_init()
+{
+  flightrec_clock_start_ms = QDateTime::currentMSecsSinceEpoch();
+  flightrec_clock.start();
+}
 
 //---------------------------------------------------------------------------
 void Tunnel::start()
@@ -18,11 +29,16 @@ void Tunnel::start()
 
   state.flags &= ~TunnelState::TF_STOPPING;
   state.flags |= TunnelState::TF_STARTED;
-  log(LOG_DBG1, QString(": starting"));
+  OBJ_LOG(this, LOG_DBG1, QString(": starting"));
+  mem_account.setOwner(params.id, params.owner_user_id);
   state.stats = TunnelStatistics();
+  latency_chain_rtt.reset();
+  latency_connect.reset();
+  latency_ack_delay.reset();
 
   buffered_packets_list.clear();
   buffered_packets_id_list.clear();
+  buffered_packets_stripe_list.clear();
   buffered_packets_total_len = 0;
   buffered_packets_rcv_count = 0;
   buffered_packets_rcv_total_len = 0;
@@ -32,8 +48,11 @@ void Tunnel::start()
   seq_packet_id = 1;
   expected_packet_id = 1;
   last_rcv_packet_id = 0;
+  reorder_packets_clear();
 
+  params_mutex.lock();
   params.next_id = 0;
+  params_mutex.unlock();
   if (next_udp_port == 0)
     next_udp_port = params.udp_port_range_from;
 
@@ -45,7 +64,7 @@ void Tunnel::start()
     if (udp_remote_addr.isNull() && !udp_remote_addr_lookup_in_progress)
     {
       udp_remote_addr_lookup_in_progress = true;
-      this->log(LOG_DBG1, QString(": starting host '%1' lookup").arg(params.remote_host));
+      OBJ_LOG(this, LOG_DBG1, QString(": starting host '%1' lookup").arg(params.remote_host));
       udp_remote_addr_lookup_id = QHostInfo::lookupHost(params.remote_host, this, SLOT(udp_hostLookupFinished(QHostInfo)));
     }
   }
@@ -93,7 +112,7 @@ void Tunnel::start()
       connect(mgrconn_in, SIGNAL(stat_bytesSent(quint64)), this, SLOT(mgrconn_bytesSent(quint64)));
       connect(mgrconn_in, SIGNAL(stat_bytesSentEncrypted(quint64)), this, SLOT(mgrconn_bytesSentEncrypted(quint64)));
     }
-    this->log(LOG_DBG2, QString(": tunnel is established"));
+    OBJ_LOG(this, LOG_DBG2, QString(": tunnel is established"));
   }
   else
   {
@@ -129,43 +148,58 @@ void Tunnel::start()
     }
   }
   emit started();
-  emit state_changed();
+  emit state_changed(params.id);
 
   if (params.heartbeat_interval > 0)
   {
-    timer_chain_heartbeat->setInterval(params.heartbeat_interval);
-    timer_chain_heartbeat->start();
+    timer_chain_heartbeat.setInterval(params.heartbeat_interval);
+    timer_chain_heartbeat.start();
   }
+  buffer_trimmed_bytes = 0;
+  timer_buffer_trim.start();
 }
 
 //---------------------------------------------------------------------------
 void Tunnel::setNewParams(TunnelParameters *new_params)
 {
   TunnelParameters old_params = params;
+  params_mutex.lock();
   params = *new_params;
   params.orig_id = old_params.orig_id;
   params.id = old_params.id;
   params.next_id = old_params.next_id;
   params.owner_user_id = old_params.owner_user_id;
   params.owner_group_id = old_params.owner_group_id;
+  params_mutex.unlock();
 
   if (mgrconn_out)
     mgrconn_out->log_prefix = QString("Tunnel '%1' mgrconn_out: ").arg(params.name);
   if (mgrconn_in && !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
     mgrconn_in->log_prefix = QString("Tunnel '%1' mgrconn_in: ").arg(params.name);
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+    if (mgrconn_out_stripes[i].conn)
+      mgrconn_out_stripes[i].conn->log_prefix = QString("Tunnel '%1' mgrconn_out stripe %2: ").arg(params.name).arg(i+1);
+  for (int i=0; i < mgrconn_in_stripes.count(); i++)
+    if (mgrconn_in_stripes[i].conn)
+      mgrconn_in_stripes[i].conn->log_prefix = QString("Tunnel '%1' mgrconn_in stripe %2: ").arg(params.name).arg(i+1);
 
-  QHashIterator<TunnelConnId, TunnelConn *> in_conn_list_iterator(in_conn_list);
-  while (in_conn_list_iterator.hasNext())
+  conn_params.clear();
+  if (!in_conn_list.isEmpty() || !out_conn_list.isEmpty())
   {
-    in_conn_list_iterator.next();
-    in_conn_list_iterator.value()->tun_params = params;
-  }
+    QSharedPointer<const TunnelParameters> new_conn_params = connParams();
+    QHashIterator<TunnelConnId, TunnelConn *> in_conn_list_iterator(in_conn_list);
+    while (in_conn_list_iterator.hasNext())
+    {
+      in_conn_list_iterator.next();
+      in_conn_list_iterator.value()->setParams(new_conn_params);
+    }
 
-  QHashIterator<TunnelConnId, TunnelConn *> out_conn_list_iterator(out_conn_list);
-  while (out_conn_list_iterator.hasNext())
-  {
-    out_conn_list_iterator.next();
-    out_conn_list_iterator.value()->tun_params = params;
+    QHashIterator<TunnelConnId, TunnelConn *> out_conn_list_iterator(out_conn_list);
+    while (out_conn_list_iterator.hasNext())
+    {
+      out_conn_list_iterator.next();
+      out_conn_list_iterator.value()->setParams(new_conn_params);
+    }
   }
 
   if (params != old_params)
@@ -179,26 +213,305 @@ void Tunnel::setNewParams(TunnelParameters *new_params)
     next_udp_port = params.udp_port_range_from;
   if (params.remote_host != old_params.remote_host)
     udp_remote_addr = QHostAddress();
+  if (params.conn_idle_timeout != old_params.conn_idle_timeout)
+  {
+    QHashIterator<TunnelConnId, TunnelUdpConn *> i_udp_conn(udp_conn_list_by_id);
+    while (i_udp_conn.hasNext())
+    {
+      i_udp_conn.next();
+      udp_conn_idle_start(i_udp_conn.value());
+    }
+  }
 
   if (params.needRestart(old_params))
   {
-    log(LOG_DBG1, QString(": stopping and restarting tunnel due to changed tunnel parameters"));
-    state.flags |= TunnelState::TF_STOPPING;
+    OBJ_LOG(this, LOG_DBG1, QString(": stopping and restarting tunnel due to changed tunnel parameters"));
     restart_after_stop = true;
-    if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) && mgrconn_out->output_buffer.length()+mgrconn_out->bytesToWrite() < 64*1024)
-    {
-      mgrconn_out->sendPacket(CMD_TUN_STOP);
-      mgrconn_out->sendPacket(CMD_CLOSE);
-    }
-    else
-      stop();
+    stop_chain();
+  }
+}
+
+//---------------------------------------------------------------------------
+// stop the tunnel letting next tunservers in chain stop first
+void Tunnel::stop_chain()
+{
+  state.flags |= TunnelState::TF_STOPPING;
+  if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) && mgrconn_out->outputBytesPending() < 64*1024)
+  {
+    mgrconn_out->sendPacket(CMD_TUN_STOP);
+    mgrconn_out->sendPacket(CMD_CLOSE);
+  }
+  else
+    stop();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::remove_chain()
+{
+  to_be_deleted = true;
+  params_mutex.lock();
+  params.flags &= ~TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY;
+  params_mutex.unlock();
+  stop_chain();
+}
+
+//---------------------------------------------------------------------------
+bool Tunnel::config_print(cJSON *j_item)
+{
+  if (!(params.flags & TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY) ||
+      !(state.flags & TunnelState::TF_CHECK_PASSED))
+    return false;
+  params.printJSON(j_item);
+  state.flags |= TunnelState::TF_SAVED_IN_CONFIG;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+static void mgrconn_metrics_add(MgrClientConnection *conn, qint64 &pending, quint64 &compress_bytes_in, quint64 &compress_bytes_out)
+{
+  if (!conn)
+    return;
+  pending += conn->outputBytesPending();
+  compress_bytes_in += conn->bytes_snd_compressible;
+  compress_bytes_out += conn->bytes_snd_compressed;
+}
+
+//---------------------------------------------------------------------------
+// counters of a mgrconn being detached from the tunnel are kept by the tunnel, so its totals never go back
+void Tunnel::mgrconn_counters_fold(MgrClientConnection *conn)
+{
+  if (!conn)
+    return;
+  stage_counters.add(conn->stage_counters);
+  conn->stage_counters = StageCounters();
+  compress_bytes_in += conn->bytes_snd_compressible;
+  compress_bytes_out += conn->bytes_snd_compressed;
+  conn->bytes_snd_compressible = 0;
+  conn->bytes_snd_compressed = 0;
+}
+
+//---------------------------------------------------------------------------
+static quint64 mgrconn_buffered(const MgrClientConnection *conn)
+{
+  if (!conn)
+    return 0;
+  return conn->outputBytesPending()+conn->inputBytesPending();
+}
+
+//---------------------------------------------------------------------------
+// retransmit and reorder buffers, data queued in chain mgrconns and in application connections;
+// the latter are summed up periodically only, as this is called on every packet
+quint64 Tunnel::memory_usage() const
+{
+  quint64 bytes = buffered_packets_total_len+reorder_packets_total_len+conn_buffered_bytes;
+  bytes += mgrconn_buffered(mgrconn_in);
+  bytes += mgrconn_buffered(mgrconn_out);
+  for (int i=0; i < mgrconn_in_stripes.count(); i++)
+    bytes += mgrconn_buffered(mgrconn_in_stripes[i].conn);
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+    bytes += mgrconn_buffered(mgrconn_out_stripes[i].conn);
+  return bytes;
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::conn_buffered_update()
+{
+  quint64 bytes = 0;
+  foreach (TunnelConn *conn, in_conn_list)
+    bytes += conn->bytesBuffered();
+  foreach (TunnelConn *conn, out_conn_list)
+    bytes += conn->bytesBuffered();
+  conn_buffered_bytes = bytes;
+}
+
+//---------------------------------------------------------------------------
+// queued by memory_governor when the account is no longer throttled: connections paused by it read again
+void Tunnel::memory_resume()
+{
+  foreach (TunnelConn *conn, in_conn_list)
+    conn->readResume();
+  foreach (TunnelConn *conn, out_conn_list)
+    conn->readResume();
+}
+
+//---------------------------------------------------------------------------
+// reading of an evicted tunnel's application connections is paused, so it may never queue another packet
+// and reach the check in queueOutPacket()/queueInPacket() - buffers are dropped here instead
+void Tunnel::memory_evict()
+{
+  if (!(state.flags & TunnelState::TF_STARTED) || (state.flags & TunnelState::TF_STOPPING))
+    return;
+  OBJ_LOG(this, LOG_DBG1, QString(": server memory budget exhausted - dropping %1 buffered bytes and restarting tunnel").arg(memory_usage()));
+  buffered_packets_id_list.clear();
+  buffered_packets_list.clear();
+  buffered_packets_stripe_list.clear();
+  buffered_packets_total_len = 0;
+  reorder_packets_clear();
+  memory_usage_update();
+  QTimer::singleShot(0, this, SLOT(restart()));
+}
+
+//---------------------------------------------------------------------------
+static void mgrconn_trim(MgrClientConnection *conn, quint64 &trimmed, quint64 &retained)
+{
+  if (!conn)
+    return;
+  trimmed += conn->trimBuffers();
+  retained += conn->bufferCapacity();
+}
+
+//---------------------------------------------------------------------------
+// low-priority pass (timer_buffer_trim): connections keep the capacity their buffers grew to during a burst,
+// which adds up to megabytes per tunnel when there are many mostly idle ones
+void Tunnel::buffers_trim()
+{
+  quint64 trimmed = 0;
+  quint64 retained = 0;
+  foreach (TunnelConn *conn, in_conn_list)
+  {
+    trimmed += conn->trimBuffers();
+    retained += conn->bufferCapacity();
+  }
+  foreach (TunnelConn *conn, out_conn_list)
+  {
+    trimmed += conn->trimBuffers();
+    retained += conn->bufferCapacity();
+  }
+  mgrconn_trim(mgrconn_in, trimmed, retained);
+  mgrconn_trim(mgrconn_out, trimmed, retained);
+  for (int i=0; i < mgrconn_in_stripes.count(); i++)
+    mgrconn_trim(mgrconn_in_stripes[i].conn, trimmed, retained);
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+    mgrconn_trim(mgrconn_out_stripes[i].conn, trimmed, retained);
+  if (trimmed > 0)
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes of idle buffer capacity released, %2 bytes retained").arg(trimmed).arg(retained));
+  buffer_trimmed_bytes += trimmed;
+  buffer_retained_bytes = retained;
+}
+
+//---------------------------------------------------------------------------
+// called every METRICS_UPDATE_INTERVAL by MgrServer (queued), so /metrics never has to wait for the tunnel's thread
+void Tunnel::metrics_update()
+{
+  conn_buffered_update();
+  memory_usage_update();
+  if (mem_account.state() == MemoryAccount::ST_EVICT)
+    memory_evict();
+  TunnelMetrics m;
+  m.id = params.id;
+  m.name = params.name;
+  m.flags = state.flags;
+  m.latency_ms = state.latency_ms;
+  m.stats = state.stats;
+  m.buffered_packets_count = buffered_packets_id_list.count();
+  m.buffered_packets_len = buffered_packets_total_len;
+  m.reorder_packets_count = reorder_packets.count();
+  m.in_conn_count = in_conn_list.count();
+  m.out_conn_count = out_conn_list.count();
+  m.udp_conn_count = udp_conn_list_by_id.count();
+  m.compress_bytes_in = compress_bytes_in;
+  m.compress_bytes_out = compress_bytes_out;
+  m.stages = stagesCopy();
+  m.memory_bytes = memory_usage();
+  m.memory_state = mem_account.state();
+  m.buffer_retained_bytes = buffer_retained_bytes;
+  m.buffer_trimmed_bytes = buffer_trimmed_bytes;
+  mgrconn_metrics_add(mgrconn_in, m.mgrconn_in_pending, m.compress_bytes_in, m.compress_bytes_out);
+  mgrconn_metrics_add(mgrconn_out, m.mgrconn_out_pending, m.compress_bytes_in, m.compress_bytes_out);
+  for (int i=0; i < mgrconn_in_stripes.count(); i++)
+    mgrconn_metrics_add(mgrconn_in_stripes[i].conn, m.mgrconn_in_pending, m.compress_bytes_in, m.compress_bytes_out);
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+    mgrconn_metrics_add(mgrconn_out_stripes[i].conn, m.mgrconn_out_pending, m.compress_bytes_in, m.compress_bytes_out);
+
+  TunnelHistorySample sample;
+  // counters are reset when tunnel is restarted
+  sample.data_bytes_rcv = state.stats.data_bytes_rcv >= history_prev_stats.data_bytes_rcv ? state.stats.data_bytes_rcv-history_prev_stats.data_bytes_rcv : state.stats.data_bytes_rcv;
+  sample.data_bytes_snd = state.stats.data_bytes_snd >= history_prev_stats.data_bytes_snd ? state.stats.data_bytes_snd-history_prev_stats.data_bytes_snd : state.stats.data_bytes_snd;
+  sample.conn_new_count = state.stats.conn_total_count >= history_prev_stats.conn_total_count ? state.stats.conn_total_count-history_prev_stats.conn_total_count : state.stats.conn_total_count;
+  sample.conn_cur_count = state.stats.conn_cur_count;
+  sample.latency_ms = state.latency_ms;
+  sample.buffered_packets = m.buffered_packets_count;
+  history_prev_stats = state.stats;
+  history.add(QDateTime::currentMSecsSinceEpoch()/1000, sample);
+
+  QMutexLocker locker(&metrics_mutex);
+  metrics = m;
+}
+
+//---------------------------------------------------------------------------
+StageCounters Tunnel::stagesCopy() const
+{
+  StageCounters counters = stage_counters;
+  if (mgrconn_in)
+    counters.add(mgrconn_in->stage_counters);
+  if (mgrconn_out)
+    counters.add(mgrconn_out->stage_counters);
+  for (int i=0; i < mgrconn_in_stripes.count(); i++)
+  {
+    if (mgrconn_in_stripes[i].conn)
+      counters.add(mgrconn_in_stripes[i].conn->stage_counters);
+  }
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+  {
+    if (mgrconn_out_stripes[i].conn)
+      counters.add(mgrconn_out_stripes[i].conn->stage_counters);
+  }
+  return counters;
+}
+
+//---------------------------------------------------------------------------
+// CMD_TUN_STAGES_GET reply data (after TunnelId): quint8 stage count, then nsecs (quint64) and calls (quint64) of every stage
+QByteArray Tunnel::stagesPrintToBuffer() const
+{
+  StageCounters counters = stagesCopy();
+  quint8 stage_count = STAGE_COUNT;
+  QByteArray buffer;
+  buffer.reserve(sizeof(stage_count)+STAGE_COUNT*2*sizeof(quint64));
+  buffer.append((const char *)&stage_count, sizeof(stage_count));
+  for (int i=0; i < STAGE_COUNT; i++)
+  {
+    buffer.append((const char *)&counters.nsecs[i], sizeof(quint64));
+    buffer.append((const char *)&counters.calls[i], sizeof(quint64));
   }
+  return buffer;
+}
+
+//---------------------------------------------------------------------------
+static void latency_print(QByteArray &buffer, LatencyHistogramKind kind, const LatencyHistogram &histogram)
+{
+  if (histogram.count == 0)
+    return;
+  quint8 kind_id = kind;
+  buffer.append((const char *)&kind_id, sizeof(kind_id));
+  buffer.append(histogram.printToBuffer());
+}
+
+//---------------------------------------------------------------------------
+// CMD_TUN_LATENCY_GET reply data (after MgrPacket_StandartReply): sequence of LatencyHistogramKind (quint8) + LatencyHistogram
+QByteArray Tunnel::latencyPrintToBuffer() const
+{
+  QByteArray buffer;
+  latency_print(buffer, LH_CHAIN_RTT, latency_chain_rtt);
+  if (mgrconn_in)
+    latency_print(buffer, LH_MGRCONN_IN_RTT, mgrconn_in->latency_histogram);
+  if (mgrconn_out)
+    latency_print(buffer, LH_MGRCONN_OUT_RTT, mgrconn_out->latency_histogram);
+  latency_print(buffer, LH_CONNECT_TIME, latency_connect);
+  latency_print(buffer, LH_ACK_DELAY, latency_ack_delay);
+  return buffer;
 }
 
 //---------------------------------------------------------------------------
 void Tunnel::log(LogPriority prio, const QString &text)
 {
-  prc_log(prio, QString("Tunnel '%1'").arg(params.name)+text);
+  if (!prc_log_enabled(prio))
+    return;
+  if (log_prefix.isEmpty() || log_prefix_name != params.name)
+  {
+    log_prefix_name = params.name;
+    log_prefix = QString("Tunnel '%1'").arg(params.name);
+  }
+  prc_log(prio, log_prefix+text);
 }
 
 //---------------------------------------------------------------------------
@@ -206,10 +519,12 @@ void Tunnel::stop()
 {
   if (!(state.flags & TunnelState::TF_STARTED))
     return;
-  if (timer_failure_tolerance->isActive())
-    timer_failure_tolerance->stop();
-  if (timer_chain_heartbeat->isActive())
-    timer_chain_heartbeat->stop();
+  if (timer_failure_tolerance.isActive())
+    timer_failure_tolerance.stop();
+  if (timer_chain_heartbeat.isActive())
+    timer_chain_heartbeat.stop();
+  timer_buffer_trim.stop();
+  buffer_retained_bytes = 0;
   if (udp_remote_addr_lookup_in_progress)
   {
     QHostInfo::abortHostLookup(udp_remote_addr_lookup_id);
@@ -219,7 +534,10 @@ void Tunnel::stop()
   bind_stop();
   state.flags &= ~TunnelState::TF_STARTED;
   state.flags &= ~TunnelState::TF_STOPPING;
+  params_mutex.lock();
   params.next_id = 0;
+  params_mutex.unlock();
+  close_mgrconn_stripes(mgrconn_out_stripes);
   if (mgrconn_out)
   {
     // disable auto-reconnect
@@ -230,11 +548,14 @@ void Tunnel::stop()
     else
       mgrconn_out->abort();
     disconnect(mgrconn_out, 0, this, 0);
+    mgrconn_out->setPacketHandler(NULL);
+    mgrconn_counters_fold(mgrconn_out);
     mgrconn_out->deleteLater();
     mgrconn_out = NULL;
   }
   if (!(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
+    close_mgrconn_stripes(mgrconn_in_stripes);
     if (mgrconn_in)
     {
       // disconnect or abort if connected
@@ -243,19 +564,30 @@ void Tunnel::stop()
       else
         mgrconn_in->abort();
       disconnect(mgrconn_in, 0, this, 0);
+      mgrconn_in->setPacketHandler(NULL);
+      mgrconn_counters_fold(mgrconn_in);
       mgrconn_in->deleteLater();
       mgrconn_in = NULL;
     }
   }
-  this->log(LOG_DBG1, QString(": stopped"));
+  OBJ_LOG(this, LOG_DBG1, QString(": stopped"));
   buffered_packets_list.clear();
   buffered_packets_id_list.clear();
+  buffered_packets_stripe_list.clear();
   buffered_packets_total_len = 0;
   buffered_packets_rcv_count = 0;
   buffered_packets_rcv_total_len = 0;
+  reorder_packets_clear();
   in_conn_info_list.clear();
+  conn_buffered_bytes = 0;
+  memory_usage_update();
   emit stopped();
-  emit state_changed();
+  if (!restart_after_stop &&
+      (!(state.flags & TunnelState::TF_CHECK_PASSED) ||
+       !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER) ||
+       to_be_deleted))
+    emit remove_requested(params.id);
+  emit state_changed(params.id);
   if (restart_after_stop)
   {
     QTimer::singleShot(0, this, SLOT(start()));
@@ -269,7 +601,7 @@ void Tunnel::mgrconn_out_packetReceived(MgrPacketCmd cmd, const QByteArray &data
   switch (cmd)
   {
     case CMD_AUTH_REP:
-      mgrconn_out_authRepPacketReceived(data);
+      mgrconn_out_authRepPacketReceived(mgrconn_out, data);
       break;
     case CMD_TUN_CREATE_REPLY:
       cmd_tun_create_reply_received(data);
@@ -299,56 +631,10 @@ void Tunnel::mgrconn_out_packetReceived(MgrPacketCmd cmd, const QByteArray &data
     case CMD_TUN_CONN_IN_DROP:
     case CMD_TUN_CONN_IN_DATA:
     case CMD_TUN_CONN_OUT_DATA:
-    {
-      if (forward_packet(mgrconn_out, cmd, data))
-        break;
-      int data_header_len = sizeof(TunnelConnPacketId)+sizeof(TunnelConnId);
-      if (data.length() < data_header_len)
-      {
-        mgrconn_out->log(LOG_DBG1, QString(": CMD_TUN_CONN_... packet too short"));
-        mgrconn_out->abort();
-        return;
-      }
-      if (!t_last_buffered_packet_ack_rcv.isValid())
-        t_last_buffered_packet_ack_rcv.start();
-      TunnelConnPacketId packet_id = *((TunnelConnPacketId *)data.data());
-      TunnelConnId conn_id = *((TunnelConnId *)(data.data()+sizeof(TunnelConnPacketId)));
-      if (!buffered_packet_received(packet_id, data.length()))
-        return;
-      switch(cmd)
-      {
-        case CMD_TUN_CONN_OUT_NEW:
-        {
-          cmd_conn_out_new(conn_id);
-          break;
-        }
-        case CMD_TUN_CONN_OUT_DROP:
-        {
-          cmd_conn_out_drop(conn_id, data.mid(data_header_len));
-          break;
-        }
-        case CMD_TUN_CONN_OUT_CONNECTED:
-        {
-          cmd_conn_out_connected(conn_id, data.mid(data_header_len));
-          break;
-        }
-        case CMD_TUN_CONN_IN_DROP:
-        {
-          cmd_conn_in_drop(conn_id, data.mid(data_header_len));
-          break;
-        }
-        case CMD_TUN_CONN_IN_DATA:
-        case CMD_TUN_CONN_OUT_DATA:
-        {
-          cmd_conn_data(cmd == CMD_TUN_CONN_IN_DATA ? TunnelConn::INCOMING : TunnelConn::OUTGOING,
-                        conn_id, data.mid(data_header_len));
-          break;
-        }
-      }
+      conn_packet_received(mgrconn_out, cmd, data);
       break;
-    }
     default:
-      mgrconn_out->log(LOG_DBG1, QString(": Unknown packet cmd %1 - dropping connection").arg(cmd));
+      OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": Unknown packet cmd %1 - dropping connection").arg(cmd));
       mgrconn_out->abort();
       break;
   }
@@ -362,11 +648,11 @@ void Tunnel::udp_hostLookupFinished(const QHostInfo &hostInfo)
     udp_remote_addr = hostInfo.addresses().first();
   if (udp_remote_addr.isNull())
   {
-    this->log(LOG_DBG1, QString(": host '%1' lookup failed: ").arg(hostInfo.hostName())+hostInfo.errorString());
+    OBJ_LOG(this, LOG_DBG1, QString(": host '%1' lookup failed: ").arg(hostInfo.hostName())+hostInfo.errorString());
     close_outgoing_connections();
     return;
   }
-  this->log(LOG_DBG1, QString(": host '%1' lookup finished, IP address is %2").arg(hostInfo.hostName()).arg(udp_remote_addr.toString()));
+  OBJ_LOG(this, LOG_DBG1, QString(": host '%1' lookup finished, IP address is %2").arg(hostInfo.hostName()).arg(udp_remote_addr.toString()));
   QHashIterator<TunnelConnId, TunnelUdpConn *> i_udp_conn(udp_conn_list_by_id);
   while (i_udp_conn.hasNext())
   {
@@ -377,7 +663,7 @@ void Tunnel::udp_hostLookupFinished(const QHostInfo &hostInfo)
       for (int i=0; i < conn->output_buffer.count(); i++)
       {
         conn->udp_sock->writeDatagram(conn->output_buffer[i], udp_remote_addr, params.remote_port);
-        log(LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn->id).arg(udp_remote_addr.toString()).arg(params.remote_port).arg(conn->output_buffer[i].length()));
+        OBJ_LOG(this, LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn->id).arg(udp_remote_addr.toString()).arg(params.remote_port).arg(conn->output_buffer[i].length()));
       }
     }
     conn->output_buffer.clear();
@@ -12,6 +12,7 @@
 #include <QObject>
 #include "../lib/tunnel-parameters.h"
 #include "../lib/tunnel-state.h"
+#include "../lib/tunnel-history.h"
 #include "../lib/mgrclient-conn.h"
 #include "../lib/prc_log.h"
 #include <QTcpServer>
@@ -19,7 +20,14 @@
 #include <QUdpSocket>
 #include <QHostInfo>
 #include <QTimer>
+#include <QVector>
+#include <QMutex>
 #include "tunnel_conn.h"
+#include "tunnel_flightrec.h"
+#include "memory_governor.h"
+#include "tunnel_listener.h"
+
+Q_DECLARE_METATYPE(cJSON*);
 
 #define BUFFERED_PACKET_MIN_SIZE                          1024
 #define BUFFERED_PACKETS_MAX_COUNT                       10000
@@ -27,28 +35,133 @@
 #define BUFFERED_PACKETS_MIN_SIZE_BEFORE_ACK         1024*1024
 #define BUFFERED_PACKETS_TIMEOUT_BEFORE_ACK               1000
 #define BUFFERED_PACKET_OPTIMAL_TRANSFER_TIME             1000
+#define BUFFERED_PACKETS_REORDER_MAX_COUNT                1000
+#define BUFFERED_PACKETS_REORDER_TIMEOUT                   500
+
+#define TUNNEL_MAX_MGRCONN_STRIPES                          16
+#define TUNNEL_STRIPE_RECONNECT_INTERVAL                  5000
+#define TUNNEL_CONN_POOL_SIZE                              256     // closed TunnelConn objects kept for reuse
+#define TUNNEL_BUFFER_TRIM_INTERVAL                      10000     // ms, releasing capacity of drained connection buffers
+#define TUNNEL_MAX_BIND_LISTENERS                           16
+#define TUNNEL_BIND_DEFAULT_BACKLOG                         50     // same as QTcpServer::listen()
 
 typedef quint16 TunnelConnPacketId;
 typedef quint32 TunnelConnPacketCount;
 
-class Tunnel: public QObject
+struct __attribute__ ((__packed__)) MgrPacket_TunnelStripeAttach
+{
+  TunnelId tunnel_id;                 // tunnel id on the tunserver the stripe is attached to
+  TunnelId orig_tunnel_id;            // tunnel id on the tunserver which has opened the stripe
+  quint8 stripe_index;                // 1..mgrconn_stripes-1 (0 is the main mgrconn)
+
+  MgrPacket_TunnelStripeAttach()
+  {
+    tunnel_id = 0;
+    orig_tunnel_id = 0;
+    stripe_index = 0;
+  }
+
+};
+
+// additional tunserver-tunserver mgrconn which carries data packets along with main mgrconn_in/mgrconn_out
+struct TunnelStripe
+{
+  MgrClientConnection *conn;
+  bool attached;                      // stripe is attached to the tunnel on the other side and can be used for data packets
+
+  TunnelStripe()
+  {
+    conn = NULL;
+    attached = false;
+  }
+};
+
+// data packet received ahead of time (through another stripe) and waiting for its turn
+struct TunnelReorderedPacket
+{
+  MgrPacketCmd cmd;
+  QByteArray data;
+};
+
+// snapshot of tunnel counters published by the tunnel itself for /metrics (read without touching tunnel's thread)
+struct TunnelMetrics
+{
+  TunnelId id;
+  QString name;
+  quint64 flags;                      // TunnelState::flags
+  qint32 latency_ms;
+  TunnelStatistics stats;
+  quint32 buffered_packets_count;     // sent data packets waiting for ack (retransmit buffer)
+  quint32 buffered_packets_len;
+  quint32 reorder_packets_count;
+  qint64 mgrconn_in_pending;          // bytes queued in mgrconn_in and its stripes
+  qint64 mgrconn_out_pending;         // bytes queued in mgrconn_out and its stripes
+  quint32 in_conn_count;
+  quint32 out_conn_count;
+  quint32 udp_conn_count;
+  quint64 compress_bytes_in;          // data bytes which compression was tried for (tunnel and its mgrconns)
+  quint64 compress_bytes_out;
+  StageCounters stages;
+  quint64 memory_bytes;               // buffer bytes charged to memory_governor
+  int memory_state;                   // MemoryAccount::State
+  quint64 buffer_retained_bytes;      // capacity of connection buffers after last trim pass
+  quint64 buffer_trimmed_bytes;       // capacity released by trim passes since tunnel start
+
+  TunnelMetrics()
+  {
+    id = 0;
+    flags = 0;
+    latency_ms = -1;
+    buffered_packets_count = 0;
+    buffered_packets_len = 0;
+    reorder_packets_count = 0;
+    mgrconn_in_pending = 0;
+    mgrconn_out_pending = 0;
+    in_conn_count = 0;
+    out_conn_count = 0;
+    udp_conn_count = 0;
+    compress_bytes_in = 0;
+    compress_bytes_out = 0;
+    memory_bytes = 0;
+    memory_state = MemoryAccount::ST_OK;
+    buffer_retained_bytes = 0;
+    buffer_trimmed_bytes = 0;
+  }
+};
+
+class Tunnel: public QObject, public TimerWheelClient, public MgrPacketHandler, public TunnelConnHandler, public IoUringClient
 {
   Q_OBJECT
 public:
   friend class TunnelConn;
+  friend class TunnelListener;
 
-  TunnelParameters params;                        // tunnel parameters
+  enum MgrconnRole { MGRCONN_ROLE_IN=1,              // mgrconn_in and its stripes (handed over by MgrServer)
+                     MGRCONN_ROLE_OUT,               // mgrconn_out
+                     MGRCONN_ROLE_OUT_STRIPE         // mgrconn_out_stripes
+                   };
+
+  TunnelParameters params;                        // tunnel parameters (modified in tunnel thread only, under params_mutex)
+  QSharedPointer<const TunnelParameters> conn_params;   // see connParams()
   TunnelState state;                              // tunnel state
   MgrClientConnection *mgrconn_in;                // incoming management connection (previous tunserver in chain or GUI)
   MgrClientConnection *mgrconn_out;               // outgoing management connection (next tunserver in chain)
+  QVector<TunnelStripe> mgrconn_in_stripes;       // additional incoming mgrconns (stripe_index-1)
+  QVector<TunnelStripe> mgrconn_out_stripes;      // additional outgoing mgrconns (stripe_index-1)
 
   QTcpServer *bind_tcpServer;
+  IoUringOp *bind_uring_accept;                   // multishot accept on bind_tcpServer's socket (accepting is paused in Qt)
+  QList<TunnelListener *> bind_tcpListeners;      // additional SO_REUSEPORT listeners running in their own threads
+  QString bind_reuseport_key;                     // address:port reserved by TunnelListener::reservePort()
   QUdpSocket *bind_udpSocket;
   QLocalServer *bind_pipeServer;
 
   QHash<TunnelConnId, TunnelConn *> in_conn_list;
   QHash<TunnelConnId, TunnelConn *> out_conn_list;
-  QHash<TunnelConnId, TunnelConnInInfo> in_conn_info_list;
+  QList<TunnelConn *> conn_pool;                  // closed connections ready for reuse (signals stay connected)
+  QList<TunnelConn *> conn_pool_released;         // closed connections to be recycled on next event loop iteration
+  bool conn_pool_recycle_queued;
+  QHash<TunnelConnId, QSharedPointer<TunnelConnInInfo> > in_conn_info_list;  // connections keep their own reference (TunnelConn::info)
 
   QHash<TunnelConnId, TunnelUdpConn *> udp_conn_list_by_id;
   QHash<QString, TunnelUdpConn *> udp_conn_list_by_addr;            // key is ipaddr:port
@@ -58,17 +171,15 @@ public:
   quint16 next_udp_port;
 
   TunnelConnId unique_conn_id;
-  QTimer *timer_failure_tolerance;
+  TimerWheelTimer timer_failure_tolerance;
 
   QTime t_last_buffered_packet_ack_rcv;
 
-  QTimer *timer_chain_heartbeat;
-  QTime t_last_chain_heartbeat_req_sent;
+  TimerWheelTimer timer_chain_heartbeat;          // periodic
+  TimerWheelTimer timer_buffer_trim;              // periodic, TUNNEL_BUFFER_TRIM_INTERVAL
+  QElapsedTimer t_last_chain_heartbeat_req_sent;
   bool chain_heartbeat_rep_received;
 
-  QTime t_last_state_sent;
-  bool state_dispatch_queued;
-
   bool to_be_deleted;
   bool restart_after_stop;
 
@@ -80,7 +191,7 @@ public:
     udp_remote_addr_lookup_in_progress = false;
 
     restart_after_stop = false;
-    state_dispatch_queued = false;
+    conn_pool_recycle_queued = false;
 
     seq_packet_id = 1;
     expected_packet_id = 1;
@@ -92,35 +203,90 @@ public:
     chain_heartbeat_rep_received = false;
 
     bind_tcpServer = NULL;
+    bind_uring_accept = NULL;
     bind_udpSocket = NULL;
     bind_pipeServer = NULL;
 
-    timer_failure_tolerance = new QTimer(this);
-    timer_failure_tolerance->setSingleShot(true);
-    connect(timer_failure_tolerance, SIGNAL(timeout()), this, SLOT(failure_tolerance_timedout()));
-
-    timer_buffered_packets_ack = new QTimer(this);
-    timer_buffered_packets_ack->setSingleShot(true);
-    timer_buffered_packets_ack->setInterval(BUFFERED_PACKETS_TIMEOUT_BEFORE_ACK);
-    connect(timer_buffered_packets_ack, SIGNAL(timeout()), this, SLOT(buffered_packets_send_ack()));
-
-    timer_chain_heartbeat = new QTimer(this);
-    connect(timer_chain_heartbeat, SIGNAL(timeout()), this, SLOT(chain_heartbeat_timeout()));
+    // timers are scheduled into the thread's timer wheel, see timerWheelExpired()
+    timer_failure_tolerance.client = this;
+    timer_buffered_packets_ack.client = this;
+    timer_buffered_packets_ack.setInterval(BUFFERED_PACKETS_TIMEOUT_BEFORE_ACK);
+    timer_chain_heartbeat.client = this;
+    timer_buffer_trim.client = this;
+    timer_buffer_trim.setInterval(TUNNEL_BUFFER_TRIM_INTERVAL);
+    buffer_retained_bytes = 0;
+    buffer_trimmed_bytes = 0;
+    timer_reorder.client = this;
+    timer_reorder.setInterval(BUFFERED_PACKETS_REORDER_TIMEOUT);
 
     unique_conn_id = 1;
     buffered_packets_total_len = 0;
     buffered_packets_rcv_count = 0;
     buffered_packets_rcv_total_len = 0;
+    reorder_packets_total_len = 0;
     cur_data_packet_size = 4*1024;
+    compress_bytes_in = 0;
+    compress_bytes_out = 0;
+    conn_buffered_bytes = 0;
+    mem_account.setResumeReceiver(this);
   }
   ~Tunnel()
   {
     to_be_deleted = true;
     stop();
+    conn_pool_clear();
     log(LOG_DBG4, QString(": destroyed"));
   }
 
   void log(LogPriority prio, const QString &text);
+  QString log_prefix;                   // cached "Tunnel 'name'" prefix
+  QString log_prefix_name;              // tunnel name log_prefix was built for
+
+  // tunnel may run in a worker thread, so MgrServer reads its parameters through a copy
+  TunnelParameters paramsCopy() const
+  {
+    QMutexLocker locker(&params_mutex);
+    return params;
+  }
+  // immutable snapshot of params referenced by application connections (tunnel thread only, rebuilt after setNewParams)
+  QSharedPointer<const TunnelParameters> connParams()
+  {
+    if (!conn_params)
+      conn_params = QSharedPointer<const TunnelParameters>(new TunnelParameters(params));
+    return conn_params;
+  }
+  Q_INVOKABLE quint64 stateFlags() const { return state.flags; }
+  Q_INVOKABLE QByteArray statePrintToBuffer(bool include_stat) const { return state.printToBuffer(include_stat); }
+  Q_INVOKABLE bool config_print(cJSON *j_item);
+
+  FlightRecorder flightrec;             // last packet events for post-mortem analysis
+  Q_INVOKABLE QByteArray flightrecDump() const { return flightrec.dump(params.id); }
+
+  // buffered data packets compression statistics, including mgrconns already detached (never reset, /metrics counters)
+  quint64 compress_bytes_in;
+  quint64 compress_bytes_out;
+  Q_INVOKABLE void metrics_update();
+
+  LatencyHistogram latency_chain_rtt;   // LH_CHAIN_RTT
+  LatencyHistogram latency_connect;     // LH_CONNECT_TIME
+  LatencyHistogram latency_ack_delay;   // LH_ACK_DELAY
+  Q_INVOKABLE QByteArray latencyPrintToBuffer() const;
+
+  StageCounters stage_counters;         // data path timing of this tunnel and of its mgrconns already detached
+  StageCounters stagesCopy() const;     // including mgrconns
+  Q_INVOKABLE QByteArray stagesPrintToBuffer() const;
+
+  TunnelHistory history;                // per-second throughput samples, filled by metrics_update()
+  TunnelStatistics history_prev_stats;  // counters at the previous sample
+  Q_INVOKABLE QByteArray historyPrintToBuffer(quint32 interval, quint32 from_time, quint32 to_time) const
+  {
+    return history.tier(interval).printToBuffer(from_time, to_time);
+  }
+  TunnelMetrics metricsCopy() const
+  {
+    QMutexLocker locker(&metrics_mutex);
+    return metrics;
+  }
 
   bool queueInPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPacketId packet_id, const QByteArray &_data=QByteArray());
   bool queueOutPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPacketId packet_id, const QByteArray &_data=QByteArray());
@@ -132,10 +298,17 @@ public:
     return packet_id;
   }
 
-  void setNewParams(TunnelParameters *new_params);
-
-  void mgrconn_in_disconnected();
+  void mgrconn_in_disconnected(MgrClientConnection *conn);
   void mgrconn_in_restored();
+  void mgrconn_in_packet(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data);
+  bool isMgrconnIn(MgrClientConnection *conn) const
+  {
+    return conn == mgrconn_in || (conn && stripeIndex(mgrconn_in_stripes, conn) > 0);
+  }
+  bool isMgrconnOut(MgrClientConnection *conn) const
+  {
+    return conn == mgrconn_out || (conn && stripeIndex(mgrconn_out_stripes, conn) > 0);
+  }
 
   void cmd_conn_out_new(TunnelConnId conn_id);
   void cmd_conn_out_drop(TunnelConnId conn_id, const QByteArray &data);
@@ -151,12 +324,21 @@ public:
   void cmd_tun_chain_restored(MgrClientConnection *conn);
   void cmd_tun_heartbeat(MgrPacketCmd cmd, MgrClientConnection *conn);
 
-  QByteArray in_connPrintToBuffer(bool include_disconnected=false);
+  Q_INVOKABLE QByteArray in_connPrintToBuffer(bool include_disconnected=false);
 
   bool buffered_packet_received(TunnelConnPacketId packet_id, quint32 packet_len);
+  void conn_packet_received(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data);
 
   bool forward_packet(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data);
 
+  void timerWheelExpired(TimerWheelTimer *timer);
+  void mgrPacketReceived(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data);
+  void connDataReceived(TunnelConn *conn);
+  void ioUringCompleted(IoUringOp *op, int result, const char *data, bool final);
+
+protected:
+  virtual bool event(QEvent *e);
+
 public slots:
 
   void start();
@@ -167,44 +349,74 @@ public slots:
     if (!this->to_be_deleted)
       start();
   }
+  void stop_chain();
+  void stop_and_remove()
+  {
+    to_be_deleted = true;
+    stop();
+  }
+  void remove_chain();
+
+  void setNewParams(TunnelParameters *new_params);
+  void mgrconn_in_reattached(MgrClientConnection *conn, TunnelParameters *new_params);
+  void mgrconn_in_stripe_attached(MgrClientConnection *conn, quint8 stripe_index);
 
 signals:
   void started();
   void stopped();
+  // tunnel's id is passed along because the tunnel may already be deleted when MgrServer gets the signal
+  void remove_requested(TunnelId tunnel_id);      // tunnel is stopped and is not going to be restarted
 
-  void state_changed();
+  void state_changed(TunnelId tunnel_id);
 
 private slots:
+  void mgrconn_in_finished();
   void mgrconn_out_state_changed(quint16 mgr_conn_state);
   void mgrconn_out_connection_error(QAbstractSocket::SocketError error);
-  void mgrconn_out_packetReceived(MgrPacketCmd cmd, const QByteArray &data);
+  void mgrconn_out_stripe_state_changed(quint16 mgr_conn_state);
+  void start_mgrconn_out_stripes();
 
   void new_incoming_conn();
-  void incoming_connection_finished(int error_code, const QString &error_str);
-  void connection_dataReceived();
+  void new_incoming_accepted();
+  void connection_finished(int error_code, const QString &error_str);
   void connection_bytesWritten(qint64);
   void connection_udpIncomingRead();
   void connection_udpOutgoingRead();
   void outgoing_connection_established();
-  void outgoing_connection_finished(int error_code, const QString &error_str);
+  void conn_pool_recycle();
   void failure_tolerance_timedout();
   void udp_hostLookupFinished(const QHostInfo &hostInfo);
 
   void chain_heartbeat_timeout();
 
   void buffered_packets_send_ack();
+  void reorder_timeout();
+  void timers_resume();
 
   void mgrconn_bytesReceived(quint64 bytes);
   void mgrconn_bytesSent(quint64 bytes);
   void mgrconn_bytesSentEncrypted(quint64 encrypted_bytes);
 
+  void memory_resume();
+
 private:
-  void mgrconn_out_authRepPacketReceived(const QByteArray &req_data);
+  void mgrconn_out_authRepPacketReceived(MgrClientConnection *conn, const QByteArray &req_data);
+
+  mutable QMutex params_mutex;
+
+  mutable QMutex metrics_mutex;
+  TunnelMetrics metrics;
 
   QList<TunnelConnPacketId> buffered_packets_id_list;
   QList<QByteArray> buffered_packets_list;
+  QList<quint8> buffered_packets_stripe_list;     // stripe_index of mgrconn the packet has been sent through
   quint32 buffered_packets_total_len;
 
+  QHash<TunnelConnPacketId, TunnelReorderedPacket> reorder_packets;
+  quint32 reorder_packets_total_len;
+  MemoryAccount mem_account;                      // buffer bytes of this tunnel in server-wide budget
+  TimerWheelTimer timer_reorder;
+
   quint32 cur_data_packet_size;
 
   TunnelConnPacketCount buffered_packets_rcv_count;
@@ -212,19 +424,59 @@ private:
   TunnelConnPacketId expected_packet_id;
   TunnelConnPacketId last_rcv_packet_id;
 
-  QTimer *timer_buffered_packets_ack;
+  TimerWheelTimer timer_buffered_packets_ack;
   QTime t_last_buffered_packet_rcv;
+  QElapsedTimer t_first_unacked_packet_rcv;       // for latency_ack_delay
   TunnelConnPacketId seq_packet_id;
 
   void mgrconn_in_after_disconnected();
   void mgrconn_out_after_disconnected();
 
   void start_mgrconn_out();
+  void mgrconn_out_packetReceived(MgrPacketCmd cmd, const QByteArray &data);
+  void mgrconn_out_stripe_packetReceived(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data);
+  void close_mgrconn_stripes(QVector<TunnelStripe> &stripes);
+  void mgrconn_out_stripe_closed(MgrClientConnection *conn);
+  void mgrconn_in_stripe_detached(MgrClientConnection *conn);
+  static int stripeIndex(const QVector<TunnelStripe> &stripes, MgrClientConnection *conn);
+  MgrClientConnection *stripeForData(MgrClientConnection *main_conn, QVector<TunnelStripe> &stripes, quint8 &stripe_index);
+  void buffered_packets_resend_stripe(quint8 stripe_index);
+  bool buffered_packet_ahead(TunnelConnPacketId packet_id) const;
+  void buffered_packets_request_resend();
+  void reorder_packets_clear();
+  void conn_packet_process(MgrPacketCmd cmd, const QByteArray &data);
   bool bind_start();
   void bind_stop();
   void close_incoming_connections();
   void close_outgoing_connections();
   void cleanup_in_conn_info_list();
+  void incoming_connection_finished(TunnelConn *in_conn, int error_code, const QString &error_str);
+  void outgoing_connection_finished(TunnelConn *out_conn, int error_code, const QString &error_str);
+  TunnelConn *conn_acquire(TunnelConn::Direction direction);
+  TunnelConn *incoming_conn_acquire();
+  void incoming_conn_start(TunnelConn *new_conn);
+  void new_incoming_tcp_conn(QTcpSocket *sock);
+  void new_incoming_pipe_conn(QLocalSocket *sock);
+  void new_incoming_uring_conn(int fd);
+  bool bind_tcp_listen(const QHostAddress &bind_address, QString &error_str);
+  void bind_tcp_listeners_stop();
+  QMutex bind_accepted_mutex;
+  QList<int> bind_accepted;                       // descriptors accepted by bind_tcpListeners, under bind_accepted_mutex
+  void listener_accepted(int fd);                 // called from listener threads
+  void conn_release(TunnelConn *conn);
+  void conn_pool_clear();
+  void udp_conn_idle_start(TunnelUdpConn *conn);
+  void udp_conn_idle_timeout(TunnelUdpConn *conn);
+  void udp_conn_remove(TunnelUdpConn *conn);
+  quint64 memory_usage() const;
+  quint64 conn_buffered_bytes;                    // application connection buffers as of last conn_buffered_update()
+  void conn_buffered_update();
+  void memory_usage_update() { mem_account.update(memory_usage()); }
+  void memory_evict();
+  void mgrconn_counters_fold(MgrClientConnection *conn);
+  quint64 buffer_retained_bytes;                  // connection buffer capacity after last buffers_trim()
+  quint64 buffer_trimmed_bytes;
+  void buffers_trim();
 
 };
 
@@ -20,24 +20,38 @@ bool Tunnel::bind_start()
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
       state.last_error_str = tr("Invalid bind address '%1' on %2").arg(params.bind_address).arg(SysUtil::machine_name);
-      emit state_changed();
+      emit state_changed(params.id);
       return false;
     }
     bind_tcpServer = new QTcpServer;
     if (params.max_incoming_connections > 0)
       bind_tcpServer->setMaxPendingConnections(params.max_incoming_connections);
     connect(bind_tcpServer, SIGNAL(newConnection()), this, SLOT(new_incoming_conn()));
-    if (!bind_tcpServer->listen(bind_address, params.bind_port))
+    QString error_str;
+    if (!bind_tcp_listen(bind_address, error_str))
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
-      state.last_error_str = tr("Failed to bind to %1:%2 on %3: ").arg(params.bind_address).arg(params.bind_port).arg(SysUtil::machine_name)+bind_tcpServer->errorString();
-      this->log(LOG_DBG1, QString(": ")+state.last_error_str);
+      state.last_error_str = tr("Failed to bind to %1:%2 on %3: ").arg(params.bind_address).arg(params.bind_port).arg(SysUtil::machine_name)+error_str;
+      OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
       delete bind_tcpServer;
       bind_tcpServer = NULL;
-      emit state_changed();
+      emit state_changed(params.id);
       return false;
     }
-    this->log(LOG_DBG1, QString(": binding TCP server on %1:%2 started").arg(bind_tcpServer->serverAddress().toString()).arg(bind_tcpServer->serverPort()));
+    OBJ_LOG(this, LOG_DBG1, QString(": binding TCP server on %1:%2 started").arg(bind_tcpServer->serverAddress().toString()).arg(bind_tcpServer->serverPort())+
+            (bind_tcpListeners.isEmpty() ? QString() : QString(" (%1 listeners)").arg(bind_tcpListeners.count()+1)));
+#if QT_VERSION >= 0x050000
+    IoUringBackend *uring = io_uring_enabled ? IoUringBackend::instance() : NULL;
+    if (uring)
+    {
+      bind_uring_accept = uring->accept(this, (int)bind_tcpServer->socketDescriptor());
+      if (bind_uring_accept)
+      {
+        bind_tcpServer->pauseAccepting();
+        OBJ_LOG(this, LOG_DBG1, QString(": accepting connections through io_uring"));
+      }
+    }
+#endif
   }
   else if (params.app_protocol == TunnelParameters::UDP && !bind_udpSocket)
   {
@@ -46,8 +60,8 @@ bool Tunnel::bind_start()
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
       state.last_error_str = tr("Invalid bind address '%1' on %2").arg(params.bind_address).arg(SysUtil::machine_name);
-      this->log(LOG_DBG1, QString(": ")+state.last_error_str);
-      emit state_changed();
+      OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
+      emit state_changed(params.id);
       return false;
     }
     bind_udpSocket = new QUdpSocket;
@@ -57,13 +71,13 @@ bool Tunnel::bind_start()
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
       state.last_error_str = tr("Failed to bind to %1:%2 on %3: ").arg(params.bind_address).arg(params.bind_port).arg(SysUtil::machine_name)+bind_udpSocket->errorString();
-      this->log(LOG_DBG1, QString(": ")+state.last_error_str);
+      OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
       delete bind_udpSocket;
       bind_udpSocket = NULL;
-      emit state_changed();
+      emit state_changed(params.id);
       return false;
     }
-    this->log(LOG_DBG1, QString(": binding UDP socket on %1:%2 opened").arg(bind_udpSocket->localAddress().toString()).arg(bind_udpSocket->localPort()));
+    OBJ_LOG(this, LOG_DBG1, QString(": binding UDP socket on %1:%2 opened").arg(bind_udpSocket->localAddress().toString()).arg(bind_udpSocket->localPort()));
   }
   else if (params.app_protocol == TunnelParameters::PIPE && !bind_pipeServer)
   {
@@ -71,8 +85,8 @@ bool Tunnel::bind_start()
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
       state.last_error_str = tr("Invalid bind address '%1' on %2").arg(params.bind_address).arg(SysUtil::machine_name);
-      this->log(LOG_DBG1, QString(": ")+state.last_error_str);
-      emit state_changed();
+      OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
+      emit state_changed(params.id);
       return false;
     }
     bind_pipeServer = new QLocalServer;
@@ -83,19 +97,114 @@ bool Tunnel::bind_start()
     {
       state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
       state.last_error_str = tr("Failed to bind to '%1' on %2: ").arg(params.bind_address).arg(SysUtil::machine_name)+bind_pipeServer->errorString();
-      this->log(LOG_DBG1, QString(": ")+state.last_error_str);
+      OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
       delete bind_pipeServer;
       bind_pipeServer = NULL;
-      emit state_changed();
+      emit state_changed(params.id);
       return false;
     }
-    this->log(LOG_DBG1, QString(": binding named pipe '%1' opened").arg(bind_pipeServer->serverName()));
+    OBJ_LOG(this, LOG_DBG1, QString(": binding named pipe '%1' opened").arg(bind_pipeServer->serverName()));
   }
   state.flags |= TunnelState::TF_BINDING;
-  emit state_changed();
+  emit state_changed(params.id);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// bind_tcpServer listens in tunnel's thread; with bind_listeners > 1 more sockets are bound
+// to the same address with SO_REUSEPORT and accept in their own threads (TunnelListener)
+bool Tunnel::bind_tcp_listen(const QHostAddress &bind_address, QString &error_str)
+{
+  int listeners = (int)qBound((quint32)1, params.bind_listeners, (quint32)TUNNEL_MAX_BIND_LISTENERS);
+  if (listeners > 1 && !TunnelListener::reusePortSupported())
+  {
+    OBJ_LOG(this, LOG_DBG1, QString(": SO_REUSEPORT is not supported, using single listener"));
+    listeners = 1;
+  }
+  if (listeners > 1 && params.bind_port == 0)
+  {
+    // every socket would get its own ephemeral port (rejected by MgrServer::tunnel_checkParams())
+    OBJ_LOG(this, LOG_DBG1, QString(": several listeners need a fixed bind port, using single listener"));
+    listeners = 1;
+  }
+  if ((listeners == 1 && params.bind_backlog == 0) || !TunnelListener::supported())
+  {
+    if (bind_tcpServer->listen(bind_address, params.bind_port))
+      return true;
+    error_str = bind_tcpServer->errorString();
+    return false;
+  }
+
+  int backlog = (params.bind_backlog > 0) ? (int)qMin(params.bind_backlog, (quint32)65535) : TUNNEL_BIND_DEFAULT_BACKLOG;
+  bool reuse_port = (listeners > 1);
+  if (reuse_port)
+  {
+    QString key = QString("%1:%2").arg(bind_address.toString()).arg(params.bind_port);
+    if (!TunnelListener::reservePort(key))
+    {
+      error_str = tr("address is already used by another tunnel");
+      return false;
+    }
+    bind_reuseport_key = key;
+  }
+  for (int i=0; i < listeners; i++)
+  {
+    int fd = TunnelListener::openSocket(bind_address, params.bind_port, backlog, reuse_port, error_str);
+    bool started = false;
+    if (fd >= 0 && i == 0)
+    {
+      started = bind_tcpServer->setSocketDescriptor(fd);
+      if (!started)
+      {
+        error_str = bind_tcpServer->errorString();
+        TunnelListener::closeSocket(fd);
+      }
+    }
+    else if (fd >= 0)
+    {
+      TunnelListener *listener = new TunnelListener(this);
+      if (params.max_incoming_connections > 0)
+        listener->setMaxPendingConnections(params.max_incoming_connections);
+      started = listener->start(fd, QString("TunnelListener%1.%2").arg(params.id).arg(i));
+      if (started)
+        bind_tcpListeners.append(listener);
+      else
+      {
+        error_str = listener->errorString();
+        listener->stop();
+      }
+    }
+    if (!started)
+    {
+      bind_tcpServer->close();
+      bind_tcp_listeners_stop();
+      return false;
+    }
+  }
   return true;
 }
 
+//---------------------------------------------------------------------------
+void Tunnel::bind_tcp_listeners_stop()
+{
+  while (!bind_tcpListeners.isEmpty())
+    bind_tcpListeners.takeLast()->stop();
+
+  // listener threads are finished, so nothing is added anymore
+  bind_accepted_mutex.lock();
+  QList<int> accepted = bind_accepted;
+  bind_accepted.clear();
+  bind_accepted_mutex.unlock();
+  for (int i=0; i < accepted.count(); i++)
+    TunnelListener::closeSocket(accepted[i]);
+
+  if (!bind_reuseport_key.isEmpty())
+  {
+    TunnelListener::releasePort(bind_reuseport_key);
+    bind_reuseport_key.clear();
+  }
+}
+
 //---------------------------------------------------------------------------
 void Tunnel::close_incoming_connections()
 {
@@ -145,10 +254,20 @@ void Tunnel::close_outgoing_connections()
 }
 
 //---------------------------------------------------------------------------
-void Tunnel::incoming_connection_finished(int error_code, const QString &error_str)
+void Tunnel::connection_finished(int error_code, const QString &error_str)
 {
-  TunnelConn *in_conn = qobject_cast<TunnelConn *>(sender());
+  TunnelConn *conn = qobject_cast<TunnelConn *>(sender());
+  if (!conn)
+    return;
+  if (conn->direction == TunnelConn::INCOMING)
+    incoming_connection_finished(conn, error_code, error_str);
+  else
+    outgoing_connection_finished(conn, error_code, error_str);
+}
 
+//---------------------------------------------------------------------------
+void Tunnel::incoming_connection_finished(TunnelConn *in_conn, int error_code, const QString &error_str)
+{
   if (!in_conn->closing_by_cmd)
   {
     MgrPacket_StandartReply pkt;
@@ -166,13 +285,13 @@ void Tunnel::incoming_connection_finished(int error_code, const QString &error_s
   state.stats.conn_cur_count--;
 
   in_conn_list.remove(in_conn->id);
-  if (in_conn_info_list.contains(in_conn->id))
+  if (in_conn->info)
   {
-    in_conn_info_list[in_conn->id].t_disconnected = QDateTime::currentDateTime().toUTC();
-    if (in_conn_info_list[in_conn->id].errorstring.isEmpty())
-      in_conn_info_list[in_conn->id].errorstring = error_str.toUtf8();
+    in_conn->info->t_disconnected = QDateTime::currentDateTime().toUTC();
+    if (in_conn->info->errorstring.isEmpty())
+      in_conn->info->errorstring = error_str.toUtf8();
   }
-  in_conn->deleteLater();
+  conn_release(in_conn);
 
   if (in_conn_list.isEmpty() && udp_conn_list_by_id.isEmpty() &&
       !(params.flags & TunnelParameters::FL_PERMANENT_TUNNEL) &&
@@ -182,19 +301,17 @@ void Tunnel::incoming_connection_finished(int error_code, const QString &error_s
     if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED))
     {
       state.flags |= TunnelState::TF_IDLE;
-      mgrconn_out->timer_idle->setInterval(params.idle_timeout);
-      mgrconn_out->log(LOG_DBG1, QString(": starting idle timer (%1 ms)").arg(params.idle_timeout));
-      mgrconn_out->timer_idle->start();
-      emit state_changed();
+      mgrconn_out->timer_idle.setInterval(params.idle_timeout);
+      OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": starting idle timer (%1 ms)").arg(params.idle_timeout));
+      mgrconn_out->timer_idle.start();
+      emit state_changed(params.id);
     }
   }
 }
 
 //---------------------------------------------------------------------------
-void Tunnel::outgoing_connection_finished(int error_code, const QString &error_str)
+void Tunnel::outgoing_connection_finished(TunnelConn *out_conn, int error_code, const QString &error_str)
 {
-  TunnelConn *out_conn = qobject_cast<TunnelConn *>(sender());
-
   if (!out_conn->closing_by_cmd)
   {
     MgrPacket_StandartReply pkt;
@@ -212,16 +329,193 @@ void Tunnel::outgoing_connection_finished(int error_code, const QString &error_s
   state.stats.conn_cur_count--;
 
   out_conn_list.remove(out_conn->id);
-  out_conn->deleteLater();
+  conn_release(out_conn);
+}
+
+//---------------------------------------------------------------------------
+// reuse closed connection object if there is one - its signals are connected already
+TunnelConn *Tunnel::conn_acquire(TunnelConn::Direction direction)
+{
+  TunnelConn *conn;
+  if (!conn_pool.isEmpty())
+  {
+    conn = conn_pool.takeLast();
+    conn->direction = direction;
+    conn->setParams(connParams());
+    conn->t_connected.start();
+    return conn;
+  }
+  // child of the tunnel, so it is moved to another thread along with it
+  conn = new TunnelConn(direction, connParams(), this);
+  connect(conn, SIGNAL(finished(int,QString)), this, SLOT(connection_finished(int,QString)));
+  connect(conn, SIGNAL(connection_established()), this, SLOT(outgoing_connection_established()));
+  connect(conn, SIGNAL(connection_bytesWritten(qint64)), this, SLOT(connection_bytesWritten(qint64)));
+  conn->handler = this;
+  conn->mem_account = &mem_account;
+  return conn;
+}
+
+//---------------------------------------------------------------------------
+// connection is still inside TunnelConn::close() here, so it is recycled on next event loop iteration
+void Tunnel::conn_release(TunnelConn *conn)
+{
+  conn_pool_released.append(conn);
+  if (!conn_pool_recycle_queued)
+  {
+    conn_pool_recycle_queued = true;
+    QMetaObject::invokeMethod(this, "conn_pool_recycle", Qt::QueuedConnection);
+  }
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::conn_pool_recycle()
+{
+  conn_pool_recycle_queued = false;
+  for (int i=0; i < conn_pool_released.count(); i++)
+  {
+    TunnelConn *conn = conn_pool_released[i];
+    if (conn_pool.count() < TUNNEL_CONN_POOL_SIZE)
+    {
+      conn->reset();
+      conn_pool.append(conn);
+    }
+    else
+      conn->deleteLater();
+  }
+  conn_pool_released.clear();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::conn_pool_clear()
+{
+  qDeleteAll(conn_pool_released);
+  conn_pool_released.clear();
+  qDeleteAll(conn_pool);
+  conn_pool.clear();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::timerWheelExpired(TimerWheelTimer *timer)
+{
+  if (timer == &timer_chain_heartbeat)
+  {
+    timer_chain_heartbeat.start();
+    chain_heartbeat_timeout();
+  }
+  else if (timer == &timer_buffer_trim)
+  {
+    timer_buffer_trim.start();
+    buffers_trim();
+  }
+  else if (timer == &timer_buffered_packets_ack)
+    buffered_packets_send_ack();
+  else if (timer == &timer_reorder)
+    reorder_timeout();
+  else if (timer == &timer_failure_tolerance)
+    failure_tolerance_timedout();
+  else
+    udp_conn_idle_timeout((TunnelUdpConn *)timer->data);
+}
+
+//---------------------------------------------------------------------------
+// timer wheel is per thread: carry active timers over to the wheel of the new thread
+bool Tunnel::event(QEvent *e)
+{
+  if (e->type() == QEvent::ThreadChange)
+  {
+    timer_failure_tolerance.suspend();
+    timer_chain_heartbeat.suspend();
+    timer_buffer_trim.suspend();
+    timer_reorder.suspend();
+    timer_buffered_packets_ack.suspend();
+    foreach (TunnelUdpConn *conn, udp_conn_list_by_id)
+      conn->timer_idle.suspend();
+    QMetaObject::invokeMethod(this, "timers_resume", Qt::QueuedConnection);
+  }
+  return QObject::event(e);
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::timers_resume()
+{
+  timer_failure_tolerance.resume();
+  timer_chain_heartbeat.resume();
+  timer_buffer_trim.resume();
+  timer_reorder.resume();
+  timer_buffered_packets_ack.resume();
+  foreach (TunnelUdpConn *conn, udp_conn_list_by_id)
+    conn->timer_idle.resume();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::udp_conn_idle_start(TunnelUdpConn *conn)
+{
+  if (params.conn_idle_timeout == 0)
+  {
+    conn->timer_idle.stop();
+    return;
+  }
+  conn->timer_idle.client = this;
+  conn->timer_idle.data = conn;
+  conn->timer_idle.start(params.conn_idle_timeout);
+}
+
+//---------------------------------------------------------------------------
+// UDP pseudo-connection is expired when idle (TunnelParameters::conn_idle_timeout), the other end is told to drop it too
+void Tunnel::udp_conn_idle_timeout(TunnelUdpConn *conn)
+{
+  if (params.conn_idle_timeout == 0)
+    return;
+  int idle = qAbs(conn->t_created.elapsed());
+  if (conn->t_last_rcv.isValid())
+    idle = qMin(idle, qAbs(conn->t_last_rcv.elapsed()));
+  if (conn->t_last_snd.isValid())
+    idle = qMin(idle, qAbs(conn->t_last_snd.elapsed()));
+  if ((quint32)idle < params.conn_idle_timeout)
+  {
+    conn->timer_idle.start(params.conn_idle_timeout-idle);
+    return;
+  }
+
+  OBJ_LOG(this, LOG_DBG3, QString(", conn %1: UDP connection expired").arg(conn->id));
+  QByteArray error_str = QString("Idle timeout").toUtf8();
+  MgrPacket_StandartReply pkt;
+  pkt.res_code = QAbstractSocket::SocketTimeoutError+1;
+  pkt.error_len = error_str.length();
+  QByteArray pkt_data;
+  pkt_data.append((const char *)&pkt, sizeof(MgrPacket_StandartReply));
+  pkt_data.append(error_str);
+  // incoming connections have no socket of their own
+  MgrPacketCmd cmd = conn->udp_sock ? CMD_TUN_CONN_IN_DROP : CMD_TUN_CONN_OUT_DROP;
+  if ((conn->udp_sock == NULL) == (params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE))
+    queueOutPacket(cmd, conn->id, next_packet_id(), pkt_data);
+  else
+    queueInPacket(cmd, conn->id, next_packet_id(), pkt_data);
+  udp_conn_remove(conn);
+}
+
+//---------------------------------------------------------------------------
+// incoming UDP connections are keyed by peer ipaddr:port, outgoing ones - by local port
+void Tunnel::udp_conn_remove(TunnelUdpConn *conn)
+{
+  udp_conn_list_by_id.remove(conn->id);
+  if (conn->udp_sock)
+    udp_conn_list_by_addr.remove(QString::number(conn->udp_sock->localPort()));
+  else
+    udp_conn_list_by_addr.remove(conn->remote_addr.toString()+QString(":%1").arg(conn->remote_port));
+  if (conn->info)
+    conn->info->t_disconnected = QDateTime::currentDateTime().toUTC();
+  state.stats.conn_cur_count--;
+  delete conn;
 }
 
 //---------------------------------------------------------------------------
 void Tunnel::outgoing_connection_established()
 {
   TunnelConn *out_conn = qobject_cast<TunnelConn *>(sender());
-  quint16 out_port = 0;
-  if (out_conn->tcp_sock)
-    out_port = out_conn->tcp_sock->localPort();
+  quint16 out_port = out_conn->localPort();
+  if (out_conn->t_connect_started.isValid())
+    latency_connect.record(out_conn->t_connect_started.nsecsElapsed());
 
   if (out_conn->direction == TunnelConn::OUTGOING)
   {
@@ -237,22 +531,25 @@ void Tunnel::bind_stop()
 {
   if (bind_tcpServer)
   {
+    IoUringBackend::cancel(bind_uring_accept);
+    bind_uring_accept = NULL;
     bind_tcpServer->close();
-    this->log(LOG_DBG1, QString(": binding TCP server on %1:%2 closed").arg(params.bind_address).arg(params.bind_port));
+    bind_tcp_listeners_stop();
+    OBJ_LOG(this, LOG_DBG1, QString(": binding TCP server on %1:%2 closed").arg(params.bind_address).arg(params.bind_port));
     bind_tcpServer->deleteLater();
     bind_tcpServer = NULL;
   }
   else if (bind_udpSocket)
   {
     bind_udpSocket->abort();
-    this->log(LOG_DBG1, QString(": binding UDP socket on %1:%2 closed").arg(params.bind_address).arg(params.bind_port));
+    OBJ_LOG(this, LOG_DBG1, QString(": binding UDP socket on %1:%2 closed").arg(params.bind_address).arg(params.bind_port));
     bind_udpSocket->deleteLater();
     bind_udpSocket = NULL;
   }
   else if (bind_pipeServer)
   {
     bind_pipeServer->close();
-    this->log(LOG_DBG1, QString(": binding named pipe '%1' closed").arg(params.bind_address));
+    OBJ_LOG(this, LOG_DBG1, QString(": binding named pipe '%1' closed").arg(params.bind_address));
     bind_pipeServer->deleteLater();
     bind_pipeServer = NULL;
   }
@@ -261,58 +558,166 @@ void Tunnel::bind_stop()
   {
     state.flags &= ~TunnelState::TF_BINDING;
   }
-  emit state_changed();
+  emit state_changed(params.id);
 }
 
 //---------------------------------------------------------------------------
 void Tunnel::new_incoming_conn()
 {
-  if (!bind_tcpServer && !bind_pipeServer)
+  // newConnection() may be emitted once for several connections, so all pending ones are taken
+  while (bind_tcpServer && bind_tcpServer->hasPendingConnections())
+    new_incoming_tcp_conn(bind_tcpServer->nextPendingConnection());
+  while (bind_pipeServer && bind_pipeServer->hasPendingConnections())
+    new_incoming_pipe_conn(bind_pipeServer->nextPendingConnection());
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::new_incoming_tcp_conn(QTcpSocket *sock)
+{
+  if ((quint32)in_conn_list.count() >= params.max_incoming_connections)
+  {
+    this->log(LOG_LOW, QString(": maximum number of incoming TCP connections reached (%1) - dropping new connection from %2:%3").arg(params.max_incoming_connections).arg(sock->peerAddress().toString()).arg(sock->peerPort()));
+    sock->abort();
+    sock->deleteLater();
     return;
+  }
+
+  TunnelConn *new_conn = incoming_conn_acquire();
+  new_conn->info->peer_address = sock->peerAddress();
+  new_conn->info->peer_port = sock->peerPort();
+  new_conn->tcp_sock = sock;
+  incoming_conn_start(new_conn);
+}
 
+//---------------------------------------------------------------------------
+void Tunnel::new_incoming_pipe_conn(QLocalSocket *sock)
+{
   if ((quint32)in_conn_list.count() >= params.max_incoming_connections)
   {
-    if (bind_tcpServer)
+    this->log(LOG_LOW, QString(": maximum number of incoming PIPE connections reached (%1) - dropping new connection from '%2'").arg(params.max_incoming_connections).arg(sock->fullServerName()));
+    sock->abort();
+    sock->deleteLater();
+    return;
+  }
+
+  TunnelConn *new_conn = incoming_conn_acquire();
+  new_conn->pipe_sock = sock;
+  incoming_conn_start(new_conn);
+}
+
+//---------------------------------------------------------------------------
+// called from listener threads: descriptors are collected and handed over with one queued call per batch
+void Tunnel::listener_accepted(int fd)
+{
+  QMutexLocker locker(&bind_accepted_mutex);
+  bind_accepted.append(fd);
+  if (bind_accepted.count() == 1)
+    QMetaObject::invokeMethod(this, "new_incoming_accepted", Qt::QueuedConnection);
+}
+
+//---------------------------------------------------------------------------
+// connections accepted by bind_tcpListeners
+void Tunnel::new_incoming_accepted()
+{
+  bind_accepted_mutex.lock();
+  QList<int> accepted = bind_accepted;
+  bind_accepted.clear();
+  bind_accepted_mutex.unlock();
+
+  IoUringBackend *uring = io_uring_enabled ? IoUringBackend::instance() : NULL;
+  for (int i=0; i < accepted.count(); i++)
+  {
+    if (!bind_tcpServer)
+    {
+      TunnelListener::closeSocket(accepted[i]);
+      continue;
+    }
+    if (uring)
     {
-      QTcpSocket *sock = bind_tcpServer->nextPendingConnection();
-      this->log(LOG_LOW, QString(": maximum number of incoming TCP connections reached (%1) - dropping new connection from %2:%3").arg(params.max_incoming_connections).arg(sock->peerAddress().toString()).arg(sock->peerPort()));
-      sock->abort();
-      sock->deleteLater();
+      new_incoming_uring_conn(accepted[i]);
+      continue;
     }
-    else if (bind_pipeServer)
+    QTcpSocket *sock = new QTcpSocket;
+    if (!sock->setSocketDescriptor(accepted[i]))
     {
-      QLocalSocket *sock = bind_pipeServer->nextPendingConnection();
-      this->log(LOG_LOW, QString(": maximum number of incoming PIPE connections reached (%1) - dropping new connection from '%2'").arg(params.max_incoming_connections).arg(sock->fullServerName()));
-      sock->abort();
-      sock->deleteLater();
+      this->log(LOG_LOW, QString(": accepting incoming TCP connection failed: %1").arg(sock->errorString()));
+      delete sock;
+      TunnelListener::closeSocket(accepted[i]);
+      continue;
     }
+    new_incoming_tcp_conn(sock);
+  }
+}
+
+//---------------------------------------------------------------------------
+// connection accepted by bind_uring_accept
+void Tunnel::new_incoming_uring_conn(int fd)
+{
+  QHostAddress peer_address;
+  quint16 peer_port = 0;
+  IoUringBackend::peerAddress(fd, peer_address, peer_port);
+  if ((quint32)in_conn_list.count() >= params.max_incoming_connections)
+  {
+    this->log(LOG_LOW, QString(": maximum number of incoming TCP connections reached (%1) - dropping new connection from %2:%3").arg(params.max_incoming_connections).arg(peer_address.toString()).arg(peer_port));
+    IoUringBackend::closeSocket(fd);
     return;
   }
 
+  TunnelConn *new_conn = incoming_conn_acquire();
+  new_conn->info->peer_address = peer_address;
+  new_conn->info->peer_port = peer_port;
+  new_conn->uring = IoUringBackend::instance();
+  new_conn->uring_fd = fd;
+  incoming_conn_start(new_conn);
+}
 
-  TunnelConn *new_conn = new TunnelConn(TunnelConn::INCOMING, params);
-  TunnelConnInInfo conn_info;
-  conn_info.t_connected = QDateTime::currentDateTime().toUTC();
-  new_conn->id = unique_conn_id++;
-  while (in_conn_list.contains(new_conn->id) || new_conn->id == 0)
-    new_conn->id = unique_conn_id++;
-  connect(new_conn, SIGNAL(finished(int,QString)), this, SLOT(incoming_connection_finished(int,QString)));
-  connect(new_conn, SIGNAL(dataReceived()), this, SLOT(connection_dataReceived()));
-  connect(new_conn, SIGNAL(connection_bytesWritten(qint64)), this, SLOT(connection_bytesWritten(qint64)));
-  if (bind_tcpServer)
+//---------------------------------------------------------------------------
+void Tunnel::ioUringCompleted(IoUringOp *op, int result, const char *, bool final)
+{
+  if (op != bind_uring_accept)
+    return;
+  if (final)
+    bind_uring_accept = NULL;
+  if (result >= 0)
+    new_incoming_uring_conn(result);
+  else
   {
-    QTcpSocket *sock = bind_tcpServer->nextPendingConnection();
-    conn_info.peer_address = sock->peerAddress();
-    conn_info.peer_port = sock->peerPort();
-    new_conn->tcp_sock = sock;
+    QAbstractSocket::SocketError error;
+    QString error_str;
+    IoUringBackend::socketError(result, error, error_str);
+    this->log(LOG_LOW, QString(": accepting incoming TCP connection failed: %1").arg(error_str));
   }
-  else if (bind_pipeServer)
+  if (final && bind_tcpServer)
   {
-    QLocalSocket *sock = bind_pipeServer->nextPendingConnection();
-    new_conn->pipe_sock = sock;
+    // multishot accept has ended - restart it, or let Qt accept connections again
+    IoUringBackend *uring = IoUringBackend::instance();
+    if (result >= 0 && uring)
+      bind_uring_accept = uring->accept(this, (int)bind_tcpServer->socketDescriptor());
+#if QT_VERSION >= 0x050000
+    if (!bind_uring_accept)
+      bind_tcpServer->resumeAccepting();
+#endif
   }
+}
+
+//---------------------------------------------------------------------------
+TunnelConn *Tunnel::incoming_conn_acquire()
+{
+  TunnelConn *new_conn = conn_acquire(TunnelConn::INCOMING);
+  QSharedPointer<TunnelConnInInfo> conn_info(new TunnelConnInInfo);
+  conn_info->t_connected = QDateTime::currentDateTime().toUTC();
+  new_conn->info = conn_info;
+  new_conn->id = unique_conn_id++;
+  while (in_conn_list.contains(new_conn->id) || new_conn->id == 0)
+    new_conn->id = unique_conn_id++;
+  return new_conn;
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::incoming_conn_start(TunnelConn *new_conn)
+{
   in_conn_list.insert(new_conn->id, new_conn);
-  in_conn_info_list.insert(new_conn->id, conn_info);
+  in_conn_info_list.insert(new_conn->id, new_conn->info);
 
   if (in_conn_info_list.count() > (int)params.max_incoming_connections_info || new_conn->id % 10 == 0)
     cleanup_in_conn_info_list();
@@ -334,19 +739,19 @@ void Tunnel::new_incoming_conn()
     {
       state.flags &= ~TunnelState::TF_IDLE;
       mgrconn_out->beginConnection();
-      emit state_changed();
+      emit state_changed(params.id);
     }
     else if (mgrconn_out->state() == QAbstractSocket::ClosingState)
       close_incoming_connections();
     else if (state.flags & TunnelState::TF_IDLE)
     {
       state.flags &= ~TunnelState::TF_IDLE;
-      if (mgrconn_out->timer_idle->isActive())
+      if (mgrconn_out->timer_idle.isActive())
       {
-        mgrconn_out->timer_idle->stop();
-        mgrconn_out->log(LOG_DBG1, QString(": stopped idle timer"));
+        mgrconn_out->timer_idle.stop();
+        OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": stopped idle timer"));
       }
-      emit state_changed();
+      emit state_changed(params.id);
     }
   }
 }
@@ -368,7 +773,7 @@ void Tunnel::cmd_conn_out_new(TunnelConnId conn_id)
       if (udp_remote_addr.isNull() && !udp_remote_addr_lookup_in_progress)
       {
         udp_remote_addr_lookup_in_progress = true;
-        this->log(LOG_DBG1, QString(": starting host '%1' lookup").arg(params.remote_host));
+        OBJ_LOG(this, LOG_DBG1, QString(": starting host '%1' lookup").arg(params.remote_host));
         udp_remote_addr_lookup_id = QHostInfo::lookupHost(params.remote_host, this, SLOT(udp_hostLookupFinished(QHostInfo)));
       }
       TunnelUdpConn *new_conn = new TunnelUdpConn;
@@ -386,13 +791,13 @@ void Tunnel::cmd_conn_out_new(TunnelConnId conn_id)
         {
           state.last_error_code = TunnelState::RES_CODE_BIND_ERROR;
           state.last_error_str = tr("Failed to bind to port range %1-%2 on %3: ").arg(params.udp_port_range_from).arg(params.udp_port_range_till).arg(SysUtil::machine_name)+new_conn->udp_sock->errorString();
-          this->log(LOG_DBG1, QString(": ")+state.last_error_str);
+          OBJ_LOG(this, LOG_DBG1, QString(": ")+state.last_error_str);
           delete new_conn;
-          emit state_changed();
+          emit state_changed(params.id);
           return;
         }
       }
-      this->log(LOG_DBG3, QString(", conn %1: binding UDP socket on port %2 opened").arg(new_conn->id).arg(new_conn->udp_sock->localPort()));
+      OBJ_LOG(this, LOG_DBG3, QString(", conn %1: binding UDP socket on port %2 opened").arg(new_conn->id).arg(new_conn->udp_sock->localPort()));
 
       if (params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE)
         queueInPacket(CMD_TUN_CONN_OUT_CONNECTED, new_conn->id, next_packet_id(), QByteArray((const char *)&next_udp_port, sizeof(quint16)));
@@ -401,18 +806,17 @@ void Tunnel::cmd_conn_out_new(TunnelConnId conn_id)
 
       udp_conn_list_by_id.insert(new_conn->id, new_conn);
       udp_conn_list_by_addr.insert(QString::number(new_conn->udp_sock->localPort()), new_conn);
+      udp_conn_idle_start(new_conn);
     }
     else
     {
-      TunnelConn *new_conn = new TunnelConn(TunnelConn::OUTGOING, params);
-      connect(new_conn, SIGNAL(finished(int,QString)), this, SLOT(outgoing_connection_finished(int,QString)));
-      connect(new_conn, SIGNAL(connection_established()), this, SLOT(outgoing_connection_established()));
-      connect(new_conn, SIGNAL(connection_bytesWritten(qint64)), this, SLOT(connection_bytesWritten(qint64)));
-      connect(new_conn, SIGNAL(dataReceived()), this, SLOT(connection_dataReceived()));
+      TunnelConn *new_conn = conn_acquire(TunnelConn::OUTGOING);
       new_conn->id = conn_id;
       if (params.app_protocol == TunnelParameters::TCP)
       {
-        new_conn->tcp_sock = new QTcpSocket;
+        new_conn->uring = io_uring_enabled ? IoUringBackend::instance() : NULL;
+        if (!new_conn->uring)
+          new_conn->tcp_sock = new QTcpSocket;
       }
       else if (params.app_protocol == TunnelParameters::PIPE)
       {
@@ -433,6 +837,13 @@ void Tunnel::cmd_conn_out_drop(TunnelConnId conn_id, const QByteArray &data)
   if ((params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE && params.tunservers.isEmpty()) ||
       (params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL && (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)))
   {
+    if (params.app_protocol == TunnelParameters::UDP)
+    {
+      TunnelUdpConn *udp_conn = udp_conn_list_by_id.value(conn_id);
+      if (udp_conn)
+        udp_conn_remove(udp_conn);
+      return;
+    }
     TunnelConn *conn = out_conn_list.value(conn_id);
     int error_code = 0;
     QString error_str;
@@ -460,6 +871,13 @@ void Tunnel::cmd_conn_in_drop(TunnelConnId conn_id, const QByteArray &data)
   if ((params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE && (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)) ||
       (params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL && params.tunservers.isEmpty()))
   {
+    if (params.app_protocol == TunnelParameters::UDP)
+    {
+      TunnelUdpConn *udp_conn = udp_conn_list_by_id.value(conn_id);
+      if (udp_conn)
+        udp_conn_remove(udp_conn);
+      return;
+    }
     TunnelConn *conn = in_conn_list.value(conn_id);
     int error_code = 0;
     QString error_str;
@@ -470,11 +888,11 @@ void Tunnel::cmd_conn_in_drop(TunnelConnId conn_id, const QByteArray &data)
       if (pkt->error_len > 0)
       {
         error_str = QString::fromUtf8(data.mid(sizeof(MgrPacket_StandartReply), pkt->error_len));
-        if (conn && in_conn_info_list.contains(conn_id))
+        if (conn && conn->info)
         {
-          in_conn_info_list[conn_id].t_disconnected = QDateTime::currentDateTime().toUTC();
-          if (in_conn_info_list[conn_id].errorstring.isEmpty())
-            in_conn_info_list[conn_id].errorstring = error_str.toUtf8();
+          conn->info->t_disconnected = QDateTime::currentDateTime().toUTC();
+          if (conn->info->errorstring.isEmpty())
+            conn->info->errorstring = error_str.toUtf8();
         }
       }
     }
@@ -495,11 +913,12 @@ void Tunnel::cmd_conn_out_connected(TunnelConnId conn_id, const QByteArray &data
   if ((params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE && (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)) ||
       (params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL && params.tunservers.isEmpty()))
   {
-    if (in_conn_info_list.contains(conn_id))
+    QSharedPointer<TunnelConnInInfo> conn_info = in_conn_info_list.value(conn_id);
+    if (conn_info)
     {
       if (data.length() >= (int)sizeof(quint16))
-        in_conn_info_list[conn_id].tun_out_port = *((quint16 *)data.data());
-      in_conn_info_list[conn_id].flags |= TunnelConnInInfo::FL_OUT_CONNECTED;
+        conn_info->tun_out_port = *((quint16 *)data.data());
+      conn_info->flags |= TunnelConnInInfo::FL_OUT_CONNECTED;
     }
   }
 }
@@ -515,22 +934,22 @@ void Tunnel::cleanup_in_conn_info_list()
   QDateTime now = QDateTime::currentDateTime().toUTC();
   int old_conn_count = 0;
   int oldest_conn = 0;
-  QMutableHashIterator<TunnelConnId, TunnelConnInInfo> i_in_conn_info(in_conn_info_list);
+  QMutableHashIterator<TunnelConnId, QSharedPointer<TunnelConnInInfo> > i_in_conn_info(in_conn_info_list);
   while (i_in_conn_info.hasNext())
   {
     i_in_conn_info.next();
-    QDateTime t_disconnected = i_in_conn_info.value().t_disconnected;
+    QDateTime t_disconnected = i_in_conn_info.value()->t_disconnected;
     if (params.app_protocol == TunnelParameters::UDP)
       t_disconnected = now;
     if (t_disconnected.isValid())
     {
-      if (i_in_conn_info.value().t_connected.secsTo(t_disconnected) > (int)params.incoming_connections_info_timeout)
+      if (i_in_conn_info.value()->t_connected.secsTo(t_disconnected) > (int)params.incoming_connections_info_timeout)
         i_in_conn_info.remove();
       else
       {
         old_conn_count++;
-        if (oldest_conn == 0 || oldest_conn < i_in_conn_info.value().t_connected.secsTo(t_disconnected))
-          oldest_conn = i_in_conn_info.value().t_connected.secsTo(t_disconnected);
+        if (oldest_conn == 0 || oldest_conn < i_in_conn_info.value()->t_connected.secsTo(t_disconnected))
+          oldest_conn = i_in_conn_info.value()->t_connected.secsTo(t_disconnected);
       }
     }
   }
@@ -544,22 +963,22 @@ void Tunnel::cleanup_in_conn_info_list()
       int _timeout = oldest_conn/2;
       old_conn_count = 0;
       oldest_conn = 0;
-      QMutableHashIterator<TunnelConnId, TunnelConnInInfo> i_in_conn_info(in_conn_info_list);
+      QMutableHashIterator<TunnelConnId, QSharedPointer<TunnelConnInInfo> > i_in_conn_info(in_conn_info_list);
       while (i_in_conn_info.hasNext())
       {
         i_in_conn_info.next();
-        QDateTime t_disconnected = i_in_conn_info.value().t_disconnected;
+        QDateTime t_disconnected = i_in_conn_info.value()->t_disconnected;
         if (params.app_protocol == TunnelParameters::UDP)
           t_disconnected = now;
         if (t_disconnected.isValid())
         {
-          if (_timeout < 1 || i_in_conn_info.value().t_connected.secsTo(t_disconnected) > _timeout)
+          if (_timeout < 1 || i_in_conn_info.value()->t_connected.secsTo(t_disconnected) > _timeout)
             i_in_conn_info.remove();
           else
           {
             old_conn_count++;
-            if (oldest_conn == 0 || oldest_conn < i_in_conn_info.value().t_connected.secsTo(t_disconnected))
-              oldest_conn = i_in_conn_info.value().t_connected.secsTo(t_disconnected);
+            if (oldest_conn == 0 || oldest_conn < i_in_conn_info.value()->t_connected.secsTo(t_disconnected))
+              oldest_conn = i_in_conn_info.value()->t_connected.secsTo(t_disconnected);
           }
         }
       }
@@ -568,7 +987,7 @@ void Tunnel::cleanup_in_conn_info_list()
     // if that doesn't help - just remove active connections info randomly
     while (in_conn_info_list.count() > (int)params.max_incoming_connections_info)
     {
-      QMutableHashIterator<TunnelConnId, TunnelConnInInfo> i_in_conn_info(in_conn_info_list);
+      QMutableHashIterator<TunnelConnId, QSharedPointer<TunnelConnInInfo> > i_in_conn_info(in_conn_info_list);
       if (i_in_conn_info.hasNext())
       {
         i_in_conn_info.next();
@@ -583,15 +1002,15 @@ QByteArray Tunnel::in_connPrintToBuffer(bool include_disconnected)
 {
   QByteArray buffer;
   buffer.reserve(in_conn_info_list.count()*128);
-  QHashIterator<TunnelConnId, TunnelConnInInfo> i(in_conn_info_list);
+  QHashIterator<TunnelConnId, QSharedPointer<TunnelConnInInfo> > i(in_conn_info_list);
   while (i.hasNext())
   {
     i.next();
-    if (!include_disconnected && i.value().t_disconnected.isValid())
+    if (!include_disconnected && i.value()->t_disconnected.isValid())
       continue;
 
     buffer.append((const char *)&i.key(), sizeof(TunnelConnId));
-    buffer.append(i.value().printToBuffer());
+    buffer.append(i.value()->printToBuffer());
   }
   return buffer;
 }
@@ -8,6 +8,7 @@
 
 #include "tunnel.h"
 #include "../lib/sys_util.h"
+#include "../lib/buffer-pool.h"
 #include "mgr_server.h"
 
 //---------------------------------------------------------------------------
@@ -18,22 +19,23 @@ bool Tunnel::buffered_packet_received(TunnelConnPacketId packet_id, quint32 pack
     return true;
   if (packet_id != expected_packet_id)
   {
+    flightrec.record(FR_PACKET_UNEXPECTED, 0, packet_id, 0, expected_packet_id);
+    bool packet_ahead = buffered_packet_ahead(packet_id);
+    // with striping this is normal - packet will be kept in reorder buffer by the caller
+    if (packet_ahead && params.mgrconn_stripes > 1)
+      return false;
+
     if (buffered_packets_rcv_count > 0)
       buffered_packets_send_ack();
 
-    if ((packet_id > expected_packet_id && qAbs((int)packet_id-(int)expected_packet_id) <= BUFFERED_PACKETS_MAX_COUNT) ||
-        (packet_id < expected_packet_id && qAbs((int)packet_id-(int)expected_packet_id) > BUFFERED_PACKETS_MAX_COUNT))
+    if (packet_ahead)
     {
-      log(LOG_DBG3, QString(": got packet_id=%1 (expected %2) - sending CMD_TUN_BUFFER_RESEND_FROM, packet_id=%2").arg(packet_id).arg(expected_packet_id));
-      QByteArray packet_resend_data;
-      packet_resend_data.append((const char *)&expected_packet_id, sizeof(TunnelConnPacketId));
-      if (params.tunservers.isEmpty() && mgrconn_in)
-        mgrconn_in->sendPacket(CMD_TUN_BUFFER_RESEND_FROM, packet_resend_data);
-      else if ((params.flags & TunnelParameters::FL_MASTER_TUNSERVER) && mgrconn_out)
-        mgrconn_out->sendPacket(CMD_TUN_BUFFER_RESEND_FROM, packet_resend_data);
+      OBJ_LOG(this, LOG_DBG3, QString(": got packet_id=%1 (expected %2) - sending CMD_TUN_BUFFER_RESEND_FROM, packet_id=%2").arg(packet_id).arg(expected_packet_id));
+      buffered_packets_request_resend();
     }
     return false;
   }
+  flightrec.record(FR_PACKET_RCV, 0, packet_id, 0, packet_len);
 
   bool need_ack = !t_last_buffered_packet_rcv.isValid() ||
                   qAbs(t_last_buffered_packet_rcv.elapsed()) >= BUFFERED_PACKETS_TIMEOUT_BEFORE_ACK;
@@ -45,8 +47,10 @@ bool Tunnel::buffered_packet_received(TunnelConnPacketId packet_id, quint32 pack
   if (expected_packet_id == 0)
     expected_packet_id = 1;
 
+  if (buffered_packets_rcv_count == 0)
+    t_first_unacked_packet_rcv.start();
   if (buffered_packets_rcv_count == 0 && !need_ack)
-    timer_buffered_packets_ack->start();
+    timer_buffered_packets_ack.start();
   buffered_packets_rcv_count++;
   buffered_packets_rcv_total_len += packet_len;
   if (buffered_packets_rcv_count >= BUFFERED_PACKETS_MIN_COUNT_BEFORE_ACK ||
@@ -56,17 +60,146 @@ bool Tunnel::buffered_packet_received(TunnelConnPacketId packet_id, quint32 pack
   return true;
 }
 
+//---------------------------------------------------------------------------
+// returns true if packet_id is ahead of expected one (some packets are missing)
+bool Tunnel::buffered_packet_ahead(TunnelConnPacketId packet_id) const
+{
+  return (packet_id > expected_packet_id && qAbs((int)packet_id-(int)expected_packet_id) <= BUFFERED_PACKETS_MAX_COUNT) ||
+         (packet_id < expected_packet_id && qAbs((int)packet_id-(int)expected_packet_id) > BUFFERED_PACKETS_MAX_COUNT);
+}
+
+//---------------------------------------------------------------------------
+// ask the other side to resend buffered packets starting from expected_packet_id
+void Tunnel::buffered_packets_request_resend()
+{
+  QByteArray packet_resend_data;
+  packet_resend_data.append((const char *)&expected_packet_id, sizeof(TunnelConnPacketId));
+  flightrec.record(FR_RESEND_REQ_SENT, CMD_TUN_BUFFER_RESEND_FROM, expected_packet_id, 0, 0);
+  if (params.tunservers.isEmpty() && mgrconn_in)
+    mgrconn_in->sendPacket(CMD_TUN_BUFFER_RESEND_FROM, packet_resend_data);
+  else if ((params.flags & TunnelParameters::FL_MASTER_TUNSERVER) && mgrconn_out)
+    mgrconn_out->sendPacket(CMD_TUN_BUFFER_RESEND_FROM, packet_resend_data);
+}
+
+//---------------------------------------------------------------------------
+// CMD_TUN_CONN_... packet received from mgrconn_in/mgrconn_out or one of their stripes
+void Tunnel::conn_packet_received(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data)
+{
+  if (forward_packet(conn, cmd, data))
+    return;
+  if (data.length() < (int)(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)))
+  {
+    OBJ_LOG(conn, LOG_DBG1, QString(": CMD_TUN_CONN_... packet too short"));
+    conn->abort();
+    return;
+  }
+  if (!t_last_buffered_packet_ack_rcv.isValid())
+    t_last_buffered_packet_ack_rcv.start();
+  TunnelConnPacketId packet_id = *((TunnelConnPacketId *)data.data());
+  if (!buffered_packet_received(packet_id, data.length()))
+  {
+    // packet came ahead of time through another stripe - keep it until missing ones arrive
+    if (params.mgrconn_stripes > 1 && buffered_packet_ahead(packet_id) && !reorder_packets.contains(packet_id))
+    {
+      // if reorder buffer is full, just drop the packet - it will be resent after reorder timeout
+      if (reorder_packets.count() < BUFFERED_PACKETS_REORDER_MAX_COUNT)
+      {
+        TunnelReorderedPacket packet;
+        packet.cmd = cmd;
+        packet.data = data;
+        reorder_packets.insert(packet_id, packet);
+        reorder_packets_total_len += data.length();
+      }
+      if (!timer_reorder.isActive())
+        timer_reorder.start();
+    }
+    return;
+  }
+  conn_packet_process(cmd, data);
+
+  while (!reorder_packets.isEmpty() && reorder_packets.contains(expected_packet_id))
+  {
+    TunnelConnPacketId reordered_packet_id = expected_packet_id;
+    TunnelReorderedPacket packet = reorder_packets.take(reordered_packet_id);
+    reorder_packets_total_len -= packet.data.length();
+    if (!buffered_packet_received(reordered_packet_id, packet.data.length()))
+      break;
+    conn_packet_process(packet.cmd, packet.data);
+  }
+  if (reorder_packets.isEmpty() && timer_reorder.isActive())
+    timer_reorder.stop();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::conn_packet_process(MgrPacketCmd cmd, const QByteArray &data)
+{
+  int data_header_len = sizeof(TunnelConnPacketId)+sizeof(TunnelConnId);
+  TunnelConnId conn_id = *((TunnelConnId *)(data.data()+sizeof(TunnelConnPacketId)));
+  switch (cmd)
+  {
+    case CMD_TUN_CONN_OUT_NEW:
+    {
+      cmd_conn_out_new(conn_id);
+      break;
+    }
+    case CMD_TUN_CONN_OUT_DROP:
+    {
+      cmd_conn_out_drop(conn_id, data.mid(data_header_len));
+      break;
+    }
+    case CMD_TUN_CONN_OUT_CONNECTED:
+    {
+      cmd_conn_out_connected(conn_id, data.mid(data_header_len));
+      break;
+    }
+    case CMD_TUN_CONN_IN_DROP:
+    {
+      cmd_conn_in_drop(conn_id, data.mid(data_header_len));
+      break;
+    }
+    case CMD_TUN_CONN_IN_DATA:
+    case CMD_TUN_CONN_OUT_DATA:
+    {
+      cmd_conn_data(cmd == CMD_TUN_CONN_IN_DATA ? TunnelConn::INCOMING : TunnelConn::OUTGOING,
+                    conn_id, data.mid(data_header_len));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+//---------------------------------------------------------------------------
+// missing packets have not arrived through any stripe in time
+void Tunnel::reorder_timeout()
+{
+  if (reorder_packets.isEmpty())
+    return;
+  OBJ_LOG(this, LOG_DBG3, QString(": packet_id=%1 is still missing (%2 packets received ahead of time) - sending CMD_TUN_BUFFER_RESEND_FROM").arg(expected_packet_id).arg(reorder_packets.count()));
+  buffered_packets_request_resend();
+  timer_reorder.start();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::reorder_packets_clear()
+{
+  reorder_packets.clear();
+  reorder_packets_total_len = 0;
+  if (timer_reorder.isActive())
+    timer_reorder.stop();
+}
+
 //---------------------------------------------------------------------------
 void Tunnel::buffered_packets_send_ack()
 {
-  if (timer_buffered_packets_ack->isActive())
-    timer_buffered_packets_ack->stop();
+  if (timer_buffered_packets_ack.isActive())
+    timer_buffered_packets_ack.stop();
 
   if (!(params.tunservers.isEmpty() && mgrconn_in) &&
       !((params.flags & TunnelParameters::FL_MASTER_TUNSERVER) && mgrconn_out))
     return;
 
-  log(LOG_DBG4, QString(": %1 buffered packets received, now sending ack (last_rcv_id=%2)").arg(buffered_packets_rcv_count).arg(last_rcv_packet_id));
+  OBJ_LOG(this, LOG_DBG4, QString(": %1 buffered packets received, now sending ack (last_rcv_id=%2)").arg(buffered_packets_rcv_count).arg(last_rcv_packet_id));
   QByteArray packet_data;
   packet_data.reserve(sizeof(TunnelConnPacketId)+sizeof(TunnelConnPacketCount));
   packet_data.append((const char *)&last_rcv_packet_id, sizeof(TunnelConnPacketId));
@@ -74,6 +207,9 @@ void Tunnel::buffered_packets_send_ack()
   if ((params.tunservers.isEmpty() && mgrconn_in && mgrconn_in->sendPacket(CMD_TUN_BUFFER_ACK, packet_data)) ||
       ((params.flags & TunnelParameters::FL_MASTER_TUNSERVER) && mgrconn_out && mgrconn_out->sendPacket(CMD_TUN_BUFFER_ACK, packet_data)))
   {
+    flightrec.record(FR_ACK_SENT, CMD_TUN_BUFFER_ACK, last_rcv_packet_id, 0, buffered_packets_rcv_count);
+    if (buffered_packets_rcv_count > 0 && t_first_unacked_packet_rcv.isValid())
+      latency_ack_delay.record(t_first_unacked_packet_rcv.nsecsElapsed());
     buffered_packets_rcv_count = 0;
     buffered_packets_rcv_total_len = 0;
   }
@@ -84,7 +220,7 @@ void Tunnel::cmd_tun_buffer_ack_received(MgrClientConnection *conn, const QByteA
 {
   if (data.length() < (int)(sizeof(TunnelConnPacketId)+sizeof(TunnelConnPacketCount)))
   {
-    conn->log(LOG_DBG1, QString(": CMD_TUN_BUFFER_ACK packet too short"));
+    OBJ_LOG(conn, LOG_DBG1, QString(": CMD_TUN_BUFFER_ACK packet too short"));
     conn->abort();
     return;
   }
@@ -94,6 +230,7 @@ void Tunnel::cmd_tun_buffer_ack_received(MgrClientConnection *conn, const QByteA
 
   TunnelConnPacketId last_packet_id = *((TunnelConnPacketId *)data.data());
   TunnelConnPacketCount packet_count = *((TunnelConnPacketCount *)(data.data()+sizeof(TunnelConnPacketId)));
+  flightrec.record(FR_ACK_RCV, CMD_TUN_BUFFER_ACK, last_packet_id, 0, packet_count);
 
   TunnelConnPacketId first_packet_id = last_packet_id;
   for (TunnelConnPacketCount i=1; i < packet_count; i++)
@@ -111,8 +248,11 @@ void Tunnel::cmd_tun_buffer_ack_received(MgrClientConnection *conn, const QByteA
     buffered_packets_total_len -= buffered_packets_list[first_packet_index].length();
     acked_packets_total_len += buffered_packets_list[first_packet_index].length();
     buffered_packets_id_list.removeAt(first_packet_index);
+    BufferPool::release(buffered_packets_list[first_packet_index]);     // retransmit buffer goes back to the pool
     buffered_packets_list.removeAt(first_packet_index);
+    buffered_packets_stripe_list.removeAt(first_packet_index);
   }
+  memory_usage_update();
 
   // calculate optimal data packet size
   unsigned int transfer_time = qAbs(t_last_buffered_packet_ack_rcv.elapsed());
@@ -127,10 +267,10 @@ void Tunnel::cmd_tun_buffer_ack_received(MgrClientConnection *conn, const QByteA
   if (cur_data_packet_size+sizeof(TunnelConnId)+sizeof(TunnelConnPacketId) > MGR_PACKET_MAX_LEN)
     cur_data_packet_size = MGR_PACKET_MAX_LEN-sizeof(TunnelConnId)-sizeof(TunnelConnPacketId);
   if (old_data_packet_size != cur_data_packet_size)
-    log(LOG_DBG4, QString(": new calculated optimal data packet size = %1").arg(cur_data_packet_size));
+    OBJ_LOG(this, LOG_DBG4, QString(": new calculated optimal data packet size = %1").arg(cur_data_packet_size));
 
   t_last_buffered_packet_ack_rcv.restart();
-  log(LOG_DBG4, QString(": %1 buffered packets acknowledged and removed from buffer (%2 left in buffer)").arg(packet_count).arg(buffered_packets_id_list.count()));
+  OBJ_LOG(this, LOG_DBG4, QString(": %1 buffered packets acknowledged and removed from buffer (%2 left in buffer)").arg(packet_count).arg(buffered_packets_id_list.count()));
 }
 
 //---------------------------------------------------------------------------
@@ -138,7 +278,7 @@ void Tunnel::cmd_tun_buffer_resend_from(MgrClientConnection *conn, const QByteAr
 {
   if (data.length() < (int)sizeof(TunnelConnPacketId))
   {
-    conn->log(LOG_DBG1, QString(": CMD_TUN_BUFFER_RESEND_FROM packet too short"));
+    OBJ_LOG(conn, LOG_DBG1, QString(": CMD_TUN_BUFFER_RESEND_FROM packet too short"));
     conn->abort();
     return;
   }
@@ -147,7 +287,7 @@ void Tunnel::cmd_tun_buffer_resend_from(MgrClientConnection *conn, const QByteAr
     return;
 
   TunnelConnPacketId resend_from_packet_id = *((TunnelConnPacketId *)data.data());
-  log(LOG_DBG4, QString(": received CMD_TUN_BUFFER_RESEND_FROM, packet_id=%1").arg(resend_from_packet_id));
+  OBJ_LOG(this, LOG_DBG4, QString(": received CMD_TUN_BUFFER_RESEND_FROM, packet_id=%1").arg(resend_from_packet_id));
   if (resend_from_packet_id == 0 && !buffered_packets_id_list.isEmpty())
     resend_from_packet_id = buffered_packets_id_list.first();
 
@@ -164,10 +304,14 @@ void Tunnel::cmd_tun_buffer_resend_from(MgrClientConnection *conn, const QByteAr
   if (resend_from_packet_index < 0)
     return;
   for (int i=resend_from_packet_index; i < buffered_packets_id_list.count(); i++)
+  {
     dest_conn->output_buffer.append(buffered_packets_list[i]);
+    buffered_packets_stripe_list[i] = 0;
+  }
   dest_conn->sendOutputBuffer();
   int resent_packets_count = buffered_packets_id_list.count()-resend_from_packet_index;
-  log(LOG_DBG4, QString(": %1 buffered packets resent due to resend request").arg(resent_packets_count));
+  flightrec.record(FR_RESEND_REQ_RCV, CMD_TUN_BUFFER_RESEND_FROM, resend_from_packet_id, 0, resent_packets_count);
+  OBJ_LOG(this, LOG_DBG4, QString(": %1 buffered packets resent due to resend request").arg(resent_packets_count));
 }
 
 //---------------------------------------------------------------------------
@@ -183,7 +327,7 @@ void Tunnel::cmd_tun_buffer_reset()
     state.flags |= TunnelState::TF_MGRCONN_OUT_CLEAR_TO_SEND;
   state.flags |= TunnelState::TF_CHAIN_OK;
   chain_heartbeat_timeout();
-  emit state_changed();
+  emit state_changed(params.id);
 
   if ((!buffered_packets_id_list.isEmpty() && buffered_packets_id_list.first() != 1) ||
            (params.flags & TunnelParameters::FL_PERMANENT_TUNNEL) ||
@@ -191,6 +335,7 @@ void Tunnel::cmd_tun_buffer_reset()
   {
     buffered_packets_list.clear();
     buffered_packets_id_list.clear();
+    buffered_packets_stripe_list.clear();
     buffered_packets_total_len = 0;
     buffered_packets_rcv_count = 0;
     buffered_packets_rcv_total_len = 0;
@@ -200,14 +345,18 @@ void Tunnel::cmd_tun_buffer_reset()
     seq_packet_id = 1;
     expected_packet_id = 1;
     last_rcv_packet_id = 0;
+    reorder_packets_clear();
   }
   else if (!buffered_packets_id_list.isEmpty())
   {
     for (int i=0; i < buffered_packets_id_list.count(); i++)
+    {
       mgrconn_out->output_buffer.append(buffered_packets_list[i]);
+      buffered_packets_stripe_list[i] = 0;
+    }
     mgrconn_out->sendOutputBuffer();
     int resent_packets_count = buffered_packets_id_list.count();
-    log(LOG_DBG4, QString(": %1 buffered packets resent due to reset request").arg(resent_packets_count));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 buffered packets resent due to reset request").arg(resent_packets_count));
   }
 }
 
@@ -215,6 +364,7 @@ void Tunnel::cmd_tun_buffer_reset()
 // command to send new connection data which has been received
 void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id, const QByteArray &data)
 {
+  StageTimer stage_timer(stage_counters, STAGE_APP_DELIVERY);
   if (direction == TunnelConn::INCOMING &&
      ((params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE && params.tunservers.isEmpty()) ||
       (params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL && (params.flags & TunnelParameters::FL_MASTER_TUNSERVER))))
@@ -229,13 +379,14 @@ void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id
         else if (!udp_remote_addr.isNull())
         {
           qint64 snd_len = conn->udp_sock->writeDatagram(data, udp_remote_addr, params.remote_port);
-          if (in_conn_info_list.contains(conn->id))
-            in_conn_info_list[conn->id].bytes_snd += snd_len;
-          log(LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn_id).arg(udp_remote_addr.toString()).arg(params.remote_port).arg(data.length()));
+          conn->t_last_snd.restart();
+          if (conn->info)
+            conn->info->bytes_snd += snd_len;
+          OBJ_LOG(this, LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn_id).arg(udp_remote_addr.toString()).arg(params.remote_port).arg(data.length()));
         }
       }
       else
-        log(LOG_DBG1, QString(": failed to find outgoing connection ID %1").arg(conn_id));
+        OBJ_LOG(this, LOG_DBG1, QString(": failed to find outgoing connection ID %1").arg(conn_id));
     }
     else
     {
@@ -246,7 +397,7 @@ void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id
         conn->sendOutputBuffer();
       }
       else
-        log(LOG_DBG1, QString(": failed to find outgoing connection ID %1").arg(conn_id));
+        OBJ_LOG(this, LOG_DBG1, QString(": failed to find outgoing connection ID %1").arg(conn_id));
     }
   }
   else if (direction == TunnelConn::OUTGOING &&
@@ -259,12 +410,13 @@ void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id
       if (conn && bind_udpSocket)
       {
         qint64 snd_len = bind_udpSocket->writeDatagram(data, conn->remote_addr, conn->remote_port);
-        if (in_conn_info_list.contains(conn->id))
-          in_conn_info_list[conn->id].bytes_snd += snd_len;
-        log(LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn_id).arg(conn->remote_addr.toString()).arg(conn->remote_port).arg(data.length()));
+        conn->t_last_snd.restart();
+        if (conn->info)
+          conn->info->bytes_snd += snd_len;
+        OBJ_LOG(this, LOG_DBG4, QString(", conn %1: sending datagram to %2:%3, len=%4").arg(conn_id).arg(conn->remote_addr.toString()).arg(conn->remote_port).arg(data.length()));
       }
       else
-        log(LOG_DBG1, QString(": failed to find incoming connection ID %1").arg(conn_id));
+        OBJ_LOG(this, LOG_DBG1, QString(": failed to find incoming connection ID %1").arg(conn_id));
     }
     else
     {
@@ -275,7 +427,7 @@ void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id
         conn->sendOutputBuffer();
       }
       else
-        log(LOG_DBG1, QString(": failed to find incoming connection ID %1").arg(conn_id));
+        OBJ_LOG(this, LOG_DBG1, QString(": failed to find incoming connection ID %1").arg(conn_id));
     }
   }
 }
@@ -283,16 +435,20 @@ void Tunnel::cmd_conn_data(TunnelConn::Direction direction, TunnelConnId conn_id
 //---------------------------------------------------------------------------
 bool Tunnel::queueOutPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPacketId packet_id, const QByteArray &_data)
 {
-  QByteArray packet_data;
-  packet_data.reserve(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)+_data.length());
+  QByteArray packet_data = BufferPool::acquire(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)+_data.length());
   packet_data.append((const char *)&packet_id, sizeof(TunnelConnPacketId));
   packet_data.append((const char *)&conn_id, sizeof(TunnelConnId));
   packet_data.append(_data);
+  flightrec.record(FR_QUEUE_OUT, _cmd, packet_id, conn_id, _data.length());
   if (!(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
     if (!mgrconn_out || !(state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED))
       return false;
-    return mgrconn_out->sendPacket(_cmd, packet_data);
+    quint8 stripe_index;
+    bool result = stripeForData(mgrconn_out, mgrconn_out_stripes, stripe_index)->sendPacket(_cmd, packet_data);
+    BufferPool::release(packet_data);
+    memory_usage_update();
+    return result;
   }
   MgrPacketLen len = packet_data.length();
   quint32 buf_len = buffered_packets_total_len;
@@ -303,12 +459,16 @@ bool Tunnel::queueOutPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnP
     use_compression = mgrconn_out->params.flags & MgrClientParameters::FL_USE_COMPRESSION;
   }
   if ((params.max_io_buffer_size > 0 && buf_len+len > params.max_io_buffer_size) ||
-      buffered_packets_id_list.count()+1 > BUFFERED_PACKETS_MAX_COUNT)
+      buffered_packets_id_list.count()+1 > BUFFERED_PACKETS_MAX_COUNT ||
+      mem_account.state() == MemoryAccount::ST_EVICT)
   {
-    log(LOG_DBG1, QString("mgrconn_out buffer overflow - closing/restarting tunnel"));
+    OBJ_LOG(this, LOG_DBG1, QString("mgrconn_out buffer overflow%1 - closing/restarting tunnel")
+            .arg(mem_account.state() == MemoryAccount::ST_EVICT ? " (server memory budget exhausted)" : ""));
     buffered_packets_id_list.clear();
     buffered_packets_list.clear();
+    buffered_packets_stripe_list.clear();
     buffered_packets_total_len = 0;
+    memory_usage_update();
     QTimer::singleShot(0, this, SLOT(restart()));
     return false;
   }
@@ -316,42 +476,49 @@ bool Tunnel::queueOutPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnP
   bool compressed = false;
   if (use_compression && len >= MGR_PACKET_MIN_LEN_FOR_COMPRESSION)
   {
+    StageTimer stage_timer(stage_counters, STAGE_COMPRESS);
     QByteArray compressed_packet_data = qCompress(packet_data);
+    compress_bytes_in += packet_data.length();
+    compress_bytes_out += qMin(compressed_packet_data.length(), packet_data.length());
     if (compressed_packet_data.length() < packet_data.length())
     {
       MgrPacketLen cmd = _cmd | MGR_PACKET_FLAG_COMPRESSED;
       len = compressed_packet_data.length();
-      packet_buffer.reserve(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+compressed_packet_data.length());
-      packet_buffer.append(QByteArray((const char *)&cmd, sizeof(MgrPacketCmd)));
-      packet_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
+      packet_buffer = BufferPool::acquire(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+compressed_packet_data.length());
+      packet_buffer.append((const char *)&cmd, sizeof(MgrPacketCmd));
+      packet_buffer.append((const char *)&len, sizeof(MgrPacketLen));
       packet_buffer.append(compressed_packet_data);
       compressed = true;
     }
   }
   if (!compressed)
   {
-    packet_buffer.reserve(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+packet_data.length());
-    packet_buffer.append(QByteArray((const char *)&_cmd, sizeof(MgrPacketCmd)));
-    packet_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
+    packet_buffer = BufferPool::acquire(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+packet_data.length());
+    packet_buffer.append((const char *)&_cmd, sizeof(MgrPacketCmd));
+    packet_buffer.append((const char *)&len, sizeof(MgrPacketLen));
     packet_buffer.append(packet_data);
   }
-  log(LOG_DBG4, QString(": queueing mgrconn_out packet cmd=%1, id=%2, conn_id=%3, len=%4").arg(mgrPacket_cmdString(_cmd)).arg(packet_id).arg(conn_id).arg(len));
-  buffered_packets_id_list.append(packet_id);
-  buffered_packets_list.append(packet_buffer);
-  buffered_packets_total_len += packet_buffer.length();
-
+  BufferPool::release(packet_data);
+  OBJ_LOG(this, LOG_DBG4, QString(": queueing mgrconn_out packet cmd=%1, id=%2, conn_id=%3, len=%4").arg(mgrPacket_cmdString(_cmd)).arg(packet_id).arg(conn_id).arg(len));
+  quint8 stripe_index = 0;
   if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) && (state.flags & TunnelState::TF_MGRCONN_OUT_CLEAR_TO_SEND))
   {
-    mgrconn_out->output_buffer.append(packet_buffer);
-    mgrconn_out->sendOutputBuffer();
+    MgrClientConnection *dest_conn = stripeForData(mgrconn_out, mgrconn_out_stripes, stripe_index);
+    dest_conn->output_buffer.append(packet_buffer);
+    dest_conn->sendOutputBuffer();
   }
+  buffered_packets_id_list.append(packet_id);
+  buffered_packets_list.append(packet_buffer);
+  buffered_packets_stripe_list.append(stripe_index);
+  buffered_packets_total_len += packet_buffer.length();
+  memory_usage_update();
   return true;
 }
 
 //---------------------------------------------------------------------------
-void Tunnel::connection_dataReceived()
+void Tunnel::connDataReceived(TunnelConn *conn)
 {
-  TunnelConn *conn = qobject_cast<TunnelConn *>(sender());
+  StageTimer stage_timer(stage_counters, STAGE_APP_READ);
 
   int pos = 0;
   QTime t;
@@ -361,18 +528,21 @@ void Tunnel::connection_dataReceived()
     int data_len = conn->input_buffer.length()-pos;
     if (data_len > (int)cur_data_packet_size)
       data_len = cur_data_packet_size;
+    QByteArray chunk = BufferPool::acquire(data_len);
+    chunk.append(conn->input_buffer.constData()+pos, data_len);
 
     MgrPacketCmd _cmd = (conn->direction == TunnelConn::INCOMING) ? CMD_TUN_CONN_IN_DATA : CMD_TUN_CONN_OUT_DATA;
     if ((conn->direction == TunnelConn::INCOMING && params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE) ||
         (conn->direction == TunnelConn::OUTGOING && params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL))
-      queueOutPacket(_cmd, conn->id, next_packet_id(), conn->input_buffer.mid(pos, data_len));
+      queueOutPacket(_cmd, conn->id, next_packet_id(), chunk);
     else if ((conn->direction == TunnelConn::OUTGOING && params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE) ||
              (conn->direction == TunnelConn::INCOMING && params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL))
-      queueInPacket(_cmd, conn->id, next_packet_id(), conn->input_buffer.mid(pos, data_len));
+      queueInPacket(_cmd, conn->id, next_packet_id(), chunk);
+    BufferPool::release(chunk);
 
     state.stats.data_bytes_rcv += data_len;
-    if (in_conn_info_list.contains(conn->id))
-      in_conn_info_list[conn->id].bytes_rcv += data_len;
+    if (conn->info)
+      conn->info->bytes_rcv += data_len;
     pos += data_len;
   }
   conn->input_buffer.clear();
@@ -384,8 +554,8 @@ void Tunnel::connection_bytesWritten(qint64 bytes)
   if (params.app_protocol != TunnelParameters::UDP)
   {
     TunnelConn *conn = qobject_cast<TunnelConn *>(sender());
-    if (conn && in_conn_info_list.contains(conn->id))
-      in_conn_info_list[conn->id].bytes_snd += bytes;
+    if (conn && conn->info)
+      conn->info->bytes_snd += bytes;
   }
   state.stats.data_bytes_snd += bytes;
 }
@@ -393,8 +563,7 @@ void Tunnel::connection_bytesWritten(qint64 bytes)
 //---------------------------------------------------------------------------
 bool Tunnel::queueInPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPacketId packet_id, const QByteArray &_data)
 {
-  QByteArray packet_data;
-  packet_data.reserve(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)+_data.length());
+  QByteArray packet_data = BufferPool::acquire(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)+_data.length());
   packet_data.append((const char *)&packet_id, sizeof(TunnelConnPacketId));
   packet_data.append((const char *)&conn_id, sizeof(TunnelConnId));
   packet_data.append(_data);
@@ -402,7 +571,11 @@ bool Tunnel::queueInPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPa
   {
     if (!mgrconn_in)
       return false;
-    return mgrconn_in->sendPacket(_cmd, packet_data);
+    quint8 stripe_index;
+    bool result = stripeForData(mgrconn_in, mgrconn_in_stripes, stripe_index)->sendPacket(_cmd, packet_data);
+    BufferPool::release(packet_data);
+    memory_usage_update();
+    return result;
   }
   MgrPacketLen len = packet_data.length();
   quint32 buf_len = buffered_packets_total_len;
@@ -413,12 +586,16 @@ bool Tunnel::queueInPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPa
     use_compression = mgrconn_in->params.flags & MgrClientParameters::FL_USE_COMPRESSION;
   }
   if ((params.max_io_buffer_size > 0 && buf_len+len > params.max_io_buffer_size) ||
-       buffered_packets_id_list.count()+1 > BUFFERED_PACKETS_MAX_COUNT)
+       buffered_packets_id_list.count()+1 > BUFFERED_PACKETS_MAX_COUNT ||
+       mem_account.state() == MemoryAccount::ST_EVICT)
   {
-    log(LOG_DBG1, QString("mgrconn_in buffer overflow - closing/restarting tunnel"));
+    OBJ_LOG(this, LOG_DBG1, QString("mgrconn_in buffer overflow%1 - closing/restarting tunnel")
+            .arg(mem_account.state() == MemoryAccount::ST_EVICT ? " (server memory budget exhausted)" : ""));
     buffered_packets_id_list.clear();
     buffered_packets_list.clear();
+    buffered_packets_stripe_list.clear();
     buffered_packets_total_len = 0;
+    memory_usage_update();
     QTimer::singleShot(0, this, SLOT(restart()));
     return false;
   }
@@ -426,35 +603,42 @@ bool Tunnel::queueInPacket(MgrPacketCmd _cmd, TunnelConnId conn_id, TunnelConnPa
   bool compressed = false;
   if (use_compression && len >= MGR_PACKET_MIN_LEN_FOR_COMPRESSION)
   {
+    StageTimer stage_timer(stage_counters, STAGE_COMPRESS);
     QByteArray compressed_packet_data = qCompress(packet_data);
+    compress_bytes_in += packet_data.length();
+    compress_bytes_out += qMin(compressed_packet_data.length(), packet_data.length());
     if (compressed_packet_data.length() < packet_data.length())
     {
       MgrPacketLen cmd = _cmd | MGR_PACKET_FLAG_COMPRESSED;
       len = compressed_packet_data.length();
-      packet_buffer.reserve(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+compressed_packet_data.length());
-      packet_buffer.append(QByteArray((const char *)&cmd, sizeof(MgrPacketCmd)));
-      packet_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
+      packet_buffer = BufferPool::acquire(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+compressed_packet_data.length());
+      packet_buffer.append((const char *)&cmd, sizeof(MgrPacketCmd));
+      packet_buffer.append((const char *)&len, sizeof(MgrPacketLen));
       packet_buffer.append(compressed_packet_data);
       compressed = true;
     }
   }
   if (!compressed)
   {
-    packet_buffer.reserve(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+packet_data.length());
-    packet_buffer.append(QByteArray((const char *)&_cmd, sizeof(MgrPacketCmd)));
-    packet_buffer.append(QByteArray((const char *)&len, sizeof(MgrPacketLen)));
+    packet_buffer = BufferPool::acquire(sizeof(MgrPacketCmd)+sizeof(MgrPacketLen)+packet_data.length());
+    packet_buffer.append((const char *)&_cmd, sizeof(MgrPacketCmd));
+    packet_buffer.append((const char *)&len, sizeof(MgrPacketLen));
     packet_buffer.append(packet_data);
   }
-  log(LOG_DBG4, QString(": queueing mgrconn_in packet cmd=%1, id=%2, conn_id=%3, len=%4").arg(mgrPacket_cmdString(_cmd)).arg(packet_id).arg(conn_id).arg(len));
-  buffered_packets_id_list.append(packet_id);
-  buffered_packets_list.append(packet_buffer);
-  buffered_packets_total_len += packet_buffer.length();
-
+  BufferPool::release(packet_data);
+  OBJ_LOG(this, LOG_DBG4, QString(": queueing mgrconn_in packet cmd=%1, id=%2, conn_id=%3, len=%4").arg(mgrPacket_cmdString(_cmd)).arg(packet_id).arg(conn_id).arg(len));
+  quint8 stripe_index = 0;
   if (mgrconn_in && (state.flags & TunnelState::TF_MGRCONN_IN_CLEAR_TO_SEND))
   {
-    mgrconn_in->output_buffer.append(packet_buffer);
-    mgrconn_in->sendOutputBuffer();
+    MgrClientConnection *dest_conn = stripeForData(mgrconn_in, mgrconn_in_stripes, stripe_index);
+    dest_conn->output_buffer.append(packet_buffer);
+    dest_conn->sendOutputBuffer();
   }
+  buffered_packets_id_list.append(packet_id);
+  buffered_packets_list.append(packet_buffer);
+  buffered_packets_stripe_list.append(stripe_index);
+  buffered_packets_total_len += packet_buffer.length();
+  memory_usage_update();
   return true;
 }
 
@@ -473,7 +657,7 @@ void Tunnel::connection_udpIncomingRead()
       log(LOG_HIGH, QString(": readDatagram() error: ").arg(bind_udpSocket->errorString()));
       continue;
     }
-    log(LOG_DBG4, QString(": received datagram from %1:%2, size=%3").arg(sender.toString()).arg(senderPort).arg(datagram.size()));
+    OBJ_LOG(this, LOG_DBG4, QString(": received datagram from %1:%2, size=%3").arg(sender.toString()).arg(senderPort).arg(datagram.size()));
     state.stats.data_bytes_rcv += datagram.size();
 
     QString hash_key = sender.toString()+QString(":%1").arg(senderPort);
@@ -498,24 +682,20 @@ void Tunnel::connection_udpIncomingRead()
           }
         }
         if (id_less_recent_used > 0)
-        {
-          TunnelUdpConn *less_recent_used_conn = udp_conn_list_by_id.take(id_less_recent_used);
-          QString less_recent_used_hash_key = less_recent_used_conn->remote_addr.toString()+QString(":%1").arg(less_recent_used_conn->remote_port);
-          udp_conn_list_by_addr.remove(less_recent_used_hash_key);
-          delete less_recent_used_conn;
-          state.stats.conn_cur_count--;
-        }
+          udp_conn_remove(udp_conn_list_by_id.value(id_less_recent_used));
       }
       conn = new TunnelUdpConn;
-      TunnelConnInInfo conn_info;
-      conn_info.t_connected = QDateTime::currentDateTime().toUTC();
+      QSharedPointer<TunnelConnInInfo> conn_info(new TunnelConnInInfo);
+      conn_info->t_connected = QDateTime::currentDateTime().toUTC();
+      conn->info = conn_info;
       conn->id = unique_conn_id++;
       while (conn->id == 0 || udp_conn_list_by_id.contains(conn->id))
         conn->id = unique_conn_id++;
-      conn->remote_addr = conn_info.peer_address = sender;
-      conn->remote_port = conn_info.peer_port = senderPort;
+      conn->remote_addr = conn_info->peer_address = sender;
+      conn->remote_port = conn_info->peer_port = senderPort;
       udp_conn_list_by_id.insert(conn->id, conn);
       udp_conn_list_by_addr.insert(hash_key, conn);
+      udp_conn_idle_start(conn);
 
       in_conn_info_list.insert(conn->id, conn_info);
       if (in_conn_info_list.count() > (int)params.max_incoming_connections_info || conn->id % 10 == 0)
@@ -536,26 +716,26 @@ void Tunnel::connection_udpIncomingRead()
         {
           state.flags &= ~TunnelState::TF_IDLE;
           mgrconn_out->beginConnection();
-          emit state_changed();
+          emit state_changed(params.id);
         }
         else if (mgrconn_out->state() == QAbstractSocket::ClosingState)
           close_incoming_connections();
         else if (state.flags & TunnelState::TF_IDLE)
         {
           state.flags &= ~TunnelState::TF_IDLE;
-          if (mgrconn_out->timer_idle->isActive())
+          if (mgrconn_out->timer_idle.isActive())
           {
-            mgrconn_out->timer_idle->stop();
-            mgrconn_out->log(LOG_DBG1, QString(": stopped idle timer"));
+            mgrconn_out->timer_idle.stop();
+            OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": stopped idle timer"));
           }
-          emit state_changed();
+          emit state_changed(params.id);
         }
       }
     }
     conn->t_last_rcv.restart();
 //    conn->bytes_rcv += datagram.size();
-    if (in_conn_info_list.contains(conn->id))
-      in_conn_info_list[conn->id].bytes_rcv += datagram.size();
+    if (conn->info)
+      conn->info->bytes_rcv += datagram.size();
 
     if (params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE)
       queueOutPacket(CMD_TUN_CONN_IN_DATA, conn->id, next_packet_id(), datagram);
@@ -583,7 +763,7 @@ void Tunnel::connection_udpOutgoingRead()
       log(LOG_HIGH, QString(": readDatagram() error: ").arg(udp_sock->errorString()));
       continue;
     }
-    log(LOG_DBG4, QString(", conn %1: received datagram from %2:%3, size=%4").arg(conn->id).arg(sender.toString()).arg(senderPort).arg(datagram.size()));
+    OBJ_LOG(this, LOG_DBG4, QString(", conn %1: received datagram from %2:%3, size=%4").arg(conn->id).arg(sender.toString()).arg(senderPort).arg(datagram.size()));
     state.stats.data_bytes_rcv += datagram.size();
     conn->t_last_rcv.restart();
 //    conn->bytes_rcv += datagram.size();
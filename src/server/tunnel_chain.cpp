@@ -15,14 +15,14 @@ void Tunnel::cmd_tun_create_reply_received(const QByteArray &req_data)
 {
   if (req_data.length() < (int)(sizeof(MgrPacket_TunnelCreateReply)))
   {
-    mgrconn_out->log(LOG_DBG1, QString(": CMD_TUN_CREATE_REPLY packet too short"));
+    OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": CMD_TUN_CREATE_REPLY packet too short"));
     mgrconn_out->abort();
     return;
   }
   MgrPacket_TunnelCreateReply *packet = (MgrPacket_TunnelCreateReply *)req_data.data();
   if (req_data.length() < (int)sizeof(MgrPacket_TunnelCreateReply)+packet->error_len)
   {
-    mgrconn_out->log(LOG_DBG1, QString(": CMD_TUN_CREATE_REPLY packet too short"));
+    OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": CMD_TUN_CREATE_REPLY packet too short"));
     mgrconn_out->abort();
     return;
   }
@@ -33,15 +33,17 @@ void Tunnel::cmd_tun_create_reply_received(const QByteArray &req_data)
   {
     if (packet->res_code == TunnelState::RES_CODE_OK)
     {
-      log(LOG_DBG2, QString(": next tunserver has reported that tunnel is established"));
-      if (timer_failure_tolerance->isActive() && (mgrconn_in || (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)))
+      OBJ_LOG(this, LOG_DBG2, QString(": next tunserver has reported that tunnel is established"));
+      if (timer_failure_tolerance.isActive() && (mgrconn_in || (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)))
       {
-        log(LOG_DBG4, QString(": stopping failure tolerance timer"));
-        timer_failure_tolerance->stop();
+        OBJ_LOG(this, LOG_DBG4, QString(": stopping failure tolerance timer"));
+        timer_failure_tolerance.stop();
         mgrconn_out->sendPacket(CMD_TUN_CHAIN_CHECK);
       }
 
+      params_mutex.lock();
       params.next_id = packet->tunnel_id;
+      params_mutex.unlock();
       if (params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE && (params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
       {
         if ((params.flags & TunnelParameters::FL_PERMANENT_TUNNEL))
@@ -84,21 +86,22 @@ void Tunnel::cmd_tun_create_reply_received(const QByteArray &req_data)
       state.flags |= TunnelState::TF_CHECK_PASSED;
       state.last_error_code = TunnelState::RES_CODE_OK;
       state.last_error_str.clear();
+      start_mgrconn_out_stripes();
       if (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)
       {
         if ((params.flags & TunnelParameters::FL_SAVE_IN_CONFIG_PERMANENTLY) &&
             !(state.flags & TunnelState::TF_SAVED_IN_CONFIG))
         {
-          this->log(LOG_DBG2, QString(": saving tunnel in configuration file"));
-          mgrServer->config_save(&mgrServer->params);
+          OBJ_LOG(this, LOG_DBG2, QString(": saving tunnel in configuration file"));
+          QMetaObject::invokeMethod(mgrServer, "tunnels_config_save");
         }
         if (params.fwd_direction == TunnelParameters::LOCAL_TO_REMOTE &&
             in_conn_list.isEmpty() && !(params.flags & TunnelParameters::FL_PERMANENT_TUNNEL))
         {
           state.flags |= TunnelState::TF_IDLE;
-          mgrconn_out->timer_idle->setInterval(params.idle_timeout);
-          mgrconn_out->log(LOG_DBG1, QString(": starting idle timer (%1 ms)").arg(params.idle_timeout));
-          mgrconn_out->timer_idle->start();
+          mgrconn_out->timer_idle.setInterval(params.idle_timeout);
+          OBJ_LOG(mgrconn_out, LOG_DBG1, QString(": starting idle timer (%1 ms)").arg(params.idle_timeout));
+          mgrconn_out->timer_idle.start();
         }
       }
     }
@@ -123,7 +126,7 @@ void Tunnel::cmd_tun_create_reply_received(const QByteArray &req_data)
       if (!(this->state.flags & TunnelState::TF_CHECK_PASSED) || !(this->params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
         this->stop();
     }
-    emit state_changed();
+    emit state_changed(params.id);
   }
 }
 
@@ -136,7 +139,7 @@ void Tunnel::start_mgrconn_out()
     mgrconn_out->log_prefix = QString("Tunnel '%1' mgrconn_out: ").arg(params.name);
     connect(mgrconn_out, SIGNAL(state_changed(quint16)), this, SLOT(mgrconn_out_state_changed(quint16)));
     connect(mgrconn_out, SIGNAL(connection_error(QAbstractSocket::SocketError)), this, SLOT(mgrconn_out_connection_error(QAbstractSocket::SocketError)));
-    connect(mgrconn_out, SIGNAL(packetReceived(MgrPacketCmd,QByteArray)), this, SLOT(mgrconn_out_packetReceived(MgrPacketCmd,QByteArray)));
+    mgrconn_out->setPacketHandler(this, MGRCONN_ROLE_OUT);
 
     connect(mgrconn_out, SIGNAL(stat_bytesReceived(quint64)), this, SLOT(mgrconn_bytesReceived(quint64)));
     connect(mgrconn_out, SIGNAL(stat_bytesSent(quint64)), this, SLOT(mgrconn_bytesSent(quint64)));
@@ -148,8 +151,8 @@ void Tunnel::start_mgrconn_out()
                                         ? MgrClientParameters::CONN_AUTO
                                         : MgrClientParameters::CONN_DEMAND;
   mgrconn_out->params.idle_timeout = params.idle_timeout;
-  mgrconn_out->params.private_key_filename = mgrServer->params.private_key_filename;
-  mgrconn_out->params.ssl_cert_filename = mgrServer->params.ssl_cert_filename;
+  mgrconn_out->params.private_key_filename = mgrServer->privateKeyFilename();
+  mgrconn_out->params.ssl_cert_filename = mgrServer->sslCertFilename();
   if (mgrconn_out->params.conn_type == MgrClientParameters::CONN_AUTO ||
      !(this->state.flags & TunnelState::TF_CHECK_PASSED))
     mgrconn_out->beginConnection();
@@ -170,6 +173,8 @@ void Tunnel::mgrconn_out_state_changed(quint16 mgr_conn_state)
     {
       tun_params.bind_address.clear();
       tun_params.bind_port = 0;
+      tun_params.bind_listeners = 1;
+      tun_params.bind_backlog = 0;
     }
     else if (tun_params.fwd_direction == TunnelParameters::REMOTE_TO_LOCAL)
     {
@@ -201,10 +206,13 @@ void Tunnel::mgrconn_out_state_changed(quint16 mgr_conn_state)
     state.flags &= ~TunnelState::TF_MGRCONN_OUT_CONNECTED;
     state.flags &= ~TunnelState::TF_MGRCONN_OUT_CLEAR_TO_SEND;
     state.flags &= ~TunnelState::TF_CHAIN_OK;
+    // stripes are useless without main mgrconn_out, they will be reopened after it is restored
+    close_mgrconn_stripes(mgrconn_out_stripes);
     if (was_connected && (state.flags & TunnelState::TF_IDLE))
     {
       buffered_packets_list.clear();
       buffered_packets_id_list.clear();
+      buffered_packets_stripe_list.clear();
       buffered_packets_total_len = 0;
       buffered_packets_rcv_count = 0;
       buffered_packets_rcv_total_len = 0;
@@ -214,12 +222,13 @@ void Tunnel::mgrconn_out_state_changed(quint16 mgr_conn_state)
       seq_packet_id = 1;
       expected_packet_id = 1;
       last_rcv_packet_id = 0;
+      reorder_packets_clear();
     }
 
     state.stats.chain_error_count++;
     chain_heartbeat_rep_received = true;
     state.latency_ms = -1;
-    emit state_changed();
+    emit state_changed(params.id);
 
     if (was_connected && mgrconn_in && !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
       mgrconn_in->sendPacket(CMD_TUN_CHAIN_BROKEN);
@@ -229,11 +238,11 @@ void Tunnel::mgrconn_out_state_changed(quint16 mgr_conn_state)
         !(state.flags & TunnelState::TF_STOPPING) &&
         !(state.flags & TunnelState::TF_IDLE))
     {
-      if (!timer_failure_tolerance->isActive() && was_connected)
+      if (!timer_failure_tolerance.isActive() && was_connected)
       {
-        log(LOG_DBG4, QString(": mgrconn_out disconnected - starting failure tolerance timer (%1 ms)").arg(params.failure_tolerance_timeout));
-        timer_failure_tolerance->setInterval(params.failure_tolerance_timeout);
-        timer_failure_tolerance->start();
+        OBJ_LOG(this, LOG_DBG4, QString(": mgrconn_out disconnected - starting failure tolerance timer (%1 ms)").arg(params.failure_tolerance_timeout));
+        timer_failure_tolerance.setInterval(params.failure_tolerance_timeout);
+        timer_failure_tolerance.start();
       }
     }
     else
@@ -248,7 +257,7 @@ void Tunnel::mgrconn_in_after_disconnected()
 {
   if (!(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
-    log(LOG_DBG2, QString(": removing tunnel due to disconnected incoming mgrconn"));
+    OBJ_LOG(this, LOG_DBG2, QString(": removing tunnel due to disconnected incoming mgrconn"));
     this->stop();
     return;
   }
@@ -259,7 +268,7 @@ void Tunnel::mgrconn_out_after_disconnected()
 {
   if (!(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
-    log(LOG_DBG2, QString(": removing tunnel due to disconnected outgoing mgrconn"));
+    OBJ_LOG(this, LOG_DBG2, QString(": removing tunnel due to disconnected outgoing mgrconn"));
     this->stop();
     return;
   }
@@ -273,7 +282,7 @@ void Tunnel::mgrconn_out_after_disconnected()
     if (!(params.flags & TunnelParameters::FL_PERMANENT_TUNNEL))
     {
       close_incoming_connections();
-      emit state_changed();
+      emit state_changed(params.id);
     }
     else
       bind_stop();
@@ -281,38 +290,44 @@ void Tunnel::mgrconn_out_after_disconnected()
 }
 
 //---------------------------------------------------------------------------
-void Tunnel::mgrconn_in_disconnected()
+void Tunnel::mgrconn_in_disconnected(MgrClientConnection *conn)
 {
-  if (!mgrconn_in)
+  if (stripeIndex(mgrconn_in_stripes, conn) > 0)
+  {
+    mgrconn_in_stripe_detached(conn);
+    return;
+  }
+  if (!mgrconn_in || conn != mgrconn_in)
     return;
-  log(LOG_DBG2, QString(": incoming mgrconn disconnected"));
+  OBJ_LOG(this, LOG_DBG2, QString(": incoming mgrconn disconnected"));
   if (mgrconn_in->closing_by_cmd_close)
   {
     state.flags |= TunnelState::TF_STOPPING;
     if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED))
       mgrconn_out->sendPacket(CMD_CLOSE);
   }
+  mgrconn_counters_fold(mgrconn_in);
   mgrconn_in = NULL;
   state.flags &= ~TunnelState::TF_MGRCONN_IN_CLEAR_TO_SEND;
   state.flags &= ~TunnelState::TF_MGRCONN_IN_CONNECTED;
-  emit state_changed();
+  emit state_changed(params.id);
   if ((params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
     return;
 
   if (!(state.flags & TunnelState::TF_IDLE))
     state.stats.chain_error_count++;
   state.flags &= ~TunnelState::TF_CHAIN_OK;
-  emit state_changed();
+  emit state_changed(params.id);
 
   if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED))
     mgrconn_out->sendPacket(CMD_TUN_CHAIN_BROKEN);
   if (params.failure_tolerance_timeout > 0 && (state.flags & TunnelState::TF_CHECK_PASSED) && !(state.flags & TunnelState::TF_STOPPING))
   {
-    if (!timer_failure_tolerance->isActive())
+    if (!timer_failure_tolerance.isActive())
     {
-      log(LOG_DBG4, QString(": mgrconn_in disconnected - starting failure tolerance timer (%1 ms)").arg(params.failure_tolerance_timeout));
-      timer_failure_tolerance->setInterval(params.failure_tolerance_timeout);
-      timer_failure_tolerance->start();
+      OBJ_LOG(this, LOG_DBG4, QString(": mgrconn_in disconnected - starting failure tolerance timer (%1 ms)").arg(params.failure_tolerance_timeout));
+      timer_failure_tolerance.setInterval(params.failure_tolerance_timeout);
+      timer_failure_tolerance.start();
     }
   }
   else
@@ -325,7 +340,7 @@ void Tunnel::mgrconn_in_disconnected()
 //---------------------------------------------------------------------------
 void Tunnel::mgrconn_in_restored()
 {
-  log(LOG_DBG2, QString(": incoming mgrconn restored"));
+  OBJ_LOG(this, LOG_DBG2, QString(": incoming mgrconn restored"));
 
   if (params.tunservers.isEmpty())
   {
@@ -336,12 +351,12 @@ void Tunnel::mgrconn_in_restored()
 
   state.flags |= TunnelState::TF_MGRCONN_IN_CLEAR_TO_SEND;
   state.flags |= TunnelState::TF_MGRCONN_IN_CONNECTED;
-  emit state_changed();
-  if (timer_failure_tolerance->isActive() &&
+  emit state_changed(params.id);
+  if (timer_failure_tolerance.isActive() &&
       (params.tunservers.isEmpty() || (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED))))
   {
-    log(LOG_DBG4, QString(": stopping failure tolerance timer"));
-    timer_failure_tolerance->stop();
+    OBJ_LOG(this, LOG_DBG4, QString(": stopping failure tolerance timer"));
+    timer_failure_tolerance.stop();
   }
   if (!(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
@@ -355,6 +370,90 @@ void Tunnel::mgrconn_in_restored()
   }
 }
 
+//---------------------------------------------------------------------------
+// previous tunserver in chain has reconnected and has sent CMD_TUN_CREATE for the existing tunnel
+void Tunnel::mgrconn_in_reattached(MgrClientConnection *conn, TunnelParameters *new_params)
+{
+  if (mgrconn_in && mgrconn_in != conn)
+  {
+    disconnect(mgrconn_in, 0, this, 0);
+    mgrconn_in->setPacketHandler(NULL);
+    mgrconn_counters_fold(mgrconn_in);
+  }
+  mgrconn_in = conn;
+  setNewParams(new_params);
+  mgrconn_in_restored();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::mgrconn_in_packet(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data)
+{
+  switch (cmd)
+  {
+    case CMD_TUN_STOP:
+      OBJ_LOG(this, LOG_DBG1, QString(": stopping tunnel due to CMD_TUN_STOP command from %1 (%2:%3)").arg(conn->peer_hostname).arg(conn->peerAddress().toString()).arg(conn->peerPort()));
+      stop_chain();
+      break;
+    case CMD_TUN_CHAIN_HEARTBEAT_REQ:
+    case CMD_TUN_CHAIN_HEARTBEAT_REP:
+      cmd_tun_heartbeat(cmd, conn);
+      break;
+    case CMD_TUN_BUFFER_ACK:
+      cmd_tun_buffer_ack_received(conn, data);
+      break;
+    case CMD_TUN_BUFFER_RESEND_FROM:
+      cmd_tun_buffer_resend_from(conn, data);
+      break;
+    case CMD_TUN_CHAIN_BROKEN:
+      cmd_tun_chain_broken(conn);
+      break;
+    case CMD_TUN_CHAIN_CHECK:
+      cmd_tun_chain_check(conn);
+      break;
+    case CMD_TUN_CONN_OUT_NEW:
+    case CMD_TUN_CONN_OUT_DROP:
+    case CMD_TUN_CONN_OUT_CONNECTED:
+    case CMD_TUN_CONN_IN_DROP:
+    case CMD_TUN_CONN_IN_DATA:
+    case CMD_TUN_CONN_OUT_DATA:
+      conn_packet_received(conn, cmd, data);
+      break;
+    default:
+      OBJ_LOG(conn, LOG_DBG1, QString(": Unknown packet cmd %1 - dropping connection").arg(cmd));
+      conn->abort();
+      break;
+  }
+}
+
+//---------------------------------------------------------------------------
+// all tunnel's mgrconns: role is bound when connection is created or handed over by MgrServer
+void Tunnel::mgrPacketReceived(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data)
+{
+  switch (conn->packet_handler_role)
+  {
+    case MGRCONN_ROLE_IN:
+      mgrconn_in_packet(conn, cmd, data);
+      break;
+    case MGRCONN_ROLE_OUT:
+      mgrconn_out_packetReceived(cmd, data);
+      break;
+    case MGRCONN_ROLE_OUT_STRIPE:
+      mgrconn_out_stripe_packetReceived(conn, cmd, data);
+      break;
+  }
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::mgrconn_in_finished()
+{
+  MgrClientConnection *conn = qobject_cast<MgrClientConnection *>(sender());
+  if (!conn)
+    return;
+  disconnect(conn, 0, this, 0);
+  conn->setPacketHandler(NULL);
+  mgrconn_in_disconnected(conn);
+}
+
 //---------------------------------------------------------------------------
 void Tunnel::mgrconn_out_connection_error(QAbstractSocket::SocketError error)
 {
@@ -415,7 +514,7 @@ void Tunnel::mgrconn_out_connection_error(QAbstractSocket::SocketError error)
   {
     state.last_error_code = TunnelState::RES_CODE_MGRCONN_FAILED;
     state.last_error_str = error_str;
-    emit state_changed();
+    emit state_changed(params.id);
   }
   if (!(this->state.flags & TunnelState::TF_CHECK_PASSED))
   {
@@ -436,14 +535,33 @@ void Tunnel::mgrconn_out_connection_error(QAbstractSocket::SocketError error)
   }
 }
 
+//---------------------------------------------------------------------------
+static void flightrec_forward(FlightRecorder &flightrec, MgrPacketCmd cmd, const QByteArray &data)
+{
+  TunnelConnPacketId packet_id = 0;
+  TunnelConnId conn_id = 0;
+  if (cmd >= CMD_TUN_CONN_OUT_NEW && cmd <= CMD_TUN_CONN_OUT_DATA && data.length() >= (int)(sizeof(TunnelConnPacketId)+sizeof(TunnelConnId)))
+  {
+    packet_id = *((TunnelConnPacketId *)data.data());
+    conn_id = *((TunnelConnId *)(data.data()+sizeof(TunnelConnPacketId)));
+  }
+  flightrec.record(FR_FORWARD, cmd, packet_id, conn_id, data.length());
+}
+
 //---------------------------------------------------------------------------
 bool Tunnel::forward_packet(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data)
 {
-  if (conn == mgrconn_in && !params.tunservers.isEmpty())
+  bool data_packet = (cmd >= CMD_TUN_CONN_OUT_NEW && cmd <= CMD_TUN_CONN_OUT_DATA);
+  if (isMgrconnIn(conn) && !params.tunservers.isEmpty())
   {
     if (mgrconn_out)
     {
-      mgrconn_out->sendPacket(cmd, data);
+      flightrec_forward(flightrec, cmd, data);
+      quint8 stripe_index;
+      if (data_packet)
+        stripeForData(mgrconn_out, mgrconn_out_stripes, stripe_index)->sendPacket(cmd, data);
+      else
+        mgrconn_out->sendPacket(cmd, data);
       if (cmd == CMD_TUN_CONN_IN_DATA)
         state.stats.data_bytes_rcv += data.length()-sizeof(TunnelConnPacketId)-sizeof(TunnelConnId);
       else if (cmd == CMD_TUN_CONN_OUT_DATA)
@@ -451,11 +569,16 @@ bool Tunnel::forward_packet(MgrClientConnection *conn, MgrPacketCmd cmd, const Q
     }
     return true;
   }
-  else if (conn == mgrconn_out && !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
+  else if (isMgrconnOut(conn) && !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
     if (mgrconn_in)
     {
-      mgrconn_in->sendPacket(cmd, data);
+      flightrec_forward(flightrec, cmd, data);
+      quint8 stripe_index;
+      if (data_packet)
+        stripeForData(mgrconn_in, mgrconn_in_stripes, stripe_index)->sendPacket(cmd, data);
+      else
+        mgrconn_in->sendPacket(cmd, data);
       if (cmd == CMD_TUN_CONN_IN_DATA)
         state.stats.data_bytes_rcv += data.length()-sizeof(TunnelConnPacketId)-sizeof(TunnelConnId);
       else if (cmd == CMD_TUN_CONN_OUT_DATA)
@@ -475,7 +598,7 @@ void Tunnel::cmd_tun_chain_broken(MgrClientConnection *conn)
   if (!(state.flags & TunnelState::TF_IDLE))
     state.stats.chain_error_count++;
   state.flags &= ~TunnelState::TF_CHAIN_OK;
-  emit state_changed();
+  emit state_changed(params.id);
 }
 
 //---------------------------------------------------------------------------
@@ -499,7 +622,7 @@ void Tunnel::cmd_tun_chain_restored(MgrClientConnection *conn)
 
   chain_heartbeat_rep_received = true;
   state.flags |= TunnelState::TF_CHAIN_OK;
-  emit state_changed();
+  emit state_changed(params.id);
 
   if (last_rcv_packet_id == 0)
     mgrconn_out->sendPacket(CMD_TUN_BUFFER_RESEND_FROM, QByteArray((const char *)&last_rcv_packet_id, sizeof(TunnelConnPacketId)));
@@ -508,42 +631,48 @@ void Tunnel::cmd_tun_chain_restored(MgrClientConnection *conn)
 }
 
 //---------------------------------------------------------------------------
-void Tunnel::mgrconn_out_authRepPacketReceived(const QByteArray &req_data)
+void Tunnel::mgrconn_out_authRepPacketReceived(MgrClientConnection *conn, const QByteArray &req_data)
 {
   if (req_data.length() < (int)sizeof(MgrPacket_AuthRep))
   {
-    mgrconn_out->log(LOG_DBG1, QString(": MgrPacket_AuthRep packet too short"));
-    mgrconn_out->abort();
+    OBJ_LOG(conn, LOG_DBG1, QString(": MgrPacket_AuthRep packet too short"));
+    conn->abort();
     return;
   }
   MgrPacket_AuthRep *rep = (MgrPacket_AuthRep *)req_data.data();
   if (req_data.length() < (int)sizeof(MgrPacket_AuthRep)+rep->server_hostname_len)
   {
-    mgrconn_out->log(LOG_DBG1, QString(": MgrPacket_AuthRep packet too short"));
-    mgrconn_out->abort();
+    OBJ_LOG(conn, LOG_DBG1, QString(": MgrPacket_AuthRep packet too short"));
+    conn->abort();
     return;
   }
 
-  mgrconn_out->peer_hostname = QString::fromUtf8(req_data.mid(sizeof(MgrPacket_AuthRep),rep->server_hostname_len));
+  conn->peer_hostname = QString::fromUtf8(req_data.mid(sizeof(MgrPacket_AuthRep),rep->server_hostname_len));
+  conn->peer_features = MgrPacket_AuthRep::serverFeatures(req_data);
 
   if (rep->auth_result != MgrPacket_AuthRep::RES_CODE_OK)
   {
-    mgrconn_out->log(LOG_DBG1, QString(": user %1 login to %2 failed").arg(mgrconn_out->params.auth_username).arg(mgrconn_out->peer_hostname));
+    OBJ_LOG(conn, LOG_DBG1, QString(": user %1 login to %2 failed").arg(conn->params.auth_username).arg(conn->peer_hostname));
+    if (conn != mgrconn_out)
+    {
+      mgrconn_out_stripe_closed(conn);
+      return;
+    }
     mgrconn_out_state_changed(MgrClientConnection::MGR_ERROR);
     mgrconn_out_connection_error(QAbstractSocket::ProxyAuthenticationRequiredError);
     mgrconn_out->disconnectFromHost();
   }
   else
   {
-    mgrconn_out->socket_startOperational();
-    mgrconn_out->log(LOG_DBG1, QString(": user %1 logged in to %2").arg(mgrconn_out->params.auth_username).arg(mgrconn_out->peer_hostname));
+    conn->socket_startOperational();
+    OBJ_LOG(conn, LOG_DBG1, QString(": user %1 logged in to %2").arg(conn->params.auth_username).arg(conn->peer_hostname));
   }
 }
 
 //---------------------------------------------------------------------------
 void Tunnel::failure_tolerance_timedout()
 {
-  log(LOG_DBG4, QString(": Failure tolerance timeout"));
+  OBJ_LOG(this, LOG_DBG4, QString(": Failure tolerance timeout"));
   if (!mgrconn_in && !(params.flags & TunnelParameters::FL_MASTER_TUNSERVER))
   {
     mgrconn_in_after_disconnected();
@@ -585,7 +714,8 @@ void Tunnel::cmd_tun_heartbeat(MgrPacketCmd cmd, MgrClientConnection *conn)
     else if (cmd == CMD_TUN_CHAIN_HEARTBEAT_REP)
     {
       chain_heartbeat_rep_received = true;
-      state.latency_ms = qAbs(t_last_chain_heartbeat_req_sent.elapsed());
+      latency_chain_rtt.record(t_last_chain_heartbeat_req_sent.nsecsElapsed());
+      state.latency_ms = t_last_chain_heartbeat_req_sent.elapsed();
     }
     return;
   }
@@ -598,9 +728,10 @@ void Tunnel::cmd_tun_heartbeat(MgrPacketCmd cmd, MgrClientConnection *conn)
   {
     chain_heartbeat_rep_received = true;
     int old_latency_ms = state.latency_ms;
-    state.latency_ms = qAbs(t_last_chain_heartbeat_req_sent.elapsed());
+    latency_chain_rtt.record(t_last_chain_heartbeat_req_sent.nsecsElapsed());
+    state.latency_ms = t_last_chain_heartbeat_req_sent.elapsed();
     if (old_latency_ms < 0)
-      emit state_changed();
+      emit state_changed(params.id);
   }
 }
 
@@ -617,7 +748,7 @@ void Tunnel::chain_heartbeat_timeout()
 
   // only send tunnel chain heartbeats if tunnel seems to be more or less idle
   if (mgrconn_out && (state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) &&
-      mgrconn_out->output_buffer.length()+mgrconn_out->bytesToWrite() < 1024*64 &&
+      mgrconn_out->outputBytesPending() < 1024*64 &&
       (!t_last_buffered_packet_rcv.isValid() || qAbs(t_last_buffered_packet_rcv.elapsed()) > 100))
   {
     t_last_chain_heartbeat_req_sent.restart();
@@ -625,3 +756,279 @@ void Tunnel::chain_heartbeat_timeout()
     mgrconn_out->sendPacket(CMD_TUN_CHAIN_HEARTBEAT_REQ);
   }
 }
+
+//---------------------------------------------------------------------------
+int Tunnel::stripeIndex(const QVector<TunnelStripe> &stripes, MgrClientConnection *conn)
+{
+  for (int i=0; i < stripes.count(); i++)
+  {
+    if (stripes[i].conn == conn)
+      return i+1;
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// choose the least loaded of main mgrconn and its attached stripes for the next data packet
+MgrClientConnection *Tunnel::stripeForData(MgrClientConnection *main_conn, QVector<TunnelStripe> &stripes, quint8 &stripe_index)
+{
+  MgrClientConnection *dest_conn = main_conn;
+  qint64 dest_len = main_conn->outputBytesPending();
+  stripe_index = 0;
+  for (int i=0; i < stripes.count(); i++)
+  {
+    if (!stripes[i].conn || !stripes[i].attached)
+      continue;
+    qint64 len = stripes[i].conn->outputBytesPending();
+    if (len < dest_len)
+    {
+      dest_conn = stripes[i].conn;
+      dest_len = len;
+      stripe_index = i+1;
+    }
+  }
+  return dest_conn;
+}
+
+//---------------------------------------------------------------------------
+// open additional tunserver-tunserver mgrconns (if configured) after main mgrconn_out is established
+void Tunnel::start_mgrconn_out_stripes()
+{
+  if (params.mgrconn_stripes <= 1 || !mgrconn_out || params.next_id == 0 ||
+      !(state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) ||
+      (state.flags & TunnelState::TF_STOPPING))
+    return;
+
+  int stripe_count = qMin(params.mgrconn_stripes, (quint32)TUNNEL_MAX_MGRCONN_STRIPES)-1;
+  for (int i=stripe_count; i < mgrconn_out_stripes.count(); i++)
+  {
+    if (mgrconn_out_stripes[i].conn)
+      mgrconn_out_stripe_closed(mgrconn_out_stripes[i].conn);
+  }
+  mgrconn_out_stripes.resize(stripe_count);
+  for (int i=0; i < mgrconn_out_stripes.count(); i++)
+  {
+    if (mgrconn_out_stripes[i].conn)
+      continue;
+    MgrClientConnection *conn = new MgrClientConnection(MgrClientConnection::OUTGOING);
+    conn->log_prefix = QString("Tunnel '%1' mgrconn_out stripe %2: ").arg(params.name).arg(i+1);
+    connect(conn, SIGNAL(state_changed(quint16)), this, SLOT(mgrconn_out_stripe_state_changed(quint16)));
+    conn->setPacketHandler(this, MGRCONN_ROLE_OUT_STRIPE);
+
+    connect(conn, SIGNAL(stat_bytesReceived(quint64)), this, SLOT(mgrconn_bytesReceived(quint64)));
+    connect(conn, SIGNAL(stat_bytesSent(quint64)), this, SLOT(mgrconn_bytesSent(quint64)));
+    connect(conn, SIGNAL(stat_bytesSentEncrypted(quint64)), this, SLOT(mgrconn_bytesSentEncrypted(quint64)));
+
+    conn->params = mgrconn_out->params;
+    conn->params.conn_type = MgrClientParameters::CONN_DEMAND;
+    mgrconn_out_stripes[i].conn = conn;
+    mgrconn_out_stripes[i].attached = false;
+    conn->beginConnection();
+  }
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::close_mgrconn_stripes(QVector<TunnelStripe> &stripes)
+{
+  for (int i=0; i < stripes.count(); i++)
+  {
+    MgrClientConnection *conn = stripes[i].conn;
+    if (!conn)
+      continue;
+    // disable auto-reconnect
+    conn->params.conn_type = MgrClientParameters::CONN_DEMAND;
+    disconnect(conn, 0, this, 0);
+    conn->setPacketHandler(NULL);
+    mgrconn_counters_fold(conn);
+    // disconnect or abort if connected
+    if (conn->state() != QAbstractSocket::UnconnectedState && conn->state() != QAbstractSocket::ClosingState)
+      conn->disconnectFromHost();
+    else
+      conn->abort();
+    conn->deleteLater();
+  }
+  stripes.clear();
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::mgrconn_out_stripe_state_changed(quint16 mgr_conn_state)
+{
+  MgrClientConnection *conn = qobject_cast<MgrClientConnection *>(sender());
+  int stripe_index = stripeIndex(mgrconn_out_stripes, conn);
+  if (!conn || stripe_index == 0)
+    return;
+
+  if (mgr_conn_state == MgrClientConnection::MGR_CONNECTED)
+  {
+    MgrPacket_TunnelStripeAttach packet;
+    packet.tunnel_id = params.next_id;
+    packet.orig_tunnel_id = params.id;
+    packet.stripe_index = stripe_index;
+    conn->sendPacket(CMD_TUN_STRIPE_ATTACH, QByteArray((const char *)&packet, sizeof(MgrPacket_TunnelStripeAttach)));
+  }
+  else if (mgr_conn_state == MgrClientConnection::MGR_ERROR || mgr_conn_state == MgrClientConnection::MGR_NONE)
+    mgrconn_out_stripe_closed(conn);
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::mgrconn_out_stripe_packetReceived(MgrClientConnection *conn, MgrPacketCmd cmd, const QByteArray &data)
+{
+  int stripe_index = stripeIndex(mgrconn_out_stripes, conn);
+  if (stripe_index == 0)
+    return;
+
+  switch (cmd)
+  {
+    case CMD_AUTH_REP:
+      mgrconn_out_authRepPacketReceived(conn, data);
+      break;
+    case CMD_TUN_STRIPE_ATTACH:
+    {
+      if (data.length() < (int)sizeof(MgrPacket_StandartReply))
+      {
+        OBJ_LOG(conn, LOG_DBG1, QString(": CMD_TUN_STRIPE_ATTACH packet too short"));
+        conn->abort();
+        return;
+      }
+      MgrPacket_StandartReply *packet = (MgrPacket_StandartReply *)data.data();
+      if (data.length() < (int)sizeof(MgrPacket_StandartReply)+packet->obj_id_len+packet->error_len)
+      {
+        OBJ_LOG(conn, LOG_DBG1, QString(": CMD_TUN_STRIPE_ATTACH packet too short"));
+        conn->abort();
+        return;
+      }
+      if (packet->res_code == TunnelState::RES_CODE_OK)
+      {
+        OBJ_LOG(conn, LOG_DBG2, QString(": attached to tunnel id=%1").arg(params.next_id));
+        mgrconn_out_stripes[stripe_index-1].attached = true;
+      }
+      else
+      {
+        QString error_str = QString::fromUtf8(data.mid(sizeof(MgrPacket_StandartReply)+packet->obj_id_len, packet->error_len));
+        OBJ_LOG(conn, LOG_DBG1, QString(": failed to attach to tunnel id=%1: ").arg(params.next_id)+error_str);
+        mgrconn_out_stripe_closed(conn);
+      }
+      break;
+    }
+    case CMD_TUN_CONN_OUT_NEW:
+    case CMD_TUN_CONN_OUT_DROP:
+    case CMD_TUN_CONN_OUT_CONNECTED:
+    case CMD_TUN_CONN_IN_DROP:
+    case CMD_TUN_CONN_IN_DATA:
+    case CMD_TUN_CONN_OUT_DATA:
+      conn_packet_received(conn, cmd, data);
+      break;
+    default:
+      OBJ_LOG(conn, LOG_DBG1, QString(": Unknown packet cmd %1 - dropping connection").arg(cmd));
+      conn->abort();
+      break;
+  }
+}
+
+//---------------------------------------------------------------------------
+// outgoing stripe has been closed or failed to attach
+void Tunnel::mgrconn_out_stripe_closed(MgrClientConnection *conn)
+{
+  int stripe_index = stripeIndex(mgrconn_out_stripes, conn);
+  if (stripe_index == 0)
+    return;
+  bool was_attached = mgrconn_out_stripes[stripe_index-1].attached;
+  mgrconn_out_stripes[stripe_index-1] = TunnelStripe();
+
+  disconnect(conn, 0, this, 0);
+  conn->setPacketHandler(NULL);
+  mgrconn_counters_fold(conn);
+  if (conn->state() != QAbstractSocket::UnconnectedState && conn->state() != QAbstractSocket::ClosingState)
+    conn->disconnectFromHost();
+  else
+    conn->abort();
+  conn->deleteLater();
+
+  // stripes which never got attached (e.g. next tunserver doesn't support them) are not retried
+  if (was_attached)
+  {
+    OBJ_LOG(conn, LOG_DBG2, QString(": stripe lost, resending its unacknowledged packets"));
+    buffered_packets_resend_stripe(stripe_index);
+    QTimer::singleShot(TUNNEL_STRIPE_RECONNECT_INTERVAL, this, SLOT(start_mgrconn_out_stripes()));
+  }
+}
+
+//---------------------------------------------------------------------------
+// previous tunserver in chain has attached additional incoming mgrconn to the tunnel
+void Tunnel::mgrconn_in_stripe_attached(MgrClientConnection *conn, quint8 stripe_index)
+{
+  if ((int)stripe_index > mgrconn_in_stripes.count())
+    mgrconn_in_stripes.resize(stripe_index);
+  MgrClientConnection *old_conn = mgrconn_in_stripes[stripe_index-1].conn;
+  if (old_conn && old_conn != conn)
+  {
+    disconnect(old_conn, 0, this, 0);
+    old_conn->setPacketHandler(NULL);
+    mgrconn_counters_fold(old_conn);
+    old_conn->abort();
+  }
+  mgrconn_in_stripes[stripe_index-1].conn = conn;
+  mgrconn_in_stripes[stripe_index-1].attached = true;
+  conn->log_prefix = QString("Tunnel '%1' mgrconn_in stripe %2: ").arg(params.name).arg(stripe_index);
+  OBJ_LOG(this, LOG_DBG2, QString(": incoming mgrconn stripe %1 attached").arg(stripe_index));
+  send_standart_reply(conn, CMD_TUN_STRIPE_ATTACH, QByteArray((const char *)&params.orig_id, sizeof(TunnelId)), TunnelState::RES_CODE_OK, QString());
+
+  if (params.tunservers.isEmpty())
+  {
+    connect(conn, SIGNAL(stat_bytesReceived(quint64)), this, SLOT(mgrconn_bytesReceived(quint64)));
+    connect(conn, SIGNAL(stat_bytesSent(quint64)), this, SLOT(mgrconn_bytesSent(quint64)));
+    connect(conn, SIGNAL(stat_bytesSentEncrypted(quint64)), this, SLOT(mgrconn_bytesSentEncrypted(quint64)));
+  }
+}
+
+//---------------------------------------------------------------------------
+void Tunnel::mgrconn_in_stripe_detached(MgrClientConnection *conn)
+{
+  int stripe_index = stripeIndex(mgrconn_in_stripes, conn);
+  if (stripe_index == 0)
+    return;
+  mgrconn_in_stripes[stripe_index-1] = TunnelStripe();
+  disconnect(conn, 0, this, 0);
+  conn->setPacketHandler(NULL);
+  mgrconn_counters_fold(conn);
+  OBJ_LOG(this, LOG_DBG2, QString(": incoming mgrconn stripe %1 detached").arg(stripe_index));
+  buffered_packets_resend_stripe(stripe_index);
+}
+
+//---------------------------------------------------------------------------
+// resend unacknowledged packets which have been sent through lost stripe
+void Tunnel::buffered_packets_resend_stripe(quint8 stripe_index)
+{
+  MgrClientConnection *main_conn;
+  QVector<TunnelStripe> *stripes;
+  if (params.flags & TunnelParameters::FL_MASTER_TUNSERVER)
+  {
+    if (!mgrconn_out || !(state.flags & TunnelState::TF_MGRCONN_OUT_CONNECTED) ||
+        !(state.flags & TunnelState::TF_MGRCONN_OUT_CLEAR_TO_SEND))
+      return;
+    main_conn = mgrconn_out;
+    stripes = &mgrconn_out_stripes;
+  }
+  else
+  {
+    if (!mgrconn_in || !(state.flags & TunnelState::TF_MGRCONN_IN_CLEAR_TO_SEND))
+      return;
+    main_conn = mgrconn_in;
+    stripes = &mgrconn_in_stripes;
+  }
+
+  int resent_packets_count = 0;
+  for (int i=0; i < buffered_packets_stripe_list.count(); i++)
+  {
+    if (buffered_packets_stripe_list[i] != stripe_index)
+      continue;
+    quint8 dest_stripe_index;
+    MgrClientConnection *dest_conn = stripeForData(main_conn, *stripes, dest_stripe_index);
+    dest_conn->output_buffer.append(buffered_packets_list[i]);
+    dest_conn->sendOutputBuffer();
+    buffered_packets_stripe_list[i] = dest_stripe_index;
+    resent_packets_count++;
+  }
+  if (resent_packets_count > 0)
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 buffered packets resent due to lost stripe %2").arg(resent_packets_count).arg(stripe_index));
+}
@@ -8,13 +8,136 @@
 
 #include <QHostAddress>
 #include "tunnel_conn.h"
+#include "../lib/buffer-pool.h"
+
+//---------------------------------------------------------------------------
+void TunnelConn::setParams(const QSharedPointer<const TunnelParameters> &_tun_params)
+{
+  tun_params = _tun_params;
+  max_bytes_to_read_at_once = tun_params->max_bytes_to_read_at_once;
+  read_buffer_size = tun_params->read_buffer_size;
+  write_buffer_size = tun_params->write_buffer_size;
+  if (conn_idle_timeout != tun_params->conn_idle_timeout)
+  {
+    conn_idle_timeout = tun_params->conn_idle_timeout;
+    if (conn_idle_timeout == 0)
+      timer_idle.stop();
+    else if ((tcp_sock || pipe_sock || uring) && !timer_connect.isActive())
+      timer_idle.start(conn_idle_timeout);
+  }
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::reset()
+{
+  timer_connect.stop();
+  timer_idle.stop();
+  id = 0;
+  log_prefix_id = 0;
+  info.clear();
+  input_buffer.clear();
+  output_buffer.clear();
+  uring = NULL;
+  uring_fd = -1;
+  uring_error = QAbstractSocket::UnknownSocketError;
+  uring_error_str.clear();
+  t_last_rcv = QTime();
+  t_last_snd = QTime();
+  t_connect_started.invalidate();
+  closing_by_cmd = false;
+  closing = false;
+  read_paused = false;
+  read_queued = false;
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::idle_timer_start()
+{
+  if (conn_idle_timeout > 0)
+    timer_idle.start(conn_idle_timeout);
+}
+
+//---------------------------------------------------------------------------
+// idle timer is not restarted on every read/write - it checks the last activity time when it expires
+void TunnelConn::timerWheelExpired(TimerWheelTimer *timer)
+{
+  if (timer == &timer_connect)
+    socket_connect_timeout();
+  else if (timer == &timer_idle && conn_idle_timeout > 0)
+  {
+    int idle = qAbs(t_connected.elapsed());
+    if (t_last_rcv.isValid())
+      idle = qMin(idle, qAbs(t_last_rcv.elapsed()));
+    if (t_last_snd.isValid())
+      idle = qMin(idle, qAbs(t_last_snd.elapsed()));
+    if ((quint32)idle < conn_idle_timeout)
+      timer_idle.start(conn_idle_timeout-idle);
+    else
+    {
+      OBJ_LOG(this, LOG_DBG3, QString(": idle timeout"));
+      this->close(CLOSE_IDLE_TIMEOUT);
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// timer wheel is per thread: connections (and their sockets) are children of their tunnel and are moved along with it
+bool TunnelConn::event(QEvent *e)
+{
+  if (e->type() == QEvent::ThreadChange)
+  {
+    timer_connect.suspend();
+    timer_idle.suspend();
+    QMetaObject::invokeMethod(this, "timers_resume", Qt::QueuedConnection);
+  }
+  return QObject::event(e);
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::timers_resume()
+{
+  timer_connect.resume();
+  timer_idle.resume();
+}
+
+//---------------------------------------------------------------------------
+// output_buffer keeps its capacity after a burst towards a slow application, returns released bytes
+quint64 TunnelConn::trimBuffers()
+{
+  return BufferPool::trim(input_buffer)+BufferPool::trim(output_buffer);
+}
+
+//---------------------------------------------------------------------------
+// application data held by this connection, including data buffered inside its socket (Tunnel::memory_usage)
+quint64 TunnelConn::bytesBuffered() const
+{
+  quint64 bytes = input_buffer.length()+output_buffer.length();
+  if (tcp_sock)
+    bytes += tcp_sock->bytesAvailable()+tcp_sock->bytesToWrite();
+  else if (pipe_sock)
+    bytes += pipe_sock->bytesAvailable()+pipe_sock->bytesToWrite();
+  if (uring_send_op)
+    bytes += uring_send_op->buffer.length();
+  return bytes;
+}
+
+//---------------------------------------------------------------------------
+quint16 TunnelConn::localPort() const
+{
+  if (tcp_sock)
+    return tcp_sock->localPort();
+  if (uring_fd >= 0)
+    return IoUringBackend::localPort(uring_fd);
+  return 0;
+}
 
 //---------------------------------------------------------------------------
 void TunnelConn::init_incoming()
 {
   if (tcp_sock)
   {
-    log(LOG_DBG3, QString(": new incoming TCP connection from %1:%2").arg(tcp_sock->peerAddress().toString()).arg(tcp_sock->peerPort()));
+    tcp_sock->setParent(this);
+    OBJ_LOG(this, LOG_DBG3, QString(": new incoming TCP connection from %1:%2").arg(tcp_sock->peerAddress().toString()).arg(tcp_sock->peerPort()));
     connect(tcp_sock, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
     connect(tcp_sock, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(tcp_socket_error(QAbstractSocket::SocketError)));
     connect(tcp_sock, SIGNAL(bytesWritten(qint64)), this, SLOT(socket_bytesWritten(qint64)));
@@ -22,12 +145,20 @@ void TunnelConn::init_incoming()
   }
   else if (pipe_sock)
   {
-    log(LOG_DBG3, QString(": new incoming PIPE connection on '%1'").arg(pipe_sock->fullServerName()));
+    pipe_sock->setParent(this);
+    OBJ_LOG(this, LOG_DBG3, QString(": new incoming PIPE connection on '%1'").arg(pipe_sock->fullServerName()));
     connect(pipe_sock, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
     connect(pipe_sock, SIGNAL(error(QLocalSocket::LocalSocketError)), this, SLOT(local_socket_error(QLocalSocket::LocalSocketError)));
     connect(pipe_sock, SIGNAL(bytesWritten(qint64)), this, SLOT(socket_bytesWritten(qint64)));
     connect(pipe_sock, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
   }
+  else if (uring)
+  {
+    OBJ_LOG(this, LOG_DBG3, QString(": new incoming TCP connection from %1:%2 (io_uring)").arg(info->peer_address.toString()).arg(info->peer_port));
+    uring_connected = true;
+    uring_recv_start();
+  }
+  idle_timer_start();
 }
 
 //---------------------------------------------------------------------------
@@ -35,45 +166,65 @@ void TunnelConn::init_outgoing(const QString &remote_host, quint16 remote_port,
 {
   if (tcp_sock)
   {
-    log(LOG_DBG3, QString(": establishing outgoing TCP connection to %1:%2").arg(remote_host).arg(remote_port));
+    tcp_sock->setParent(this);
+    OBJ_LOG(this, LOG_DBG3, QString(": establishing outgoing TCP connection to %1:%2").arg(remote_host).arg(remote_port));
     connect(tcp_sock, SIGNAL(connected()), this, SLOT(socket_connected()));
     connect(tcp_sock, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
     connect(tcp_sock, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(tcp_socket_error(QAbstractSocket::SocketError)));
     connect(tcp_sock, SIGNAL(bytesWritten(qint64)), this, SLOT(socket_bytesWritten(qint64)));
     connect(tcp_sock, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
-    timer_connect->setInterval(connect_timeout);
-    timer_connect->start();
+    timer_connect.start(connect_timeout);
+    t_connect_started.start();
     tcp_sock->connectToHost(remote_host, remote_port);
   }
   else if (pipe_sock)
   {
-    log(LOG_DBG3, QString(": establishing outgoing PIPE connection to %1").arg(remote_host));
+    pipe_sock->setParent(this);
+    OBJ_LOG(this, LOG_DBG3, QString(": establishing outgoing PIPE connection to %1").arg(remote_host));
     connect(pipe_sock, SIGNAL(connected()), this, SLOT(socket_connected()));
     connect(pipe_sock, SIGNAL(disconnected()), this, SLOT(socket_disconnected()));
     connect(pipe_sock, SIGNAL(error(QLocalSocket::LocalSocketError)), this, SLOT(local_socket_error(QLocalSocket::LocalSocketError)));
     connect(pipe_sock, SIGNAL(bytesWritten(qint64)), this, SLOT(socket_bytesWritten(qint64)));
     connect(pipe_sock, SIGNAL(readyRead()), this, SLOT(socket_readyRead()));
-    timer_connect->setInterval(connect_timeout);
-    timer_connect->start();
+    timer_connect.start(connect_timeout);
+    t_connect_started.start();
     pipe_sock->connectToServer(remote_host);
   }
+  else if (uring)
+  {
+    OBJ_LOG(this, LOG_DBG3, QString(": establishing outgoing TCP connection to %1:%2 (io_uring)").arg(remote_host).arg(remote_port));
+    timer_connect.start(connect_timeout);
+    t_connect_started.start();
+    uring_remote_port = remote_port;
+    QHostAddress address;
+    if (address.setAddress(remote_host))
+      uring_connect(address);
+    else
+      uring_lookup_id = QHostInfo::lookupHost(remote_host, this, SLOT(uring_hostLookupFinished(QHostInfo)));
+  }
 }
 
 //---------------------------------------------------------------------------
 void TunnelConn::socket_connected()
 {
-  if (timer_connect->isActive())
-    timer_connect->stop();
+  timer_connect.stop();
+  idle_timer_start();
   emit connection_established();
-  log(LOG_DBG3, QString(": connected"));
+  OBJ_LOG(this, LOG_DBG3, QString(": connected"));
   if (tcp_sock)
   {
-    tcp_sock->setSocketOption(QTcpSocket::KeepAliveOption, (tun_params.flags & TunnelParameters::FL_TCP_KEEP_ALIVE) ? 1 : 0);
-    tcp_sock->setSocketOption(QTcpSocket::LowDelayOption, (tun_params.flags & TunnelParameters::FL_TCP_NO_DELAY) ? 1 : 0);
-    tcp_sock->setReadBufferSize(tun_params.read_buffer_size);
+    tcp_sock->setSocketOption(QTcpSocket::KeepAliveOption, (tun_params->flags & TunnelParameters::FL_TCP_KEEP_ALIVE) ? 1 : 0);
+    tcp_sock->setSocketOption(QTcpSocket::LowDelayOption, (tun_params->flags & TunnelParameters::FL_TCP_NO_DELAY) ? 1 : 0);
+    tcp_sock->setReadBufferSize(read_buffer_size);
   }
   else if (pipe_sock)
-    pipe_sock->setReadBufferSize(tun_params.read_buffer_size);
+    pipe_sock->setReadBufferSize(read_buffer_size);
+  else if (uring)
+  {
+    IoUringBackend::setSocketOptions(uring_fd, tun_params->flags & TunnelParameters::FL_TCP_KEEP_ALIVE, tun_params->flags & TunnelParameters::FL_TCP_NO_DELAY);
+    uring_connected = true;
+    uring_recv_start();
+  }
   if (!output_buffer.isEmpty())
     sendOutputBuffer();
 }
@@ -81,48 +232,66 @@ void TunnelConn::socket_connected()
 //---------------------------------------------------------------------------
 void TunnelConn::socket_connect_timeout()
 {
-  log(LOG_DBG3, QString(": connect timeout"));
-  this->close(true);
+  OBJ_LOG(this, LOG_DBG3, QString(": connect timeout"));
+  this->close(CLOSE_CONNECT_TIMEOUT);
 }
 
 //---------------------------------------------------------------------------
 void TunnelConn::socket_disconnected()
 {
-  if (timer_connect->isActive())
-    timer_connect->stop();
-  log(LOG_DBG3, QString(": disconnected"));
+  timer_connect.stop();
+  OBJ_LOG(this, LOG_DBG3, QString(": disconnected"));
   this->close();
 }
 
 //---------------------------------------------------------------------------
 void TunnelConn::tcp_socket_error(QAbstractSocket::SocketError)
 {
-  if (timer_connect->isActive())
-    timer_connect->stop();
-  log(LOG_DBG3, QString(" error: ")+tcp_sock->errorString());
+  timer_connect.stop();
+  OBJ_LOG(this, LOG_DBG3, QString(" error: ")+tcp_sock->errorString());
   this->close();
 }
 
 //---------------------------------------------------------------------------
 void TunnelConn::local_socket_error(QLocalSocket::LocalSocketError)
 {
-  if (timer_connect->isActive())
-    timer_connect->stop();
-  log(LOG_DBG3, QString(" error: ")+pipe_sock->errorString());
+  timer_connect.stop();
+  OBJ_LOG(this, LOG_DBG3, QString(" error: ")+pipe_sock->errorString());
   this->close();
 }
 
 //-----------------------------------------------------------------------------
 void TunnelConn::sendOutputBuffer()
 {
+  if (uring)
+  {
+    if (!uring_connected || uring_send_op || output_buffer.isEmpty())
+      return;
+    QByteArray data;
+    if (write_buffer_size > 0 && (quint32)output_buffer.length() > write_buffer_size)
+    {
+      data = output_buffer.left(write_buffer_size);
+      output_buffer.remove(0, write_buffer_size);
+    }
+    else
+    {
+      data = output_buffer;
+      output_buffer.clear();
+    }
+    uring_send_op = uring->send(this, uring_fd, data);
+    if (!uring_send_op)
+      uring_failed(0);
+    return;
+  }
+
   quint64 bytes_to_write=0;
   if (tcp_sock)
     bytes_to_write = tcp_sock->bytesToWrite();
   else if (pipe_sock)
     bytes_to_write = pipe_sock->bytesToWrite();
   int max_new_bytes_to_write = output_buffer.length();
-  if (tun_params.write_buffer_size > 0 && bytes_to_write+max_new_bytes_to_write > tun_params.write_buffer_size)
-    max_new_bytes_to_write = tun_params.write_buffer_size-bytes_to_write;
+  if (write_buffer_size > 0 && bytes_to_write+max_new_bytes_to_write > write_buffer_size)
+    max_new_bytes_to_write = write_buffer_size-bytes_to_write;
   if (max_new_bytes_to_write <= 0)
     return;
   int send_len=0;
@@ -149,13 +318,13 @@ void TunnelConn::socket_bytesWritten(qint64 bytes)
   else if (pipe_sock)
     bytes_to_write = pipe_sock->bytesToWrite();
   if (bytes_to_write > 0 && output_buffer.length() > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer, %3 in output buffer)").arg(bytes).arg(bytes_to_write).arg(output_buffer.length()));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer, %3 in output buffer)").arg(bytes).arg(bytes_to_write).arg(output_buffer.length()));
   else if (bytes_to_write > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer)").arg(bytes).arg(bytes_to_write));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%2 more in internal buffer)").arg(bytes).arg(bytes_to_write));
   else if (output_buffer.length() > 0)
-    log(LOG_DBG4, QString(": %1 bytes written (%3 more in output buffer)").arg(bytes).arg(output_buffer.length()));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written (%3 more in output buffer)").arg(bytes).arg(output_buffer.length()));
   else
-    log(LOG_DBG4, QString(": %1 bytes written").arg(bytes));
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes written").arg(bytes));
   if (!output_buffer.isEmpty())
     sendOutputBuffer();
 }
@@ -163,6 +332,8 @@ void TunnelConn::socket_bytesWritten(qint64 bytes)
 //---------------------------------------------------------------------------
 void TunnelConn::socket_readyRead()
 {
+  if (read_paused)
+    return;                             // data left in the socket is read by readResume()
   t_last_rcv.restart();
   int bytes_avail = 0;
   if (tcp_sock)
@@ -170,16 +341,22 @@ void TunnelConn::socket_readyRead()
   if (pipe_sock)
     bytes_avail = pipe_sock->bytesAvailable();
 
-  if (tun_params.read_buffer_size > 0 && (quint32)input_buffer.length() >= tun_params.read_buffer_size)
+  if (read_buffer_size > 0 && (quint32)input_buffer.length() >= read_buffer_size)
   {
     // input buffer overflows, slow down and reschedule
-    QTimer::singleShot(5, this, SLOT(socket_readyRead()));
+    read_queue(5);
+    return;
+  }
+  if (mem_account && !mem_account->readAllowed())
+  {
+    // server-wide buffer memory budget is tight, let the socket's receive window apply backpressure
+    readPause();
     return;
   }
 
-  int bytes_to_read = tun_params.max_bytes_to_read_at_once > 0 ? tun_params.max_bytes_to_read_at_once : bytes_avail;
-  if (tun_params.read_buffer_size > 0 && (quint32)input_buffer.length()+bytes_to_read > tun_params.read_buffer_size)
-    bytes_to_read = tun_params.read_buffer_size-input_buffer.length();
+  int bytes_to_read = max_bytes_to_read_at_once > 0 ? max_bytes_to_read_at_once : bytes_avail;
+  if (read_buffer_size > 0 && (quint32)input_buffer.length()+bytes_to_read > read_buffer_size)
+    bytes_to_read = read_buffer_size-input_buffer.length();
 
   QByteArray data;
   if (tcp_sock)
@@ -194,32 +371,99 @@ void TunnelConn::socket_readyRead()
   if (prc_log_level >= LOG_DBG4)
   {
     if (bytes_avail > 0)
-      log(LOG_DBG4, QString(": %1 bytes received (%2 more available)").arg(data.length()).arg(bytes_avail));
+      OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes received (%2 more available)").arg(data.length()).arg(bytes_avail));
     else
-      log(LOG_DBG4, QString(": %1 bytes received").arg(data.length()));
+      OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes received").arg(data.length()));
   }
 
-  emit dataReceived();
+  if (handler)
+    handler->connDataReceived(this);
 
   if (bytes_avail > 0)
-    QTimer::singleShot(0, this, SLOT(socket_readyRead()));
+    read_queue(0);
+}
+
+//---------------------------------------------------------------------------
+// one pending read at a time, a read already queued runs at its own time
+void TunnelConn::read_queue(int msec)
+{
+  if (read_queued)
+    return;
+  read_queued = true;
+  QTimer::singleShot(msec, this, SLOT(read_queued_run()));
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::read_queued_run()
+{
+  if (!read_queued)
+    return;
+  read_queued = false;
+  if (!closing)
+    socket_readyRead();
 }
 
 //---------------------------------------------------------------------------
-void TunnelConn::close(bool connect_timeout)
+// stops reading until readResume(): Qt stops polling the socket once its internal buffer reaches the read
+// buffer limit, so the limit is lowered to a single byte instead of retrying on a timer
+void TunnelConn::readPause()
+{
+  if (read_paused || closing)
+    return;
+  read_paused = true;
+  OBJ_LOG(this, LOG_DBG4, QString(": reading paused, server buffer memory budget is tight"));
+  if (tcp_sock)
+  {
+    paused_read_buffer_size = tcp_sock->readBufferSize();
+    tcp_sock->setReadBufferSize(1);
+  }
+  else if (pipe_sock)
+  {
+    paused_read_buffer_size = pipe_sock->readBufferSize();
+    pipe_sock->setReadBufferSize(1);
+  }
+  else if (uring && uring_recv_op && !uring_recv_paused)
+  {
+    uring_recv_paused = true;
+    IoUringBackend::stop(uring_recv_op);
+  }
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::readResume()
+{
+  if (!read_paused)
+    return;
+  read_paused = false;
+  if (closing)
+    return;
+  OBJ_LOG(this, LOG_DBG4, QString(": reading resumed"));
+  if (tcp_sock)
+    tcp_sock->setReadBufferSize(paused_read_buffer_size);
+  else if (pipe_sock)
+    pipe_sock->setReadBufferSize(paused_read_buffer_size);
+  if (tcp_sock || pipe_sock)
+    read_queue(0);
+  else if (uring)
+    uring_recv_resume();
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::close(CloseReason reason)
 {
   if (closing)
     return;
   closing = true;
-  if (timer_connect->isActive())
-    timer_connect->stop();
+  timer_connect.stop();
+  timer_idle.stop();
+  QString timeout_str = (reason == CLOSE_CONNECT_TIMEOUT) ? QString("Connect timeout") : QString("Idle timeout");
   if (tcp_sock)
   {
-    emit finished((connect_timeout ? QAbstractSocket::SocketTimeoutError : tcp_sock->error())+1,
-                  connect_timeout ? QString("Connect timeout") : tcp_sock->errorString());
+    emit finished((reason != CLOSE_NORMAL ? QAbstractSocket::SocketTimeoutError : tcp_sock->error())+1,
+                  reason != CLOSE_NORMAL ? timeout_str : tcp_sock->errorString());
     if (tcp_sock->state() != QAbstractSocket::UnconnectedState)
     {
-      log(LOG_DBG3, QString(": closing"));
+      OBJ_LOG(this, LOG_DBG3, QString(": closing"));
       tcp_sock->abort();
     }
     tcp_sock->deleteLater();
@@ -227,23 +471,220 @@ void TunnelConn::close(bool connect_timeout)
   }
   if (pipe_sock)
   {
-    emit finished((connect_timeout ? QLocalSocket::SocketTimeoutError : pipe_sock->error())+1,
-                  connect_timeout ? QString("Connect timeout") : pipe_sock->errorString());
+    emit finished((reason != CLOSE_NORMAL ? QLocalSocket::SocketTimeoutError : pipe_sock->error())+1,
+                  reason != CLOSE_NORMAL ? timeout_str : pipe_sock->errorString());
     if (pipe_sock->state() != QLocalSocket::UnconnectedState)
     {
-      log(LOG_DBG3, QString(": closing"));
+      OBJ_LOG(this, LOG_DBG3, QString(": closing"));
       pipe_sock->abort();
     }
     pipe_sock->deleteLater();
     pipe_sock = NULL;
   }
+  if (uring)
+  {
+    emit finished((reason != CLOSE_NORMAL ? QAbstractSocket::SocketTimeoutError : uring_error)+1,
+                  reason != CLOSE_NORMAL ? timeout_str : uring_error_str);
+    if (uring_lookup_id >= 0)
+      QHostInfo::abortHostLookup(uring_lookup_id);
+    uring_lookup_id = -1;
+    IoUringBackend::cancel(uring_connect_op);
+    IoUringBackend::cancel(uring_recv_op);
+    IoUringBackend::cancel(uring_send_op);
+    uring_connect_op = uring_recv_op = uring_send_op = NULL;
+    if (uring_fd >= 0)
+    {
+      OBJ_LOG(this, LOG_DBG3, QString(": closing"));
+      IoUringBackend::closeSocket(uring_fd);     // cancelled operations keep the socket until they are done
+    }
+    uring_fd = -1;
+    uring_connected = false;
+    uring_recv_paused = false;
+  }
+  read_paused = false;
   input_buffer.clear();
   output_buffer.clear();
 }
 
+//---------------------------------------------------------------------------
+void TunnelConn::uring_hostLookupFinished(const QHostInfo &host)
+{
+  if (host.lookupId() != uring_lookup_id)
+    return;
+  uring_lookup_id = -1;
+  if (host.error() != QHostInfo::NoError || host.addresses().isEmpty())
+  {
+    timer_connect.stop();
+    uring_error = QAbstractSocket::HostNotFoundError;
+    uring_error_str = host.errorString();
+    OBJ_LOG(this, LOG_DBG3, QString(" error: ")+uring_error_str);
+    this->close();
+    return;
+  }
+  uring_connect(host.addresses().first());
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::uring_connect(const QHostAddress &address)
+{
+  uring_fd = IoUringBackend::socketFor(address);
+  if (uring_fd < 0)
+  {
+    int result = uring_fd;
+    uring_fd = -1;
+    uring_failed(result);
+    return;
+  }
+  uring_connect_op = uring->connect(this, uring_fd, address, uring_remote_port);
+  if (!uring_connect_op)
+    uring_failed(0);
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::uring_recv_start()
+{
+  uring_recv_op = uring->recv(this, uring_fd);
+  if (!uring_recv_op)
+    uring_failed(0);
+}
+
+//---------------------------------------------------------------------------
+// same input buffer limit as socket_readyRead(): 0 if reading is allowed, retry interval otherwise
+// (memory budget pauses wait for readResume() instead)
+int TunnelConn::uring_recv_pause_interval() const
+{
+  if (read_buffer_size > 0 && (quint32)input_buffer.length() >= read_buffer_size)
+    return 5;
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// result: -errno, or 0 when operation could not be queued
+void TunnelConn::uring_failed(int result)
+{
+  timer_connect.stop();
+  if (result == 0)
+  {
+    uring_error = QAbstractSocket::SocketResourceError;
+    uring_error_str = QString("io_uring submission queue is full");
+  }
+  else
+    IoUringBackend::socketError(result, uring_error, uring_error_str);
+  OBJ_LOG(this, LOG_DBG3, QString(" error: ")+uring_error_str);
+  this->close();
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::uring_data_received(const char *data, int len)
+{
+  t_last_rcv.restart();
+  input_buffer.append(data, len);
+  if (uring_recv_paused)
+    return;                             // data which was in flight when receiving was stopped
+
+  if (prc_log_level >= LOG_DBG4)
+    OBJ_LOG(this, LOG_DBG4, QString(": %1 bytes received").arg(len));
+  if (handler)
+    handler->connDataReceived(this);
+
+  if (!closing && uring_recv_op && mem_account && !mem_account->readAllowed())
+  {
+    readPause();
+    return;
+  }
+  int pause_interval = uring_recv_pause_interval();
+  if (!closing && pause_interval > 0 && uring_recv_op)
+  {
+    // let the socket's receive window apply backpressure
+    uring_recv_paused = true;
+    IoUringBackend::stop(uring_recv_op);
+    QTimer::singleShot(pause_interval, this, SLOT(uring_recv_resume()));
+  }
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::uring_recv_resume()
+{
+  if (!uring_recv_paused || read_paused || closing)
+    return;
+  int pause_interval = uring_recv_pause_interval();
+  if (pause_interval > 0)
+  {
+    QTimer::singleShot(pause_interval, this, SLOT(uring_recv_resume()));
+    return;
+  }
+  uring_recv_paused = false;
+  if (!input_buffer.isEmpty() && handler)
+    handler->connDataReceived(this);
+  // stopped multishot recv is restarted once its last completion is in
+  if (!closing && !uring_recv_op)
+    uring_recv_start();
+}
+
+//---------------------------------------------------------------------------
+void TunnelConn::ioUringCompleted(IoUringOp *op, int result, const char *data, bool final)
+{
+  if (op == uring_recv_op)
+  {
+    bool stopped = op->stopping;
+    if (final)
+      uring_recv_op = NULL;
+    if (result > 0)
+      uring_data_received(data, result);
+    else if (result == 0 || !stopped)
+    {
+      // data held while paused goes out before the connection is reported closed
+      uring_recv_paused = false;
+      if (!input_buffer.isEmpty() && handler)
+        handler->connDataReceived(this);
+      if (closing)
+        return;
+      if (result == 0)
+      {
+        uring_error = QAbstractSocket::RemoteHostClosedError;
+        uring_error_str = QString("The remote host closed the connection");
+        socket_disconnected();
+      }
+      else
+        uring_failed(result);
+      return;
+    }
+    if (final && stopped && !uring_recv_paused && !closing)
+      uring_recv_start();
+  }
+  else if (op == uring_send_op)
+  {
+    uring_send_op = NULL;
+    if (result < 0)
+    {
+      uring_failed(result);
+      return;
+    }
+    if (result < op->buffer.length())
+      output_buffer.prepend(op->buffer.mid(result));
+    socket_bytesWritten(result);
+  }
+  else if (op == uring_connect_op)
+  {
+    uring_connect_op = NULL;
+    if (result < 0)
+      uring_failed(result);
+    else
+      socket_connected();
+  }
+}
+
 //---------------------------------------------------------------------------
 void TunnelConn::log(LogPriority prio, const QString &text)
 {
-  prc_log(prio, QString("Tunnel '%1', conn %2").arg(tun_params.name).arg(this->id)+text);
+  if (!prc_log_enabled(prio))
+    return;
+  if (log_prefix.isEmpty() || log_prefix_name != tun_params->name || log_prefix_id != this->id)
+  {
+    log_prefix_name = tun_params->name;
+    log_prefix_id = this->id;
+    log_prefix = QString("Tunnel '%1', conn %2").arg(tun_params->name).arg(this->id);
+  }
+  prc_log(prio, log_prefix+text);
 }
 
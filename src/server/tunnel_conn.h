@@ -14,9 +14,25 @@
 #include <QUdpSocket>
 #include <QTime>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QHostInfo>
 #include "../lib/tunnel-parameters.h"
 #include "../lib/tunnel-state.h"
 #include "../lib/prc_log.h"
+#include "../lib/timer-wheel.h"
+#include "memory_governor.h"
+#include "io_uring_backend.h"
+
+class TunnelConn;
+
+// receiver of application data read by TunnelConn (Tunnel), called directly from the socket's readyRead()
+class TunnelConnHandler
+{
+public:
+  virtual ~TunnelConnHandler() {}
+  virtual void connDataReceived(TunnelConn *conn) = 0;
+};
 
 // UDP tunnel connection (application)
 class TunnelUdpConn
@@ -38,6 +54,10 @@ public:
   // for outgoing UDP connection
   QUdpSocket *udp_sock;
 
+  QSharedPointer<TunnelConnInInfo> info;  // shared with Tunnel::in_conn_info_list (NULL if not kept on this tunserver)
+
+  TimerWheelTimer timer_idle;         // expiry (TunnelParameters::conn_idle_timeout), handled by Tunnel
+
   TunnelUdpConn()
   {
     id = 0;
@@ -55,7 +75,7 @@ public:
 };
 
 // tunnel incoming connection (application)
-class TunnelConn: public QObject
+class TunnelConn: public QObject, public TimerWheelClient, public IoUringClient
 {
   Q_OBJECT
 public:
@@ -65,20 +85,40 @@ public:
     INCOMING=1,
     OUTGOING=2
   } direction;
+  enum CloseReason
+  {
+    CLOSE_NORMAL=0,
+    CLOSE_CONNECT_TIMEOUT=1,
+    CLOSE_IDLE_TIMEOUT=2
+  };
 
   TunnelConnId id;
   QTcpSocket *tcp_sock;
   QLocalSocket *pipe_sock;
-  TunnelParameters tun_params;
+  IoUringBackend *uring;                // set by Tunnel instead of tcp_sock: TCP connection through io_uring
+  int uring_fd;
+  QSharedPointer<const TunnelParameters> tun_params;  // tunnel parameters snapshot shared by all connections (Tunnel::connParams)
+
+  // cached from tun_params for the data path
+  quint32 max_bytes_to_read_at_once;
+  quint32 read_buffer_size;
+  quint32 write_buffer_size;
+  quint32 conn_idle_timeout;
 
   QByteArray input_buffer;
   QByteArray output_buffer;
 
+  QSharedPointer<TunnelConnInInfo> info;  // shared with Tunnel::in_conn_info_list (NULL if not kept on this tunserver)
+
   QTime t_connected;
   QTime t_last_rcv;
   QTime t_last_snd;
+  QElapsedTimer t_connect_started;      // outgoing connection establishment time (Tunnel::latency_connect)
 
-  QTimer *timer_connect;
+  TimerWheelTimer timer_connect;
+  TimerWheelTimer timer_idle;
+  TunnelConnHandler *handler;
+  const MemoryAccount *mem_account;     // tunnel's account: reading is paused while it is throttled
 
 //  quint64 bytes_rcv;
 //  quint64 bytes_snd;
@@ -86,26 +126,59 @@ public:
   bool closing_by_cmd;
 
   void init_incoming();
-  void close(bool connect_timeout=false);
+  void close(CloseReason reason=CLOSE_NORMAL);
+  void reset();                         // prepare closed connection for reuse (Tunnel::conn_pool)
+  void timerWheelExpired(TimerWheelTimer *timer);
   void log(LogPriority prio, const QString &text);
+  QString log_prefix;                   // cached "Tunnel 'name', conn id" prefix
+  QString log_prefix_name;              // tunnel name and conn id log_prefix was built for
+  TunnelConnId log_prefix_id;
   void sendOutputBuffer();
   void init_outgoing(const QString &remote_host, quint16 remote_port, quint32 connect_timeout);
+  void setParams(const QSharedPointer<const TunnelParameters> &_tun_params);
+  quint64 bufferCapacity() const { return input_buffer.capacity()+output_buffer.capacity(); }
+  quint64 bytesBuffered() const;
+  quint64 trimBuffers();
+  quint16 localPort() const;
+  void ioUringCompleted(IoUringOp *op, int result, const char *data, bool final);
+  void readPause();
+  void readResume();                    // Tunnel::memory_resume()
+
+protected:
+  virtual bool event(QEvent *e);
 
-  TunnelConn(Direction _direction, TunnelParameters _tun_params, QObject *parent=NULL): QObject(parent)
+public:
+  TunnelConn(Direction _direction, const QSharedPointer<const TunnelParameters> &_tun_params, QObject *parent=NULL): QObject(parent)
   {
     direction = _direction;
-    tun_params = _tun_params;
+    timer_connect.client = this;
+    timer_idle.client = this;
+    handler = NULL;
+    mem_account = NULL;
     id = 0;
+    log_prefix_id = 0;
     tcp_sock = NULL;
     pipe_sock = NULL;
+    uring = NULL;
+    uring_fd = -1;
+    uring_connect_op = NULL;
+    uring_recv_op = NULL;
+    uring_send_op = NULL;
+    uring_lookup_id = -1;
+    uring_remote_port = 0;
+    uring_connected = false;
+    uring_recv_paused = false;
+    uring_error = QAbstractSocket::UnknownSocketError;
+    conn_idle_timeout = 0;
+    setParams(_tun_params);
 //    bytes_rcv = 0;
 //    bytes_snd = 0;
     t_connected.start();
-    timer_connect = new QTimer(this);
-    timer_connect->setSingleShot(true);
-    connect(timer_connect, SIGNAL(timeout()), this, SLOT(socket_connect_timeout()));
     closing_by_cmd = false;
     closing = false;
+    read_paused = false;
+    paused_read_buffer_size = 0;
+    read_queued = false;
   }
   ~TunnelConn()
   {
@@ -115,7 +188,6 @@ public:
 
 signals:
   void finished(int error_code, const QString &error_str);
-  void dataReceived();
   void connection_established();
   void connection_bytesWritten(qint64);
 
@@ -126,10 +198,35 @@ private slots:
   void local_socket_error(QLocalSocket::LocalSocketError);
   void socket_bytesWritten(qint64);
   void socket_readyRead();
+  void read_queued_run();
   void socket_connect_timeout();
+  void timers_resume();
+  void uring_hostLookupFinished(const QHostInfo &host);
+  void uring_recv_resume();
 
 private:
   bool closing;
+  bool read_paused;                     // reading stopped while tunnel's memory account is throttled
+  qint64 paused_read_buffer_size;       // socket's read buffer limit to restore on readResume()
+  bool read_queued;                     // read_queued_run() pending; cleared by reset(), so calls queued before
+                                        // a pooled connection was reused are ignored
+  void read_queue(int msec);
+  void idle_timer_start();
+
+  IoUringOp *uring_connect_op;
+  IoUringOp *uring_recv_op;             // multishot
+  IoUringOp *uring_send_op;             // one send in flight at a time
+  int uring_lookup_id;
+  quint16 uring_remote_port;
+  bool uring_connected;
+  bool uring_recv_paused;               // receiving stopped until buffers drain / memory budget allows
+  QAbstractSocket::SocketError uring_error;
+  QString uring_error_str;
+  void uring_connect(const QHostAddress &address);
+  void uring_recv_start();
+  int uring_recv_pause_interval() const;
+  void uring_data_received(const char *data, int len);
+  void uring_failed(int result);
 };
 
 
@@ -0,0 +1,104 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef TUNNEL_FLIGHTREC_H
+#define TUNNEL_FLIGHTREC_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include "../lib/mgr_packet.h"
+#include "../lib/tunnel-parameters.h"
+#include "../lib/tunnel-state.h"
+
+// Flight recorder keeps last FLIGHTREC_SIZE packet events of a tunnel in memory (always enabled).
+// Dump format (host byte order): FlightRecHeader followed by FlightRecHeader::count FlightRecRecord's, oldest first
+
+#define FLIGHTREC_MAGIC                     0x52464d51      // "QMFR"
+#define FLIGHTREC_VERSION                            1
+#define FLIGHTREC_SIZE                            1024      // records per tunnel (must be power of 2)
+
+enum FlightRecEvent
+{
+  FR_QUEUE_OUT=1,                     // data packet queued to mgrconn (queueOutPacket)
+  FR_PACKET_RCV=2,                    // buffered packet received in order (cmd = 0)
+  FR_PACKET_UNEXPECTED=3,             // buffered packet received out of order (cmd = 0, len = expected packet id)
+  FR_ACK_SENT=4,                      // packet_id = last received packet id, len = packets count
+  FR_ACK_RCV=5,                       // packet_id = last acknowledged packet id, len = packets count
+  FR_RESEND_REQ_SENT=6,               // packet_id = resend from
+  FR_RESEND_REQ_RCV=7,                // packet_id = resend from, len = packets resent
+  FR_FORWARD=8                        // packet forwarded to the next/previous tunserver in chain
+};
+
+struct __attribute__ ((__packed__)) FlightRecHeader
+{
+  quint32 magic;
+  quint8 version;
+  quint8 record_size;                 // sizeof(FlightRecRecord)
+  TunnelId tunnel_id;
+  quint32 count;                      // number of records to follow
+  qint64 clock_start_ms;              // wall clock time (ms since epoch) of FlightRecRecord::time_us == 0
+  quint64 dump_time_us;               // time of dump, same clock as FlightRecRecord::time_us
+};
+
+struct __attribute__ ((__packed__)) FlightRecRecord
+{
+  quint64 time_us;                    // monotonic time since flightrec_clock start
+  quint8 event;                       // FlightRecEvent
+  MgrPacketCmd cmd;
+  quint16 packet_id;                  // TunnelConnPacketId
+  TunnelConnId conn_id;
+  quint32 len;
+};
+
+extern QElapsedTimer flightrec_clock;
+extern qint64 flightrec_clock_start_ms;
+void flightrec_clock_init();
+
+class FlightRecorder
+{
+public:
+  FlightRecRecord records[FLIGHTREC_SIZE];
+  quint32 pos;                        // total number of records ever written
+
+  FlightRecorder()
+  {
+    pos = 0;
+  }
+
+  void record(FlightRecEvent event, MgrPacketCmd cmd, quint16 packet_id, TunnelConnId conn_id, quint32 len)
+  {
+    FlightRecRecord &rec = records[pos & (FLIGHTREC_SIZE-1)];
+    rec.time_us = flightrec_clock.nsecsElapsed()/1000;
+    rec.event = event;
+    rec.cmd = cmd;
+    rec.packet_id = packet_id;
+    rec.conn_id = conn_id;
+    rec.len = len;
+    pos++;
+  }
+
+  QByteArray dump(TunnelId tunnel_id) const
+  {
+    FlightRecHeader header;
+    header.magic = FLIGHTREC_MAGIC;
+    header.version = FLIGHTREC_VERSION;
+    header.record_size = sizeof(FlightRecRecord);
+    header.tunnel_id = tunnel_id;
+    header.count = qMin(pos, (quint32)FLIGHTREC_SIZE);
+    header.clock_start_ms = flightrec_clock_start_ms;
+    header.dump_time_us = flightrec_clock.nsecsElapsed()/1000;
+    QByteArray buffer;
+    buffer.reserve(sizeof(FlightRecHeader)+header.count*sizeof(FlightRecRecord));
+    buffer.append((const char *)&header, sizeof(FlightRecHeader));
+    for (quint32 i=pos-header.count; i != pos; i++)
+      buffer.append((const char *)&records[i & (FLIGHTREC_SIZE-1)], sizeof(FlightRecRecord));
+    return buffer;
+  }
+};
+
+#endif // TUNNEL_FLIGHTREC_H
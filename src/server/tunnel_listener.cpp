@@ -0,0 +1,216 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#include "tunnel_listener.h"
+#include "tunnel.h"
+#include <QThread>
+#include <QMutex>
+#include <QSet>
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+static QMutex reserved_ports_mutex;
+static QSet<QString> reserved_ports;
+
+//---------------------------------------------------------------------------
+bool TunnelListener::supported()
+{
+#ifdef Q_OS_UNIX
+  return true;
+#else
+  return false;
+#endif
+}
+
+//---------------------------------------------------------------------------
+bool TunnelListener::reusePortSupported()
+{
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+  return true;
+#else
+  return false;
+#endif
+}
+
+//---------------------------------------------------------------------------
+// address is handled the way QTcpServer::listen() does: IPv6 addresses listen on IPv6 only, while
+// QHostAddress::Any of Qt 5 is a dual-stack socket bound to :: (or 0.0.0.0 where there is no IPv6)
+int TunnelListener::openSocket(const QHostAddress &address, quint16 port, int backlog, bool reuse_port, QString &error_str)
+{
+#ifdef Q_OS_UNIX
+  bool ipv6 = (address.protocol() == QAbstractSocket::IPv6Protocol);
+  bool dual_stack = false;
+#if QT_VERSION >= 0x050000
+  dual_stack = (address.protocol() == QAbstractSocket::AnyIPProtocol);
+#endif
+  int fd = ::socket((ipv6 || dual_stack) ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 && dual_stack && errno == EAFNOSUPPORT)
+  {
+    dual_stack = false;
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  }
+  if (fd < 0)
+  {
+    error_str = QString::fromLocal8Bit(strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  memset(&sa, 0, sizeof(sa));
+  if (ipv6 || dual_stack)
+  {
+    struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *)&sa;
+    sa6->sin6_family = AF_INET6;
+    sa6->sin6_port = htons(port);
+    if (ipv6)
+    {
+      Q_IPV6ADDR ip6 = address.toIPv6Address();
+      memcpy(&sa6->sin6_addr, &ip6, sizeof(ip6));
+    }
+    sa_len = sizeof(struct sockaddr_in6);
+#ifdef IPV6_V6ONLY
+    // system default varies (net.ipv6.bindv6only), so it is always set explicitly
+    int v6only = ipv6 ? 1 : 0;
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+#endif
+  }
+  else
+  {
+    struct sockaddr_in *sa4 = (struct sockaddr_in *)&sa;
+    sa4->sin_family = AF_INET;
+    sa4->sin_port = htons(port);
+    sa4->sin_addr.s_addr = htonl(address.toIPv4Address());
+    sa_len = sizeof(struct sockaddr_in);
+  }
+
+  ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  int on = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (reuse_port)
+  {
+#ifdef SO_REUSEPORT
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+      error_str = QString("SO_REUSEPORT: ")+QString::fromLocal8Bit(strerror(errno));
+      ::close(fd);
+      return -1;
+    }
+#else
+    error_str = QString("SO_REUSEPORT is not supported");
+    ::close(fd);
+    return -1;
+#endif
+  }
+  if (::bind(fd, (struct sockaddr *)&sa, sa_len) < 0 || ::listen(fd, backlog) < 0)
+  {
+    error_str = QString::fromLocal8Bit(strerror(errno));
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  Q_UNUSED(address);
+  Q_UNUSED(port);
+  Q_UNUSED(backlog);
+  Q_UNUSED(reuse_port);
+  error_str = QString("not supported on this platform");
+  return -1;
+#endif
+}
+
+//---------------------------------------------------------------------------
+void TunnelListener::closeSocket(int fd)
+{
+#ifdef Q_OS_UNIX
+  ::close(fd);
+#else
+  Q_UNUSED(fd);
+#endif
+}
+
+//---------------------------------------------------------------------------
+// SO_REUSEPORT would let another tunnel of this server bind the same port silently and take part of its connections
+bool TunnelListener::reservePort(const QString &key)
+{
+  QMutexLocker locker(&reserved_ports_mutex);
+  if (reserved_ports.contains(key))
+    return false;
+  reserved_ports.insert(key);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void TunnelListener::releasePort(const QString &key)
+{
+  QMutexLocker locker(&reserved_ports_mutex);
+  reserved_ports.remove(key);
+}
+
+//---------------------------------------------------------------------------
+TunnelListener::TunnelListener(Tunnel *_tunnel): QTcpServer(NULL)
+{
+  tunnel = _tunnel;
+  thread = NULL;
+}
+
+//---------------------------------------------------------------------------
+TunnelListener::~TunnelListener()
+{
+}
+
+//---------------------------------------------------------------------------
+// takes ownership of listening socket even if it fails
+bool TunnelListener::start(int socket_descriptor, const QString &thread_name)
+{
+  if (!setSocketDescriptor(socket_descriptor))
+  {
+    closeSocket(socket_descriptor);
+    return false;
+  }
+  // nothing is queued as pending: incomingConnection() passes every descriptor to the tunnel right away,
+  // so QTcpServer keeps accepting until the backlog is drained
+  thread = new QThread;
+  thread->setObjectName(thread_name);
+  moveToThread(thread);
+  thread->start();
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void TunnelListener::stop()
+{
+  QThread *listener_thread = thread;
+  if (!listener_thread)
+  {
+    delete this;
+    return;
+  }
+  // deleted (and its socket closed) in its own thread when the event loop quits
+  deleteLater();
+  listener_thread->quit();
+  listener_thread->wait();
+  delete listener_thread;
+}
+
+//---------------------------------------------------------------------------
+#if QT_VERSION >= 0x050000
+void TunnelListener::incomingConnection(qintptr socket_descriptor)
+#else
+void TunnelListener::incomingConnection(int socket_descriptor)
+#endif
+{
+  tunnel->listener_accepted((int)socket_descriptor);
+}
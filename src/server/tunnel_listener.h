@@ -0,0 +1,52 @@
+/*
+ Copyright (C) 2017 Nikolay N. Karikh <knn@qmtunnel.com>
+
+ This file is part of qmtunnel and is licensed under GNU General Public License 3.0, with
+ the additional special exception to link portions of this program with the OpenSSL library.
+ See LICENSE file for more details.
+*/
+
+#ifndef TUNNEL_LISTENER_H
+#define TUNNEL_LISTENER_H
+
+#include <QTcpServer>
+#include <QHostAddress>
+
+class Tunnel;
+class QThread;
+
+// additional listening socket of TCP tunnel with TunnelParameters::bind_listeners > 1:
+// all listeners are bound to the same address with SO_REUSEPORT, so the kernel spreads incoming
+// connections across them; each one accepts in its own thread and hands descriptors over to the tunnel
+class TunnelListener: public QTcpServer
+{
+  Q_OBJECT
+public:
+  static bool supported();                    // listening sockets can be opened with openSocket() (Unix)
+  static bool reusePortSupported();
+  // listening socket with given backlog (and SO_REUSEPORT), -1 on error
+  static int openSocket(const QHostAddress &address, quint16 port, int backlog, bool reuse_port, QString &error_str);
+  static void closeSocket(int fd);
+  // address:port may be shared by listeners of one tunnel only
+  static bool reservePort(const QString &key);
+  static void releasePort(const QString &key);
+
+  TunnelListener(Tunnel *_tunnel);
+  ~TunnelListener();
+
+  bool start(int socket_descriptor, const QString &thread_name);
+  void stop();                                // from tunnel's thread, listener is deleted
+
+protected:
+#if QT_VERSION >= 0x050000
+  void incomingConnection(qintptr socket_descriptor);
+#else
+  void incomingConnection(int socket_descriptor);
+#endif
+
+private:
+  Tunnel *tunnel;
+  QThread *thread;
+};
+
+#endif // TUNNEL_LISTENER_H